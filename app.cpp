@@ -16,6 +16,10 @@
 #include "profiler.hpp"
 #include "animation_manager.hpp"
 #include "bit_utils.hpp"
+#include "command_replay.hpp"
+#include "frame_capture.hpp"
+#include "deferred_context.hpp"
+#include "tests/test.hpp"
 
 #include "test/ps3_background.hpp"
 #include "test/scene_player.hpp"
@@ -46,6 +50,16 @@ App::App()
   , _hinstance(NULL)
   , _test_effect(NULL)
   , _frame_time(0)
+  , _headless(false)
+  , _headless_frames(300)
+  , _capture_frames(1)
+  , _replay_loops(10)
+  , _offline(false)
+  , _offline_fps(60)
+  , _offline_frames(0)
+  , _pace_work_ms(0)
+  , _run_tests(false)
+  , _run_benchmarks(false)
 {
   find_app_root();
 }
@@ -54,6 +68,21 @@ App::~App()
 {
 }
 
+namespace {
+  // spins for 0.5 to 1.5 times 'ms', and 2.5 times on every 50th frame. The sequence only
+  // depends on the seed, so runs can be compared
+  void simulate_work(int ms, int frame, uint32 *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    const double scale = frame % 50 == 49 ? 2.5 : 0.5 + ((*seed >> 16) & 1023) / 1023.0;
+    LARGE_INTEGER freq, now, end;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    end.QuadPart = now.QuadPart + (int64)(scale * ms * freq.QuadPart / 1000);
+    while (now.QuadPart < end.QuadPart)
+      QueryPerformanceCounter(&now);
+  }
+}
+
 App& App::instance()
 {
   if (_instance == NULL)
@@ -61,22 +90,72 @@ App& App::instance()
   return *_instance;
 }
 
-bool App::init(HINSTANCE hinstance)
+void App::parse_cmd_line(const char *cmd_line) {
+  if (!cmd_line)
+    return;
+
+  _headless = strstr(cmd_line, "-headless") != nullptr;
+
+  if (const char *frames = strstr(cmd_line, "-frames=")) {
+    _headless_frames = atoi(frames + strlen("-frames="));
+    _offline_frames = _headless_frames;
+  }
+
+  _offline = strstr(cmd_line, "-offline") != nullptr;
+  if (const char *fps = strstr(cmd_line, "-fps="))
+    _offline_fps = max(1, atoi(fps + strlen("-fps=")));
+
+  if (const char *fps = strstr(cmd_line, "-pace="))
+    _pacer.set_target_fps(atoi(fps + strlen("-pace=")));
+  if (const char *ms = strstr(cmd_line, "-pace_work="))
+    _pace_work_ms = atoi(ms + strlen("-pace_work="));
+
+  if (const char *frames = strstr(cmd_line, "-capture_frames="))
+    _capture_frames = atoi(frames + strlen("-capture_frames="));
+
+  if (const char *loops = strstr(cmd_line, "-loops="))
+    _replay_loops = atoi(loops + strlen("-loops="));
+
+  _capture_filename = cmd_line_value(cmd_line, "-capture=");
+  _replay_filename = cmd_line_value(cmd_line, "-replay=");
+  _dump_pattern = cmd_line_value(cmd_line, "-dump=");
+
+  // the tests run without a window
+  _run_tests = strstr(cmd_line, "-test") != nullptr;
+  _run_benchmarks = strstr(cmd_line, "-bench") != nullptr;
+  _test_filter = cmd_line_value(cmd_line, "-filter=");
+  _headless |= _run_tests || _run_benchmarks;
+}
+
+string App::cmd_line_value(const char *cmd_line, const char *key) {
+  const char *value = strstr(cmd_line, key);
+  if (!value)
+    return string();
+  value += strlen(key);
+  const char *end = strchr(value, ' ');
+  return end ? string(value, end - value) : string(value);
+}
+
+bool App::init(HINSTANCE hinstance, const char *cmd_line)
 {
+  parse_cmd_line(cmd_line);
+
   if (_appRootFilename.empty()) {
     MessageBoxA(0, "Unable to find resource.dat", "Error", MB_ICONEXCLAMATION);
     return false;
   }
 
+  // headless runs, and the tests, report errors through the exit code instead of breaking,
+  // which would kill the process when there's no debugger attached
   LOGGER.
 #if WITH_UNPACKED_RESOURCES
     open_output_file(_T("kumi.log")).
 #endif
-    break_on_error(true);
+    break_on_error(!_headless);
 
   _hinstance = hinstance;
   B_ERR_BOOL(Graphics::create());
-  if (!GRAPHICS.config(_hinstance))
+  if (!_headless && !GRAPHICS.config(_hinstance))
     return false;
 
 #if WITH_PROFILER
@@ -95,7 +174,12 @@ bool App::init(HINSTANCE hinstance)
 #endif
   B_ERR_BOOL(AnimationManager::create());
 
-  B_ERR_BOOL(GRAPHICS.init(wnd_proc));
+  if (_headless) {
+    // only offline renders and frame dumps need rendered frames, the rest run on the null driver
+    B_ERR_BOOL(GRAPHICS.init_headless(1280, 720, _offline || !_dump_pattern.empty()));
+  } else {
+    B_ERR_BOOL(GRAPHICS.init(wnd_proc));
+  }
 
 #if WITH_UNPACKED_RESOUCES
   RESOURCE_MANAGER.add_path("D:\\SkyDrive");
@@ -241,7 +325,172 @@ void App::send_stats(const JsonValue::JsonValuePtr &frame) {
 }
 #endif
 
+UINT App::run_headless() {
+
+  if (!_capture_filename.empty())
+    GRAPHICS.start_capture(_capture_filename.c_str(), _capture_frames);
+
+  if (!_dump_pattern.empty())
+    GRAPHICS.start_frame_dump(_dump_pattern.c_str());
+
+  DEMO_ENGINE.start();
+
+  // time spent recording the effects, to compare serial and parallel recording
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  int64 tick_ctr = 0;
+  uint32 work_seed = 1;
+
+  for (int i = 0; i < _headless_frames; ++i) {
+#if WITH_PROFILER
+    PROFILE_MANAGER.start_frame();
+#endif
+    _pacer.begin_frame();
+    process_deferred();
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    DEMO_ENGINE.tick();
+    QueryPerformanceCounter(&end);
+    tick_ctr += end.QuadPart - start.QuadPart;
+    if (_pace_work_ms)
+      simulate_work(_pace_work_ms, i, &work_seed);
+    // the null device doesn't finish anything, so there's no gpu latency to track
+    _pacer.end_frame(nullptr);
+    GRAPHICS.present();
+#if WITH_PROFILER
+    PROFILE_MANAGER.end_frame();
+#endif
+  }
+
+  CommandRecorder *recorder = GRAPHICS.recorder();
+  LOG_INFO_LN("Headless run: %d frames, %d commands, %d errors, %.3f ms/tick (%s recording)", 
+    _headless_frames, recorder->num_commands(), recorder->num_errors(),
+    1000.0 * tick_ctr / freq.QuadPart / max(1, _headless_frames), WITH_PARALLEL_RECORDING ? "parallel" : "serial");
+  for (int i = 0; i < CommandRecorder::kNumOps; ++i) {
+    CommandRecorder::Op op = (CommandRecorder::Op)i;
+    if (recorder->count(op))
+      LOG_INFO_LN("  %s: %d", CommandRecorder::op_name(op), recorder->count(op));
+  }
+
+  GRAPHICS.frame_capture()->flush();
+  GRAPHICS.frame_capture()->log_stats();
+  _pacer.log_stats();
+
+  return recorder->num_errors() ? 1 : 0;
+}
+
+UINT App::run_replay() {
+
+  CommandReplayer replayer;
+  if (!replayer.load(_replay_filename.c_str()))
+    return 1;
+
+  // run a single frame of the demo first, so all the resources referenced by the
+  // capture (including the ones created on first use) exist
+  DEMO_ENGINE.start();
+  process_deferred();
+  DEMO_ENGINE.tick();
+  GRAPHICS.present();
+
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+  for (int i = 0; i < _replay_loops; ++i) {
+    replayer.replay(ctx);
+    GRAPHICS.present();
+  }
+  GRAPHICS.destroy_deferred_context(ctx);
+
+  LOG_INFO_LN("Replayed %d frames %d times", replayer.num_frames(), _replay_loops);
+  replayer.log_stats();
+  return 0;
+}
+
+UINT App::run_offline() {
+
+  // an offline render that can't save its frames is wasted
+  if (_dump_pattern.empty()) {
+    LOG_ERROR_LN("-offline needs a pattern to save the frames to, like -dump=frame%%05d.png");
+    return 1;
+  }
+  if (!GRAPHICS.start_frame_dump(_dump_pattern.c_str()))
+    return 1;
+#if !WITH_SOFTWARE_RASTERIZER
+  if (GRAPHICS.null_device()) {
+    LOG_ERROR_LN("Nothing is rendered on the null driver, so there are no frames to save");
+    return 1;
+  }
+#endif
+  FrameCapture *capture = GRAPHICS.frame_capture();
+  capture->set_drop_when_busy(false);
+
+  DEMO_ENGINE.set_fixed_fps(_offline_fps);
+  DEMO_ENGINE.start();
+  const int num_frames = _offline_frames > 0 ? _offline_frames : (int)(DEMO_ENGINE.duration() * _offline_fps / 1000);
+
+  LARGE_INTEGER freq, start, end;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&start);
+
+  MSG msg = {0};
+  int frames = 0;
+  while (frames < num_frames && WM_QUIT != msg.message) {
+    // keep the window responsive, without waiting for messages between frames
+    if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+      TranslateMessage(&msg);
+      DispatchMessage(&msg);
+      continue;
+    }
+#if WITH_PROFILER
+    PROFILE_MANAGER.start_frame();
+#endif
+    process_deferred();
+    DEMO_ENGINE.tick();
+    GRAPHICS.present();
+#if WITH_PROFILER
+    PROFILE_MANAGER.end_frame();
+#endif
+    ++frames;
+  }
+
+  // the export isn't done until the last frame is on disk
+  capture->flush();
+  QueryPerformanceCounter(&end);
+  const double secs = (end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+  LOG_INFO_LN("Offline render: %d frames at %d fps (%.1f s of demo) in %.1f s, %.1f frames/s",
+    frames, _offline_fps, (double)frames / _offline_fps, secs, frames / max(secs, 0.001));
+  capture->log_stats();
+
+  DEMO_ENGINE.set_fixed_fps(0);
+  return capture->stats().failed ? 1 : 0;
+}
+
+UINT App::run_tests() {
+  int failed = 0;
+  if (_run_tests)
+    failed += test::run_tests(false, _test_filter.c_str());
+  if (_run_benchmarks)
+    failed += test::run_tests(true, _test_filter.c_str());
+  return failed ? 1 : 0;
+}
+
 UINT App::run(void *userdata) {
+  if (_run_tests || _run_benchmarks)
+    return run_tests();
+
+  if (!_replay_filename.empty())
+    return run_replay();
+
+  if (_offline)
+    return run_offline();
+
+  if (_headless)
+    return run_headless();
+
+  if (!_capture_filename.empty())
+    GRAPHICS.start_capture(_capture_filename.c_str(), _capture_frames);
+
+  if (!_dump_pattern.empty())
+    GRAPHICS.start_frame_dump(_dump_pattern.c_str());
+
   MSG msg = {0};
 
   float running_time = 0;
@@ -265,6 +514,7 @@ UINT App::run(void *userdata) {
 #if WITH_PROFILER
       PROFILE_MANAGER.start_frame();
 #endif
+      _pacer.begin_frame();
       LARGE_INTEGER start, end;
       QueryPerformanceCounter(&start);
       {
@@ -277,6 +527,7 @@ UINT App::run(void *userdata) {
       }
       {
         ADD_PROFILE_SCOPE();
+        _pacer.end_frame(GRAPHICS._immediate_context);
         GRAPHICS.present();
 
         on_idle();
@@ -305,6 +556,10 @@ UINT App::run(void *userdata) {
 
     }
   }
+
+  GRAPHICS.frame_capture()->flush();
+  GRAPHICS.frame_capture()->log_stats();
+  _pacer.log_stats();
   return 0;
 }
 
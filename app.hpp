@@ -4,6 +4,7 @@
 #include "graphics.hpp"
 #include "threading.hpp"
 #include "json_utils.hpp"
+#include "frame_pacer.hpp"
 #if WITH_WEBSOCKETS
 #include "websocket_server.hpp"
 #endif
@@ -25,7 +26,7 @@ public:
 
   static App& instance();
 
-  bool init(HINSTANCE hinstance);
+  bool init(HINSTANCE hinstance, const char *cmd_line);
   static bool close();
 
   void	tick();
@@ -55,6 +56,12 @@ private:
   void send_stats(const JsonValue::JsonValuePtr &frame);
 #endif
   void find_app_root();
+  void parse_cmd_line(const char *cmd_line);
+  UINT run_headless();
+  UINT run_replay();
+  UINT run_offline();
+  UINT run_tests();
+  static std::string cmd_line_value(const char *cmd_line, const char *key);
 
   void save_settings();
   void load_settings();
@@ -69,6 +76,37 @@ protected:
 
   double _frame_time;
 
+  // with -headless, the effects are rendered on the null driver for a fixed number of
+  // frames (-frames=N). -capture=filename saves the commands submitted during the first
+  // -capture_frames=N frames, and -replay=filename plays back a capture -loops=N times,
+  // timing each command. Both work with or without -headless.
+  bool _headless;
+  int _headless_frames;
+  std::string _capture_filename;
+  int _capture_frames;
+  std::string _dump_pattern;
+  std::string _replay_filename;
+  int _replay_loops;
+
+  // -offline renders the demo at a fixed -fps=N (60 by default), as fast as it can, for
+  // -frames=N frames or the whole demo, and saves every frame to -dump=pattern, which it
+  // needs. With -headless, it renders on WARP (or the reference device) without a window
+  bool _offline;
+  int _offline_fps;
+  int _offline_frames;
+
+  // -pace=N paces the frames to N fps. In headless runs, -pace_work=ms adds a simulated
+  // workload of ms on average per frame, with some jitter and an occasional spike, to see
+  // how well the pacing holds up
+  FramePacer _pacer;
+  int _pace_work_ms;
+
+  // -test runs the tests in tests/, and -bench the benchmarks, headless. -filter=name only
+  // runs the ones whose name contains name. The exit code is 1 if any of them failed
+  bool _run_tests;
+  bool _run_benchmarks;
+  std::string _test_filter;
+
   std::string _app_root;
   std::string _appRootFilename;
 
@@ -89,3 +89,230 @@ bool save_bmp32(const char *filename, uint8_t *ptr, int width, int height)
 
 	return true;
 }
+
+namespace {
+	// the crc32 of every byte value, for the reflected polynomial 0xedb88320. It's constant so
+	// the workers encoding pngs can share it without setting it up
+	const uint32_t crc_table[256] = {
+		0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
+		0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
+		0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+		0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
+		0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+		0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+		0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+		0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924, 0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
+		0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+		0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+		0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
+		0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+		0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
+		0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+		0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+		0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
+		0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
+		0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+		0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
+		0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+		0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+		0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
+		0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236, 0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
+		0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+		0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+		0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
+		0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+		0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+		0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
+		0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+		0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
+		0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+	};
+
+	uint32_t png_crc(uint32_t crc, const uint8_t *buf, size_t len)
+	{
+		crc ^= 0xffffffff;
+		for (size_t i = 0; i < len; ++i)
+			crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+		return crc ^ 0xffffffff;
+	}
+
+	// LSB first bit writer, as deflate wants it
+	struct BitWriter {
+		BitWriter(std::vector<uint8_t> *out) : out(out), bits(0), num_bits(0) {}
+		void write(uint32_t value, int count) {
+			bits |= value << num_bits;
+			num_bits += count;
+			while (num_bits >= 8) {
+				out->push_back((uint8_t)bits);
+				bits >>= 8;
+				num_bits -= 8;
+			}
+		}
+		// huffman codes are stored MSB first
+		void write_code(uint32_t code, int count) {
+			uint32_t rev = 0;
+			for (int i = 0; i < count; ++i)
+				rev |= ((code >> i) & 1) << (count - 1 - i);
+			write(rev, count);
+		}
+		void flush() {
+			if (num_bits > 0)
+				out->push_back((uint8_t)bits);
+			bits = num_bits = 0;
+		}
+		std::vector<uint8_t> *out;
+		uint32_t bits;
+		int num_bits;
+	};
+
+	void write_literal(BitWriter *w, int lit)
+	{
+		if (lit < 144)
+			w->write_code(0x30 + lit, 8);
+		else if (lit < 256)
+			w->write_code(0x190 + lit - 144, 9);
+		else if (lit < 280)
+			w->write_code(lit - 256, 7);
+		else
+			w->write_code(0xc0 + lit - 280, 8);
+	}
+
+	void write_match(BitWriter *w, int len, int dist)
+	{
+		static const int len_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const int len_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const int dist_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		static const int dist_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+		int l = 28;
+		while (len_base[l] > len)
+			--l;
+		write_literal(w, 257 + l);
+		w->write(len - len_base[l], len_extra[l]);
+
+		int d = 29;
+		while (dist_base[d] > dist)
+			--d;
+		w->write_code(d, 5);
+		w->write(dist - dist_base[d], dist_extra[d]);
+	}
+
+	// zlib stream with a single fixed huffman block. Matches are found with a hash of the next
+	// three bytes, which only remembers the last position, so it's fast rather than small
+	void zlib_compress(const std::vector<uint8_t> &src, std::vector<uint8_t> *out)
+	{
+		const int cWindow = 32768, cMinMatch = 3, cMaxMatch = 258;
+		const int cHashBits = 15;
+
+		out->push_back(0x78);
+		out->push_back(0x01);
+
+		BitWriter w(out);
+		w.write(1, 1);
+		w.write(1, 2);
+
+		std::vector<int> head(1 << cHashBits, -1);
+		const int len = (int)src.size();
+		const uint8_t *s = src.data();
+		int i = 0;
+		while (i < len) {
+			int best_len = 0, best_dist = 0;
+			if (i + cMinMatch <= len) {
+				const uint32_t h = ((s[i] << 16 | s[i+1] << 8 | s[i+2]) * 2654435761u) >> (32 - cHashBits);
+				const int candidate = head[h];
+				head[h] = i;
+				if (candidate >= 0 && i - candidate <= cWindow) {
+					const int max_len = len - i < cMaxMatch ? len - i : cMaxMatch;
+					int l = 0;
+					while (l < max_len && s[candidate + l] == s[i + l])
+						++l;
+					if (l >= cMinMatch) {
+						best_len = l;
+						best_dist = i - candidate;
+					}
+				}
+			}
+
+			if (best_len) {
+				write_match(&w, best_len, best_dist);
+				i += best_len;
+			} else {
+				write_literal(&w, s[i]);
+				++i;
+			}
+		}
+		write_literal(&w, 256);
+		w.flush();
+
+		uint32_t a = 1, b = 0;
+		for (int j = 0; j < len; ++j) {
+			a = (a + s[j]) % 65521;
+			b = (b + a) % 65521;
+		}
+		const uint32_t adler = b << 16 | a;
+		for (int j = 3; j >= 0; --j)
+			out->push_back((uint8_t)(adler >> (j * 8)));
+	}
+
+	void write_chunk(FILE *f, const char *type, const std::vector<uint8_t> &data)
+	{
+		uint8_t header[8];
+		const uint32_t len = (uint32_t)data.size();
+		for (int i = 0; i < 4; ++i)
+			header[i] = (uint8_t)(len >> (24 - i * 8));
+		memcpy(header + 4, type, 4);
+		uint32_t crc = png_crc(0, header + 4, 4);
+		crc = png_crc(crc, data.data(), data.size());
+		uint8_t footer[4];
+		for (int i = 0; i < 4; ++i)
+			footer[i] = (uint8_t)(crc >> (24 - i * 8));
+		fwrite(header, sizeof(header), 1, f);
+		if (len)
+			fwrite(data.data(), len, 1, f);
+		fwrite(footer, sizeof(footer), 1, f);
+	}
+}
+
+bool save_png32(const char *filename, const uint8_t *ptr, int width, int height)
+{
+	// the rows use the sub filter, which makes flat and smoothly shaded areas compress well
+	std::vector<uint8_t> filtered;
+	filtered.reserve((width * 4 + 1) * height);
+	for (int y = 0; y < height; ++y) {
+		const uint8_t *row = ptr + y * width * 4;
+		filtered.push_back(1);
+		for (int x = 0; x < width; ++x) {
+			// BGRA to RGBA
+			static const int order[] = { 2, 1, 0, 3 };
+			for (int c = 0; c < 4; ++c) {
+				const uint8_t cur = row[x * 4 + order[c]];
+				const uint8_t left = x > 0 ? row[(x - 1) * 4 + order[c]] : 0;
+				filtered.push_back(cur - left);
+			}
+		}
+	}
+
+	std::vector<uint8_t> idat;
+	zlib_compress(filtered, &idat);
+
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	fwrite(signature, sizeof(signature), 1, f);
+
+	std::vector<uint8_t> ihdr(13);
+	for (int i = 0; i < 4; ++i) {
+		ihdr[i] = (uint8_t)(width >> (24 - i * 8));
+		ihdr[4 + i] = (uint8_t)(height >> (24 - i * 8));
+	}
+	ihdr[8] = 8;	// bit depth
+	ihdr[9] = 6;	// rgba
+	write_chunk(f, "IHDR", ihdr);
+	write_chunk(f, "IDAT", idat);
+	write_chunk(f, "IEND", std::vector<uint8_t>());
+	fclose(f);
+
+	return true;
+}
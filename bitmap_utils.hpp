@@ -2,3 +2,5 @@
 
 bool save_bmp32(const char *filename, uint8_t *ptr, int width, int height);
 bool save_bmp_mono(const char *filename, uint8_t *ptr, int width, int height);
+// 'ptr' is BGRA, like the bmp functions expect
+bool save_png32(const char *filename, const uint8_t *ptr, int width, int height);
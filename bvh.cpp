@@ -0,0 +1,239 @@
+#include "stdafx.h"
+#include "bvh.hpp"
+#include "frustum_culler.hpp"
+
+using namespace std;
+
+namespace {
+  void box_bounds(const XMFLOAT3 &c, const XMFLOAT3 &e, XMFLOAT3 *mn, XMFLOAT3 *mx) {
+    *mn = XMFLOAT3(c.x - e.x, c.y - e.y, c.z - e.z);
+    *mx = XMFLOAT3(c.x + e.x, c.y + e.y, c.z + e.z);
+  }
+
+  void grow(XMFLOAT3 *mn, XMFLOAT3 *mx, const XMFLOAT3 &other_min, const XMFLOAT3 &other_max) {
+    mn->x = min(mn->x, other_min.x); mn->y = min(mn->y, other_min.y); mn->z = min(mn->z, other_min.z);
+    mx->x = max(mx->x, other_max.x); mx->y = max(mx->y, other_max.y); mx->z = max(mx->z, other_max.z);
+  }
+
+  float axis(const XMFLOAT3 &v, int a) {
+    return a == 0 ? v.x : a == 1 ? v.y : v.z;
+  }
+}
+
+void Bvh::build(const XMFLOAT3 *centers, const XMFLOAT3 *extents, int count) {
+  _nodes.clear();
+  _indices.resize(count);
+  for (int i = 0; i < count; ++i)
+    _indices[i] = i;
+
+  if (count > 0) {
+    // a tree split at the median has about 2 * count / (leaf size / 2) nodes
+    _nodes.reserve(4 * count / kMaxLeafSize + 1);
+    build_node(centers, extents, 0, count, 0);
+  }
+  fill_boxes(centers, extents);
+}
+
+void Bvh::fill_boxes(const XMFLOAT3 *centers, const XMFLOAT3 *extents) {
+  _boxes.resize(_indices.size());
+  for (size_t i = 0; i < _indices.size(); ++i)
+    box_bounds(centers[_indices[i]], extents[_indices[i]], &_boxes[i].min, &_boxes[i].max);
+}
+
+int Bvh::build_node(const XMFLOAT3 *centers, const XMFLOAT3 *extents, int begin, int end, int depth) {
+  const int idx = (int)_nodes.size();
+  _nodes.push_back(Node());
+
+  // bounds of the boxes, and of their centers, to pick the split axis
+  XMFLOAT3 mn, mx;
+  box_bounds(centers[_indices[begin]], extents[_indices[begin]], &mn, &mx);
+  XMFLOAT3 cmin(centers[_indices[begin]]), cmax(cmin);
+  for (int i = begin + 1; i < end; ++i) {
+    XMFLOAT3 bmin, bmax;
+    const XMFLOAT3 &c = centers[_indices[i]];
+    box_bounds(c, extents[_indices[i]], &bmin, &bmax);
+    grow(&mn, &mx, bmin, bmax);
+    grow(&cmin, &cmax, c, c);
+  }
+
+  Node &node = _nodes[idx];
+  node.min = mn;
+  node.max = mx;
+  node.begin = begin;
+  node.end = end;
+  node.right = -1;
+
+  if (end - begin <= kMaxLeafSize || depth + 1 >= kMaxDepth)
+    return idx;
+
+  const XMFLOAT3 size(cmax.x - cmin.x, cmax.y - cmin.y, cmax.z - cmin.z);
+  const int split_axis = size.x > size.y && size.x > size.z ? 0 : size.y > size.z ? 1 : 2;
+  const int mid = (begin + end) / 2;
+  nth_element(_indices.begin() + begin, _indices.begin() + mid, _indices.begin() + end, [&](int a, int b) {
+    return axis(centers[a], split_axis) < axis(centers[b], split_axis);
+  });
+
+  build_node(centers, extents, begin, mid, depth + 1);
+  // NB: 'node' might have been invalidated by the push_backs of the left child
+  const int right = build_node(centers, extents, mid, end, depth + 1);
+  _nodes[idx].right = right;
+  return idx;
+}
+
+void Bvh::refit(const XMFLOAT3 *centers, const XMFLOAT3 *extents) {
+  fill_boxes(centers, extents);
+  for (int i = (int)_nodes.size() - 1; i >= 0; --i) {
+    Node &node = _nodes[i];
+    if (node.right == -1) {
+      node.min = _boxes[node.begin].min;
+      node.max = _boxes[node.begin].max;
+      for (int j = node.begin + 1; j < node.end; ++j)
+        grow(&node.min, &node.max, _boxes[j].min, _boxes[j].max);
+    } else {
+      const Node &left = _nodes[i + 1];
+      const Node &right = _nodes[node.right];
+      node.min = left.min;
+      node.max = left.max;
+      grow(&node.min, &node.max, right.min, right.max);
+    }
+  }
+}
+
+void Bvh::add_range(const Node &node, vector<int> *out) const {
+  out->insert(out->end(), _indices.begin() + node.begin, _indices.begin() + node.end);
+}
+
+namespace {
+  enum FrustumTest { kOutside, kIntersecting, kInside };
+
+  FrustumTest test_frustum(const Frustum &frustum, const XMFLOAT3 &mn, const XMFLOAT3 &mx) {
+    const XMFLOAT3 c(0.5f * (mn.x + mx.x), 0.5f * (mn.y + mx.y), 0.5f * (mn.z + mx.z));
+    const XMFLOAT3 e(0.5f * (mx.x - mn.x), 0.5f * (mx.y - mn.y), 0.5f * (mx.z - mn.z));
+    bool inside = true;
+    for (int i = 0; i < 6; ++i) {
+      const XMFLOAT4 &p = frustum.planes[i];
+      float d = c.x * p.x + c.y * p.y + c.z * p.z + p.w;
+      float r = e.x * fabsf(p.x) + e.y * fabsf(p.y) + e.z * fabsf(p.z);
+      if (d + r < 0)
+        return kOutside;
+      inside &= d - r >= 0;
+    }
+    return inside ? kInside : kIntersecting;
+  }
+}
+
+void Bvh::query_frustum(const Frustum &frustum, vector<int> *out) const {
+  if (_nodes.empty())
+    return;
+
+  int stack[kMaxDepth];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const int idx = stack[--top];
+    const Node &node = _nodes[idx];
+    FrustumTest res = test_frustum(frustum, node.min, node.max);
+    if (res == kOutside)
+      continue;
+
+    // everything below a node that's completely inside is visible, so skip the tests
+    if (res == kInside) {
+      add_range(node, out);
+    } else if (node.right == -1) {
+      for (int i = node.begin; i < node.end; ++i) {
+        if (test_frustum(frustum, _boxes[i].min, _boxes[i].max) != kOutside)
+          out->push_back(_indices[i]);
+      }
+    } else {
+      stack[top++] = node.right;
+      stack[top++] = idx + 1;
+    }
+  }
+}
+
+void Bvh::query_aabb(const XMFLOAT3 &center, const XMFLOAT3 &extents, vector<int> *out) const {
+  if (_nodes.empty())
+    return;
+
+  XMFLOAT3 qmin, qmax;
+  box_bounds(center, extents, &qmin, &qmax);
+
+  int stack[kMaxDepth];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const int idx = stack[--top];
+    const Node &node = _nodes[idx];
+    if (node.min.x > qmax.x || node.max.x < qmin.x ||
+        node.min.y > qmax.y || node.max.y < qmin.y ||
+        node.min.z > qmax.z || node.max.z < qmin.z)
+      continue;
+
+    if (node.right == -1) {
+      for (int i = node.begin; i < node.end; ++i) {
+        const Box &b = _boxes[i];
+        if (b.min.x <= qmax.x && b.max.x >= qmin.x &&
+            b.min.y <= qmax.y && b.max.y >= qmin.y &&
+            b.min.z <= qmax.z && b.max.z >= qmin.z)
+          out->push_back(_indices[i]);
+      }
+    } else {
+      stack[top++] = node.right;
+      stack[top++] = idx + 1;
+    }
+  }
+}
+
+int Bvh::raycast(const XMFLOAT3 &origin, const XMFLOAT3 &dir, float max_t, float *hit_t) const {
+  if (_nodes.empty())
+    return -1;
+
+  // slab test. Division by zero gives infinities, which the min/max handle correctly
+  // as long as the origin isn't exactly on a slab
+  const float inv_dir[] = { 1 / dir.x, 1 / dir.y, 1 / dir.z };
+  const float org[] = { origin.x, origin.y, origin.z };
+  auto intersect = [&](const XMFLOAT3 &mn, const XMFLOAT3 &mx, float limit, float *t_enter) -> bool {
+    const float bmin[] = { mn.x, mn.y, mn.z };
+    const float bmax[] = { mx.x, mx.y, mx.z };
+    float t0 = 0, t1 = limit;
+    for (int i = 0; i < 3; ++i) {
+      float near_t = (bmin[i] - org[i]) * inv_dir[i];
+      float far_t = (bmax[i] - org[i]) * inv_dir[i];
+      if (near_t > far_t)
+        swap(near_t, far_t);
+      t0 = max(t0, near_t);
+      t1 = min(t1, far_t);
+    }
+    *t_enter = t0;
+    return t0 <= t1;
+  };
+
+  int best = -1;
+  float best_t = max_t;
+  int stack[kMaxDepth];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const int idx = stack[--top];
+    const Node &node = _nodes[idx];
+    float t;
+    if (!intersect(node.min, node.max, best_t, &t))
+      continue;
+
+    if (node.right == -1) {
+      for (int i = node.begin; i < node.end; ++i) {
+        if (intersect(_boxes[i].min, _boxes[i].max, best_t, &t) && (best == -1 || t < best_t)) {
+          best = _indices[i];
+          best_t = t;
+        }
+      }
+    } else {
+      stack[top++] = node.right;
+      stack[top++] = idx + 1;
+    }
+  }
+
+  if (hit_t)
+    *hit_t = best_t;
+  return best;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+struct Frustum;
+
+// Bounding volume hierarchy over a set of axis aligned boxes, which are identified by their
+// index. The boxes are split at the median of the centers along the longest axis, and the
+// nodes are stored depth first, so a node's children always come after it. That makes
+// refitting (when the boxes move, but the tree is kept) a single backwards pass.
+class Bvh {
+public:
+  void build(const XMFLOAT3 *centers, const XMFLOAT3 *extents, int count);
+  void refit(const XMFLOAT3 *centers, const XMFLOAT3 *extents);
+
+  // The queries append the indices of the matching boxes to 'out'
+  void query_frustum(const Frustum &frustum, std::vector<int> *out) const;
+  void query_aabb(const XMFLOAT3 &center, const XMFLOAT3 &extents, std::vector<int> *out) const;
+  // Returns the index of the box with the closest hit along the ray (from 'origin' to
+  // 'origin' + 'max_t' * 'dir'), or -1 if no box is hit
+  int raycast(const XMFLOAT3 &origin, const XMFLOAT3 &dir, float max_t, float *hit_t) const;
+
+  int num_nodes() const { return (int)_nodes.size(); }
+  int num_boxes() const { return (int)_indices.size(); }
+
+private:
+  enum { kMaxLeafSize = 4, kMaxDepth = 64 };
+
+  struct Node {
+    XMFLOAT3 min, max;
+    // the range of '_indices' covered by the node. The left child is the next node, and
+    // 'right' is -1 for leaves
+    int begin, end;
+    int right;
+  };
+
+  struct Box {
+    XMFLOAT3 min, max;
+  };
+
+  int build_node(const XMFLOAT3 *centers, const XMFLOAT3 *extents, int begin, int end, int depth);
+  void fill_boxes(const XMFLOAT3 *centers, const XMFLOAT3 *extents);
+  void add_range(const Node &node, std::vector<int> *out) const;
+
+  std::vector<Node> _nodes;
+  std::vector<int> _indices;
+  // the bounds of the boxes, in the order of '_indices', so the leaves can test them directly
+  std::vector<Box> _boxes;
+};
@@ -0,0 +1,128 @@
+#include "stdafx.h"
+#include "command_recorder.hpp"
+#include "graphics.hpp"
+#include "file_utils.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+CommandRecorder::CommandRecorder(bool keep_stream)
+  : _keep_stream(keep_stream)
+{
+  reset();
+}
+
+void CommandRecorder::reset() {
+  _stream.clear();
+  memset(_counts, 0, sizeof(_counts));
+  _num_commands = 0;
+  _num_errors = 0;
+}
+
+void CommandRecorder::append(const CommandRecorder &other) {
+  for (int i = 0; i < kNumOps; ++i)
+    _counts[i] += other._counts[i];
+  _num_commands += other._num_commands;
+  _num_errors += other._num_errors;
+  if (_keep_stream)
+    _stream.insert(_stream.end(), other._stream.begin(), other._stream.end());
+}
+
+void CommandRecorder::record(Op op) {
+  record(op, nullptr, 0);
+}
+
+void CommandRecorder::record(Op op, uint64 a) {
+  record(op, &a, 1);
+}
+
+void CommandRecorder::record(Op op, uint64 a, uint64 b) {
+  uint64 args[] = { a, b };
+  record(op, args, 2);
+}
+
+void CommandRecorder::record(Op op, uint64 a, uint64 b, uint64 c) {
+  uint64 args[] = { a, b, c };
+  record(op, args, 3);
+}
+
+void CommandRecorder::record(Op op, const uint64 *args, int num_args) {
+  record(op, args, num_args, nullptr, 0);
+}
+
+void CommandRecorder::record(Op op, const uint64 *args, int num_args, const void *payload, int payload_len) {
+  KASSERT(op >= 0 && op < kNumOps && num_args < 256);
+  _counts[op]++;
+  _num_commands++;
+
+  if (!_keep_stream)
+    return;
+
+  _stream.push_back((uint8)(op | (payload ? kHasPayload : 0)));
+  _stream.push_back((uint8)num_args);
+  for (int i = 0; i < num_args; ++i)
+    write_varint(args[i]);
+
+  if (payload) {
+    write_varint(payload_len);
+    const uint8 *p = (const uint8 *)payload;
+    _stream.insert(_stream.end(), p, p + payload_len);
+  }
+}
+
+void CommandRecorder::write_varint(uint64 value) {
+  // 7 bits per byte, with the high bit set on all but the last byte
+  while (value >= 0x80) {
+    _stream.push_back((uint8)(value | 0x80));
+    value >>= 7;
+  }
+  _stream.push_back((uint8)value);
+}
+
+bool CommandRecorder::validate(GraphicsObjectHandle h) {
+  if (!h.is_valid() || GRAPHICS.is_live(h))
+    return true;
+
+  LOG_WARNING_LN("Stale or unknown handle submitted. type: %d, id: %d, generation: %d", h.type(), h.id(), h.generation());
+  _num_errors++;
+  return false;
+}
+
+bool CommandRecorder::save(const char *filename) const {
+  return save_file(filename, _stream.data(), (int)_stream.size());
+}
+
+const char *CommandRecorder::op_name(Op op) {
+  static const char *names[] = {
+    "begin_frame",
+    "end_frame",
+    "set_render_targets",
+    "unset_render_targets",
+    "generate_mips",
+    "set_vs",
+    "set_ps",
+    "set_cs",
+    "set_gs",
+    "set_layout",
+    "set_vb",
+    "set_ib",
+    "set_topology",
+    "set_rs",
+    "set_dss",
+    "set_bs",
+    "set_samplers",
+    "set_shader_resources",
+    "unset_shader_resources",
+    "set_uavs",
+    "unset_uavs",
+    "set_cbuffer",
+    "map",
+    "unmap",
+    "draw",
+    "draw_indexed",
+    "draw_indexed_instanced",
+    "dispatch",
+  };
+  static_assert(ELEMS_IN_ARRAY(names) == kNumOps, "Op names don't match the ops");
+  return op >= 0 && op < kNumOps ? names[op] : "unknown";
+}
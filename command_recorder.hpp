@@ -0,0 +1,84 @@
+#pragma once
+#include "graphics_object_handle.hpp"
+
+// Records the commands submitted through a DeferredContext. Every handle is checked
+// against the graphics tables as it's recorded, and the number of commands of each kind
+// is counted. If 'keep_stream' is set, the commands are also written to a compact stream,
+// where each command is an opcode byte and an argument count byte, followed by the
+// arguments encoded as varints. Commands with a payload (cbuffer contents, the contents of
+// mapped buffers) have kHasPayload set in the opcode byte, and are followed by the
+// payload length as a varint, and the payload itself. An unmap's payload is the range
+// written since the map, at the offset given by its last argument.
+class CommandRecorder {
+public:
+  enum Op {
+    kBeginFrame,
+    kEndFrame,
+    kSetRenderTargets,
+    kUnsetRenderTargets,
+    kGenerateMips,
+    kSetVs,
+    kSetPs,
+    kSetCs,
+    kSetGs,
+    kSetLayout,
+    kSetVb,
+    kSetIb,
+    kSetTopology,
+    kSetRs,
+    kSetDss,
+    kSetBs,
+    kSetSamplers,
+    kSetShaderResources,
+    kUnsetShaderResources,
+    kSetUavs,
+    kUnsetUavs,
+    kSetCBuffer,
+    kMap,
+    kUnmap,
+    kDraw,
+    kDrawIndexed,
+    kDrawIndexedInstanced,
+    kDispatch,
+    kNumOps
+  };
+
+  enum { kHasPayload = 0x80 };
+
+  CommandRecorder(bool keep_stream);
+
+  void record(Op op);
+  void record(Op op, uint64 a);
+  void record(Op op, uint64 a, uint64 b);
+  void record(Op op, uint64 a, uint64 b, uint64 c);
+  void record(Op op, const uint64 *args, int num_args);
+  void record(Op op, const uint64 *args, int num_args, const void *payload, int payload_len);
+
+  // Returns false (and counts an error) if the handle is valid, but doesn't refer to a
+  // live object. Invalid handles are used to unbind, so they are allowed.
+  bool validate(GraphicsObjectHandle h);
+
+  void reset();
+  // adds the counts and the stream of 'other' to this recorder
+  void append(const CommandRecorder &other);
+  bool save(const char *filename) const;
+
+  bool keep_stream() const { return _keep_stream; }
+  void set_keep_stream(bool value) { _keep_stream = value; }
+
+  int count(Op op) const { return _counts[op]; }
+  int num_commands() const { return _num_commands; }
+  int num_errors() const { return _num_errors; }
+  const std::vector<uint8> &stream() const { return _stream; }
+
+  static const char *op_name(Op op);
+
+private:
+  void write_varint(uint64 value);
+
+  bool _keep_stream;
+  std::vector<uint8> _stream;
+  int _counts[kNumOps];
+  int _num_commands;
+  int _num_errors;
+};
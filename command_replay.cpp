@@ -0,0 +1,389 @@
+#include "stdafx.h"
+#include "command_replay.hpp"
+#include "deferred_context.hpp"
+#include "graphics.hpp"
+#include "file_utils.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+namespace {
+  // the arguments (and payload) each op needs to be executed. Streams with fewer are
+  // rejected when they're decoded, so execute can index the arguments without checking
+  struct OpFormat {
+    int min_args;
+    int min_payload;  // -1 if there's no payload, 0 if it's optional
+  };
+
+  const OpFormat cOpFormats[] = {
+    { 0, -1 },  // begin_frame
+    { 0, -1 },  // end_frame
+    { 1, -1 },  // set_render_targets: clear mask, render targets
+    { 2, -1 },  // unset_render_targets: first, count
+    { 1, -1 },  // generate_mips
+    { 1, -1 },  // set_vs
+    { 1, -1 },  // set_ps
+    { 1, -1 },  // set_cs
+    { 1, -1 },  // set_gs
+    { 1, -1 },  // set_layout
+    { 3, -1 },  // set_vb: vb, stride, offset
+    { 3, -1 },  // set_ib: ib, format, offset
+    { 1, -1 },  // set_topology
+    { 1, -1 },  // set_rs
+    { 2, -1 },  // set_dss: dss, stencil ref
+    { 2, 4 * sizeof(float) },  // set_bs: bs, sample mask, the blend factors as payload
+    { 1, -1 },  // set_samplers: 0, samplers
+    { 1, -1 },  // set_shader_resources: shader type, resources
+    { 3, -1 },  // unset_shader_resources: first, count, shader type
+    { 1, -1 },  // set_uavs: 0, uavs
+    { 2, -1 },  // unset_uavs: first, count
+    { 3, 0 },   // set_cbuffer: cb, slot, shader type, the contents as payload
+    { 3, -1 },  // map: h, sub, map type
+    { 2, 0 },   // unmap: h, sub, offset of the payload
+    { 2, -1 },  // draw
+    { 3, -1 },  // draw_indexed
+    { 5, -1 },  // draw_indexed_instanced
+    { 3, -1 },  // dispatch
+  };
+  static_assert(ELEMS_IN_ARRAY(cOpFormats) == CommandRecorder::kNumOps, "Op formats don't match the ops");
+}
+
+CommandReplayer::CommandReplayer()
+  : _num_frames(0)
+{
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  _frequency = freq.QuadPart;
+}
+
+bool CommandReplayer::load(const char *filename) {
+  vector<uint8> buf;
+  if (!load_file(filename, &buf)) {
+    LOG_ERROR_LN("Unable to load command stream: %s", filename);
+    return false;
+  }
+
+  if (!decode(buf.data(), (int)buf.size())) {
+    LOG_ERROR_LN("Corrupt command stream: %s", filename);
+    return false;
+  }
+
+  LOG_INFO_LN("Loaded %d commands (%d frames) from %s", (int)_commands.size(), _num_frames, filename);
+  return true;
+}
+
+bool CommandReplayer::read_varint(const uint8 **cur, const uint8 *end, uint64 *value) {
+  uint64 res = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*cur == end)
+      return false;
+    uint8 b = *(*cur)++;
+    res |= (uint64)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *value = res;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CommandReplayer::decode(const uint8 *data, int len) {
+  // the whole stream is decoded up front, so the replay timings don't include the parsing
+  _commands.clear();
+  _args.clear();
+  _payloads.clear();
+  _num_frames = 0;
+
+  const uint8 *cur = data;
+  const uint8 *end = data + len;
+  while (cur != end) {
+    if (end - cur < 2) {
+      LOG_ERROR_LN("Truncated command at offset %d", (int)(cur - data));
+      return false;
+    }
+
+    const uint8 op = *cur++;
+    Command cmd;
+    cmd.op = (CommandRecorder::Op)(op & ~CommandRecorder::kHasPayload);
+    cmd.num_args = *cur++;
+    cmd.first_arg = (int)_args.size();
+    cmd.payload_ofs = 0;
+    cmd.payload_len = 0;
+    if (cmd.op >= CommandRecorder::kNumOps) {
+      LOG_ERROR_LN("Unknown op %d at offset %d", cmd.op, (int)(cur - data) - 2);
+      return false;
+    }
+
+    const OpFormat &format = cOpFormats[cmd.op];
+    const bool has_payload = !!(op & CommandRecorder::kHasPayload);
+    if (cmd.num_args < format.min_args || (has_payload && format.min_payload < 0)) {
+      LOG_ERROR_LN("Malformed %s at offset %d: %d args%s", CommandRecorder::op_name(cmd.op),
+        (int)(cur - data) - 2, cmd.num_args, has_payload ? ", unexpected payload" : "");
+      return false;
+    }
+
+    for (int i = 0; i < cmd.num_args; ++i) {
+      uint64 arg;
+      if (!read_varint(&cur, end, &arg)) {
+        LOG_ERROR_LN("Truncated %s arguments", CommandRecorder::op_name(cmd.op));
+        return false;
+      }
+      _args.push_back(arg);
+    }
+
+    if (has_payload) {
+      uint64 payload_len;
+      if (!read_varint(&cur, end, &payload_len) || payload_len > (uint64)(end - cur)) {
+        LOG_ERROR_LN("Truncated %s payload", CommandRecorder::op_name(cmd.op));
+        return false;
+      }
+      cmd.payload_ofs = (int)_payloads.size();
+      cmd.payload_len = (int)payload_len;
+      _payloads.insert(_payloads.end(), cur, cur + payload_len);
+      cur += payload_len;
+    }
+
+    if (format.min_payload > 0 && cmd.payload_len < format.min_payload) {
+      LOG_ERROR_LN("Malformed %s: %d byte payload, %d needed", CommandRecorder::op_name(cmd.op), cmd.payload_len, format.min_payload);
+      return false;
+    }
+
+    if (cmd.op == CommandRecorder::kEndFrame)
+      _num_frames++;
+    _commands.push_back(cmd);
+  }
+
+  return true;
+}
+
+bool CommandReplayer::handles_live(const Command &cmd) const {
+  int first = 0, last = 0;
+  switch (cmd.op) {
+    case CommandRecorder::kSetRenderTargets:
+    case CommandRecorder::kSetSamplers:
+    case CommandRecorder::kSetShaderResources:
+    case CommandRecorder::kSetUavs:
+      // the first argument is a mask or shader type, followed by the handles
+      first = 1;
+      last = cmd.num_args;
+      break;
+
+    case CommandRecorder::kGenerateMips:
+    case CommandRecorder::kSetVs:
+    case CommandRecorder::kSetPs:
+    case CommandRecorder::kSetCs:
+    case CommandRecorder::kSetGs:
+    case CommandRecorder::kSetLayout:
+    case CommandRecorder::kSetVb:
+    case CommandRecorder::kSetIb:
+    case CommandRecorder::kSetRs:
+    case CommandRecorder::kSetDss:
+    case CommandRecorder::kSetBs:
+    case CommandRecorder::kSetCBuffer:
+    case CommandRecorder::kMap:
+    case CommandRecorder::kUnmap:
+      last = min(1, cmd.num_args);
+      break;
+  }
+
+  for (int i = first; i < last; ++i) {
+    GraphicsObjectHandle h = to_handle(_args[cmd.first_arg + i]);
+    if (h.is_valid() && !GRAPHICS.is_live(h))
+      return false;
+  }
+  return true;
+}
+
+void CommandReplayer::execute(DeferredContext *ctx, const Command &cmd) {
+  const uint64 *args = cmd.num_args ? &_args[cmd.first_arg] : nullptr;
+  const uint8 *payload = cmd.payload_len ? &_payloads[cmd.payload_ofs] : nullptr;
+
+  switch (cmd.op) {
+    case CommandRecorder::kBeginFrame:
+      ctx->begin_frame();
+      break;
+
+    case CommandRecorder::kEndFrame:
+      ctx->end_frame();
+      break;
+
+    case CommandRecorder::kSetRenderTargets: {
+      GraphicsObjectHandle render_targets[8];
+      bool clear[8];
+      int count = min(cmd.num_args - 1, (int)ELEMS_IN_ARRAY(render_targets));
+      for (int i = 0; i < count; ++i) {
+        render_targets[i] = to_handle(args[i+1]);
+        clear[i] = !!(args[0] & (1ull << i));
+      }
+      ctx->set_render_targets(render_targets, clear, count);
+      break;
+    }
+
+    case CommandRecorder::kUnsetRenderTargets:
+      ctx->unset_render_targets((int)args[0], (int)args[1]);
+      break;
+
+    case CommandRecorder::kGenerateMips:
+      ctx->generate_mips(to_handle(args[0]));
+      break;
+
+    case CommandRecorder::kSetVs:
+      ctx->set_vs(to_handle(args[0]));
+      break;
+
+    case CommandRecorder::kSetPs:
+      ctx->set_ps(to_handle(args[0]));
+      break;
+
+    case CommandRecorder::kSetCs:
+      ctx->set_cs(to_handle(args[0]));
+      break;
+
+    case CommandRecorder::kSetGs:
+      ctx->set_gs(to_handle(args[0]));
+      break;
+
+    case CommandRecorder::kSetLayout:
+      ctx->set_layout(to_handle(args[0]));
+      break;
+
+    case CommandRecorder::kSetVb: {
+      // binds of raw buffers are recorded with an invalid handle, and can't be replayed
+      GraphicsObjectHandle vb = to_handle(args[0]);
+      if (vb.is_valid())
+        ctx->set_vb(vb, (uint32)args[1], (uint32)args[2]);
+      break;
+    }
+
+    case CommandRecorder::kSetIb:
+      ctx->set_ib(to_handle(args[0]), (DXGI_FORMAT)args[1], (uint32)args[2]);
+      break;
+
+    case CommandRecorder::kSetTopology:
+      ctx->set_topology((D3D11_PRIMITIVE_TOPOLOGY)args[0]);
+      break;
+
+    case CommandRecorder::kSetRs:
+      ctx->set_rs(to_handle(args[0]));
+      break;
+
+    case CommandRecorder::kSetDss:
+      ctx->set_dss(to_handle(args[0]), (UINT)args[1]);
+      break;
+
+    case CommandRecorder::kSetBs:
+      ctx->set_bs(to_handle(args[0]), (const float *)payload, (UINT)args[1]);
+      break;
+
+    case CommandRecorder::kSetSamplers: {
+      SamplerArray samplers;
+      for (int i = 1; i < cmd.num_args && i <= MAX_SAMPLERS; ++i)
+        samplers[i-1] = to_handle(args[i]);
+      ctx->set_samplers(samplers);
+      break;
+    }
+
+    case CommandRecorder::kSetShaderResources:
+    case CommandRecorder::kSetUavs: {
+      TextureArray resources;
+      for (int i = 1; i < cmd.num_args && i <= MAX_TEXTURES; ++i)
+        resources[i-1] = to_handle(args[i]);
+      if (cmd.op == CommandRecorder::kSetUavs)
+        ctx->set_uavs(resources);
+      else
+        ctx->set_shader_resources(resources, (ShaderType::Enum)args[0]);
+      break;
+    }
+
+    case CommandRecorder::kUnsetShaderResources:
+      ctx->unset_shader_resource((int)args[0], (int)args[1], (ShaderType::Enum)args[2]);
+      break;
+
+    case CommandRecorder::kUnsetUavs:
+      ctx->unset_uavs((int)args[0], (int)args[1]);
+      break;
+
+    case CommandRecorder::kSetCBuffer:
+      ctx->set_cbuffer(to_handle(args[0]), (int)args[1], (ShaderType::Enum)args[2], payload, cmd.payload_len);
+      break;
+
+    case CommandRecorder::kMap: {
+      D3D11_MAPPED_SUBRESOURCE res;
+      if (ctx->map(to_handle(args[0]), (UINT)args[1], (D3D11_MAP)args[2], 0, &res)) {
+        Mapping m = { args[0], (UINT)args[1], res.pData };
+        _mapped.push_back(m);
+      }
+      break;
+    }
+
+    case CommandRecorder::kUnmap: {
+      auto it = _mapped.begin();
+      while (it != _mapped.end() && !(it->h == args[0] && it->sub == (UINT)args[1]))
+        ++it;
+      if (it == _mapped.end())
+        break;
+      // the payload might only be a slice of the mapped resource
+      if (payload)
+        memcpy((uint8 *)it->data + (cmd.num_args > 2 ? args[2] : 0), payload, cmd.payload_len);
+      _mapped.erase(it);
+      ctx->unmap(to_handle(args[0]), (UINT)args[1]);
+      break;
+    }
+
+    case CommandRecorder::kDraw:
+      ctx->draw((int)args[0], (int)args[1]);
+      break;
+
+    case CommandRecorder::kDrawIndexed:
+      ctx->draw_indexed((int)args[0], (int)args[1], (int)args[2]);
+      break;
+
+    case CommandRecorder::kDrawIndexedInstanced:
+      ctx->draw_indexed_instanced((int)args[0], (int)args[1], (int)args[2], (int)args[3], (int)args[4]);
+      break;
+
+    case CommandRecorder::kDispatch:
+      ctx->dispatch((int)args[0], (int)args[1], (int)args[2]);
+      break;
+  }
+}
+
+void CommandReplayer::replay(DeferredContext *ctx) {
+  for (size_t i = 0; i < _commands.size(); ++i) {
+    const Command &cmd = _commands[i];
+    OpStats &stats = _stats[cmd.op];
+    if (!handles_live(cmd)) {
+      stats.skipped++;
+      continue;
+    }
+
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    execute(ctx, cmd);
+    QueryPerformanceCounter(&end);
+    stats.count++;
+    stats.ticks += end.QuadPart - start.QuadPart;
+  }
+}
+
+void CommandReplayer::reset_stats() {
+  for (int i = 0; i < CommandRecorder::kNumOps; ++i)
+    _stats[i] = OpStats();
+}
+
+void CommandReplayer::log_stats() const {
+  int64 total = 0;
+  for (int i = 0; i < CommandRecorder::kNumOps; ++i)
+    total += _stats[i].ticks;
+
+  LOG_INFO_LN("Replay: %.3f ms total", 1000.0 * total / _frequency);
+  for (int i = 0; i < CommandRecorder::kNumOps; ++i) {
+    const OpStats &stats = _stats[i];
+    if (!stats.count && !stats.skipped)
+      continue;
+    // the timings include the cost of reading the counter, which dominates for the cheap binds
+    LOG_INFO_LN("  %s: %d commands, %d skipped, %.3f ms, %.3f us/command",
+      CommandRecorder::op_name((CommandRecorder::Op)i), stats.count, stats.skipped,
+      1000.0 * stats.ticks / _frequency, stats.count ? 1e6 * stats.ticks / _frequency / stats.count : 0.0);
+  }
+}
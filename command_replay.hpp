@@ -0,0 +1,66 @@
+#pragma once
+#include "command_recorder.hpp"
+
+class DeferredContext;
+
+// Plays back a command stream saved by a CommandRecorder, and times every command. The
+// handles in the stream are only meaningful if the same resources have been created in
+// the same order as in the capturing run (ie the same demo has been loaded), so commands
+// that refer to objects that aren't live are skipped and counted.
+class CommandReplayer {
+public:
+  struct OpStats {
+    OpStats() : count(0), skipped(0), ticks(0) {}
+    int count;
+    int skipped;
+    int64 ticks;
+  };
+
+  CommandReplayer();
+
+  bool load(const char *filename);
+  // replays the whole stream on the context, and adds the timings to the stats
+  void replay(DeferredContext *ctx);
+
+  int num_frames() const { return _num_frames; }
+  int num_commands() const { return (int)_commands.size(); }
+  const OpStats &stats(CommandRecorder::Op op) const { return _stats[op]; }
+  void reset_stats();
+  void log_stats() const;
+
+private:
+  struct Command {
+    CommandRecorder::Op op;
+    int first_arg;
+    int num_args;
+    int payload_ofs;
+    int payload_len;
+  };
+
+  bool decode(const uint8 *data, int len);
+  bool read_varint(const uint8 **cur, const uint8 *end, uint64 *value);
+  bool handles_live(const Command &cmd) const;
+  void execute(DeferredContext *ctx, const Command &cmd);
+
+  static GraphicsObjectHandle to_handle(uint64 raw) {
+    GraphicsObjectHandle h;
+    h._raw = raw;
+    return h;
+  }
+
+  // mapped resources, waiting for their contents at unmap
+  struct Mapping {
+    uint64 h;
+    UINT sub;
+    void *data;
+  };
+  std::vector<Mapping> _mapped;
+
+  std::vector<Command> _commands;
+  std::vector<uint64> _args;
+  std::vector<uint8> _payloads;
+  int _num_frames;
+
+  OpStats _stats[CommandRecorder::kNumOps];
+  int64 _frequency;
+};
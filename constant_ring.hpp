@@ -0,0 +1,75 @@
+#pragma once
+
+// Linear allocator over a fixed size ring, used to sub-allocate per draw constants and
+// transient geometry from one large buffer. It only hands out offsets, so it doesn't care
+// what the backing storage is. When an allocation doesn't fit at the end, it restarts at
+// the beginning of the ring and reports that it wrapped, in which case the caller has to
+// discard (rename) the backing storage before writing to it.
+class ConstantRing {
+public:
+  ConstantRing(int size, int alignment)
+    : _size(size)
+    , _alignment(alignment)
+    , _head(0)
+    , _needs_discard(true)
+  {
+    KASSERT(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    KASSERT(size % alignment == 0);
+  }
+
+  // Restart at the beginning of the ring. The next allocation always reports a wrap,
+  // because a freshly started (deferred) context must discard before its first write.
+  void reset() {
+    _head = 0;
+    _needs_discard = true;
+  }
+
+  // Returns the offset of a slice of at least 'len' bytes, or -1 if 'len' is larger than the ring.
+  int alloc(int len, bool *wrapped) {
+    const int aligned_len = (len + _alignment - 1) & ~(_alignment - 1);
+    if (aligned_len > _size)
+      return -1;
+
+    *wrapped = _needs_discard;
+    _needs_discard = false;
+
+    if (_head + aligned_len > _size) {
+      _head = 0;
+      *wrapped = true;
+    }
+
+    int ofs = _head;
+    _head += aligned_len;
+    return ofs;
+  }
+
+  // Like alloc, but returns -1 instead of wrapping, for rings that are filled once per
+  // frame and uploaded as a whole
+  int alloc_no_wrap(int len) {
+    const int aligned_len = (len + _alignment - 1) & ~(_alignment - 1);
+    if (_head + aligned_len > _size)
+      return -1;
+
+    _needs_discard = false;
+    int ofs = _head;
+    _head += aligned_len;
+    return ofs;
+  }
+
+  // Shrinks the latest allocation (at 'ofs') to 'len' bytes, and returns the rest to the ring
+  void trim(int ofs, int len) {
+    const int end = ofs + ((len + _alignment - 1) & ~(_alignment - 1));
+    KASSERT(ofs >= 0 && end <= _head);
+    _head = end;
+  }
+
+  int size() const { return _size; }
+  int alignment() const { return _alignment; }
+  int head() const { return _head; }
+
+private:
+  int _size;
+  int _alignment;
+  int _head;
+  bool _needs_discard;
+};
@@ -0,0 +1,203 @@
+#include "stdafx.h"
+#include "cpu_post_process.hpp"
+
+using namespace std;
+
+namespace {
+  // rows are handed out to the threads in bands, to keep the task overhead down
+  const int cRowsPerTask = 16;
+
+  template <typename Fn>
+  void for_each_band(int count, bool parallel, const Fn &fn) {
+    const int num_bands = (count + cRowsPerTask - 1) / cRowsPerTask;
+    auto band = [&](int i) { fn(i * cRowsPerTask, min(count, (i + 1) * cRowsPerTask)); };
+    if (parallel) {
+      Concurrency::parallel_for(0, num_bands, band);
+    } else {
+      for (int i = 0; i < num_bands; ++i)
+        band(i);
+    }
+  }
+
+  __m128 load(const XMFLOAT4 &v) {
+    return _mm_loadu_ps(&v.x);
+  }
+
+  void store(XMFLOAT4 *dst, __m128 v) {
+    _mm_storeu_ps(&dst->x, v);
+  }
+
+  __m128 lerp(__m128 a, __m128 b, __m128 t) {
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+  }
+
+  float luminance(const XMFLOAT4 &c) {
+    return c.x * 0.299f + c.y * 0.587f + c.z * 0.114f;
+  }
+
+  // bilinear sample at the center of 'dst' texel (x, y), with clamp addressing
+  __m128 sample_bilinear(const FloatImage &src, const FloatImage &dst, int x, int y) {
+    const float u = (x + 0.5f) * src.width / dst.width - 0.5f;
+    const float v = (y + 0.5f) * src.height / dst.height - 0.5f;
+    const int x0 = (int)floorf(u), y0 = (int)floorf(v);
+    const __m128 fu = _mm_set1_ps(u - x0), fv = _mm_set1_ps(v - y0);
+    const int xa = max(0, min(src.width - 1, x0)), xb = max(0, min(src.width - 1, x0 + 1));
+    const int ya = max(0, min(src.height - 1, y0)), yb = max(0, min(src.height - 1, y0 + 1));
+    const XMFLOAT4 *ra = src.row(ya), *rb = src.row(yb);
+    return lerp(lerp(load(ra[xa]), load(ra[xb]), fu), lerp(load(rb[xa]), load(rb[xb]), fu), fv);
+  }
+
+  // one pass of the box blur shaders, along rows (with 'stride' 1) or columns. Loads
+  // outside the image return 0, like Texture.Load
+  void box_blur_line(const XMFLOAT4 *src, XMFLOAT4 *dst, int count, int stride, float radius, bool saturate) {
+    const int m = (int)radius;
+    const __m128 alpha = _mm_set1_ps(radius - m);
+    const __m128 scale = _mm_set1_ps(1.0f / (2 * radius + 1));
+    const __m128 one = _mm_set1_ps(1);
+    auto tap = [&](int i) { return i >= 0 && i < count ? load(src[i * stride]) : _mm_setzero_ps(); };
+
+    __m128 sum = tap(0);
+    for (int i = 1; i <= m; ++i)
+      sum = _mm_add_ps(sum, _mm_add_ps(tap(-i), tap(i)));
+    sum = _mm_add_ps(sum, _mm_mul_ps(alpha, _mm_add_ps(tap(-m-1), tap(m+1))));
+
+    for (int i = 0; i < count; ++i) {
+      __m128 res = _mm_mul_ps(sum, scale);
+      store(&dst[i * stride], saturate ? _mm_min_ps(one, res) : res);
+      sum = _mm_add_ps(sum, lerp(tap(i+m+1), tap(i+m+2), alpha));
+      sum = _mm_sub_ps(sum, lerp(tap(i-m), tap(i-m-1), alpha));
+    }
+  }
+}
+
+void cpu_box_blur(const FloatImage &src, FloatImage *dst, FloatImage *tmp, float radius, int iterations, bool parallel) {
+  const int w = src.width, h = src.height;
+  dst->resize(w, h);
+  tmp->resize(w, h);
+  const FloatImage *input = &src;
+  for (int i = 0; i < iterations; ++i) {
+    for_each_band(h, parallel, [&](int y0, int y1) {
+      for (int y = y0; y < y1; ++y)
+        box_blur_line(input->row(y), tmp->row(y), w, 1, radius, false);
+    });
+    // the columns are independent too. Walking down a column is a cache miss per pixel,
+    // but a band of columns shares the cache lines
+    for_each_band(w, parallel, [&](int x0, int x1) {
+      for (int x = x0; x < x1; ++x)
+        box_blur_line(&tmp->pixels[x], &dst->pixels[x], h, w, radius, true);
+    });
+    input = dst;
+  }
+}
+
+void cpu_gaussian_blur(const FloatImage &src, FloatImage *dst, FloatImage *tmp, float sigma, bool parallel) {
+  const int cFirstTap = -6, cNumTaps = 12;
+  __m128 weights[cNumTaps];
+  for (int i = 0; i < cNumTaps; ++i) {
+    // same (unnormalized) weights as CalcGaussianWeight
+    const float d = (float)(cFirstTap + i);
+    const float g = 1.0f / sqrtf(2.0f * 3.14159f * sigma * sigma);
+    weights[i] = _mm_set1_ps(g * expf(-(d * d) / (2 * sigma * sigma)));
+  }
+
+  const int w = src.width, h = src.height;
+  dst->resize(w, h);
+  tmp->resize(w, h);
+
+  for_each_band(h, parallel, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      const XMFLOAT4 *s = src.row(y);
+      XMFLOAT4 *d = tmp->row(y);
+      for (int x = 0; x < w; ++x) {
+        __m128 sum = _mm_setzero_ps();
+        for (int i = 0; i < cNumTaps; ++i) {
+          const int sx = max(0, min(w - 1, x + cFirstTap + i));
+          sum = _mm_add_ps(sum, _mm_mul_ps(weights[i], load(s[sx])));
+        }
+        store(&d[x], sum);
+      }
+    }
+  });
+
+  // vertically, whole rows are weighted and added, so the reads stay sequential
+  for_each_band(h, parallel, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      XMFLOAT4 *d = dst->row(y);
+      for (int x = 0; x < w; ++x)
+        store(&d[x], _mm_setzero_ps());
+      for (int i = 0; i < cNumTaps; ++i) {
+        const XMFLOAT4 *s = tmp->row(max(0, min(h - 1, y + cFirstTap + i)));
+        for (int x = 0; x < w; ++x)
+          store(&d[x], _mm_add_ps(load(d[x]), _mm_mul_ps(weights[i], load(s[x]))));
+      }
+    }
+  });
+}
+
+void cpu_scale(const FloatImage &src, FloatImage *dst, bool parallel) {
+  for_each_band(dst->height, parallel, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      XMFLOAT4 *d = dst->row(y);
+      for (int x = 0; x < dst->width; ++x)
+        store(&d[x], sample_bilinear(src, *dst, x, y));
+    }
+  });
+}
+
+void cpu_luminance_map(const FloatImage &src, FloatImage *dst, bool parallel) {
+  dst->resize(src.width, src.height);
+  for_each_band(src.height, parallel, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      const XMFLOAT4 *s = src.row(y);
+      XMFLOAT4 *d = dst->row(y);
+      for (int x = 0; x < src.width; ++x)
+        d[x] = XMFLOAT4(logf(max(luminance(s[x]), 0.00001f)), 1, 1, 1);
+    }
+  });
+}
+
+float cpu_average_log_luminance(const FloatImage &luminance) {
+  // accumulated per row, so large images don't lose the small values
+  double sum = 0;
+  for (int y = 0; y < luminance.height; ++y) {
+    const XMFLOAT4 *s = luminance.row(y);
+    float row_sum = 0;
+    for (int x = 0; x < luminance.width; ++x)
+      row_sum += s[x].x;
+    sum += row_sum;
+  }
+  return (float)(sum / max(1, luminance.width * luminance.height));
+}
+
+void cpu_scale_cutoff(const FloatImage &src, float avg_log_luminance, FloatImage *dst, bool parallel) {
+  const float cutoff = 10 * expf(avg_log_luminance);
+  for_each_band(dst->height, parallel, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      XMFLOAT4 *d = dst->row(y);
+      for (int x = 0; x < dst->width; ++x) {
+        XMFLOAT4 color;
+        store(&color, sample_bilinear(src, *dst, x, y));
+        const float cur = max(luminance(color), 0.00001f);
+        d[x] = cur >= cutoff ? XMFLOAT4(color.x, color.y, color.z, 1) : XMFLOAT4(0, 0, 0, 1);
+      }
+    }
+  });
+}
+
+void cpu_gamma_correct(const FloatImage &color, const FloatImage &blurred, const FloatImage &pos, float inv_gamma,
+                       FloatImage *dst, bool parallel) {
+  KASSERT(color.width == blurred.width && color.width == pos.width);
+  KASSERT(color.height == blurred.height && color.height == pos.height);
+  dst->resize(color.width, color.height);
+  for_each_band(color.height, parallel, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      const XMFLOAT4 *c = color.row(y), *b = blurred.row(y), *p = pos.row(y);
+      XMFLOAT4 *d = dst->row(y);
+      for (int x = 0; x < color.width; ++x) {
+        XMFLOAT4 v;
+        store(&v, lerp(load(c[x]), load(b[x]), _mm_set1_ps(p[x].w)));
+        d[x] = XMFLOAT4(powf(v.x, inv_gamma), powf(v.y, inv_gamma), powf(v.z, inv_gamma), powf(v.w, inv_gamma));
+      }
+    }
+  });
+}
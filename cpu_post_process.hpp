@@ -0,0 +1,45 @@
+#pragma once
+
+// Float RGBA image, with the rows packed
+struct FloatImage {
+  FloatImage() : width(0), height(0) {}
+  FloatImage(int width, int height) : width(width), height(height), pixels(width * height) {}
+  void resize(int w, int h) { width = w; height = h; pixels.resize(w * h); }
+  XMFLOAT4 *row(int y) { return &pixels[y * width]; }
+  const XMFLOAT4 *row(int y) const { return &pixels[y * width]; }
+  int width, height;
+  std::vector<XMFLOAT4> pixels;
+};
+
+// CPU versions of the post processing passes, with the same parameters and sampling as the
+// shaders, so they can run without a device, and serve as a reference for the gpu output.
+// Every pixel is a single SSE vector, and the rows are split between threads when
+// 'parallel' is set. The destination images are resized to the expected size, except for
+// the scaling passes where the destination size selects the scale.
+
+// The hblur/vblur compute shaders run by GaussianBlur: 'iterations' rounds of a horizontal
+// and a vertical box blur, where texels outside the image are black, and the vertical pass
+// saturates its output. The shaders currently use a radius of 1, whatever the setting.
+void cpu_box_blur(const FloatImage &src, FloatImage *dst, FloatImage *tmp, float radius, int iterations, bool parallel);
+
+// blur_horiz followed by blur_vert: 12 unnormalized gaussian weighted taps, from -6 to 5,
+// with clamped point sampling. The shaders step by the texel size of a fixed 1440/8 x 900/8
+// input, where this steps by the texels of 'src'
+void cpu_gaussian_blur(const FloatImage &src, FloatImage *dst, FloatImage *tmp, float sigma, bool parallel);
+
+// scale: bilinear sampling with clamping, to the size of 'dst'. Halving the size averages
+// 2x2 blocks
+void cpu_scale(const FloatImage &src, FloatImage *dst, bool parallel);
+
+// luminance_map: the log of the luminance in x
+void cpu_luminance_map(const FloatImage &src, FloatImage *dst, bool parallel);
+// The average of a luminance map, like the last mip level of rt_luminance
+float cpu_average_log_luminance(const FloatImage &luminance);
+// scale_cutoff: keeps the pixels at least 10 times brighter than the average, scaled to
+// the size of 'dst'
+void cpu_scale_cutoff(const FloatImage &src, float avg_log_luminance, FloatImage *dst, bool parallel);
+
+// gamma_correction: pow(lerp(color, blurred, depth of field), inv_gamma), where the depth
+// of field factor is in the alpha of 'pos'. All the inputs have to be the same size
+void cpu_gamma_correct(const FloatImage &color, const FloatImage &blurred, const FloatImage &pos, float inv_gamma,
+  FloatImage *dst, bool parallel);
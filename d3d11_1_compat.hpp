@@ -0,0 +1,55 @@
+#pragma once
+
+// The parts of D3D11.1 used to bind constant buffers by offset. The June 2010 SDK we build
+// against predates d3d11_1.h, so they're declared here, with the same values, layout and
+// iid as the real ones. They only work on a runtime that supports D3D11.1 (Windows 8, or
+// Windows 7 with the platform update), so check for the feature, and query for the
+// interface, before using them.
+namespace d3d11_1 {
+
+  // D3D11_FEATURE_D3D11_OPTIONS
+  const D3D11_FEATURE kFeatureOptions = (D3D11_FEATURE)5;
+
+  // D3D11_FEATURE_DATA_D3D11_OPTIONS
+  struct FeatureOptions {
+    BOOL OutputMergerLogicOp;
+    BOOL UAVOnlyRenderingForcedSampleCount;
+    BOOL DiscardAPIsSeenByDriver;
+    BOOL FlagsForUpdateAndCopySeenByDriver;
+    BOOL ClearView;
+    BOOL CopyWithOverlap;
+    BOOL ConstantBufferPartialUpdate;
+    BOOL ConstantBufferOffsetting;
+    BOOL MapNoOverwriteOnDynamicConstantBuffer;
+    BOOL MapNoOverwriteOnDynamicBufferSRV;
+    BOOL MultisampleRTVWithForcedSampleCountOne;
+    BOOL SAD4ShaderInstructions;
+    BOOL ExtendedDoublesShaderInstructions;
+    BOOL ExtendedResourceSharing;
+  };
+
+  // ID3D11DeviceContext1, up to the last of the *SetConstantBuffers1 methods. The methods
+  // after those aren't declared, so this must never be implemented, only queried for
+  MIDL_INTERFACE("bb2c6faa-b5fb-4082-8e6b-388b8cfa90e1")
+  DeviceContext1 : public ID3D11DeviceContext {
+  public:
+    virtual void STDMETHODCALLTYPE CopySubresourceRegion1(ID3D11Resource *pDstResource, UINT DstSubresource,
+      UINT DstX, UINT DstY, UINT DstZ, ID3D11Resource *pSrcResource, UINT SrcSubresource, const D3D11_BOX *pSrcBox, UINT CopyFlags) = 0;
+    virtual void STDMETHODCALLTYPE UpdateSubresource1(ID3D11Resource *pDstResource, UINT DstSubresource,
+      const D3D11_BOX *pDstBox, const void *pSrcData, UINT SrcRowPitch, UINT SrcDepthPitch, UINT CopyFlags) = 0;
+    virtual void STDMETHODCALLTYPE DiscardResource(ID3D11Resource *pResource) = 0;
+    virtual void STDMETHODCALLTYPE DiscardView(ID3D11View *pResourceView) = 0;
+    virtual void STDMETHODCALLTYPE VSSetConstantBuffers1(UINT StartSlot, UINT NumBuffers,
+      ID3D11Buffer *const *ppConstantBuffers, const UINT *pFirstConstant, const UINT *pNumConstants) = 0;
+    virtual void STDMETHODCALLTYPE HSSetConstantBuffers1(UINT StartSlot, UINT NumBuffers,
+      ID3D11Buffer *const *ppConstantBuffers, const UINT *pFirstConstant, const UINT *pNumConstants) = 0;
+    virtual void STDMETHODCALLTYPE DSSetConstantBuffers1(UINT StartSlot, UINT NumBuffers,
+      ID3D11Buffer *const *ppConstantBuffers, const UINT *pFirstConstant, const UINT *pNumConstants) = 0;
+    virtual void STDMETHODCALLTYPE GSSetConstantBuffers1(UINT StartSlot, UINT NumBuffers,
+      ID3D11Buffer *const *ppConstantBuffers, const UINT *pFirstConstant, const UINT *pNumConstants) = 0;
+    virtual void STDMETHODCALLTYPE PSSetConstantBuffers1(UINT StartSlot, UINT NumBuffers,
+      ID3D11Buffer *const *ppConstantBuffers, const UINT *pFirstConstant, const UINT *pNumConstants) = 0;
+    virtual void STDMETHODCALLTYPE CSSetConstantBuffers1(UINT StartSlot, UINT NumBuffers,
+      ID3D11Buffer *const *ppConstantBuffers, const UINT *pFirstConstant, const UINT *pNumConstants) = 0;
+  };
+}
@@ -5,12 +5,49 @@
 #include "deferred_context.hpp"
 #include "material_manager.hpp"
 #include "scene.hpp"
+#include "constant_ring.hpp"
+#include "profiler.hpp"
 
 using namespace std;
 
+namespace {
+  const int cTransientVbSize = 8 * 1024 * 1024;
+  const int cTransientIbSize = 1024 * 1024;
+  // a multiple of both index sizes, and of the common vertex component sizes
+  const int cTransientAlignment = 16;
+
+  // the resource behind a mappable handle, or null if the handle is stale or not mappable
+  ID3D11Resource *mappable_resource(GraphicsObjectHandle h) {
+    switch (h.type()) {
+    case GraphicsObjectHandle::kTexture: {
+      auto *data = GRAPHICS._textures.get(h);
+      return data ? data->texture.resource : nullptr;
+    }
+
+    case GraphicsObjectHandle::kVertexBuffer:
+      return GRAPHICS._vertex_buffers.get(h);
+
+    case GraphicsObjectHandle::kIndexBuffer:
+      return GRAPHICS._index_buffers.get(h);
+
+    case GraphicsObjectHandle::kStructuredBuffer: {
+      auto *data = GRAPHICS._structured_buffers.get(h);
+      return data ? data->buffer.resource : nullptr;
+    }
+
+    default:
+      LOG_ERROR_LN("Invalid resource type passed to %s", __FUNCTION__);
+      return nullptr;
+    }
+  }
+}
+
 DeferredContext::DeferredContext() 
   : _ctx(nullptr)
   , _is_immediate_context(false)
+  , _cbuffer_ring(nullptr)
+  , _recorder(nullptr)
+  , _upload_generation(0)
 {
     _default_stencil_ref = GRAPHICS.default_stencil_ref();
     memcpy(_default_blend_factors, GRAPHICS.default_blend_factors(), sizeof(_default_blend_factors));
@@ -18,6 +55,168 @@ DeferredContext::DeferredContext()
 }
 
 DeferredContext::~DeferredContext() {
+  delete exch_null(_cbuffer_ring);
+  delete exch_null(_transient_vb.ring);
+  delete exch_null(_transient_ib.ring);
+}
+
+#if WITH_CBUFFER_RING
+bool DeferredContext::init_cbuffer_ring(ID3D11Device *device, int size) {
+  // a D3D11.0 runtime doesn't know the feature, and doesn't hand out the interface
+  d3d11_1::FeatureOptions options;
+  if (FAILED(device->CheckFeatureSupport(d3d11_1::kFeatureOptions, &options, sizeof(options))))
+    return false;
+
+  if (!options.ConstantBufferOffsetting || !options.MapNoOverwriteOnDynamicConstantBuffer)
+    return false;
+
+  if (FAILED(_ctx->QueryInterface(__uuidof(d3d11_1::DeviceContext1), (void **)&_ctx1.p)))
+    return false;
+
+  CD3D11_BUFFER_DESC desc(size, D3D11_BIND_CONSTANT_BUFFER, D3D11_USAGE_DYNAMIC, D3D11_CPU_ACCESS_WRITE);
+  if (FAILED(device->CreateBuffer(&desc, NULL, &_ring_buffer.p)))
+    return false;
+
+  // offsets have to be a multiple of 16 constants
+  _cbuffer_ring = new ConstantRing(size, 16 * 16);
+  _ring_staging.resize(size);
+  return true;
+}
+#endif
+
+int DeferredContext::cbuffer_ring_used() const {
+  return _cbuffer_ring ? _cbuffer_ring->head() : -1;
+}
+
+DeferredContext::CBufferBinding DeferredContext::upload_cbuffer(GraphicsObjectHandle cb, const void *data, int len) {
+
+  if (!cb.is_valid() || len <= 0)
+    return upload_cbuffer_inner(cb, data, len);
+
+  // skip the map and copy if the buffer still holds the same contents as our last upload
+  const uint32 id = cb.id();
+  if (id >= _upload_cache.size())
+    _upload_cache.resize(id + 1);
+  UploadCache &cache = _upload_cache[id];
+  if (cache.handle == cb && cache.generation == _upload_generation && cache.version == GRAPHICS.cbuffer_version(cb) &&
+      (int)cache.contents.size() == len && !memcmp(cache.contents.data(), data, len)) {
+    ++_bind_stats.cbuffer_uploads_skipped;
+    return cache.binding;
+  }
+
+  CBufferBinding binding = upload_cbuffer_inner(cb, data, len);
+  _bind_stats.cbuffer_bytes_uploaded += len;
+  cache.handle = cb;
+  cache.generation = _upload_generation;
+  cache.version = GRAPHICS.cbuffer_version(cb);
+  cache.binding = binding;
+  cache.contents.assign((const char *)data, (const char *)data + len);
+  return binding;
+}
+
+DeferredContext::CBufferBinding DeferredContext::upload_cbuffer_inner(GraphicsObjectHandle cb, const void *data, int len) {
+
+  CBufferBinding binding = { nullptr, 0, 0 };
+
+#if WITH_CBUFFER_RING
+  if (_cbuffer_ring && len > 0) {
+    // the whole frame is uploaded at once, so the ring can't wrap. If it fills up, the rest
+    // of the frame uses per-buffer uploads
+    int ofs = _cbuffer_ring->alloc_no_wrap(len);
+    if (ofs == -1) {
+      LOG_WARNING_LN_ONESHOT("Constant buffer ring full (%d bytes), falling back to per-buffer uploads", _cbuffer_ring->size());
+    } else {
+      memcpy(_ring_staging.data() + ofs, data, len);
+      binding.buffer = _ring_buffer;
+      binding.first_constant = ofs / 16;
+      binding.num_constants = (len + _cbuffer_ring->alignment() - 1) / _cbuffer_ring->alignment() * 16;
+      return binding;
+    }
+  }
+#endif
+
+  ID3D11Buffer *buffer = GRAPHICS._constant_buffers.get(cb);
+  if (!buffer) {
+    LOG_WARNING_LN_ONESHOT("Stale constant buffer handle, binding null");
+    return binding;
+  }
+  if (len > 0) {
+    D3D11_MAPPED_SUBRESOURCE sub;
+    _ctx->Map(buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &sub);
+    memcpy(sub.pData, data, len);
+    _ctx->Unmap(buffer, 0);
+    GRAPHICS.bump_cbuffer_version(cb);
+  }
+  binding.buffer = buffer;
+  binding.num_constants = (len + 255) / 256 * 16;
+  return binding;
+}
+
+void DeferredContext::bind_cbuffers(ShaderType::Enum type, int first_slot, int count, const CBufferBinding *bindings) {
+
+  ID3D11Buffer *buffers[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT];
+  for (int i = 0; i < count; ++i)
+    buffers[i] = bindings[i].buffer;
+
+#if WITH_CBUFFER_RING
+  if (_cbuffer_ring) {
+    UINT first_constants[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT];
+    UINT num_constants[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT];
+    for (int i = 0; i < count; ++i) {
+      first_constants[i] = bindings[i].first_constant;
+      num_constants[i] = bindings[i].num_constants;
+    }
+
+    if (type == ShaderType::kVertexShader)
+      _ctx1->VSSetConstantBuffers1(first_slot, count, buffers, first_constants, num_constants);
+    else if (type == ShaderType::kPixelShader)
+      _ctx1->PSSetConstantBuffers1(first_slot, count, buffers, first_constants, num_constants);
+    else if (type == ShaderType::kComputeShader)
+      _ctx1->CSSetConstantBuffers1(first_slot, count, buffers, first_constants, num_constants);
+    else if (type == ShaderType::kGeometryShader)
+      _ctx1->GSSetConstantBuffers1(first_slot, count, buffers, first_constants, num_constants);
+    else
+      LOG_ERROR_LN("Implement me!");
+    return;
+  }
+#endif
+
+  if (type == ShaderType::kVertexShader)
+    _ctx->VSSetConstantBuffers(first_slot, count, buffers);
+  else if (type == ShaderType::kPixelShader)
+    _ctx->PSSetConstantBuffers(first_slot, count, buffers);
+  else if (type == ShaderType::kComputeShader)
+    _ctx->CSSetConstantBuffers(first_slot, count, buffers);
+  else if (type == ShaderType::kGeometryShader)
+    _ctx->GSSetConstantBuffers(first_slot, count, buffers);
+  else
+    LOG_ERROR_LN("Implement me!");
+}
+
+void DeferredContext::upload_and_bind_cbuffers(ShaderType::Enum type, const std::vector<CBuffer *> &cbuffers) {
+
+  CBufferBinding bindings[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT];
+  memset(bindings, 0, sizeof(bindings));
+  int first_slot = D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT;
+  int last_slot = -1;
+
+  for (size_t i = 0; i < cbuffers.size(); ++i) {
+    if (auto *cur = cbuffers[i]) {
+      int slot = cur->slot;
+      // reflection only hands out slots the stage has, but the bindings are indexed by it
+      if (slot < 0 || slot >= D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT) {
+        LOG_WARNING_LN_ONESHOT("Constant buffer bound to slot %d, past the stage's slots", slot);
+        continue;
+      }
+      first_slot = min(first_slot, slot);
+      last_slot = max(last_slot, slot);
+      record_payload(CommandRecorder::kSetCBuffer, cur->handle, slot, type, cur->staging.data(), (int)cur->staging.size());
+      bindings[slot] = upload_cbuffer(cur->handle, cur->staging.data(), (int)cur->staging.size());
+    }
+  }
+
+  if (last_slot >= first_slot)
+    bind_cbuffers(type, first_slot, last_slot - first_slot + 1, &bindings[first_slot]);
 }
 
 
@@ -26,6 +225,10 @@ void DeferredContext::render_technique(GraphicsObjectHandle technique_handle,
                                        const TextureArray &resources,
                                        const InstanceData &instance_data) {
   Technique *technique = GRAPHICS._techniques.get(technique_handle);
+  if (!technique) {
+    LOG_WARNING_LN_ONESHOT("Stale technique handle, skipping draw");
+    return;
+  }
 
   Shader *vs = technique->vertex_shader(0);
   Shader *ps = technique->pixel_shader(0);
@@ -74,25 +277,31 @@ void DeferredContext::render_technique(GraphicsObjectHandle technique_handle,
 
     set_cbuffer(vs_s_cbuffer, ps_s_cbuffer);
 
-    for (int ii = 0; ii < instance_data.num_instances; ++ii) {
+    if (ps->instance_buffer().is_valid()) {
+      draw_instances(ps->instance_buffer(), instance_data, technique->index_count());
+
+    } else {
+      // the shader reads its instance data from a cbuffer, so draw the instances one at a time
+      for (int ii = 0; ii < instance_data.num_instances; ++ii) {
 
-      auto &ps_i_cbuffer = ps->instance_cbuffer();
+        auto &ps_i_cbuffer = ps->instance_cbuffer();
 
-      for (size_t j = 0; j < ps_i_cbuffer.vars.size(); ++j) {
-        auto &var = ps_i_cbuffer.vars[j];
+        for (size_t j = 0; j < ps_i_cbuffer.vars.size(); ++j) {
+          auto &var = ps_i_cbuffer.vars[j];
 
-        for (size_t k = 0; k < instance_data.vars.size(); ++k) {
-          auto &cur = instance_data.vars[k];
-          if (cur.id == var.id) {
-            const void *data = &instance_data.payload[cur.ofs + ii * instance_data.block_size];
-            memcpy(&ps_i_cbuffer.staging[var.ofs], data, cur.len);
-            break;
+          for (size_t k = 0; k < instance_data.vars.size(); ++k) {
+            auto &cur = instance_data.vars[k];
+            if (cur.id == var.id) {
+              const void *data = &instance_data.payload[cur.ofs + ii * instance_data.block_size];
+              memcpy(&ps_i_cbuffer.staging[var.ofs], data, cur.len);
+              break;
+            }
           }
         }
-      }
 
-      set_cbuffer(vs->instance_cbuffer(), ps->instance_cbuffer());
-      draw_indexed(technique->index_count(), 0, 0);
+        set_cbuffer(vs->instance_cbuffer(), ps->instance_cbuffer());
+        draw_indexed(technique->index_count(), 0, 0);
+      }
     }
 
   } else {
@@ -105,7 +314,55 @@ void DeferredContext::render_technique(GraphicsObjectHandle technique_handle,
     unset_shader_resource(0, MAX_TEXTURES, ShaderType::kPixelShader);
 }
 
+void DeferredContext::draw_instances(const InstanceBuffer &instance_buffer, const InstanceData &instance_data, int index_count) {
+
+  // find the payload variable for each of the shader's instance variables
+  auto &vars = instance_buffer.vars;
+  int *payload_var = (int *)_alloca(vars.size() * sizeof(int));
+  for (size_t i = 0; i < vars.size(); ++i) {
+    payload_var[i] = -1;
+    for (size_t j = 0; j < instance_data.vars.size(); ++j) {
+      if (instance_data.vars[j].id == vars[i].id) {
+        payload_var[i] = (int)j;
+        break;
+      }
+    }
+  }
+
+  TextureArray views;
+  views[instance_buffer.slot] = instance_buffer.handle;
+  set_shader_resources(views, ShaderType::kPixelShader);
+
+  // pack the payload into the instance buffer, and draw as many instances as fit
+  const int stride = instance_buffer.stride;
+  for (int first = 0; first < instance_data.num_instances; first += instance_buffer.capacity) {
+    int count = min(instance_buffer.capacity, instance_data.num_instances - first);
+
+    D3D11_MAPPED_SUBRESOURCE res;
+    if (!map(instance_buffer.handle, 0, D3D11_MAP_WRITE_DISCARD, 0, &res))
+      break;
+
+    char *dst = (char *)res.pData;
+    for (int i = 0; i < count; ++i) {
+      const char *src = &instance_data.payload[(first + i) * instance_data.block_size];
+      for (size_t j = 0; j < vars.size(); ++j) {
+        if (payload_var[j] == -1)
+          continue;
+        auto &cur = instance_data.vars[payload_var[j]];
+        memcpy(dst + i * stride + vars[j].ofs, src + cur.ofs, min(cur.len, vars[j].len));
+      }
+    }
+    unmap(instance_buffer.handle, 0);
+
+    draw_indexed_instanced(index_count, count, 0, 0, 0);
+  }
+
+  unset_shader_resource(instance_buffer.slot, 1, ShaderType::kPixelShader);
+}
+
 void DeferredContext::fill_system_resource_views(const ResourceViewArray &views, TextureArray *out) const {
+  // the system views are mostly render targets, whose properties are set as they're acquired
+  SCOPED_CS(GRAPHICS._render_target_cs);
   for (size_t i = 0; i < views.size(); ++i) {
     if (views[i].used && views[i].source == PropertySource::kSystem) {
       (*out)[i] = PROPERTY_MANAGER.get_property<GraphicsObjectHandle>(views[i].class_id);
@@ -113,9 +370,25 @@ void DeferredContext::fill_system_resource_views(const ResourceViewArray &views,
   }
 }
 
+void DeferredContext::record_handles(CommandRecorder::Op op, uint64 a, const GraphicsObjectHandle *handles, int count) {
+  if (!_recorder)
+    return;
+  uint64 args[1 + MAX_TEXTURES];
+  KASSERT(count <= MAX_TEXTURES);
+  args[0] = a;
+  for (int i = 0; i < count; ++i) {
+    _recorder->validate(handles[i]);
+    args[i+1] = handles[i];
+  }
+  _recorder->record(op, args, count + 1);
+}
+
 void DeferredContext::generate_mips(GraphicsObjectHandle h) {
-  auto rt = GRAPHICS._render_targets.get(h);
-  _ctx->GenerateMips(rt->srv.resource);
+  record_handle(CommandRecorder::kGenerateMips, h);
+  if (auto rt = GRAPHICS.render_target(h))
+    _ctx->GenerateMips(rt->srv.resource);
+  else
+    LOG_WARNING_LN_ONESHOT("Stale render target handle, skipping GenerateMips");
 }
 
 void DeferredContext::set_render_target(GraphicsObjectHandle render_target, bool clear_target) {
@@ -124,16 +397,29 @@ void DeferredContext::set_render_target(GraphicsObjectHandle render_target, bool
 
 void DeferredContext::set_render_targets(GraphicsObjectHandle *render_targets, bool *clear_targets, int num_render_targets) {
 
-  ID3D11RenderTargetView *rts[8] = { nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr };
-  ID3D11DepthStencilView *dsv = nullptr;
+  uint32 clear_mask = 0;
+  for (int i = 0; i < num_render_targets; ++i)
+    clear_mask |= clear_targets[i] ? 1 << i : 0;
+  record_handles(CommandRecorder::kSetRenderTargets, clear_mask, render_targets, num_render_targets);
+
+  RenderTargetState state;
+  memset(&state, 0, sizeof(state));
+  state.count = num_render_targets;
+  ID3D11RenderTargetView **rts = state.rtvs;
+  ID3D11DepthStencilView *&dsv = state.dsv;
   D3D11_TEXTURE2D_DESC texture_desc;
+  memset(&texture_desc, 0, sizeof(texture_desc));
   float color[4] = {0,0,0,0};
   // Collect the valid render targets, set the first available depth buffer
   // and clear targets if specified
   for (int i = 0; i < num_render_targets; ++i) {
     GraphicsObjectHandle h = render_targets[i];
     KASSERT(h.is_valid());
-    auto rt = GRAPHICS._render_targets.get(h);
+    auto rt = GRAPHICS.render_target(h);
+    if (!rt) {
+      LOG_WARNING_LN_ONESHOT("Stale render target handle in slot %d, binding null", i);
+      continue;
+    }
     texture_desc = rt->texture.desc;
     if (!dsv && rt->dsv.resource) {
       dsv = rt->dsv.resource;
@@ -147,82 +433,151 @@ void DeferredContext::set_render_targets(GraphicsObjectHandle *render_targets, b
       }
     }
   }
-  CD3D11_VIEWPORT viewport(0.0f, 0.0f, (float)texture_desc.Width, (float)texture_desc.Height);
-  _ctx->RSSetViewports(1, &viewport);
-  _ctx->OMSetRenderTargets(num_render_targets, rts, dsv);
+  bind_render_targets(state);
+  if (texture_desc.Width > 0)
+    bind_viewport(CD3D11_VIEWPORT(0.0f, 0.0f, (float)texture_desc.Width, (float)texture_desc.Height));
 }
 
 void DeferredContext::set_default_render_target(bool clear) {
-  auto rt = GRAPHICS._render_targets.get(GRAPHICS._default_render_target);
-  _ctx->OMSetRenderTargets(1, &rt->rtv.resource.p, rt->dsv.resource);
+  record_handles(CommandRecorder::kSetRenderTargets, clear ? 1 : 0, &GRAPHICS._default_render_target, 1);
+  auto rt = GRAPHICS.render_target(GRAPHICS._default_render_target);
+  RenderTargetState state;
+  memset(&state, 0, sizeof(state));
+  state.count = 1;
+  state.rtvs[0] = rt->rtv.resource;
+  state.dsv = rt->dsv.resource;
+  bind_render_targets(state);
   if (clear) {
     static float color[4] = {0,0,0,0};
     _ctx->ClearRenderTargetView(rt->rtv.resource, color);
     _ctx->ClearDepthStencilView(rt->dsv.resource, D3D11_CLEAR_DEPTH | D3D11_CLEAR_STENCIL, 1.0f, 0 );
   }
-  _ctx->RSSetViewports(1, &GRAPHICS._viewport);
+  bind_viewport(GRAPHICS._viewport);
+}
+
+void DeferredContext::bind_render_targets(const RenderTargetState &state) {
+  if (update_state(&_render_targets, state))
+    _ctx->OMSetRenderTargets(state.count, state.rtvs, state.dsv);
+}
+
+void DeferredContext::bind_viewport(const D3D11_VIEWPORT &viewport) {
+  ViewportState state;
+  state.viewport = viewport;
+  if (update_state(&_viewport, state))
+    _ctx->RSSetViewports(1, &viewport);
 }
 
 void DeferredContext::set_vs(GraphicsObjectHandle vs) {
+  record_handle(CommandRecorder::kSetVs, vs);
   KASSERT(vs.type() == GraphicsObjectHandle::kVertexShader || !vs.is_valid());
-  _ctx->VSSetShader(GRAPHICS._vertex_shaders.get(vs), NULL, 0);
+  ID3D11VertexShader *shader = vs.is_valid() ? GRAPHICS._vertex_shaders.get(vs) : NULL;
+  if (update_state(&_vs, shader))
+    _ctx->VSSetShader(shader, NULL, 0);
 }
 
 void DeferredContext::set_cs(GraphicsObjectHandle cs) {
+  record_handle(CommandRecorder::kSetCs, cs);
   KASSERT(cs.type() == GraphicsObjectHandle::kComputeShader || !cs.is_valid());
-  _ctx->CSSetShader(cs.is_valid() ? GRAPHICS._compute_shaders.get(cs) : NULL, NULL, 0);
+  ID3D11ComputeShader *shader = cs.is_valid() ? GRAPHICS._compute_shaders.get(cs) : NULL;
+  if (update_state(&_cs, shader))
+    _ctx->CSSetShader(shader, NULL, 0);
 }
 
 void DeferredContext::set_gs(GraphicsObjectHandle gs) {
+  record_handle(CommandRecorder::kSetGs, gs);
   KASSERT(gs.type() == GraphicsObjectHandle::kGeometryShader || !gs.is_valid());
-  _ctx->GSSetShader(gs.is_valid() ? GRAPHICS._geometry_shaders.get(gs) : NULL, NULL, 0);
+  ID3D11GeometryShader *shader = gs.is_valid() ? GRAPHICS._geometry_shaders.get(gs) : NULL;
+  if (update_state(&_gs, shader))
+    _ctx->GSSetShader(shader, NULL, 0);
 }
 
 void DeferredContext::set_ps(GraphicsObjectHandle ps) {
+  record_handle(CommandRecorder::kSetPs, ps);
   KASSERT(ps.type() == GraphicsObjectHandle::kPixelShader || !ps.is_valid());
-  _ctx->PSSetShader(ps.is_valid() ? GRAPHICS._pixel_shaders.get(ps) : NULL, NULL, 0);
+  ID3D11PixelShader *shader = ps.is_valid() ? GRAPHICS._pixel_shaders.get(ps) : NULL;
+  if (update_state(&_ps, shader))
+    _ctx->PSSetShader(shader, NULL, 0);
 }
 
 void DeferredContext::set_layout(GraphicsObjectHandle layout) {
-  _ctx->IASetInputLayout(GRAPHICS._input_layouts.get(layout));
+  record_handle(CommandRecorder::kSetLayout, layout);
+  ID3D11InputLayout *input_layout = GRAPHICS._input_layouts.get(layout);
+  if (update_state(&_layout, input_layout))
+    _ctx->IASetInputLayout(input_layout);
 }
 
-void DeferredContext::set_vb(ID3D11Buffer *buf, uint32_t stride)
-{
-  UINT ofs[] = { 0 };
+void DeferredContext::set_vb(ID3D11Buffer *buf, uint32_t stride) {
+  // raw buffers aren't in the graphics tables, so only the stride is recorded
+  record(CommandRecorder::kSetVb, GraphicsObjectHandle(), stride);
+  bind_vb(buf, stride, 0);
+}
+
+void DeferredContext::bind_vb(ID3D11Buffer *buf, uint32_t stride, uint32 offset) {
+  VbState state = { buf, stride, offset };
+  if (!update_state(&_vb, state))
+    return;
+  UINT ofs[] = { offset };
   ID3D11Buffer* bufs[] = { buf };
   uint32_t strides[] = { stride };
   _ctx->IASetVertexBuffers(0, 1, bufs, strides, ofs);
 }
 
 void DeferredContext::set_vb(GraphicsObjectHandle vb) {
-set_vb(GRAPHICS._vertex_buffers.get(vb), vb.data());
+  set_vb(vb, vb.data(), 0);
+}
+
+void DeferredContext::set_vb(GraphicsObjectHandle vb, uint32 stride, uint32 offset) {
+  record_handle(CommandRecorder::kSetVb, vb, stride, offset);
+  bind_vb(GRAPHICS._vertex_buffers.get(vb), stride, offset);
 }
 
 void DeferredContext::set_ib(GraphicsObjectHandle ib) {
-  _ctx->IASetIndexBuffer(GRAPHICS._index_buffers.get(ib), (DXGI_FORMAT)ib.data(), 0);
+  set_ib(ib, (DXGI_FORMAT)ib.data(), 0);
+}
+
+void DeferredContext::set_ib(GraphicsObjectHandle ib, DXGI_FORMAT format, uint32 offset) {
+  record_handle(CommandRecorder::kSetIb, ib, format, offset);
+  IbState state = { GRAPHICS._index_buffers.get(ib), format, offset };
+  if (update_state(&_ib, state))
+    _ctx->IASetIndexBuffer(state.buf, state.format, offset);
 }
 
 void DeferredContext::set_topology(D3D11_PRIMITIVE_TOPOLOGY top) {
-  _ctx->IASetPrimitiveTopology(top);
+  record(CommandRecorder::kSetTopology, top);
+  if (update_state(&_topology, top))
+    _ctx->IASetPrimitiveTopology(top);
 }
 
 void DeferredContext::set_rs(GraphicsObjectHandle rs) {
-  _ctx->RSSetState(GRAPHICS._rasterizer_states.get(rs));
+  record_handle(CommandRecorder::kSetRs, rs);
+  ID3D11RasterizerState *state = GRAPHICS._rasterizer_states.get(rs);
+  if (update_state(&_rs, state))
+    _ctx->RSSetState(state);
 }
 
 void DeferredContext::set_dss(GraphicsObjectHandle dss, UINT stencil_ref) {
-  _ctx->OMSetDepthStencilState(GRAPHICS._depth_stencil_states.get(dss), stencil_ref);
+  record_handle(CommandRecorder::kSetDss, dss, stencil_ref);
+  DssState state = { GRAPHICS._depth_stencil_states.get(dss), stencil_ref };
+  if (update_state(&_dss, state))
+    _ctx->OMSetDepthStencilState(state.state, stencil_ref);
 }
 
 void DeferredContext::set_bs(GraphicsObjectHandle bs, const float *blend_factors, UINT sample_mask) {
-  _ctx->OMSetBlendState(GRAPHICS._blend_states.get(bs), blend_factors, sample_mask);
+  record_payload(CommandRecorder::kSetBs, bs, sample_mask, 0, blend_factors, 4 * sizeof(float));
+  BsState state;
+  state.state = GRAPHICS._blend_states.get(bs);
+  memcpy(state.blend_factors, blend_factors, sizeof(state.blend_factors));
+  state.sample_mask = sample_mask;
+  if (update_state(&_bs, state))
+    _ctx->OMSetBlendState(state.state, blend_factors, sample_mask);
 }
 
 void DeferredContext::set_samplers(const SamplerArray &samplers) {
-  int size = samplers.size() * sizeof(GraphicsObjectHandle);
+  record_handles(CommandRecorder::kSetSamplers, 0, samplers.data(), MAX_SAMPLERS);
+  SamplerState state;
+  memset(&state, 0, sizeof(state));
   int first_sampler = MAX_SAMPLERS, num_samplers = 0;
-  ID3D11SamplerState *d3dsamplers[MAX_SAMPLERS];
+  ID3D11SamplerState **d3dsamplers = state.samplers;
   for (int i = 0; i < MAX_SAMPLERS; ++i) {
     if (samplers[i].is_valid()) {
       d3dsamplers[i] = GRAPHICS._sampler_states.get(samplers[i]);
@@ -232,17 +587,25 @@ void DeferredContext::set_samplers(const SamplerArray &samplers) {
   }
 
   if (num_samplers) {
-    _ctx->PSSetSamplers(first_sampler, num_samplers, &d3dsamplers[first_sampler]);
+    state.first = first_sampler;
+    state.count = num_samplers;
+    if (update_state(&_samplers, state))
+      _ctx->PSSetSamplers(first_sampler, num_samplers, &d3dsamplers[first_sampler]);
   }
 }
 
 void DeferredContext::unset_uavs(int first, int count) {
+  record(CommandRecorder::kUnsetUavs, first, count);
   UINT initialCount = -1;
   static ID3D11UnorderedAccessView *nullViews[MAX_TEXTURES] = {0, 0, 0, 0, 0, 0, 0, 0};
   _ctx->CSSetUnorderedAccessViews(first, count, nullViews, &initialCount);
 }
 
 void DeferredContext::set_uavs(const TextureArray &uavs) {
+  record_handles(CommandRecorder::kSetUavs, 0, uavs.data(), MAX_TEXTURES);
+
+  // binding a resource as a uav unbinds it as a render target
+  _render_targets.valid = false;
 
   int size = uavs.size() * sizeof(GraphicsObjectHandle);
   ID3D11UnorderedAccessView *d3dUavs[MAX_TEXTURES];
@@ -254,12 +617,18 @@ void DeferredContext::set_uavs(const TextureArray &uavs) {
       GraphicsObjectHandle h = uavs[i];
       auto type = h.type();
 
+      // stale handles, and unsupported types, are bound as null
+      d3dUavs[i] = nullptr;
       if (type == GraphicsObjectHandle::kStructuredBuffer) {
-        auto *data = GRAPHICS._structured_buffers.get(h);
-        d3dUavs[i] = data->uav.resource;
+        if (auto *data = GRAPHICS._structured_buffers.get(h))
+          d3dUavs[i] = data->uav.resource;
+        else
+          LOG_WARNING_LN_ONESHOT("Stale structured buffer handle in uav slot %d, binding null", i);
       } else if (type == GraphicsObjectHandle::kRenderTarget) {
-        auto *data = GRAPHICS._render_targets.get(h);
-        d3dUavs[i] = data->uav.resource;
+        if (auto *data = GRAPHICS.render_target(h))
+          d3dUavs[i] = data->uav.resource;
+        else
+          LOG_WARNING_LN_ONESHOT("Stale render target handle in uav slot %d, binding null", i);
       } else {
         LOG_ERROR_LN("Trying to set an unsupported UAV type!");
       }
@@ -296,6 +665,7 @@ void DeferredContext::set_shader_resource(GraphicsObjectHandle resource, ShaderT
 }
 
 void DeferredContext::set_shader_resources(const TextureArray &resources, ShaderType::Enum type) {
+  record_handles(CommandRecorder::kSetShaderResources, type, resources.data(), MAX_TEXTURES);
   int size = resources.size() * sizeof(GraphicsObjectHandle);
   ID3D11ShaderResourceView *d3dresources[MAX_TEXTURES];
   int first_resource = MAX_TEXTURES, num_resources = 0;
@@ -303,21 +673,25 @@ void DeferredContext::set_shader_resources(const TextureArray &resources, Shader
     if (resources[i].is_valid()) {
       GraphicsObjectHandle h = resources[i];
       auto type = h.type();
+      // stale handles, and invalid types, are bound as null
+      d3dresources[i] = nullptr;
       if (type == GraphicsObjectHandle::kTexture) {
-        auto *data = GRAPHICS._textures.get(h);
-        d3dresources[i] = data->view.resource;
+        if (auto *data = GRAPHICS._textures.get(h))
+          d3dresources[i] = data->view.resource;
       } else if (type == GraphicsObjectHandle::kResource) {
-        auto *data = GRAPHICS._resources.get(h);
-        d3dresources[i] = data->view.resource;
+        if (auto *data = GRAPHICS._resources.get(h))
+          d3dresources[i] = data->view.resource;
       } else if (type == GraphicsObjectHandle::kRenderTarget) {
-        auto *data = GRAPHICS._render_targets.get(h);
-        d3dresources[i] = data->srv.resource;
+        if (auto *data = GRAPHICS.render_target(h))
+          d3dresources[i] = data->srv.resource;
       } else if (type == GraphicsObjectHandle::kStructuredBuffer) {
-        auto *data = GRAPHICS._structured_buffers.get(h);
-        d3dresources[i] = data->srv.resource;
+        if (auto *data = GRAPHICS._structured_buffers.get(h))
+          d3dresources[i] = data->srv.resource;
       } else {
         LOG_ERROR_LN("Trying to set invalid resource type!");
       }
+      if (!d3dresources[i])
+        LOG_WARNING_LN_ONESHOT("Stale handle in shader resource slot %d, binding null", i);
       num_resources++;
       first_resource = min(first_resource, i);
     }
@@ -356,13 +730,32 @@ void DeferredContext::set_shader_resources(const TextureArray &resources, Shader
 }
 
 void DeferredContext::unset_render_targets(int first, int count) {
-  static ID3D11RenderTargetView *nullViews[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-  _ctx->OMSetRenderTargets(8, nullViews, nullptr);
+  record(CommandRecorder::kUnsetRenderTargets, first, count);
+  RenderTargetState state;
+  memset(&state, 0, sizeof(state));
+  if (!_render_targets.valid) {
+    // nothing is known about what's bound, so unbind everything
+    state.count = D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT;
+    bind_render_targets(state);
+    return;
+  }
+
+  // the targets outside the range stay bound, and the depth buffer goes with the last target
+  state = _render_targets.value;
+  const int end = min(first + count, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT);
+  for (int i = max(first, 0); i < end; ++i)
+    state.rtvs[i] = nullptr;
+  while (state.count > 0 && !state.rtvs[state.count - 1])
+    --state.count;
+  if (!state.count)
+    state.dsv = nullptr;
+  bind_render_targets(state);
 }
 
 void DeferredContext::unset_shader_resource(int first_view, int num_views, ShaderType::Enum type) {
   if (!num_views)
     return;
+  record(CommandRecorder::kUnsetShaderResources, first_view, num_views, type);
   static ID3D11ShaderResourceView *null_views[MAX_SAMPLERS] = {0, 0, 0, 0, 0, 0, 0, 0};
   if (type == ShaderType::kVertexShader)
     _ctx->VSSetShaderResources(first_view, num_views, null_views);
@@ -380,148 +773,233 @@ void DeferredContext::unset_shader_resource(int first_view, int num_views, Shade
 void DeferredContext::set_cbuffer(const CBuffer &vs, const CBuffer &ps) {
 
   if (vs.staging.size() > 0) {
-    ID3D11Buffer *buffer = GRAPHICS._constant_buffers.get(vs.handle);
-    D3D11_MAPPED_SUBRESOURCE sub;
-    _ctx->Map(buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &sub);
-    memcpy(sub.pData, vs.staging.data(), vs.staging.size());
-    _ctx->Unmap(buffer, 0);
-
-    _ctx->VSSetConstantBuffers(vs.slot, 1, &buffer);
+    record_payload(CommandRecorder::kSetCBuffer, vs.handle, vs.slot, ShaderType::kVertexShader, vs.staging.data(), (int)vs.staging.size());
+    CBufferBinding binding = upload_cbuffer(vs.handle, vs.staging.data(), (int)vs.staging.size());
+    bind_cbuffers(ShaderType::kVertexShader, vs.slot, 1, &binding);
   }
 
   if (ps.staging.size() > 0) {
-    ID3D11Buffer *buffer = GRAPHICS._constant_buffers.get(ps.handle);
-    D3D11_MAPPED_SUBRESOURCE sub;
-    _ctx->Map(buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &sub);
-    memcpy(sub.pData, ps.staging.data(), ps.staging.size());
-    _ctx->Unmap(buffer, 0);
-
-    _ctx->PSSetConstantBuffers(ps.slot, 1, &buffer);
+    record_payload(CommandRecorder::kSetCBuffer, ps.handle, ps.slot, ShaderType::kPixelShader, ps.staging.data(), (int)ps.staging.size());
+    CBufferBinding binding = upload_cbuffer(ps.handle, ps.staging.data(), (int)ps.staging.size());
+    bind_cbuffers(ShaderType::kPixelShader, ps.slot, 1, &binding);
   }
 }
 
 void DeferredContext::set_cbuffers(const std::vector<CBuffer *> &vs, const std::vector<CBuffer *> &ps) {
+  upload_and_bind_cbuffers(ShaderType::kVertexShader, vs);
+  upload_and_bind_cbuffers(ShaderType::kPixelShader, ps);
+}
 
-  ID3D11Buffer **vs_cb = (ID3D11Buffer **)_alloca(vs.size() * sizeof(ID3D11Buffer *));
-  ID3D11Buffer **ps_cb = (ID3D11Buffer **)_alloca(ps.size() * sizeof(ID3D11Buffer *));
+void DeferredContext::set_cbuffer(GraphicsObjectHandle cb, int slot, ShaderType::Enum type, const void *data, int dataLen) {
 
-  // Copy the vs cbuffers
-  int firstVsSlot = D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT;
-  for (size_t i = 0; i < vs.size(); ++i) {
-    if (auto *cur = vs[i]) {
-      int slot = cur->slot;
-      firstVsSlot = min(firstVsSlot, slot);
-      ID3D11Buffer *buffer = GRAPHICS._constant_buffers.get(cur->handle);
-      D3D11_MAPPED_SUBRESOURCE sub;
-      _ctx->Map(buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &sub);
-      memcpy(sub.pData, cur->staging.data(), cur->staging.size());
-      _ctx->Unmap(buffer, 0);
-      vs_cb[slot] = buffer;
-    }
-  }
+  KASSERT(dataLen == cb.data());
+  record_payload(CommandRecorder::kSetCBuffer, cb, slot, type, data, dataLen);
+  if (!GRAPHICS._constant_buffers.get(cb))
+    return;
+  CBufferBinding binding = upload_cbuffer(cb, data, dataLen);
+  bind_cbuffers(type, slot, 1, &binding);
+}
 
-  // Copy the ps cbuffers
-  int firstPsSlot = D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT;
-  for (size_t i = 0; i < ps.size(); ++i) {
-    if (auto *cur = ps[i]) {
-      int slot = cur->slot;
-      firstPsSlot = min(firstPsSlot, slot);
-      ID3D11Buffer *buffer = GRAPHICS._constant_buffers.get(cur->handle);
-      D3D11_MAPPED_SUBRESOURCE sub;
-      _ctx->Map(buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &sub);
-      memcpy(sub.pData, cur->staging.data(), cur->staging.size());
-      _ctx->Unmap(buffer, 0);
-      ps_cb[slot] = buffer;
-    }
+bool DeferredContext::map(GraphicsObjectHandle h, UINT sub, D3D11_MAP type, UINT flags, D3D11_MAPPED_SUBRESOURCE *res) {
+  record_handle(CommandRecorder::kMap, h, sub, type);
+  ID3D11Resource *resource = mappable_resource(h);
+  if (!resource) {
+    LOG_WARNING_LN_ONESHOT("Can't map handle %d, it's stale or not mappable", h.id());
+    return false;
   }
 
-  if (!vs.empty())
-    _ctx->VSSetConstantBuffers(firstVsSlot, vs.size() - firstVsSlot, &vs_cb[firstVsSlot]);
+  if (FAILED(_ctx->Map(resource, sub, type, flags, res)))
+    return false;
 
-  if (!ps.empty())
-      _ctx->PSSetConstantBuffers(firstPsSlot, ps.size() - firstPsSlot, &ps_cb[firstPsSlot]);
+  // when capturing, the contents are saved on unmap, so they can be written again on replay
+  if (_recorder && _recorder->keep_stream()) {
+    MappedRange range = { h, sub, res->pData, 0, mapped_size(resource, sub, *res) };
+    _mapped.push_back(range);
+  }
+  return true;
 }
 
-void DeferredContext::set_cbuffer(GraphicsObjectHandle cb, int slot, ShaderType::Enum type, const void *data, int dataLen) {
+int DeferredContext::mapped_size(ID3D11Resource *resource, UINT sub, const D3D11_MAPPED_SUBRESOURCE &res) {
+  D3D11_RESOURCE_DIMENSION dim;
+  resource->GetType(&dim);
+  if (dim == D3D11_RESOURCE_DIMENSION_BUFFER) {
+    D3D11_BUFFER_DESC desc;
+    static_cast<ID3D11Buffer *>(resource)->GetDesc(&desc);
+    return desc.ByteWidth;
+  }
 
-  KASSERT(dataLen == cb.data());
-  ID3D11Buffer *buffer = GRAPHICS._constant_buffers.get(cb);
-  if (!buffer)
-    return;
-  D3D11_MAPPED_SUBRESOURCE sub;
-  _ctx->Map(buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &sub);
-  memcpy(sub.pData, data, dataLen);
-  _ctx->Unmap(buffer, 0);
+  if (dim == D3D11_RESOURCE_DIMENSION_TEXTURE2D) {
+    D3D11_TEXTURE2D_DESC desc;
+    static_cast<ID3D11Texture2D *>(resource)->GetDesc(&desc);
+    UINT mip = sub % max(1u, desc.MipLevels);
+    return res.RowPitch * max(1u, desc.Height >> mip);
+  }
 
-  if (type == ShaderType::kVertexShader)
-    _ctx->VSSetConstantBuffers(slot, 1, &buffer);
-  else if (type == ShaderType::kPixelShader)
-    _ctx->PSSetConstantBuffers(slot, 1, &buffer);
-  else if (type == ShaderType::kComputeShader)
-    _ctx->CSSetConstantBuffers(slot, 1, &buffer);
-  else if (type == ShaderType::kGeometryShader)
-    _ctx->GSSetConstantBuffers(slot, 1, &buffer);
-  else
-    LOG_ERROR_LN("Implement me!");
+  LOG_WARNING_LN("Unable to capture mapped resource of dimension %d", dim);
+  return 0;
 }
 
-bool DeferredContext::map(GraphicsObjectHandle h, UINT sub, D3D11_MAP type, UINT flags, D3D11_MAPPED_SUBRESOURCE *res) {
-  switch (h.type()) {
-  case GraphicsObjectHandle::kTexture:
-    return SUCCEEDED(_ctx->Map(GRAPHICS._textures.get(h)->texture.resource, sub, type, flags, res));
+bool DeferredContext::map_transient_vb(int len, TransientAlloc *alloc) {
+  return map_transient(&_transient_vb, D3D11_BIND_VERTEX_BUFFER, cTransientVbSize, len, alloc);
+}
+
+bool DeferredContext::map_transient_ib(int len, TransientAlloc *alloc) {
+  return map_transient(&_transient_ib, D3D11_BIND_INDEX_BUFFER, cTransientIbSize, len, alloc);
+}
 
-  case GraphicsObjectHandle::kVertexBuffer:
-    return SUCCEEDED(_ctx->Map(GRAPHICS._vertex_buffers.get(h), sub, type, flags, res));
+bool DeferredContext::map_transient(TransientRing *ring, D3D11_BIND_FLAG bind, int size, int len, TransientAlloc *alloc) {
+  if (!ring->ring) {
+    // the stride and format are given when binding, so the handle data is just a placeholder
+    int data = bind == D3D11_BIND_INDEX_BUFFER ? DXGI_FORMAT_R16_UINT : 1;
+    ring->buffer = GRAPHICS.create_buffer(FROM_HERE, bind, size, true, nullptr, data);
+    if (!ring->buffer.is_valid())
+      return false;
+    ring->ring = new ConstantRing(size, cTransientAlignment);
+  }
 
-  case GraphicsObjectHandle::kIndexBuffer:
-    return SUCCEEDED(_ctx->Map(GRAPHICS._index_buffers.get(h), sub, type, flags, res));
+  bool wrapped;
+  int ofs = ring->ring->alloc(len, &wrapped);
+  if (ofs == -1) {
+    LOG_ERROR_LN("Transient allocation of %d bytes is larger than the ring (%d bytes)", len, size);
+    return false;
+  }
+
+  // Every discard after the frame's first renames the whole ring, and the driver holds on to
+  // each copy until the frame has been drawn. The odd heavy frame can wrap once, but wrapping
+  // again means the ring is too small for the frames it's used for
+  if (wrapped && ++ring->discards > 1) {
+    ++_bind_stats.transient_wraps;
+    if (ring->discards > 2)
+      LOG_WARNING_LN_ONESHOT("Transient %s ring (%d bytes) wrapped %d times in a frame", 
+        bind == D3D11_BIND_INDEX_BUFFER ? "index" : "vertex", size, ring->discards - 1);
+  }
 
-  default:
-    LOG_ERROR_LN("Invalid resource type passed to %s", __FUNCTION__);
+  // only discard when the slices handed out so far might be overwritten
+  D3D11_MAPPED_SUBRESOURCE res;
+  if (!map(ring->buffer, 0, wrapped ? D3D11_MAP_WRITE_DISCARD : D3D11_MAP_WRITE_NO_OVERWRITE, 0, &res))
     return false;
+
+  alloc->buffer = ring->buffer;
+  alloc->offset = ofs;
+  alloc->len = len;
+  alloc->data = (char *)res.pData + ofs;
+
+  // capture the slice, and not the whole ring
+  if (MappedRange *range = find_mapped(ring->buffer, 0)) {
+    range->ofs = ofs;
+    range->len = len;
   }
+  return true;
 }
 
-void DeferredContext::unmap(GraphicsObjectHandle h, UINT sub) {
-  switch (h.type()) {
-  case GraphicsObjectHandle::kTexture:
-    _ctx->Unmap(GRAPHICS._textures.get(h)->texture.resource, sub);
-    break;
-
-  case GraphicsObjectHandle::kVertexBuffer:
-    _ctx->Unmap(GRAPHICS._vertex_buffers.get(h), sub);
-    break;
+void DeferredContext::unmap_transient(TransientAlloc *alloc, int used_len) {
+  KASSERT(used_len <= alloc->len);
+  TransientRing *ring = alloc->buffer == _transient_vb.buffer ? &_transient_vb : &_transient_ib;
+  KASSERT(alloc->buffer == ring->buffer);
+  if (MappedRange *range = find_mapped(alloc->buffer, 0))
+    range->len = used_len;
+  unmap(alloc->buffer, 0);
+  ring->ring->trim(alloc->offset, used_len);
+  alloc->len = used_len;
+  alloc->data = nullptr;
+}
 
-  case GraphicsObjectHandle::kIndexBuffer:
-    _ctx->Unmap(GRAPHICS._index_buffers.get(h), sub);
-    break;
+DeferredContext::MappedRange *DeferredContext::find_mapped(GraphicsObjectHandle h, UINT sub) {
+  for (size_t i = 0; i < _mapped.size(); ++i) {
+    if (_mapped[i].h == h && _mapped[i].sub == sub)
+      return &_mapped[i];
+  }
+  return nullptr;
+}
 
-  default:
-    LOG_WARNING_LN("Invalid resource type passed to %s", __FUNCTION__);
+void DeferredContext::unmap(GraphicsObjectHandle h, UINT sub) {
+  if (_recorder) {
+    _recorder->validate(h);
+    // the payload is the range written to since the map, and the last argument is its offset
+    if (MappedRange *range = find_mapped(h, sub)) {
+      uint64 args[] = { h, sub, (uint64)range->ofs };
+      _recorder->record(CommandRecorder::kUnmap, args, ELEMS_IN_ARRAY(args), (char *)range->data + range->ofs, range->len);
+      _mapped.erase(_mapped.begin() + (range - _mapped.data()));
+    } else {
+      uint64 args[] = { h, sub, 0 };
+      _recorder->record(CommandRecorder::kUnmap, args, ELEMS_IN_ARRAY(args));
+    }
   }
+
+  if (ID3D11Resource *resource = mappable_resource(h))
+    _ctx->Unmap(resource, sub);
+  else
+    LOG_WARNING_LN_ONESHOT("Can't unmap handle %d, it's stale or not mappable", h.id());
 }
 
 void DeferredContext::draw_indexed(int count, int start_index, int base_vertex) {
+  record(CommandRecorder::kDrawIndexed, count, start_index, base_vertex);
   _ctx->DrawIndexed(count, start_index, base_vertex);
 }
 
+void DeferredContext::draw_indexed_instanced(int count, int num_instances, int start_index, int base_vertex, int start_instance) {
+  uint64 args[] = { count, num_instances, start_index, base_vertex, start_instance };
+  if (_recorder)
+    _recorder->record(CommandRecorder::kDrawIndexedInstanced, args, ELEMS_IN_ARRAY(args));
+  _ctx->DrawIndexedInstanced(count, num_instances, start_index, base_vertex, start_instance);
+}
+
 void DeferredContext::draw(int vertexCount, int startVertexLocation) {
+  record(CommandRecorder::kDraw, vertexCount, startVertexLocation);
   _ctx->Draw(vertexCount, startVertexLocation);
 }
 
 void DeferredContext::dispatch(int threadGroupCountX, int threadGroupCountY, int threadGroupCountZ) {
+  record(CommandRecorder::kDispatch, threadGroupCountX, threadGroupCountY, threadGroupCountZ);
   _ctx->Dispatch(threadGroupCountX, threadGroupCountY, threadGroupCountZ);
 }
 
+void DeferredContext::invalidate_state() {
+  _vs.valid = _ps.valid = _gs.valid = _cs.valid = false;
+  _layout.valid = _vb.valid = _ib.valid = _topology.valid = false;
+  _rs.valid = _dss.valid = _bs.valid = _samplers.valid = false;
+  _render_targets.valid = _viewport.valid = false;
+}
+
 void DeferredContext::begin_frame() {
+  // when recording in parallel, each thread records to its own recorder
+  _recorder = GRAPHICS.thread_recorder();
+  record(CommandRecorder::kBeginFrame);
+  // the immediate context is shared between effects, so we can't trust the shadow state
+  invalidate_state();
+  if (_cbuffer_ring)
+    _cbuffer_ring->reset();
+  // a new command list has to discard before its first write to the transient rings
+  if (_transient_vb.ring)
+    _transient_vb.ring->reset();
+  if (_transient_ib.ring)
+    _transient_ib.ring->reset();
+  _transient_vb.discards = _transient_ib.discards = 0;
+  // The cached uploads are kept across frames, as the buffer versions catch writes from
+  // other contexts. The ring's slices only live for a frame though, and contexts recording
+  // in parallel don't run their command lists in the order they check the versions
+  if (_cbuffer_ring || WITH_PARALLEL_RECORDING)
+    ++_upload_generation;
+  _bind_stats = BindStats();
 }
 
 void DeferredContext::end_frame() {
+  record(CommandRecorder::kEndFrame);
   if (!_is_immediate_context) {
     ID3D11CommandList *cmd_list;
     _ctx->FinishCommandList(FALSE, &cmd_list);
+#if WITH_CBUFFER_RING
+    if (_cbuffer_ring && _cbuffer_ring->head() > 0)
+      GRAPHICS.add_command_list(cmd_list, _ring_buffer, _ring_staging.data(), _cbuffer_ring->head());
+    else
+#endif
     GRAPHICS.add_command_list(cmd_list);
   }
+  // FinishCommandList resets the deferred context's state. The bindings are set for every
+  // draw anyway, and the buffer contents survive it, so the upload cache stays
+  invalidate_state();
+  _last_bind_stats = _bind_stats;
+  ADD_PROFILE_COUNTER("cbuffer_bytes_uploaded", _bind_stats.cbuffer_bytes_uploaded);
 }
 
 
@@ -1,13 +1,28 @@
 #pragma once
 #include "graphics_object_handle.hpp"
 #include "shader.hpp"
+#include "command_recorder.hpp"
+#include "d3d11_1_compat.hpp"
 
 struct Scene;
+class ConstantRing;
 
 class DeferredContext {
   friend class Graphics;
 public:
 
+  // Number of state binds passed on to the device context vs skipped because the
+  // state was already bound, and the same for constant buffer uploads. The transient wraps
+  // are the discards of the transient rings after the frame's first map
+  struct BindStats {
+    BindStats() : issued(0), filtered(0), cbuffer_bytes_uploaded(0), cbuffer_uploads_skipped(0), transient_wraps(0) {}
+    int issued;
+    int filtered;
+    int cbuffer_bytes_uploaded;
+    int cbuffer_uploads_skipped;
+    int transient_wraps;
+  };
+
   struct InstanceVar {
     InstanceVar(PropertyId id, int len) : id(id), len(len), ofs(0) {}
     PropertyId id;
@@ -49,6 +64,16 @@ public:
   void set_render_targets(GraphicsObjectHandle *render_targets, bool *clear_targets, int num_render_targets);
   void generate_mips(GraphicsObjectHandle h);
 
+  // A slice of one of the transient geometry rings. Transient geometry is valid until the
+  // end of the frame, or until the ring wraps, which discards everything handed out before.
+  struct TransientAlloc {
+    TransientAlloc() : offset(0), len(0), data(nullptr) {}
+    GraphicsObjectHandle buffer;
+    int offset;
+    int len;
+    void *data;
+  };
+
   void render_technique(GraphicsObjectHandle technique_handle,
     const std::function<void(CBuffer *)> &fnSystemCbuffers,
     const TextureArray &resources = TextureArray(),
@@ -75,23 +100,241 @@ public:
   void set_uavs(const TextureArray &uavs);
   void unset_uavs(int first, int count);
   void unset_shader_resource(int first_view, int num_views, ShaderType::Enum type);
+  // Unbinds the render targets in slots [first, first + count), and the depth buffer once
+  // no targets are left
   void unset_render_targets(int first, int count);
   void set_cbuffers(const std::vector<CBuffer *> &vs, const std::vector<CBuffer *> &ps);
   void set_cbuffer(const CBuffer &vs, const CBuffer &ps);
   void set_cbuffer(GraphicsObjectHandle cb, int slot, ShaderType::Enum type, const void *data, int dataLen);
   void fill_system_resource_views(const ResourceViewArray &views, TextureArray *out) const;
   void draw_indexed(int count, int start_index, int base_vertex);
+  void draw_indexed_instanced(int count, int num_instances, int start_index, int base_vertex, int start_instance);
   void draw(int vertexCount, int startVertexLocation);
   void dispatch(int threadGroupCountX, int threadGroupCountY, int threadGroupCountZ);
 
   bool map(GraphicsObjectHandle h, UINT sub, D3D11_MAP type, UINT flags, D3D11_MAPPED_SUBRESOURCE *res);
   void unmap(GraphicsObjectHandle h, UINT sub);
 
+  // Maps 'len' bytes at the head of the transient vertex (or index) ring. The ring is
+  // appended to with NO_OVERWRITE, and is only discarded on the first map of the frame, or
+  // when it wraps. Draw from the slice before mapping the next one.
+  bool map_transient_vb(int len, TransientAlloc *alloc);
+  bool map_transient_ib(int len, TransientAlloc *alloc);
+  // Unmaps the slice, and returns the part after the first 'used_len' bytes to the ring
+  void unmap_transient(TransientAlloc *alloc, int used_len);
+  void set_vb(GraphicsObjectHandle vb, uint32 stride, uint32 offset);
+  void set_ib(GraphicsObjectHandle ib, DXGI_FORMAT format, uint32 offset);
+
+  // Forget the shadowed state, so the next bind of each kind is always issued. This is
+  // called at frame boundaries, but needs to be called if anyone else touches the
+  // underlying context.
+  void invalidate_state();
+
+  // stats for the last completed frame
+  const BindStats &bind_stats() const { return _last_bind_stats; }
+  // bytes of the constant ring used by the frame being recorded, or -1 if the context uploads
+  // each constant buffer on its own
+  int cbuffer_ring_used() const;
+
+  // All submitted commands are passed on to the recorder (if any) before being issued
+  void set_recorder(CommandRecorder *recorder) { _recorder = recorder; }
+
+  // Packs the instances into the instance buffer, and draws them with one instanced draw
+  // per buffer full. Called by render_technique, with the technique's shaders bound
+  void draw_instances(const InstanceBuffer &instance_buffer, const InstanceData &instance_data, int index_count);
+
 private:
   DeferredContext();
   ~DeferredContext();
+
+  // A shadowed piece of pipeline state. Unknown until the first bind after an invalidate.
+  template<typename T>
+  struct Shadow {
+    Shadow() : valid(false) {}
+    T value;
+    bool valid;
+  };
+
+  struct VbState {
+    bool operator==(const VbState &rhs) const { return buf == rhs.buf && stride == rhs.stride && offset == rhs.offset; }
+    ID3D11Buffer *buf;
+    uint32 stride;
+    uint32 offset;
+  };
+
+  struct IbState {
+    bool operator==(const IbState &rhs) const { return buf == rhs.buf && format == rhs.format && offset == rhs.offset; }
+    ID3D11Buffer *buf;
+    DXGI_FORMAT format;
+    uint32 offset;
+  };
+
+  struct DssState {
+    bool operator==(const DssState &rhs) const { return state == rhs.state && stencil_ref == rhs.stencil_ref; }
+    ID3D11DepthStencilState *state;
+    UINT stencil_ref;
+  };
+
+  struct BsState {
+    bool operator==(const BsState &rhs) const {
+      return state == rhs.state && sample_mask == rhs.sample_mask && !memcmp(blend_factors, rhs.blend_factors, sizeof(blend_factors));
+    }
+    ID3D11BlendState *state;
+    float blend_factors[4];
+    UINT sample_mask;
+  };
+
+  struct SamplerState {
+    bool operator==(const SamplerState &rhs) const {
+      return first == rhs.first && count == rhs.count && !memcmp(samplers, rhs.samplers, sizeof(samplers));
+    }
+    int first, count;
+    ID3D11SamplerState *samplers[MAX_SAMPLERS];
+  };
+
+  struct RenderTargetState {
+    // slots past 'count' are always null, so they can be included in the compare
+    bool operator==(const RenderTargetState &rhs) const {
+      return dsv == rhs.dsv && !memcmp(rtvs, rhs.rtvs, sizeof(rtvs));
+    }
+    int count;
+    ID3D11RenderTargetView *rtvs[8];
+    ID3D11DepthStencilView *dsv;
+  };
+
+  struct ViewportState {
+    bool operator==(const ViewportState &rhs) const { return !memcmp(&viewport, &rhs.viewport, sizeof(viewport)); }
+    D3D11_VIEWPORT viewport;
+  };
+
+  // Updates the shadow, and returns true if the bind needs to be issued
+  template<typename T>
+  bool update_state(Shadow<T> *shadow, const T &value) {
+    if (shadow->valid && shadow->value == value) {
+      ++_bind_stats.filtered;
+      return false;
+    }
+    shadow->value = value;
+    shadow->valid = true;
+    ++_bind_stats.issued;
+    return true;
+  }
+
+  void record(CommandRecorder::Op op) {
+    if (_recorder)
+      _recorder->record(op);
+  }
+
+  void record(CommandRecorder::Op op, uint64 a, uint64 b = 0, uint64 c = 0) {
+    if (_recorder)
+      _recorder->record(op, a, b, c);
+  }
+
+  void record_handle(CommandRecorder::Op op, GraphicsObjectHandle h, uint64 b = 0, uint64 c = 0) {
+    if (_recorder) {
+      _recorder->validate(h);
+      _recorder->record(op, h, b, c);
+    }
+  }
+
+  void record_payload(CommandRecorder::Op op, GraphicsObjectHandle h, uint64 b, uint64 c, const void *data, int len) {
+    if (_recorder) {
+      _recorder->validate(h);
+      uint64 args[] = { h, b, c };
+      _recorder->record(op, args, ELEMS_IN_ARRAY(args), data, len);
+    }
+  }
+
+  void record_handles(CommandRecorder::Op op, uint64 a, const GraphicsObjectHandle *handles, int count);
+  static int mapped_size(ID3D11Resource *resource, UINT sub, const D3D11_MAPPED_SUBRESOURCE &res);
+
+  void bind_vb(ID3D11Buffer *buf, uint32_t stride, uint32 offset);
+  void bind_render_targets(const RenderTargetState &state);
+  void bind_viewport(const D3D11_VIEWPORT &viewport);
+
+  // A constant buffer binding. When using the constant ring, it's a range of the ring buffer,
+  // specified in 16 byte constants
+  struct CBufferBinding {
+    ID3D11Buffer *buffer;
+    UINT first_constant;
+    UINT num_constants;
+  };
+
+  // The last contents uploaded to each constant buffer (indexed by handle id), so
+  // uploading the same data again can be skipped. The entries are kept across frames, and
+  // are only trusted while the buffer's version shows no other upload since ours
+  struct UploadCache {
+    UploadCache() : generation(-1), version(0) {}
+    GraphicsObjectHandle handle;
+    int generation;
+    uint32 version;
+    CBufferBinding binding;
+    std::vector<char> contents;
+  };
+
+  CBufferBinding upload_cbuffer(GraphicsObjectHandle cb, const void *data, int len);
+  CBufferBinding upload_cbuffer_inner(GraphicsObjectHandle cb, const void *data, int len);
+  void upload_and_bind_cbuffers(ShaderType::Enum type, const std::vector<CBuffer *> &cbuffers);
+  void bind_cbuffers(ShaderType::Enum type, int first_slot, int count, const CBufferBinding *bindings);
+
+#if WITH_CBUFFER_RING
+  bool init_cbuffer_ring(ID3D11Device *device, int size);
+  CComPtr<d3d11_1::DeviceContext1> _ctx1;
+  CComPtr<ID3D11Buffer> _ring_buffer;
+  // the frame's constants, uploaded with a single map when the command list is submitted
+  std::vector<char> _ring_staging;
+#endif
+  ConstantRing *_cbuffer_ring;
+  CommandRecorder *_recorder;
+
+  // The transient geometry rings are created on first use, and released with the context
+  struct TransientRing {
+    TransientRing() : ring(nullptr), discards(0) {}
+    GraphicsObjectHandle buffer;
+    ConstantRing *ring;
+    // discards in the frame being recorded
+    int discards;
+  };
+  bool map_transient(TransientRing *ring, D3D11_BIND_FLAG bind, int size, int len, TransientAlloc *alloc);
+  TransientRing _transient_vb;
+  TransientRing _transient_ib;
+
+  // mapped resources, so their contents can be captured on unmap. Only the 'len' bytes at
+  // 'ofs' from the mapped pointer are captured, so a transient slice saves just its data
+  struct MappedRange {
+    GraphicsObjectHandle h;
+    UINT sub;
+    void *data;
+    int ofs;
+    int len;
+  };
+  MappedRange *find_mapped(GraphicsObjectHandle h, UINT sub);
+  std::vector<MappedRange> _mapped;
+
+  // bumped when all the cached uploads of the context can no longer be trusted
+  int _upload_generation;
+  std::vector<UploadCache> _upload_cache;
+
   ID3D11DeviceContext *_ctx;
 
+  Shadow<ID3D11VertexShader *> _vs;
+  Shadow<ID3D11PixelShader *> _ps;
+  Shadow<ID3D11GeometryShader *> _gs;
+  Shadow<ID3D11ComputeShader *> _cs;
+  Shadow<ID3D11InputLayout *> _layout;
+  Shadow<VbState> _vb;
+  Shadow<IbState> _ib;
+  Shadow<D3D11_PRIMITIVE_TOPOLOGY> _topology;
+  Shadow<ID3D11RasterizerState *> _rs;
+  Shadow<DssState> _dss;
+  Shadow<BsState> _bs;
+  Shadow<SamplerState> _samplers;
+  Shadow<RenderTargetState> _render_targets;
+  Shadow<ViewportState> _viewport;
+
+  BindStats _bind_stats;
+  BindStats _last_bind_stats;
+
   uint32 _default_stencil_ref;
   float _default_blend_factors[4];
   uint32 _default_sample_mask;
@@ -22,6 +22,8 @@ DemoEngine::DemoEngine()
   , _running_time_ctr(0)
   , _cur_effect(0)
   , _duration_ns(3 * 60 * 1000 * 1000)
+  , _fixed_fps(0)
+  , _fixed_frame(0)
   , _time_id(PROPERTY_MANAGER.get_or_create<XMFLOAT4>("System::g_time"))
 {
   QueryPerformanceFrequency((LARGE_INTEGER *)&_frequency);
@@ -67,6 +69,11 @@ int64 DemoEngine::duration() const {
   return _duration_ns / 1000;
 }
 
+void DemoEngine::set_fixed_fps(int fps) {
+  _fixed_fps = max(0, fps);
+  _fixed_frame = 0;
+}
+
 int64 DemoEngine::ctr_to_ns(int64 ctr) {
   // convert QueryPerformanceCounter to ns
   return 1000000 * ctr / _frequency;
@@ -101,7 +108,14 @@ void DemoEngine::reclassify_effects() {
 bool DemoEngine::tick() {
   ADD_PROFILE_SCOPE();
   int64 now_ctr;
-  QueryPerformanceCounter((LARGE_INTEGER *)&now_ctr);
+  if (_fixed_fps > 0) {
+    // the step is the difference between the start times of consecutive frames, so the
+    // rounding doesn't add up over a long render
+    now_ctr = _last_time_ctr + (_fixed_frame + 1) * _frequency / _fixed_fps - _fixed_frame * _frequency / _fixed_fps;
+    ++_fixed_frame;
+  } else {
+    QueryPerformanceCounter((LARGE_INTEGER *)&now_ctr);
+  }
   int64 now_ns = ctr_to_ns(now_ctr);
   int64 delta_ctr = now_ctr - _last_time_ctr;
   int64 delta_ns = ctr_to_ns(now_ctr - _last_time_ctr);
@@ -149,14 +163,52 @@ bool DemoEngine::tick() {
         update_freq, int_num_ticks, frac_num_ticks);
     }
 
+#if !WITH_PARALLEL_RECORDING
     e->render();
+#endif
   }
 
+#if WITH_PARALLEL_RECORDING
+  render_parallel(firstTimers);
+#endif
+
   _last_time_ctr = now_ctr;
 
   return true;
 }
 
+#if WITH_PARALLEL_RECORDING
+void DemoEngine::render_parallel(const vector<Effect *> &first_timers) {
+  ADD_PROFILE_SCOPE();
+  // Each effect submits to the slot of its position in the active list, so the command
+  // lists are executed in the same order as when rendering serially. Effects render their
+  // first frame on the main thread, as that's where they create most of their resources.
+  const int num_effects = (int)_active_effects.size();
+  GRAPHICS.begin_parallel_submit(num_effects);
+
+  vector<int> parallel;
+  for (int i = 0; i < num_effects; ++i) {
+    auto *e = _active_effects[i];
+    if (find(begin(first_timers), end(first_timers), e) != end(first_timers)) {
+      GRAPHICS.set_submit_slot(i);
+      e->render();
+      GRAPHICS.set_submit_slot(-1);
+    } else {
+      parallel.push_back(i);
+    }
+  }
+
+  Concurrency::parallel_for(0, (int)parallel.size(), [&](int i) {
+    const int slot = parallel[i];
+    GRAPHICS.set_submit_slot(slot);
+    _active_effects[slot]->render();
+    GRAPHICS.set_submit_slot(-1);
+  });
+
+  GRAPHICS.end_parallel_submit();
+}
+#endif
+
 bool DemoEngine::close() {
   delete exch_null(_instance);
   return true;
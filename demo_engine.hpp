@@ -25,6 +25,12 @@ public:
   int64 duration() const; // in ms
   bool tick();
 
+  // With a fixed frame rate, every tick advances the demo by exactly one frame, however long
+  // the frame took to render, so offline renders come out the same on every run. 0 goes back
+  // to real time
+  void set_fixed_fps(int fps);
+  int fixed_fps() const { return _fixed_fps; }
+
   JsonValue::JsonValuePtr get_info();
   void update(const JsonValue::JsonValuePtr &state);
 
@@ -36,6 +42,9 @@ private:
   static DemoEngine *_instance;
 
   void reclassify_effects();
+#if WITH_PARALLEL_RECORDING
+  void render_parallel(const std::vector<Effect *> &first_timers);
+#endif
 
   Effect *find_effect_by_name(const std::string &name);
 
@@ -51,6 +60,8 @@ private:
   int64 _active_time_ctr;
   int64 _running_time_ctr;
   int64 _duration_ns;
+  int _fixed_fps;
+  int64 _fixed_frame;
 
   PropertyId _time_id;
 
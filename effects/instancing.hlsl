@@ -0,0 +1,25 @@
+#include "common.hlsl"
+
+// Quads for the pixel shaders that read their per instance variables from a PerInstance
+// structured buffer, with the instance passed on to index it
+
+struct quad_instanced_vs_input {
+    float4 pos : SV_POSITION;
+    float2 tex : TEXCOORD;
+    uint instance : SV_InstanceID;
+};
+
+struct quad_instanced_ps_input {
+    float4 pos : SV_POSITION;
+    float2 tex : TEXCOORD;
+    nointerpolation uint instance : INSTANCE;
+};
+
+quad_instanced_ps_input quad_instanced_vs_main(quad_instanced_vs_input input)
+{
+    quad_instanced_ps_input output = (quad_instanced_ps_input)0;
+    output.pos = input.pos;
+    output.tex = input.tex;
+    output.instance = input.instance;
+    return output;
+}
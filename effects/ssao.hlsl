@@ -7,7 +7,13 @@ cbuffer PerFrame {
   float4 kernel[32];
   float4 noise[16];
   float4 screenSize;    // (screenX, screenY, occlusionX, occlusionY)
+  float4 ClusterParams; // (near plane, slices / log(far / near), 0, 0)
 };
+
+// the size of the LightClusters grid
+static const uint ClusterTilesX = 16;
+static const uint ClusterTilesY = 9;
+static const uint ClusterSlices = 24;
 /*
 cbuffer PerFrame {
   float4 kernel[32];
@@ -193,25 +199,28 @@ float4 ambient_ps_main(quad_ps_input input) : SV_Target
 ///////////////////////////////////
 // Add light
 ///////////////////////////////////
-cbuffer PerInstance {
+struct LightInstance {
   float4 LightColor, LightPos;
   float AttenuationStart, AttenuationEnd;
 };
 
-float4 light_ps_main(quad_ps_input input) : SV_Target
+struct LightCluster {
+  uint offset;
+  uint count;
+};
+
+// the clusters from LightClusters, with the indices of the lights that reach each of them
+StructuredBuffer<LightCluster> LightClusterList : register(t5);
+StructuredBuffer<uint> LightIndices : register(t6);
+StructuredBuffer<LightInstance> Lights : register(t7);
+
+float4 shade_light(LightInstance light, float3 pos, float3 normal, float4 diffuse, float3 specular, float shininess)
 {
-    // Textures:
-    // 0: rt_pos
-    // 1: rt_normal
-    // 2: rt_diffuse
-    // 3: rt_specular
-    // 4: rt_occlusion
-    float3 pos = Texture0.Sample(PointSampler, input.tex).xyz;
-    float3 normal = normalize(Texture1.Sample(PointSampler, input.tex).xyz);
-    float4 diffuse = Texture2.Sample(PointSampler, input.tex);
-    float4 st = Texture3.Sample(PointSampler, input.tex);
-    float3 specular = st.rgb;
-    float shininess = st.a;
+    float4 LightColor = light.LightColor;
+    float4 LightPos = light.LightPos;
+    float AttenuationStart = light.AttenuationStart;
+    float AttenuationEnd = light.AttenuationEnd;
+
     float3 lp = LightPos.xyz;
     float3 ll = lp - pos;
     float3 v = normalize(ll);
@@ -234,11 +243,39 @@ float4 light_ps_main(quad_ps_input input) : SV_Target
     float3 h = normalize(-pos + ll);
     float4 ss = float4(specular * pow(saturate(dot(h, normal)), shininess), 1);
 
-    float occ = Texture4.Sample(PointSampler, input.tex).r;
-    
     float decay = dist < 40 ? 1 : 40 / dist;
-   
-    return pow(occ, 2)  * decay * scale * (dd + ss);
+    return decay * scale * (dd + ss);
+}
+
+// all the lights are shaded in a single pass, where each pixel only loops over the lights
+// in its own cluster
+float4 light_ps_main(quad_ps_input input) : SV_Target
+{
+    // Textures:
+    // 0: rt_pos
+    // 1: rt_normal
+    // 2: rt_diffuse
+    // 3: rt_specular
+    // 4: rt_occlusion
+    float3 pos = Texture0.Sample(PointSampler, input.tex).xyz;
+    float3 normal = normalize(Texture1.Sample(PointSampler, input.tex).xyz);
+    float4 diffuse = Texture2.Sample(PointSampler, input.tex);
+    float4 st = Texture3.Sample(PointSampler, input.tex);
+    float3 specular = st.rgb;
+    float shininess = st.a;
+    float occ = Texture4.Sample(PointSampler, input.tex).r;
+
+    // the same slices as LightClusters::slice_for_depth, with the tile rows from the top
+    uint tile_x = min((uint)(input.tex.x * ClusterTilesX), ClusterTilesX - 1);
+    uint tile_y = min((uint)(input.tex.y * ClusterTilesY), ClusterTilesY - 1);
+    uint slice = pos.z <= ClusterParams.x ? 0 : min((uint)(log(pos.z / ClusterParams.x) * ClusterParams.y), ClusterSlices - 1);
+    LightCluster cluster = LightClusterList[(slice * ClusterTilesY + tile_y) * ClusterTilesX + tile_x];
+
+    float4 res = float4(0,0,0,0);
+    for (uint i = 0; i < cluster.count; ++i) {
+      res += shade_light(Lights[LightIndices[cluster.offset + i]], pos, normal, diffuse, specular, shininess);
+    }
+    return pow(occ, 2) * res;
 }
 
 
@@ -53,5 +53,5 @@ bool save_file(const char *filename, const void *buf, int len) {
     fclose(f);
   });
 
-  return fwrite(buf, len, 1, f) == len;
+  return fwrite(buf, len, 1, f) == 1;
 }
@@ -0,0 +1,262 @@
+#include "stdafx.h"
+#include "frame_capture.hpp"
+#include "graphics.hpp"
+#include "bitmap_utils.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+namespace {
+  bool is_bgra(DXGI_FORMAT format) {
+    return format == DXGI_FORMAT_B8G8R8A8_UNORM || format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB;
+  }
+
+  bool can_read_back(DXGI_FORMAT format) {
+    return is_bgra(format) || format == DXGI_FORMAT_R8G8B8A8_UNORM || format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+  }
+
+  bool ends_with(const string &str, const char *suffix) {
+    const size_t len = strlen(suffix);
+    return str.size() >= len && _stricmp(str.c_str() + str.size() - len, suffix) == 0;
+  }
+}
+
+FrameCapture::FrameCapture()
+  : _next_staging(0)
+  , _oldest_staging(0)
+  , _pending_writes(0)
+  , _drop_when_busy(true)
+{
+}
+
+FrameCapture::~FrameCapture() {
+  flush();
+  for (size_t i = 0; i < _free_images.size(); ++i)
+    delete _free_images[i];
+}
+
+bool FrameCapture::capture(GraphicsObjectHandle render_target, const string &filename) {
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+
+  Graphics::RenderTargetResource *rt = GRAPHICS.render_target(render_target);
+  if (!rt || !can_read_back(rt->texture.desc.Format)) {
+    LOG_WARNING_LN_ONESHOT("Unable to capture render target, unsupported format");
+    return false;
+  }
+
+  Staging &staging = _staging[_next_staging];
+  if (staging.busy && !_drop_when_busy) {
+    // the ring is used in order, so the next texture is also the oldest one
+    wait_for_worker();
+    read_back(&staging, true);
+    _oldest_staging = (_oldest_staging + 1) % kNumStagingTextures;
+  }
+
+  bool res = false;
+  if (staging.busy) {
+    SCOPED_CS(_stats_cs);
+    ++_stats.dropped;
+  } else {
+    const D3D11_TEXTURE2D_DESC &src = rt->texture.desc;
+    ID3D11Device *device = GRAPHICS._device;
+    ID3D11DeviceContext *ctx = GRAPHICS._immediate_context;
+
+    if (staging.width != (int)src.Width || staging.height != (int)src.Height || staging.format != src.Format) {
+      staging.texture.Release();
+      staging.resolved.Release();
+      staging.width = src.Width;
+      staging.height = src.Height;
+      staging.format = src.Format;
+      CD3D11_TEXTURE2D_DESC desc(src.Format, src.Width, src.Height, 1, 1, 0, D3D11_USAGE_STAGING, D3D11_CPU_ACCESS_READ);
+      if (FAILED(device->CreateTexture2D(&desc, NULL, &staging.texture)))
+        staging.width = staging.height = 0;
+      // multisampled targets have to be resolved before they can be copied
+      if (src.SampleDesc.Count > 1) {
+        CD3D11_TEXTURE2D_DESC resolved_desc(src.Format, src.Width, src.Height, 1, 1, 0);
+        if (FAILED(device->CreateTexture2D(&resolved_desc, NULL, &staging.resolved)))
+          staging.width = staging.height = 0;
+      }
+    }
+
+    if (staging.width > 0) {
+      ID3D11Resource *copy_src = rt->texture.resource;
+      if (src.SampleDesc.Count > 1) {
+        ctx->ResolveSubresource(staging.resolved, 0, rt->texture.resource, 0, src.Format);
+        copy_src = staging.resolved;
+      }
+      ctx->CopySubresourceRegion(staging.texture, 0, 0, 0, 0, copy_src, 0, NULL);
+      staging.filename = filename;
+      staging.busy = true;
+      _next_staging = (_next_staging + 1) % kNumStagingTextures;
+      SCOPED_CS(_stats_cs);
+      ++_stats.captured;
+      res = true;
+    } else {
+      LOG_WARNING_LN_ONESHOT("Unable to create the capture staging textures");
+    }
+  }
+
+  QueryPerformanceCounter(&end);
+  add_main_ticks(end.QuadPart - start.QuadPart);
+  return res;
+}
+
+bool FrameCapture::capture(const uint32 *pixels, int width, int height, int pitch, const string &filename) {
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+
+  if (!_drop_when_busy)
+    wait_for_worker();
+
+  bool res = false;
+  if (_pending_writes >= kMaxPendingWrites) {
+    SCOPED_CS(_stats_cs);
+    ++_stats.dropped;
+  } else {
+    Image *image = alloc_image(filename, width, height, true);
+    for (int y = 0; y < height; ++y)
+      memcpy(&image->pixels[y * width], pixels + y * pitch, width * sizeof(uint32));
+    InterlockedIncrement(&_pending_writes);
+    _tasks.run([=]() { write(image); });
+    SCOPED_CS(_stats_cs);
+    ++_stats.captured;
+    res = true;
+  }
+
+  QueryPerformanceCounter(&end);
+  add_main_ticks(end.QuadPart - start.QuadPart);
+  return res;
+}
+
+void FrameCapture::tick() {
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+
+  // the copies complete in order, so stop at the first one that isn't done
+  while (_staging[_oldest_staging].busy && read_back(&_staging[_oldest_staging], false))
+    _oldest_staging = (_oldest_staging + 1) % kNumStagingTextures;
+
+  QueryPerformanceCounter(&end);
+  add_main_ticks(end.QuadPart - start.QuadPart);
+}
+
+void FrameCapture::flush() {
+  while (_staging[_oldest_staging].busy) {
+    read_back(&_staging[_oldest_staging], true);
+    _oldest_staging = (_oldest_staging + 1) % kNumStagingTextures;
+  }
+  _tasks.wait();
+}
+
+bool FrameCapture::read_back(Staging *staging, bool wait) {
+  // leave the texture mapped until a worker is free, which makes new captures drop instead
+  if (!wait && _pending_writes >= kMaxPendingWrites)
+    return false;
+
+  ID3D11DeviceContext *ctx = GRAPHICS._immediate_context;
+  D3D11_MAPPED_SUBRESOURCE res;
+  HRESULT hr = ctx->Map(staging->texture, 0, D3D11_MAP_READ, wait ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT, &res);
+  if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
+    return false;
+
+  staging->busy = false;
+  if (FAILED(hr)) {
+    SCOPED_CS(_stats_cs);
+    ++_stats.failed;
+    return true;
+  }
+
+  Image *image = alloc_image(staging->filename, staging->width, staging->height, is_bgra(staging->format));
+  for (int y = 0; y < staging->height; ++y)
+    memcpy(&image->pixels[y * staging->width], (const uint8 *)res.pData + y * res.RowPitch, staging->width * sizeof(uint32));
+  ctx->Unmap(staging->texture, 0);
+
+  InterlockedIncrement(&_pending_writes);
+  _tasks.run([=]() { write(image); });
+  return true;
+}
+
+void FrameCapture::wait_for_worker() {
+  while (_pending_writes >= kMaxPendingWrites)
+    Sleep(1);
+}
+
+FrameCapture::Image *FrameCapture::alloc_image(const string &filename, int width, int height, bool bgra) {
+  Image *image = nullptr;
+  {
+    SCOPED_CS(_free_cs);
+    if (!_free_images.empty()) {
+      image = _free_images.back();
+      _free_images.pop_back();
+    }
+  }
+  if (!image)
+    image = new Image;
+  image->filename = filename;
+  image->width = width;
+  image->height = height;
+  image->bgra = bgra;
+  image->pixels.resize(width * height);
+  return image;
+}
+
+void FrameCapture::write(Image *image) {
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+
+  // the encoders want bgra, and the alpha of a frame isn't meaningful, so it's made opaque
+  vector<uint32> &pixels = image->pixels;
+  if (image->bgra) {
+    for (size_t i = 0; i < pixels.size(); ++i)
+      pixels[i] |= 0xff000000;
+  } else {
+    for (size_t i = 0; i < pixels.size(); ++i) {
+      const uint32 p = pixels[i];
+      pixels[i] = 0xff000000 | (p & 0xff) << 16 | (p & 0xff00) | ((p >> 16) & 0xff);
+    }
+  }
+
+  uint8 *data = (uint8 *)pixels.data();
+  const bool ok = ends_with(image->filename, ".png") ?
+    save_png32(image->filename.c_str(), data, image->width, image->height) :
+    save_bmp32(image->filename.c_str(), data, image->width, image->height);
+
+  {
+    SCOPED_CS(_free_cs);
+    _free_images.push_back(image);
+  }
+
+  QueryPerformanceCounter(&end);
+  {
+    SCOPED_CS(_stats_cs);
+    if (ok)
+      ++_stats.written;
+    else
+      ++_stats.failed;
+    _stats.worker_ticks += end.QuadPart - start.QuadPart;
+  }
+  InterlockedDecrement(&_pending_writes);
+}
+
+void FrameCapture::add_main_ticks(int64 ticks) {
+  SCOPED_CS(_stats_cs);
+  _stats.main_ticks += ticks;
+}
+
+FrameCapture::Stats FrameCapture::stats() const {
+  SCOPED_CS(_stats_cs);
+  return _stats;
+}
+
+void FrameCapture::log_stats() const {
+  const Stats s = stats();
+  if (!s.captured && !s.dropped)
+    return;
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  LOG_INFO_LN("Frame capture: %d captured, %d dropped, %d written, %d failed, %.3f ms/capture on the main thread, %.1f ms/capture on the workers",
+    s.captured, s.dropped, s.written, s.failed,
+    1000.0 * s.main_ticks / freq.QuadPart / max(1, s.captured),
+    1000.0 * s.worker_ticks / freq.QuadPart / max(1, s.written));
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include "graphics_object_handle.hpp"
+
+// Saves frames to disk without stalling the render loop. Render targets are copied into a
+// ring of staging textures, and only read back a few frames later, when the copy is done.
+// The read back copies the whole image out of the mapped texture on the main thread, and
+// the pixels are then converted and encoded (as png if the filename ends in .png, otherwise
+// as bmp) on the ppl worker threads. Captures are dropped and counted, rather than waited
+// for, when all the staging textures or writes are busy, unless dropping is turned off.
+class FrameCapture {
+public:
+  enum {
+    kNumStagingTextures = 3,
+    kMaxPendingWrites = 8,
+  };
+
+  struct Stats {
+    Stats() : captured(0), dropped(0), written(0), failed(0), main_ticks(0), worker_ticks(0) {}
+    int captured;
+    int dropped;
+    int written;
+    int failed;
+    // time spent on the thread calling capture and tick, and on the workers
+    int64 main_ticks;
+    int64 worker_ticks;
+  };
+
+  FrameCapture();
+  ~FrameCapture();
+
+  // Copies the render target into the next free staging texture, resolving it first if it's
+  // multisampled. Only 8 bit rgba/bgra targets can be read back
+  bool capture(GraphicsObjectHandle render_target, const std::string &filename);
+  // Copies cpu pixels (32 bit bgra, like SoftwareRasterizer) into an image on the calling
+  // thread, and hands it to a worker
+  bool capture(const uint32 *pixels, int width, int height, int pitch, const std::string &filename);
+
+  // Reads back the staging textures whose copies are done, oldest first. Called once per frame
+  void tick();
+  // Waits for all the captures to be read back and written
+  void flush();
+
+  // Offline renders can't lose frames, so they wait for a staging texture or a worker to
+  // become free instead
+  void set_drop_when_busy(bool value) { _drop_when_busy = value; }
+
+  // the workers update the stats, so this returns a copy taken under the lock
+  Stats stats() const;
+  void log_stats() const;
+
+private:
+  struct Image {
+    std::string filename;
+    int width, height;
+    bool bgra;
+    std::vector<uint32> pixels;
+  };
+
+  struct Staging {
+    Staging() : width(0), height(0), format(DXGI_FORMAT_UNKNOWN), busy(false) {}
+    CComPtr<ID3D11Texture2D> texture;
+    CComPtr<ID3D11Texture2D> resolved;
+    int width, height;
+    DXGI_FORMAT format;
+    bool busy;
+    std::string filename;
+  };
+
+  Image *alloc_image(const std::string &filename, int width, int height, bool bgra);
+  bool read_back(Staging *staging, bool wait);
+  void wait_for_worker();
+  void write(Image *image);
+  void add_main_ticks(int64 ticks);
+
+  Staging _staging[kNumStagingTextures];
+  // the next staging texture to copy into, and the oldest one waiting to be read back
+  int _next_staging;
+  int _oldest_staging;
+
+  CriticalSection _free_cs;
+  std::vector<Image *> _free_images;
+  volatile LONG _pending_writes;
+  Concurrency::task_group _tasks;
+  bool _drop_when_busy;
+
+  mutable CriticalSection _stats_cs;
+  Stats _stats;
+};
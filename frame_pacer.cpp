@@ -0,0 +1,207 @@
+#include "stdafx.h"
+#include "frame_pacer.hpp"
+#include "profiler.hpp"
+#include "logger.hpp"
+
+#pragma comment(lib, "winmm.lib")
+
+using namespace std;
+
+namespace {
+  // spin instead of sleeping when the wait is shorter than this many of the longest recent
+  // Sleep(1)s, which start out as 1 ms
+  const double cSpinSleeps = 2.0;
+  // the prediction is the average cost plus this many average deviations
+  const double cDeviationMargin = 2.0;
+  // weight of the latest frame in the running averages
+  const double cBlend = 0.1;
+
+  int64 now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+  }
+}
+
+FramePacer::FramePacer()
+  : _target_fps(0)
+  , _interval(0)
+  , _frame_start(0)
+  , _last_present(0)
+  , _deadline(0)
+  , _avg_cost(0)
+  , _avg_cost_dev(0)
+  , _history_count(0)
+  , _next_query(0)
+  , _ctx(nullptr)
+  , _queries_failed(false)
+{
+  QueryPerformanceFrequency((LARGE_INTEGER *)&_frequency);
+  _sleep_ticks = _frequency / 1000.0;
+  ZeroMemory(_history, sizeof(_history));
+  for (int i = 0; i < kHistogramBuckets; ++i)
+    sprintf(_bucket_names[i], "FramePacer::interval_%02dms%s", i, i == kHistogramBuckets - 1 ? "+" : "");
+}
+
+FramePacer::~FramePacer() {
+  set_target_fps(0);
+}
+
+void FramePacer::set_target_fps(int fps) {
+  fps = max(0, fps);
+  // while pacing, Sleep(1) should return after about a ms, instead of a whole scheduler tick
+  if (fps && !_target_fps)
+    timeBeginPeriod(1);
+  else if (!fps && _target_fps)
+    timeEndPeriod(1);
+  _target_fps = fps;
+  _interval = _target_fps ? _frequency / _target_fps : 0;
+  _deadline = 0;
+}
+
+int64 FramePacer::wait_until(int64 until) {
+  ADD_NAMED_PROFILE_SCOPE("FramePacer::wait");
+  const int64 start = now_ticks();
+  int64 now = start;
+  while (now < until) {
+    if (until - now > cSpinSleeps * _sleep_ticks) {
+      Sleep(1);
+      // the longest recent sleep, decaying slowly, so a single late wake up doesn't make
+      // it spin forever
+      const int64 slept = now_ticks() - now;
+      _sleep_ticks = max((double)slept, _sleep_ticks * 0.99);
+    } else {
+      YieldProcessor();
+    }
+    poll_queries(now);
+    now = now_ticks();
+  }
+  _stats.wait_ticks += now - start;
+  return now;
+}
+
+void FramePacer::begin_frame() {
+  _frame_start = _interval && _deadline ?
+    wait_until(_deadline - (int64)(predicted_ms() * _frequency / 1000)) : now_ticks();
+}
+
+void FramePacer::end_frame(ID3D11DeviceContext *ctx) {
+  const int64 done = now_ticks();
+  const int64 cost = done - _frame_start;
+  _stats.cpu_ticks += cost;
+  ++_stats.frames;
+
+  if (_stats.frames == 1) {
+    // assume the cost varies a lot until there's a history, or the first frames are late
+    // while the average deviation catches up from 0
+    _avg_cost = (double)cost;
+    _avg_cost_dev = cost / 2.0;
+  } else {
+    _avg_cost_dev += cBlend * (fabs(cost - _avg_cost) - _avg_cost_dev);
+    _avg_cost += cBlend * (cost - _avg_cost);
+  }
+
+  const int64 now = _interval && _deadline ? wait_until(_deadline) : now_ticks();
+  if (_last_present) {
+    const int64 interval = now - _last_present;
+    const int bucket = (int)(interval * 1000 / _frequency);
+    ++_stats.histogram[min(bucket, (int)kHistogramBuckets - 1)];
+    _history[_history_count++ % kHistorySize] = interval;
+  }
+  _last_present = now;
+
+  if (_interval) {
+    // stay on the grid of deadlines while the frames make it, and start a new one after a
+    // frame that doesn't, rather than rushing the next frames to catch up
+    const bool late = _deadline && done > _deadline;
+    _stats.late += late ? 1 : 0;
+    _deadline = _deadline && !late ? _deadline + _interval : now + _interval;
+  }
+
+  if (ctx && !_queries_failed) {
+    _ctx = ctx;
+    poll_queries(now);
+    Query &q = _queries[_next_query];
+    if (!q.query) {
+      CComPtr<ID3D11Device> device;
+      ctx->GetDevice(&device);
+      CD3D11_QUERY_DESC desc(D3D11_QUERY_EVENT);
+      if (FAILED(device->CreateQuery(&desc, &q.query)))
+        _queries_failed = true;
+    }
+    // a query that's still in flight isn't reused, so frames further behind aren't tracked
+    if (q.query && !q.busy) {
+      ctx->End(q.query);
+      q.busy = true;
+      q.frame_start = _frame_start;
+      _next_query = (_next_query + 1) % kNumQueries;
+    }
+  }
+
+  ADD_PROFILE_COUNTER("FramePacer::cpu_us", (int)(cost * 1000000 / _frequency));
+  ADD_PROFILE_COUNTER("FramePacer::p99_deviation_us", (int)(deviation_ms(0.99) * 1000));
+  ADD_PROFILE_COUNTER("FramePacer::late", _stats.late);
+  // the counters are reset every frame, so each frame reports the whole histogram so far,
+  // skipping the empty buckets
+  for (int i = 0; i < kHistogramBuckets; ++i) {
+    if (_stats.histogram[i])
+      ADD_PROFILE_COUNTER(_bucket_names[i], _stats.histogram[i]);
+  }
+}
+
+void FramePacer::poll_queries(int64 now) {
+  if (!_ctx)
+    return;
+  // the queries complete in order, oldest first, so stop at the first one that isn't done.
+  // The latency is only as accurate as the polling, which is at least once per frame
+  for (int i = 0; i < kNumQueries; ++i) {
+    Query &q = _queries[(_next_query + i) % kNumQueries];
+    if (!q.busy)
+      continue;
+    if (_ctx->GetData(q.query, NULL, 0, D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+      break;
+    q.busy = false;
+    ++_stats.gpu_frames;
+    _stats.gpu_latency_ticks += now - q.frame_start;
+  }
+}
+
+double FramePacer::predicted_ms() const {
+  const double predicted = _avg_cost + cDeviationMargin * _avg_cost_dev;
+  return min(predicted, (double)_interval) * 1000 / _frequency;
+}
+
+double FramePacer::deviation_ms(double percentile) const {
+  const int count = min(_history_count, (int)kHistorySize);
+  if (!count)
+    return 0;
+
+  int64 expected = _interval;
+  if (!expected) {
+    for (int i = 0; i < count; ++i)
+      expected += _history[i];
+    expected /= count;
+  }
+
+  int64 deviations[kHistorySize];
+  for (int i = 0; i < count; ++i)
+    deviations[i] = _history[i] > expected ? _history[i] - expected : expected - _history[i];
+  const int idx = min(count - 1, (int)(percentile * count));
+  nth_element(deviations, deviations + idx, deviations + count);
+  return deviations[idx] * 1000.0 / _frequency;
+}
+
+void FramePacer::log_stats() const {
+  if (!_stats.frames)
+    return;
+  const double to_ms = 1000.0 / _frequency;
+  LOG_INFO_LN("Frame pacing: %d frames at %d fps target, %d late, %.2f ms cpu/frame, %.2f ms waited/frame, %.2f ms gpu latency, deviation p50 %.3f ms, p99 %.3f ms",
+    _stats.frames, _target_fps, _stats.late,
+    _stats.cpu_ticks * to_ms / _stats.frames, _stats.wait_ticks * to_ms / _stats.frames,
+    _stats.gpu_latency_ticks * to_ms / max(1, _stats.gpu_frames),
+    deviation_ms(0.5), deviation_ms(0.99));
+  for (int i = 0; i < kHistogramBuckets; ++i) {
+    if (_stats.histogram[i])
+      LOG_INFO_LN("  %2d ms%s: %d", i, i == kHistogramBuckets - 1 ? "+" : "", _stats.histogram[i]);
+  }
+}
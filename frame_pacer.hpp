@@ -0,0 +1,89 @@
+#pragma once
+
+// Paces the main loop to a target frame interval. begin_frame() holds the frame back until the
+// next present deadline minus its predicted cpu cost, so the frame samples its input as late
+// as it can, rather than sleeping after the present with stale input. end_frame() is called
+// right before the present, and waits out what's left until the deadline, which absorbs the
+// error in the prediction. The waits sleep for the bulk of the time, and spin for the rest,
+// which is sized from how late Sleep has been waking up. end_frame() also updates the
+// prediction, a histogram of the intervals between presents, and their deviation from the
+// target, and reports them to the profiler. Given a context, it issues an event query per
+// frame, to track how long after the frame started the gpu finished it.
+class FramePacer {
+public:
+  enum {
+    kHistogramBuckets = 40,     // 1 ms each, the last one also counts everything longer
+    kHistorySize = 256,         // frames the percentiles are taken over
+    kNumQueries = 4,
+  };
+
+  struct Stats {
+    Stats() : frames(0), late(0), cpu_ticks(0), wait_ticks(0), gpu_frames(0), gpu_latency_ticks(0) {
+      memset(histogram, 0, sizeof(histogram));
+    }
+    int frames;
+    // frames presented after their deadline
+    int late;
+    int64 cpu_ticks;
+    int64 wait_ticks;
+    int gpu_frames;
+    int64 gpu_latency_ticks;
+    int histogram[kHistogramBuckets];
+  };
+
+  FramePacer();
+  ~FramePacer();
+
+  // 0 turns the pacing off, but the frames are still tracked
+  void set_target_fps(int fps);
+  int target_fps() const { return _target_fps; }
+
+  void begin_frame();
+  void end_frame(ID3D11DeviceContext *ctx);
+
+  // cpu time the next frame is expected to take, in ms
+  double predicted_ms() const;
+  // percentile of |interval - target| over the last frames, in ms. Without a target, the
+  // deviation is from the average interval
+  double deviation_ms(double percentile) const;
+
+  const Stats &stats() const { return _stats; }
+  void log_stats() const;
+
+private:
+  // returns the time the wait ended
+  int64 wait_until(int64 until);
+  void poll_queries(int64 now);
+
+  int _target_fps;
+  int64 _frequency;
+  int64 _interval;
+
+  int64 _frame_start;
+  int64 _last_present;
+  int64 _deadline;
+
+  // running averages of the frame cost and its absolute deviation, in ticks
+  double _avg_cost;
+  double _avg_cost_dev;
+  double _sleep_ticks;
+
+  int64 _history[kHistorySize];
+  int _history_count;
+
+  // the profiler counter for each histogram bucket, like "FramePacer::interval_16ms"
+  char _bucket_names[kHistogramBuckets][32];
+
+  struct Query {
+    Query() : busy(false), frame_start(0) {}
+    CComPtr<ID3D11Query> query;
+    bool busy;
+    int64 frame_start;
+  };
+  Query _queries[kNumQueries];
+  int _next_query;
+  ID3D11DeviceContext *_ctx;
+  bool _queries_failed;
+
+  Stats _stats;
+};
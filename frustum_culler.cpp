@@ -0,0 +1,123 @@
+#include "stdafx.h"
+#include "frustum_culler.hpp"
+
+using namespace std;
+
+void Frustum::from_view_proj(const XMFLOAT4X4 &m) {
+  // Gribb & Hartmann, with clip = m * pos, so the planes are sums of the rows. The near
+  // plane is z >= 0, as D3D clips z to [0, w]
+  XMFLOAT4 row[4];
+  for (int i = 0; i < 4; ++i)
+    row[i] = XMFLOAT4(m.m[i][0], m.m[i][1], m.m[i][2], m.m[i][3]);
+
+  planes[0] = row[3] + row[0];  // left
+  planes[1] = row[3] - row[0];  // right
+  planes[2] = row[3] + row[1];  // bottom
+  planes[3] = row[3] - row[1];  // top
+  planes[4] = row[2];           // near
+  planes[5] = row[3] - row[2];  // far
+}
+
+FrustumCuller::FrustumCuller() : _count(0) {
+}
+
+void FrustumCuller::resize(int count) {
+  _count = count;
+  const int padded = (count + 3) & ~3;
+  _center_x.resize(padded);
+  _center_y.resize(padded);
+  _center_z.resize(padded);
+  _extents_x.resize(padded);
+  _extents_y.resize(padded);
+  _extents_z.resize(padded);
+}
+
+void FrustumCuller::set_bounds(int idx, const XMFLOAT3 &center, const XMFLOAT3 &extents) {
+  KASSERT(idx >= 0 && idx < _count);
+  _center_x[idx] = center.x;
+  _center_y[idx] = center.y;
+  _center_z[idx] = center.z;
+  _extents_x[idx] = extents.x;
+  _extents_y[idx] = extents.y;
+  _extents_z[idx] = extents.z;
+}
+
+int FrustumCuller::cull(const Frustum &frustum, int *visible) const {
+  // splat the plane components, and their absolute values for projecting the extents
+  __m128 px[6], py[6], pz[6], pw[6], ax[6], ay[6], az[6];
+  const __m128 sign_mask = _mm_set1_ps(-0.0f);
+  for (int i = 0; i < 6; ++i) {
+    const XMFLOAT4 &p = frustum.planes[i];
+    px[i] = _mm_set1_ps(p.x);
+    py[i] = _mm_set1_ps(p.y);
+    pz[i] = _mm_set1_ps(p.z);
+    pw[i] = _mm_set1_ps(p.w);
+    ax[i] = _mm_andnot_ps(sign_mask, px[i]);
+    ay[i] = _mm_andnot_ps(sign_mask, py[i]);
+    az[i] = _mm_andnot_ps(sign_mask, pz[i]);
+  }
+
+  const __m128 zero = _mm_setzero_ps();
+  int num_visible = 0;
+  for (int i = 0; i < _count; i += 4) {
+    const __m128 cx = _mm_loadu_ps(&_center_x[i]);
+    const __m128 cy = _mm_loadu_ps(&_center_y[i]);
+    const __m128 cz = _mm_loadu_ps(&_center_z[i]);
+    const __m128 ex = _mm_loadu_ps(&_extents_x[i]);
+    const __m128 ey = _mm_loadu_ps(&_extents_y[i]);
+    const __m128 ez = _mm_loadu_ps(&_extents_z[i]);
+
+    // a box is outside if it's completely behind any of the planes, ie if the distance
+    // from the center to the plane is less than minus the extents projected on the normal
+    __m128 inside = _mm_cmpeq_ps(zero, zero);
+    for (int j = 0; j < 6; ++j) {
+      __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, px[j]), _mm_mul_ps(cy, py[j])), _mm_add_ps(_mm_mul_ps(cz, pz[j]), pw[j]));
+      __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, ax[j]), _mm_mul_ps(ey, ay[j])), _mm_mul_ps(ez, az[j]));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), zero));
+    }
+
+    int mask = _mm_movemask_ps(inside);
+    // mask out the padding
+    if (i + 4 > _count)
+      mask &= (1 << (_count - i)) - 1;
+
+    while (mask) {
+      unsigned long bit;
+      _BitScanForward(&bit, mask);
+      visible[num_visible++] = i + bit;
+      mask &= mask - 1;
+    }
+  }
+
+  return num_visible;
+}
+
+int FrustumCuller::cull_scalar(const Frustum &frustum, int *visible) const {
+  int num_visible = 0;
+  for (int i = 0; i < _count; ++i) {
+    bool inside = true;
+    for (int j = 0; j < 6 && inside; ++j) {
+      const XMFLOAT4 &p = frustum.planes[j];
+      // same order of operations as the SSE version, so the results match exactly
+      float d = (_center_x[i] * p.x + _center_y[i] * p.y) + (_center_z[i] * p.z + p.w);
+      float r = (_extents_x[i] * fabsf(p.x) + _extents_y[i] * fabsf(p.y)) + _extents_z[i] * fabsf(p.z);
+      inside = d + r >= 0;
+    }
+    if (inside)
+      visible[num_visible++] = i;
+  }
+  return num_visible;
+}
+
+void transform_bounds(const XMFLOAT4X4 &m, const XMFLOAT3 &center, const XMFLOAT3 &extents,
+                      XMFLOAT3 *world_center, XMFLOAT3 *world_extents) {
+  // the matrix is transposed, so the translation is in the 4th column, and the extents
+  // are projected with the absolute values of the rows
+  float c[3], e[3];
+  for (int i = 0; i < 3; ++i) {
+    c[i] = m.m[i][0] * center.x + m.m[i][1] * center.y + m.m[i][2] * center.z + m.m[i][3];
+    e[i] = fabsf(m.m[i][0]) * extents.x + fabsf(m.m[i][1]) * extents.y + fabsf(m.m[i][2]) * extents.z;
+  }
+  *world_center = XMFLOAT3(c[0], c[1], c[2]);
+  *world_extents = XMFLOAT3(e[0], e[1], e[2]);
+}
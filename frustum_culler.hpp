@@ -0,0 +1,35 @@
+#pragma once
+
+// Frustum planes, with the normals pointing into the frustum
+struct Frustum {
+  // 'view_proj' is the (transposed) projection matrix times the (transposed) view matrix,
+  // ie the same convention as the matrices passed to the shaders
+  void from_view_proj(const XMFLOAT4X4 &view_proj);
+  XMFLOAT4 planes[6];
+};
+
+// World space bounding boxes kept as a structure of arrays, so they can be tested against
+// the frustum four at a time with SSE.
+class FrustumCuller {
+public:
+  FrustumCuller();
+  void resize(int count);
+  int size() const { return _count; }
+  void set_bounds(int idx, const XMFLOAT3 &center, const XMFLOAT3 &extents);
+
+  // Writes the indices of the boxes that intersect the frustum to 'visible' (which must have
+  // room for size() indices), in increasing order, and returns the number of visible boxes
+  int cull(const Frustum &frustum, int *visible) const;
+  // the same test, one box at a time, as a reference
+  int cull_scalar(const Frustum &frustum, int *visible) const;
+
+private:
+  int _count;
+  // padded to a multiple of 4, with the padding boxes never reported as visible
+  std::vector<float> _center_x, _center_y, _center_z;
+  std::vector<float> _extents_x, _extents_y, _extents_z;
+};
+
+// Transforms an object space box to a world space box that contains it
+void transform_bounds(const XMFLOAT4X4 &obj_to_world, const XMFLOAT3 &center, const XMFLOAT3 &extents,
+  XMFLOAT3 *world_center, XMFLOAT3 *world_extents);
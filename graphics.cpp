@@ -13,6 +13,7 @@
 #include "profiler.hpp"
 #include "effect.hpp"
 #include "kumi.hpp"
+#include "frame_capture.hpp"
 #include "_win32/resource.h"
 
 using namespace std;
@@ -38,6 +39,9 @@ namespace
   uint32 multiple_of_16(uint32 a) {
     return (a + 15) & ~0xf;
   }
+
+  // the submit slot of the current thread, or -1 when submitting directly
+  __declspec(thread) int g_submit_slot = -1;
 }
 
 bool Graphics::enumerateDisplayModes(HWND hWnd) {
@@ -208,6 +212,7 @@ Graphics::Graphics()
   , _buffer_format(DXGI_FORMAT_R8G8B8A8_UNORM)
   , _start_fps_time(0xffffffff)
   , _frame_count(0)
+  , _frame_index(0)
   , _fps(0)
   , _vs_profile("vs_5_0")
   , _ps_profile("ps_5_0")
@@ -232,6 +237,12 @@ Graphics::Graphics()
   , _resources(delete_obj<SimpleResource *>)
   , _structured_buffers(delete_obj<StructuredBuffer *>)
   , _vsync(false)
+  , _headless(false)
+  , _null_device(false)
+  , _capture_frames_left(0)
+  , _frame_capture(new FrameCapture)
+  , _frame_dump_width(0)
+  , _frame_dump_zero_pad(false)
   , _totalBytesAllocated(0)
   , _displayAllModes(false)
 {
@@ -244,6 +255,9 @@ bool Graphics::create() {
 }
 
 bool Graphics::close() {
+  // the captures that haven't been read back yet need the device
+  if (_instance)
+    _instance->_frame_capture->flush();
   delete exch_null(_instance);
   return true;
 }
@@ -325,6 +339,45 @@ bool Graphics::init(WNDPROC wndProc)
     &_feature_level, &_immediate_context.p));
   set_private_data(FROM_HERE, _immediate_context.p);
 
+  return init_resources();
+}
+
+bool Graphics::init_headless(int width, int height, bool render) {
+
+  _headless = true;
+  _width = width;
+  _height = height;
+
+  int flags = 0;
+#ifdef _DEBUG
+  flags |= D3D11_CREATE_DEVICE_DEBUG;
+#endif
+
+  // the shaders are all shader model 5. WARP only has feature level 11 from windows 8, and
+  // the reference device comes with the sdk, so either can be missing
+  const D3D_FEATURE_LEVEL level = D3D_FEATURE_LEVEL_11_0;
+  const D3D_DRIVER_TYPE drivers[] = { D3D_DRIVER_TYPE_WARP, D3D_DRIVER_TYPE_REFERENCE, D3D_DRIVER_TYPE_NULL };
+  const int num_drivers = ELEMS_IN_ARRAY(drivers);
+  for (int i = render ? 0 : num_drivers - 1; i < num_drivers && !_device; ++i) {
+    if (SUCCEEDED(D3D11CreateDevice(NULL, drivers[i], NULL, flags, &level, 1, D3D11_SDK_VERSION, 
+        &_device.p, &_feature_level, &_immediate_context.p)))
+      _null_device = drivers[i] == D3D_DRIVER_TYPE_NULL;
+  }
+  if (!_device) {
+    LOG_ERROR_LN("Unable to create a headless device");
+    return false;
+  }
+  if (render && _null_device)
+    LOG_WARNING_LN("No WARP or reference device with feature level 11, using the null driver");
+  set_private_data(FROM_HERE, _immediate_context.p);
+
+  _recorder.reset(new CommandRecorder(false));
+
+  return init_resources();
+}
+
+bool Graphics::init_resources() {
+
   B_ERR_BOOL(_feature_level >= D3D_FEATURE_LEVEL_9_3);
 
 #ifdef _DEBUG
@@ -358,20 +411,23 @@ GraphicsObjectHandle Graphics::create_buffer(const TrackedLocation &loc,
     const int idx = _index_buffers.find_free_index();
     if (idx != -1 && create_buffer_inner(loc, bind, size, dynamic, buf, &_index_buffers[idx])) {
       KASSERT(data == DXGI_FORMAT_R16_UINT || data == DXGI_FORMAT_R32_UINT);
-      return make_goh(GraphicsObjectHandle::kIndexBuffer, idx, data);
+      return make_goh(GraphicsObjectHandle::kIndexBuffer, _index_buffers, idx, data);
     }
 
   } else if (bind == D3D11_BIND_VERTEX_BUFFER) {
     const int idx = _vertex_buffers.find_free_index();
     if (idx != -1 && create_buffer_inner(loc, bind, size, dynamic, buf, &_vertex_buffers[idx])) {
       KASSERT(data > 0);
-      return make_goh(GraphicsObjectHandle::kVertexBuffer, idx, data);
+      return make_goh(GraphicsObjectHandle::kVertexBuffer, _vertex_buffers, idx, data);
     }
 
   } else if (bind == D3D11_BIND_CONSTANT_BUFFER) {
     const int idx = _constant_buffers.find_free_index();
-    if (idx != -1 && create_buffer_inner(loc, bind, size, dynamic, buf, &_constant_buffers[idx]))
-      return make_goh(GraphicsObjectHandle::kConstantBuffer, idx, size);
+    if (idx != -1 && create_buffer_inner(loc, bind, size, dynamic, buf, &_constant_buffers[idx])) {
+      if (idx >= (int)_cbuffer_versions.size())
+        _cbuffer_versions.resize(idx + 1);
+      return make_goh(GraphicsObjectHandle::kConstantBuffer, _constant_buffers, idx, size);
+    }
 
   } else {
     LOG_ERROR_LN("Implement me!");
@@ -394,79 +450,93 @@ bool Graphics::create_buffer_inner(const TrackedLocation &loc, D3D11_BIND_FLAG b
     LOG_ERROR_LN("Out of memory trying to allocate %d bytes for buffer [total allocated: %d bytes]", size, _totalBytesAllocated);
   }
   set_private_data(loc, *buffer);
-  _totalBytesAllocated += size;
+  InterlockedExchangeAdd(&_totalBytesAllocated, size);
   return SUCCEEDED(hr);
 }
 
 GraphicsObjectHandle Graphics::get_temp_render_target(const TrackedLocation &loc, 
     int width, int height, DXGI_FORMAT format, uint32 bufferFlags, const std::string &name) {
 
-  KASSERT(_render_targets._key_to_idx.find(name) == _render_targets._key_to_idx.end());
-
-  // look for a free render target with the wanted properties
-  UINT flags = (bufferFlags & kCreateMipMaps) ? D3D11_RESOURCE_MISC_GENERATE_MIPS : 0;
-
-  auto cmp_desc = [&](const D3D11_TEXTURE2D_DESC &desc) {
-    return desc.Width == width && desc.Height == height && desc.Format == format && desc.MiscFlags == flags;
-  };
+  SCOPED_CS(_render_target_cs);
+  KASSERT(_render_targets.idx_from_token(name) == -1);
 
-  for (int idx = 0; idx < _render_targets.Size; ++idx) {
-    if (auto rt = _render_targets[idx]) {
-      auto &desc = rt->texture.desc;
-      if (!rt->in_use && cmp_desc(desc) && !!(bufferFlags & kCreateDepthBuffer) == !!rt->depth_stencil.resource.p) {
-        rt->in_use = true;
-        _render_targets._key_to_idx[name] = idx;
-        _render_targets._idx_to_key[idx] = name;
-        auto goh = make_goh(GraphicsObjectHandle::kRenderTarget, idx);
-        auto pid = PROPERTY_MANAGER.get_or_create<GraphicsObjectHandle>(name);
-        PROPERTY_MANAGER.set_property(pid, goh);
-        return goh;
-      }
-    }
+  // reuse the most recently released render target with the wanted properties
+  uint64 key = TempTargetPool::make_key(width, height, format, bufferFlags);
+  int idx = _temp_render_targets.acquire(key);
+  if (idx != -1) {
+    auto rt = _render_targets[idx];
+    KASSERT(!rt->in_use && rt->pool_key == key);
+    rt->in_use = true;
+    _render_targets.rename(idx, name);
+    auto goh = make_goh(GraphicsObjectHandle::kRenderTarget, _render_targets, idx);
+    auto pid = PROPERTY_MANAGER.get_or_create<GraphicsObjectHandle>(name);
+    PROPERTY_MANAGER.set_property(pid, goh);
+    return goh;
   }
+
   // nothing suitable found, so we create a render target
-  return create_render_target(loc, width, height, format, bufferFlags, name);
+  auto goh = create_render_target(loc, width, height, format, bufferFlags, name);
+  if (goh.is_valid())
+    _render_targets.get(goh)->pool_key = key;
+  return goh;
 }
 
 void Graphics::release_temp_render_target(GraphicsObjectHandle h) {
+  SCOPED_CS(_render_target_cs);
   auto rt = _render_targets.get(h);
   KASSERT(rt->in_use);
   rt->in_use = false;
   int idx = h.id();
-  string key = _render_targets._idx_to_key[idx];
-  _render_targets._idx_to_key.erase(idx);
-  _render_targets._key_to_idx.erase(key);
+  // the name is dropped from the map the next time it's looked up
+  _render_targets.clear_key(idx);
+
+  _temp_render_targets.release(rt->pool_key, idx, _frame_index);
 }
 
-GraphicsObjectHandle Graphics::create_structured_buffer(const TrackedLocation &loc, int elemSize, int numElems, bool createSrv) {
+void Graphics::collect_temp_render_targets() {
+  // destroy temp render targets that haven't been used for a while, so targets for
+  // resolutions (or passes) that are no longer used don't stick around
+  const int cMaxUnusedFrames = 120;
+  SCOPED_CS(_render_target_cs);
+  vector<int> stale;
+  _temp_render_targets.collect(_frame_index, cMaxUnusedFrames, &stale);
+  for (size_t i = 0; i < stale.size(); ++i)
+    _render_targets.release(stale[i]);
+  _render_targets.remove_stale_keys();
+}
+
+GraphicsObjectHandle Graphics::create_structured_buffer(const TrackedLocation &loc, int elemSize, int numElems, bool createSrv, bool dynamic) {
 
   unique_ptr<StructuredBuffer> sb(new StructuredBuffer);
 
   // Create Structured Buffer
   D3D11_BUFFER_DESC sbDesc;
-  sbDesc.BindFlags            = D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
-  sbDesc.CPUAccessFlags       = 0;
+  KASSERT(!dynamic || createSrv);
+  sbDesc.BindFlags            = dynamic ? D3D11_BIND_SHADER_RESOURCE : D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
+  sbDesc.CPUAccessFlags       = dynamic ? D3D11_CPU_ACCESS_WRITE : 0;
   sbDesc.MiscFlags            = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
   sbDesc.StructureByteStride  = elemSize;
   sbDesc.ByteWidth            = elemSize * numElems;
-  sbDesc.Usage                = D3D11_USAGE_DEFAULT;
+  sbDesc.Usage                = dynamic ? D3D11_USAGE_DYNAMIC : D3D11_USAGE_DEFAULT;
   if (FAILED(_device->CreateBuffer(&sbDesc, NULL, &sb->buffer.resource)))
     return emptyGoh;
 
   auto buf = sb->buffer.resource.p;
   set_private_data(loc, sb->buffer.resource.p);
 
-  // create the UAV for the structured buffer
-  D3D11_UNORDERED_ACCESS_VIEW_DESC sbUAVDesc;
-  sbUAVDesc.Buffer.FirstElement       = 0;
-  sbUAVDesc.Buffer.Flags              = 0;
-  sbUAVDesc.Buffer.NumElements        = numElems;
-  sbUAVDesc.Format                    = DXGI_FORMAT_UNKNOWN;
-  sbUAVDesc.ViewDimension             = D3D11_UAV_DIMENSION_BUFFER;
-  if (FAILED(_device->CreateUnorderedAccessView(buf, &sbUAVDesc, &sb->uav.resource)))
-    return emptyGoh;
+  if (!dynamic) {
+    // create the UAV for the structured buffer
+    D3D11_UNORDERED_ACCESS_VIEW_DESC sbUAVDesc;
+    sbUAVDesc.Buffer.FirstElement       = 0;
+    sbUAVDesc.Buffer.Flags              = 0;
+    sbUAVDesc.Buffer.NumElements        = numElems;
+    sbUAVDesc.Format                    = DXGI_FORMAT_UNKNOWN;
+    sbUAVDesc.ViewDimension             = D3D11_UAV_DIMENSION_BUFFER;
+    if (FAILED(_device->CreateUnorderedAccessView(buf, &sbUAVDesc, &sb->uav.resource)))
+      return emptyGoh;
 
-  set_private_data(loc, sb->uav.resource.p);
+    set_private_data(loc, sb->uav.resource.p);
+  }
 
   if (createSrv) {
     // create the Shader Resource View (SRV) for the structured buffer
@@ -487,7 +557,7 @@ GraphicsObjectHandle Graphics::create_structured_buffer(const TrackedLocation &l
   int idx = _structured_buffers.find_free_index();
   if (idx != -1) {
     _structured_buffers[idx] = sb.release();
-    return make_goh(GraphicsObjectHandle::kStructuredBuffer, idx);
+    return make_goh(GraphicsObjectHandle::kStructuredBuffer, _structured_buffers, idx);
   }
 
   return emptyGoh;
@@ -497,12 +567,13 @@ GraphicsObjectHandle Graphics::create_render_target(const TrackedLocation &loc,
 
     unique_ptr<RenderTargetResource> data(new RenderTargetResource);
     if (create_render_target(loc, width, height, format, bufferFlags, data.get())) {
+      SCOPED_CS(_render_target_cs);
       int idx = !name.empty() ? _render_targets.idx_from_token(name) : -1;
       if (idx != -1 || (idx = _render_targets.find_free_index()) != -1) {
         if (_render_targets[idx])
           _render_targets[idx]->reset();
         _render_targets.set_pair(idx, make_pair(name, data.release()));
-        auto goh = make_goh(GraphicsObjectHandle::kRenderTarget, idx);
+        auto goh = make_goh(GraphicsObjectHandle::kRenderTarget, _render_targets, idx);
         auto pid = PROPERTY_MANAGER.get_or_create<GraphicsObjectHandle>(name);
         PROPERTY_MANAGER.set_property(pid, goh);
         return goh;
@@ -598,7 +669,7 @@ bool Graphics::read_texture(const char *filename, D3DX11_IMAGE_INFO *info, uint3
 
 GraphicsObjectHandle Graphics::get_texture(const char *filename) {
   int idx = _resources.idx_from_token(filename);
-  return make_goh(GraphicsObjectHandle::kResource, idx);
+  return make_goh(GraphicsObjectHandle::kResource, _resources, idx);
 }
 
 GraphicsObjectHandle Graphics::load_texture(const char *filename, const char *friendly_name, bool srgb, D3DX11_IMAGE_INFO *info) {
@@ -626,7 +697,7 @@ GraphicsObjectHandle Graphics::load_texture(const char *filename, const char *fr
   if (_resources[idx])
     _resources[idx]->reset();
   _resources.set_pair(idx, make_pair(friendly_name, data.release()));
-  return make_goh(GraphicsObjectHandle::kResource, idx);
+  return make_goh(GraphicsObjectHandle::kResource, _resources, idx);
 }
 
 GraphicsObjectHandle Graphics::load_texture_from_memory(const void *buf, size_t len, const char *friendly_name, bool srgb, D3DX11_IMAGE_INFO *info) {
@@ -650,7 +721,7 @@ GraphicsObjectHandle Graphics::load_texture_from_memory(const void *buf, size_t
       _resources[idx]->reset();
     _resources.set_pair(idx, make_pair(friendly_name, data.release()));
   }
-  return make_goh(GraphicsObjectHandle::kResource, idx);
+  return make_goh(GraphicsObjectHandle::kResource, _resources, idx);
 }
 
 GraphicsObjectHandle Graphics::insert_texture(TextureResource *data, const char *friendly_name) {
@@ -661,7 +732,7 @@ GraphicsObjectHandle Graphics::insert_texture(TextureResource *data, const char
       _textures[idx]->reset();
     _textures.set_pair(idx, make_pair(friendly_name, data));
   }
-  return make_goh(GraphicsObjectHandle::kTexture, idx);
+  return make_goh(GraphicsObjectHandle::kTexture, _textures, idx);
 }
 
 GraphicsObjectHandle Graphics::create_texture(const TrackedLocation &loc, const D3D11_TEXTURE2D_DESC &desc, const char *name) {
@@ -729,6 +800,13 @@ bool Graphics::create_back_buffers(int width, int height)
   KASSERT(width && height);
   _width = width;
   _height = height;
+  _viewport = CD3D11_VIEWPORT (0.0f, 0.0f, (float)_width, (float)_height);
+
+  if (_headless) {
+    // there's no swap chain, so the back buffer is just a render target
+    _default_render_target = create_render_target(FROM_HERE, width, height, _buffer_format, kCreateDepthBuffer | kCreateSrv, "default_rt");
+    return _default_render_target.is_valid();
+  }
 
   int idx = _render_targets.idx_from_token("default_rt");
   RenderTargetResource *rt = nullptr;
@@ -767,9 +845,7 @@ bool Graphics::create_back_buffers(int width, int height)
   rt->dsv.resource->GetDesc(&rt->dsv.desc);
 
   _render_targets.set_pair(idx, make_pair("default_rt", rt));
-  _default_render_target = GraphicsObjectHandle(GraphicsObjectHandle::kRenderTarget, idx);
-
-  _viewport = CD3D11_VIEWPORT (0.0f, 0.0f, (float)_width, (float)_height);
+  _default_render_target = make_goh(GraphicsObjectHandle::kRenderTarget, _render_targets, idx);
 
   //set_default_render_target();
 
@@ -832,7 +908,103 @@ void Graphics::present()
     _start_fps_time = now;
     _frame_count = 0;
   }
-  _swap_chain->Present(_vsync ? 1 : 0,0);
+  if (!_frame_dump_pattern.empty() && !_null_device)
+    _frame_capture->capture(_default_render_target, frame_dump_filename());
+  _frame_capture->tick();
+
+  if (!_headless)
+    _swap_chain->Present(_vsync ? 1 : 0,0);
+
+  if (++_frame_index % 60 == 0)
+    collect_temp_render_targets();
+
+  if (_capture_frames_left > 0 && --_capture_frames_left == 0)
+    end_capture();
+}
+
+bool Graphics::start_frame_dump(const char *pattern) {
+  _frame_dump_pattern.clear();
+  if (!*pattern)
+    return true;
+
+  // the pattern comes from the command line, so it's never used as a format string. It's
+  // split around the %d instead, and the index is formatted on its own
+  string prefix, suffix;
+  int width = 0;
+  bool zero_pad = false, found = false;
+  for (const char *p = pattern; *p; ++p) {
+    string &dst = found ? suffix : prefix;
+    if (*p != '%') {
+      dst += *p;
+      continue;
+    }
+    if (p[1] == '%') {
+      dst += '%';
+      ++p;
+      continue;
+    }
+    if (found) {
+      LOG_ERROR_LN("Invalid frame dump pattern: %s, it can only have one %%d", pattern);
+      return false;
+    }
+    ++p;
+    zero_pad = *p == '0';
+    for (; isdigit((uint8)*p); ++p)
+      width = min(width * 10 + *p - '0', 1000);
+    if (*p != 'd' || width > 32) {
+      LOG_ERROR_LN("Invalid frame dump pattern: %s, the frame index has to be a %%d, like frame%%05d.png", pattern);
+      return false;
+    }
+    found = true;
+  }
+  if (!found) {
+    LOG_ERROR_LN("Invalid frame dump pattern: %s, it needs a %%d for the frame index", pattern);
+    return false;
+  }
+
+  _frame_dump_pattern = pattern;
+  _frame_dump_prefix = prefix;
+  _frame_dump_suffix = suffix;
+  _frame_dump_width = width;
+  _frame_dump_zero_pad = zero_pad;
+  return true;
+}
+
+string Graphics::frame_dump_filename() const {
+  if (_frame_dump_pattern.empty())
+    return string();
+  char index[16];
+  sprintf(index, "%d", _frame_index);
+  const int len = (int)strlen(index);
+  return _frame_dump_prefix + string(max(0, _frame_dump_width - len), _frame_dump_zero_pad ? '0' : ' ') + index + _frame_dump_suffix;
+}
+
+void Graphics::start_capture(const char *filename, int num_frames) {
+  if (!_recorder) {
+    _recorder.reset(new CommandRecorder(false));
+    for (size_t i = 0; i < _deferred_contexts.size(); ++i)
+      _deferred_contexts[i]->set_recorder(_recorder.get());
+  }
+
+  _recorder->set_keep_stream(true);
+  _capture_filename = filename;
+  _capture_frames_left = max(1, num_frames);
+}
+
+void Graphics::end_capture() {
+  if (_recorder->save(_capture_filename.c_str()))
+    LOG_INFO_LN("Saved %d bytes of commands to %s", (int)_recorder->stream().size(), _capture_filename.c_str());
+  else
+    LOG_ERROR_LN("Unable to save commands to %s", _capture_filename.c_str());
+
+  _recorder->set_keep_stream(false);
+
+  // outside of headless runs, the recorder only exists while capturing
+  if (!_headless) {
+    for (size_t i = 0; i < _deferred_contexts.size(); ++i)
+      _deferred_contexts[i]->set_recorder(nullptr);
+    _recorder.reset();
+  }
 }
 
 /*
@@ -847,7 +1019,7 @@ void Graphics::resize(int width, int height)
 GraphicsObjectHandle Graphics::create_input_layout(const TrackedLocation &loc, const std::vector<D3D11_INPUT_ELEMENT_DESC> &desc, const std::vector<char> &shader_bytecode) {
   const int idx = _input_layouts.find_free_index();
   if (idx != -1 && SUCCEEDED(_device->CreateInputLayout(&desc[0], desc.size(), &shader_bytecode[0], shader_bytecode.size(), &_input_layouts[idx])))
-    return GraphicsObjectHandle(GraphicsObjectHandle::kInputLayout, idx);
+    return make_goh(GraphicsObjectHandle::kInputLayout, _input_layouts, idx);
   return emptyGoh;
 }
 
@@ -856,7 +1028,7 @@ GraphicsObjectHandle add_shader(const TrackedLocation &loc, int idx, Cont &cont,
   set_private_data(loc, shader);
   SAFE_RELEASE(cont[idx]);
   cont.set_pair(idx, make_pair(id, shader));
-  return Graphics::make_goh(type, idx);
+  return Graphics::make_goh(type, cont, idx);
 }
 
 GraphicsObjectHandle Graphics::create_vertex_shader(const TrackedLocation &loc, const std::vector<char> &shader_bytecode, const string &id) {
@@ -907,78 +1079,108 @@ GraphicsObjectHandle Graphics::create_geometry_shader(const TrackedLocation &loc
   return emptyGoh;
 }
 
-template<typename T, class Cont>
-int find_existing(const T &desc, Cont &c) {
-  // look for an existing state
-  T d2;
-  for (int i = 0; i < c.Size; ++i) {
-    if (!c[i])
-      continue;
-    c[i]->GetDesc(&d2);
-    if (0 == memcmp(&d2, &desc, sizeof(T)))
-      return i;
+// The descs are hashed and compared as raw bytes, so they're first copied field by field
+// into zeroed structs. The blend and depth stencil descs have padding after their UINT8
+// write masks, which would otherwise make identical states hash differently.
+static D3D11_BLEND_DESC canonical_desc(const D3D11_BLEND_DESC &desc) {
+  D3D11_BLEND_DESC res;
+  ZeroMemory(&res, sizeof(res));
+  res.AlphaToCoverageEnable = desc.AlphaToCoverageEnable;
+  res.IndependentBlendEnable = desc.IndependentBlendEnable;
+  for (int i = 0; i < ELEMS_IN_ARRAY(desc.RenderTarget); ++i) {
+    const D3D11_RENDER_TARGET_BLEND_DESC &src = desc.RenderTarget[i];
+    D3D11_RENDER_TARGET_BLEND_DESC &dst = res.RenderTarget[i];
+    dst.BlendEnable = src.BlendEnable;
+    dst.SrcBlend = src.SrcBlend;
+    dst.DestBlend = src.DestBlend;
+    dst.BlendOp = src.BlendOp;
+    dst.SrcBlendAlpha = src.SrcBlendAlpha;
+    dst.DestBlendAlpha = src.DestBlendAlpha;
+    dst.BlendOpAlpha = src.BlendOpAlpha;
+    dst.RenderTargetWriteMask = src.RenderTargetWriteMask;
   }
-  return -1;
+  return res;
 }
 
-GraphicsObjectHandle Graphics::create_rasterizer_state(const TrackedLocation &loc, const D3D11_RASTERIZER_DESC &desc, const char *name) {
-
-  int idx = name ? _rasterizer_states.idx_from_token(name) : find_existing(desc, _rasterizer_states);
-  if (idx != -1)
-    return make_goh(GraphicsObjectHandle::kRasterizerState, idx);
-
-  idx = _rasterizer_states.find_free_index();
-  ID3D11RasterizerState *rs;
-  if (idx != -1 && SUCCEEDED(_device->CreateRasterizerState(&desc, &rs))) {
-    _rasterizer_states.set_pair(idx, make_pair(name ? name : "", rs));
-    return make_goh(GraphicsObjectHandle::kRasterizerState, idx);
-  }
-  return emptyGoh;
+static D3D11_DEPTH_STENCIL_DESC canonical_desc(const D3D11_DEPTH_STENCIL_DESC &desc) {
+  D3D11_DEPTH_STENCIL_DESC res;
+  ZeroMemory(&res, sizeof(res));
+  res.DepthEnable = desc.DepthEnable;
+  res.DepthWriteMask = desc.DepthWriteMask;
+  res.DepthFunc = desc.DepthFunc;
+  res.StencilEnable = desc.StencilEnable;
+  res.StencilReadMask = desc.StencilReadMask;
+  res.StencilWriteMask = desc.StencilWriteMask;
+  res.FrontFace = desc.FrontFace;
+  res.BackFace = desc.BackFace;
+  return res;
 }
 
-GraphicsObjectHandle Graphics::create_blend_state(const TrackedLocation &loc, const D3D11_BLEND_DESC &desc, const char *name) {
+// the rasterizer and sampler descs only have 4 byte members, so they have no padding
+static const D3D11_RASTERIZER_DESC &canonical_desc(const D3D11_RASTERIZER_DESC &desc) { return desc; }
+static const D3D11_SAMPLER_DESC &canonical_desc(const D3D11_SAMPLER_DESC &desc) { return desc; }
 
-  int idx = name ? _blend_states.idx_from_token(name) : find_existing(desc, _blend_states);
+template<typename Desc, typename State, class Cont, class Creator>
+GraphicsObjectHandle intern_state(const Desc &desc, const char *name, GraphicsObjectHandle::Type type, 
+                                  Cont &cont, Graphics::StateInternTable *table, const Creator &creator) {
+
+  // named states are looked up by name first, to allow them to be referenced by later techniques
+  int idx = name ? cont.idx_from_token(name) : -1;
   if (idx != -1)
-    return make_goh(GraphicsObjectHandle::kBlendState, idx);
+    return Graphics::make_goh(type, cont, idx);
+
+  // look for an existing state with the same desc. identical states share a handle, no
+  // matter what they're named
+  const Desc canonical = canonical_desc(desc);
+  uint32 hash = fnv_hash(&canonical, sizeof(Desc));
+  auto range = table->equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    Desc d2;
+    cont[it->second]->GetDesc(&d2);
+    const Desc other = canonical_desc(d2);
+    if (0 == memcmp(&other, &canonical, sizeof(Desc))) {
+      idx = it->second;
+      break;
+    }
+  }
 
-  idx = _blend_states.find_free_index();
-  ID3D11BlendState *bs;
-  if (idx != -1 && SUCCEEDED(_device->CreateBlendState(&desc, &bs))) {
-    _blend_states.set_pair(idx, make_pair(name ? name : "", bs));
-    return make_goh(GraphicsObjectHandle::kBlendState, idx);
+  if (idx == -1) {
+    State *state;
+    idx = cont.find_free_index();
+    if (idx == -1 || FAILED(creator(&desc, &state)))
+      return emptyGoh;
+    cont.set_pair(idx, make_pair(name ? name : "", state));
+    table->insert(make_pair(hash, idx));
+  } else if (name) {
+    // alias the name to the existing state
+    cont.add_alias(name, idx);
   }
-  return emptyGoh;
+
+  return Graphics::make_goh(type, cont, idx);
 }
 
-GraphicsObjectHandle Graphics::create_depth_stencil_state(const TrackedLocation &loc, const D3D11_DEPTH_STENCIL_DESC &desc, const char *name) {
+GraphicsObjectHandle Graphics::create_rasterizer_state(const TrackedLocation &loc, const D3D11_RASTERIZER_DESC &desc, const char *name) {
+  return intern_state<D3D11_RASTERIZER_DESC, ID3D11RasterizerState>(desc, name, GraphicsObjectHandle::kRasterizerState,
+    _rasterizer_states, &_rasterizer_state_table, 
+    [&](const D3D11_RASTERIZER_DESC *d, ID3D11RasterizerState **s) { return _device->CreateRasterizerState(d, s); });
+}
 
-  int idx = name ? _depth_stencil_states.idx_from_token(name) : find_existing(desc, _depth_stencil_states);
-  if (idx != -1)
-    return make_goh(GraphicsObjectHandle::kDepthStencilState, idx);
+GraphicsObjectHandle Graphics::create_blend_state(const TrackedLocation &loc, const D3D11_BLEND_DESC &desc, const char *name) {
+  return intern_state<D3D11_BLEND_DESC, ID3D11BlendState>(desc, name, GraphicsObjectHandle::kBlendState,
+    _blend_states, &_blend_state_table, 
+    [&](const D3D11_BLEND_DESC *d, ID3D11BlendState **s) { return _device->CreateBlendState(d, s); });
+}
 
-  idx = _depth_stencil_states.find_free_index();
-  ID3D11DepthStencilState *dss;
-  if (idx != -1 && SUCCEEDED(_device->CreateDepthStencilState(&desc, &dss))) {
-    _depth_stencil_states.set_pair(idx, make_pair(name ? name : "", dss));
-    return make_goh(GraphicsObjectHandle::kDepthStencilState, idx);
-  }
-  return emptyGoh;
+GraphicsObjectHandle Graphics::create_depth_stencil_state(const TrackedLocation &loc, const D3D11_DEPTH_STENCIL_DESC &desc, const char *name) {
+  return intern_state<D3D11_DEPTH_STENCIL_DESC, ID3D11DepthStencilState>(desc, name, GraphicsObjectHandle::kDepthStencilState,
+    _depth_stencil_states, &_depth_stencil_state_table, 
+    [&](const D3D11_DEPTH_STENCIL_DESC *d, ID3D11DepthStencilState **s) { return _device->CreateDepthStencilState(d, s); });
 }
 
 GraphicsObjectHandle Graphics::create_sampler_state(const TrackedLocation &loc, const D3D11_SAMPLER_DESC &desc, const char *name) {
-
-  int idx = name ? _sampler_states.idx_from_token(name) : find_existing(desc, _sampler_states);
-  if (idx != -1)
-    return make_goh(GraphicsObjectHandle::kSamplerState, idx);
-
-  idx = _sampler_states.find_free_index();
-  ID3D11SamplerState *ss;
-  if (idx != -1 && SUCCEEDED(_device->CreateSamplerState(&desc, &ss))) {
-    _sampler_states.set_pair(idx, make_pair(name ? name : "", ss));
-    return make_goh(GraphicsObjectHandle::kSamplerState, idx);
-  }
-  return emptyGoh;
+  return intern_state<D3D11_SAMPLER_DESC, ID3D11SamplerState>(desc, name, GraphicsObjectHandle::kSamplerState,
+    _sampler_states, &_sampler_state_table, 
+    [&](const D3D11_SAMPLER_DESC *d, ID3D11SamplerState **s) { return _device->CreateSamplerState(d, s); });
 }
 
 bool Graphics::technique_file_changed(const char *filename, void *token) {
@@ -1042,6 +1244,9 @@ bool Graphics::load_techniques(const char *filename, bool add_materials) {
   RESOURCE_MANAGER.add_file_watch(filename, NULL, bind(&Graphics::technique_file_changed, this, _1, _2), false, nullptr, -1);
 #endif
 
+  LOG_INFO_LN("Unique render states after loading %s: %Iu rasterizer, %Iu blend, %Iu depth stencil, %Iu sampler",
+    filename, _rasterizer_state_table.size(), _blend_state_table.size(), _depth_stencil_state_table.size(), _sampler_state_table.size());
+
   return res;
 }
 
@@ -1053,32 +1258,59 @@ GraphicsObjectHandle Graphics::find_resource(const std::string &name) {
   // check textures, then resources, then render targets
   int idx = _textures.idx_from_token(name);
   if (idx != -1)
-    return GraphicsObjectHandle(GraphicsObjectHandle::kTexture, idx);
+    return make_goh(GraphicsObjectHandle::kTexture, _textures, idx);
   idx = _resources.idx_from_token(name);
   if (idx != -1)
-    return GraphicsObjectHandle(GraphicsObjectHandle::kResource, idx);
+    return make_goh(GraphicsObjectHandle::kResource, _resources, idx);
+  SCOPED_CS(_render_target_cs);
   idx = _render_targets.idx_from_token(name);
-  return make_goh(GraphicsObjectHandle::kRenderTarget, idx);
+  return make_goh(GraphicsObjectHandle::kRenderTarget, _render_targets, idx);
+}
+
+bool Graphics::is_live(GraphicsObjectHandle h) const {
+  switch (h.type()) {
+    case GraphicsObjectHandle::kVertexBuffer: return _vertex_buffers.is_live(h);
+    case GraphicsObjectHandle::kIndexBuffer: return _index_buffers.is_live(h);
+    case GraphicsObjectHandle::kConstantBuffer: return _constant_buffers.is_live(h);
+    case GraphicsObjectHandle::kTexture: return _textures.is_live(h);
+    case GraphicsObjectHandle::kResource: return _resources.is_live(h);
+    case GraphicsObjectHandle::kRenderTarget: {
+      SCOPED_CS(_render_target_cs);
+      return _render_targets.is_live(h);
+    }
+    case GraphicsObjectHandle::kInputLayout: return _input_layouts.is_live(h);
+    case GraphicsObjectHandle::kBlendState: return _blend_states.is_live(h);
+    case GraphicsObjectHandle::kRasterizerState: return _rasterizer_states.is_live(h);
+    case GraphicsObjectHandle::kSamplerState: return _sampler_states.is_live(h);
+    case GraphicsObjectHandle::kDepthStencilState: return _depth_stencil_states.is_live(h);
+    case GraphicsObjectHandle::kTechnique: return _techniques.is_live(h);
+    case GraphicsObjectHandle::kVertexShader: return _vertex_shaders.is_live(h);
+    case GraphicsObjectHandle::kGeometryShader: return _geometry_shaders.is_live(h);
+    case GraphicsObjectHandle::kPixelShader: return _pixel_shaders.is_live(h);
+    case GraphicsObjectHandle::kComputeShader: return _compute_shaders.is_live(h);
+    case GraphicsObjectHandle::kStructuredBuffer: return _structured_buffers.is_live(h);
+    default: return h.is_valid();
+  }
 }
 
 GraphicsObjectHandle Graphics::find_technique(const std::string &name) {
-  return make_goh(GraphicsObjectHandle::kTechnique, _techniques.idx_from_token(name));
+  return make_goh(GraphicsObjectHandle::kTechnique, _techniques, _techniques.idx_from_token(name));
 }
 
 GraphicsObjectHandle Graphics::find_sampler(const std::string &name) {
-  return make_goh(GraphicsObjectHandle::kSamplerState, _sampler_states.idx_from_token(name));
+  return make_goh(GraphicsObjectHandle::kSamplerState, _sampler_states, _sampler_states.idx_from_token(name));
 }
 
 GraphicsObjectHandle Graphics::find_blend_state(const std::string &name) {
-  return make_goh(GraphicsObjectHandle::kBlendState, _blend_states.idx_from_token(name));
+  return make_goh(GraphicsObjectHandle::kBlendState, _blend_states, _blend_states.idx_from_token(name));
 }
 
 GraphicsObjectHandle Graphics::find_rasterizer_state(const std::string &name) {
-  return make_goh(GraphicsObjectHandle::kRasterizerState, _rasterizer_states.idx_from_token(name));
+  return make_goh(GraphicsObjectHandle::kRasterizerState, _rasterizer_states, _rasterizer_states.idx_from_token(name));
 }
 
 GraphicsObjectHandle Graphics::find_depth_stencil_state(const std::string &name) {
-  return make_goh(GraphicsObjectHandle::kDepthStencilState, _depth_stencil_states.idx_from_token(name));
+  return make_goh(GraphicsObjectHandle::kDepthStencilState, _depth_stencil_states, _depth_stencil_states.idx_from_token(name));
 }
 
 Technique *Graphics::get_technique(GraphicsObjectHandle h) {
@@ -1101,13 +1333,10 @@ int Graphics::get_shader_flag(const std::string &flag) {
   return it == _shader_flags.end() ? 0 : it->second;
 }
 
-GraphicsObjectHandle Graphics::make_goh(GraphicsObjectHandle::Type type, int idx, int data) {
-  KASSERT(idx != -1);
-  return idx != -1 ? GraphicsObjectHandle(type, idx, data) : emptyGoh;
-}
-
 void Graphics::fill_system_resource_views(const ResourceViewArray &views, TextureArray *out) const {
 
+  // the system views are mostly render targets, whose properties are set as they're acquired
+  SCOPED_CS(_render_target_cs);
   for (size_t i = 0; i < views.size(); ++i) {
     if (views[i].used && views[i].source == PropertySource::kSystem) {
       (*out)[i] = PROPERTY_MANAGER.get_property<GraphicsObjectHandle>(views[i].class_id);
@@ -1117,6 +1346,11 @@ void Graphics::fill_system_resource_views(const ResourceViewArray &views, Textur
 
 void Graphics::destroy_deferred_context(DeferredContext *ctx) {
   if (ctx) {
+    _deferred_contexts.erase(remove(_deferred_contexts.begin(), _deferred_contexts.end(), ctx), _deferred_contexts.end());
+    if (ctx->_transient_vb.buffer.is_valid())
+      _vertex_buffers.release(ctx->_transient_vb.buffer.id());
+    if (ctx->_transient_ib.buffer.is_valid())
+      _index_buffers.release(ctx->_transient_ib.buffer.id());
     if (!ctx->_is_immediate_context)
       ctx->_ctx->Release();
     delete exch_null(ctx);
@@ -1125,13 +1359,23 @@ void Graphics::destroy_deferred_context(DeferredContext *ctx) {
 
 DeferredContext *Graphics::create_deferred_context(bool can_use_immediate) {
   DeferredContext *dc = new DeferredContext;
-  if (can_use_immediate) {
+  // with parallel recording, every context has to be deferred
+  if (can_use_immediate && !WITH_PARALLEL_RECORDING) {
     dc->_is_immediate_context = true;
     dc->_ctx = _immediate_context;
   } else {
     _device->CreateDeferredContext(0, &dc->_ctx);
   }
 
+  dc->set_recorder(_recorder.get());
+  _deferred_contexts.push_back(dc);
+
+#if WITH_CBUFFER_RING
+  // the ring is uploaded before the command list runs, so the immediate context can't use it
+  if (!dc->_is_immediate_context && !dc->init_cbuffer_ring(_device, 4 * 1024 * 1024))
+    LOG_INFO_LN("Constant buffer offsets not supported, using per-buffer uploads");
+#endif
+
   return dc;
 }
 
@@ -1158,7 +1402,59 @@ void Graphics::get_predefined_geometry(PredefinedGeometry geom, GraphicsObjectHa
   }
 }
 
-void Graphics::add_command_list(ID3D11CommandList *cmd_list) {
-  _immediate_context->ExecuteCommandList(cmd_list, FALSE);
-  cmd_list->Release();
+void Graphics::add_command_list(ID3D11CommandList *cmd_list, ID3D11Buffer *upload_buffer, const void *upload_data, int upload_len) {
+  // the upload data is owned by the context, and stays put until it records its next frame
+  CommandList c = { cmd_list, upload_buffer, upload_data, upload_len };
+  if (g_submit_slot != -1) {
+    _slot_command_lists[g_submit_slot].push_back(c);
+    return;
+  }
+  execute_command_list(c);
+}
+
+void Graphics::execute_command_list(const CommandList &c) {
+  if (c.upload_buffer) {
+    D3D11_MAPPED_SUBRESOURCE sub;
+    if (SUCCEEDED(_immediate_context->Map(c.upload_buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &sub))) {
+      memcpy(sub.pData, c.upload_data, c.upload_len);
+      _immediate_context->Unmap(c.upload_buffer, 0);
+    }
+  }
+  _immediate_context->ExecuteCommandList(c.cmd_list, FALSE);
+  c.cmd_list->Release();
+}
+
+void Graphics::begin_parallel_submit(int num_slots) {
+  KASSERT(_slot_command_lists.empty());
+  _slot_command_lists.resize(num_slots);
+  if (_recorder) {
+    while ((int)_slot_recorders.size() < num_slots)
+      _slot_recorders.push_back(unique_ptr<CommandRecorder>(new CommandRecorder(false)));
+    for (int i = 0; i < num_slots; ++i) {
+      _slot_recorders[i]->reset();
+      _slot_recorders[i]->set_keep_stream(_recorder->keep_stream());
+    }
+  }
+}
+
+void Graphics::set_submit_slot(int slot) {
+  KASSERT(slot == -1 || slot < (int)_slot_command_lists.size());
+  g_submit_slot = slot;
+}
+
+void Graphics::end_parallel_submit() {
+  for (size_t i = 0; i < _slot_command_lists.size(); ++i) {
+    auto &cmd_lists = _slot_command_lists[i];
+    for (size_t j = 0; j < cmd_lists.size(); ++j)
+      execute_command_list(cmd_lists[j]);
+    if (_recorder)
+      _recorder->append(*_slot_recorders[i]);
+  }
+  _slot_command_lists.clear();
+}
+
+CommandRecorder *Graphics::thread_recorder() {
+  if (!_recorder || g_submit_slot == -1)
+    return _recorder.get();
+  return _slot_recorders[g_submit_slot].get();
 }
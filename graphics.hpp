@@ -6,10 +6,13 @@
 #include "graphics_object_handle.hpp"
 #include "technique.hpp"
 #include "tracked_location.hpp"
+#include "command_recorder.hpp"
+#include "temp_target_pool.hpp"
 
 struct Io;
 class Shader;
 class Material;
+class FrameCapture;
 
 enum FileEvent;
 
@@ -41,7 +44,7 @@ public:
   };
 
   struct RenderTargetResource {
-    RenderTargetResource() : in_use(true) {
+    RenderTargetResource() : in_use(true), pool_key(0) {
       reset();
     }
 
@@ -55,6 +58,8 @@ public:
     }
 
     bool in_use;
+    // temp render targets are returned to the free list for this key when released
+    uint64 pool_key;
     ResourceAndDesc<ID3D11Texture2D, D3D11_TEXTURE2D_DESC> texture;
     ResourceAndDesc<ID3D11Texture2D, D3D11_TEXTURE2D_DESC> depth_stencil;
     ResourceAndDesc<ID3D11RenderTargetView, D3D11_RENDER_TARGET_VIEW_DESC> rtv;
@@ -87,6 +92,9 @@ public:
     ResourceAndDesc<ID3D11UnorderedAccessView, D3D11_UNORDERED_ACCESS_VIEW_DESC> uav;
   };
 
+  // maps the hash of a state desc to the index of the state object created from it
+  typedef std::unordered_multimap<uint32, int> StateInternTable;
+
   static bool create();
   inline static Graphics& instance() {
     KASSERT(_instance);
@@ -97,6 +105,34 @@ public:
 
   bool config(HINSTANCE hInstance);
   bool	init(WNDPROC wndProc);
+  // Creates a device without a window or swap chain. Calls are validated by the runtime,
+  // and counted by the recorder. Unless 'render' is set, the device is on the null driver,
+  // and nothing is rendered. With 'render', it's on WARP, or the reference device, so the
+  // frames can be read back, and only falls back to the null driver if neither has
+  // feature level 11
+  bool init_headless(int width, int height, bool render);
+  bool headless() const { return _headless; }
+  bool null_device() const { return _null_device; }
+  CommandRecorder *recorder() { return _recorder.get(); }
+  // the recorder for commands submitted from the calling thread
+  CommandRecorder *thread_recorder();
+
+  // Captures the commands submitted on all contexts, including cbuffer and mapped buffer
+  // contents, for the next 'num_frames' frames, and saves them to 'filename'
+  void start_capture(const char *filename, int num_frames);
+
+  // Saves every presented frame with the frame capture, to 'pattern' with the frame index in
+  // place of its one %d, which can have a width and zero padding (like "dump/frame%05d.png").
+  // Returns false, and doesn't dump, if the pattern has any other conversions. An empty
+  // pattern stops dumping. The null driver has nothing to read back, so frames on it have to
+  // come from the software rasterizer
+  bool start_frame_dump(const char *pattern);
+  // the name for the current frame, or empty if frames aren't being dumped
+  std::string frame_dump_filename() const;
+  FrameCapture *frame_capture() { return _frame_capture.get(); }
+
+  // true if the handle refers to a live object of the handle's type
+  bool is_live(GraphicsObjectHandle h) const;
 
   void	present();
   //void	resize(int width, int height);
@@ -128,7 +164,8 @@ public:
   void release_temp_render_target(GraphicsObjectHandle h);
 
   GraphicsObjectHandle create_render_target(const TrackedLocation &loc, int width, int height, DXGI_FORMAT format, uint32 bufferFlags, const std::string &name);
-  GraphicsObjectHandle create_structured_buffer(const TrackedLocation &loc, int elemSize, int numElems, bool createSrv);
+  // dynamic structured buffers are cpu writable (with map), but can't have an uav
+  GraphicsObjectHandle create_structured_buffer(const TrackedLocation &loc, int elemSize, int numElems, bool createSrv, bool dynamic = false);
   GraphicsObjectHandle create_texture(const TrackedLocation &loc, const D3D11_TEXTURE2D_DESC &desc, const char *name);
   GraphicsObjectHandle get_texture(const char *filename);
 
@@ -169,12 +206,31 @@ public:
 
   DeferredContext *create_deferred_context(bool can_use_immediate);
   void destroy_deferred_context(DeferredContext *ctx);
-  void add_command_list(ID3D11CommandList *cmd_list);
+  // Every upload to a constant buffer bumps its version, so a context can tell if another
+  // context has written to the buffer since its own last upload
+  uint32 cbuffer_version(GraphicsObjectHandle cb) const { return (uint32)_cbuffer_versions[cb.id()]; }
+  uint32 bump_cbuffer_version(GraphicsObjectHandle cb) { return (uint32)InterlockedIncrement(&_cbuffer_versions[cb.id()]); }
+  // 'upload_data' is written to 'upload_buffer' with a single discarding map right before
+  // the command list is executed. Used for the deferred contexts' constant buffer rings
+  void add_command_list(ID3D11CommandList *cmd_list, ID3D11Buffer *upload_buffer = nullptr,
+    const void *upload_data = nullptr, int upload_len = 0);
+
+  // When recording in parallel, each thread submits to a slot. The command lists and the
+  // recorded commands are held per slot, and end_parallel_submit executes them (and adds them
+  // to the recorder) in slot order, so the result doesn't depend on the thread timings.
+  void begin_parallel_submit(int num_slots);
+  void set_submit_slot(int slot);
+  void end_parallel_submit();
 
   bool vsync() const { return _vsync; }
   void set_vsync(bool value) { _vsync = value; }
 
-  static GraphicsObjectHandle make_goh(GraphicsObjectHandle::Type type, int idx, int data = 0);
+  // handles include the generation of the slot, so they have to be made from the container
+  template<class Cont>
+  static GraphicsObjectHandle make_goh(GraphicsObjectHandle::Type type, const Cont &cont, int idx, int data = 0) {
+    KASSERT(idx != -1);
+    return idx != -1 ? GraphicsObjectHandle(type, idx, cont.generation(idx), data) : GraphicsObjectHandle();
+  }
 
   void setDisplayAllModes(bool value) { _displayAllModes = value; }
   bool displayAllModes() const { return _displayAllModes; }
@@ -190,8 +246,11 @@ public:
   bool create_buffer_inner(const TrackedLocation &loc, D3D11_BIND_FLAG bind, int size, bool dynamic, const void* data, ID3D11Buffer** buffer);
 
   bool create_render_target(const TrackedLocation &loc, int width, int height, DXGI_FORMAT format, uint32 bufferFlags, RenderTargetResource *out);
+  void collect_temp_render_targets();
   bool create_texture(const TrackedLocation &loc, const D3D11_TEXTURE2D_DESC &desc, TextureResource *out);
 
+  bool init_resources();
+  void end_capture();
   bool create_back_buffers(int width, int height);
   bool create_default_geometry();
 
@@ -231,27 +290,42 @@ public:
 
 
   // resources
-  enum { IdCount = 1 << GraphicsObjectHandle::cIdBits };
-  SearchableIdBuffer<std::string, ID3D11VertexShader *, IdCount> _vertex_shaders;
-  SearchableIdBuffer<std::string, ID3D11PixelShader *, IdCount> _pixel_shaders;
-  SearchableIdBuffer<std::string, ID3D11ComputeShader *, IdCount> _compute_shaders;
-  SearchableIdBuffer<std::string, ID3D11GeometryShader *, IdCount> _geometry_shaders;
-  IdBuffer<ID3D11InputLayout *, IdCount> _input_layouts;
-  IdBuffer<ID3D11Buffer *, IdCount> _vertex_buffers;
-  IdBuffer<ID3D11Buffer *, IdCount> _index_buffers;
-  IdBuffer<ID3D11Buffer *, IdCount> _constant_buffers;
-  SearchableIdBuffer<std::string, Technique *, IdCount> _techniques;
-
-  SearchableIdBuffer<std::string, ID3D11BlendState *, IdCount> _blend_states;
-  SearchableIdBuffer<std::string, ID3D11DepthStencilState *, IdCount> _depth_stencil_states;
-  SearchableIdBuffer<std::string, ID3D11RasterizerState *, IdCount> _rasterizer_states;
-  SearchableIdBuffer<std::string, ID3D11SamplerState *, IdCount> _sampler_states;
-
-  SearchableIdBuffer<std::string, TextureResource *, IdCount> _textures;
-  SearchableIdBuffer<std::string, RenderTargetResource *, IdCount> _render_targets;
-  SearchableIdBuffer<std::string, SimpleResource *, IdCount> _resources;
-  IdBuffer<ID3D11ShaderResourceView *, IdCount> _shader_resource_views;
-  IdBuffer<StructuredBuffer *, IdCount> _structured_buffers;
+  SearchableIdBuffer<std::string, ID3D11VertexShader *> _vertex_shaders;
+  SearchableIdBuffer<std::string, ID3D11PixelShader *> _pixel_shaders;
+  SearchableIdBuffer<std::string, ID3D11ComputeShader *> _compute_shaders;
+  SearchableIdBuffer<std::string, ID3D11GeometryShader *> _geometry_shaders;
+  IdBuffer<ID3D11InputLayout *> _input_layouts;
+  IdBuffer<ID3D11Buffer *> _vertex_buffers;
+  IdBuffer<ID3D11Buffer *> _index_buffers;
+  IdBuffer<ID3D11Buffer *> _constant_buffers;
+  SearchableIdBuffer<std::string, Technique *> _techniques;
+
+  SearchableIdBuffer<std::string, ID3D11BlendState *> _blend_states;
+  SearchableIdBuffer<std::string, ID3D11DepthStencilState *> _depth_stencil_states;
+  SearchableIdBuffer<std::string, ID3D11RasterizerState *> _rasterizer_states;
+  SearchableIdBuffer<std::string, ID3D11SamplerState *> _sampler_states;
+
+  StateInternTable _blend_state_table;
+  StateInternTable _depth_stencil_state_table;
+  StateInternTable _rasterizer_state_table;
+  StateInternTable _sampler_state_table;
+
+  TempTargetPool _temp_render_targets;
+  // Guards _render_targets, _temp_render_targets and the render targets' properties. Effects
+  // recording in parallel acquire and release temp render targets, which adds slots and
+  // names, so everything that looks up a render target takes it too
+  mutable CriticalSection _render_target_cs;
+  RenderTargetResource *render_target(GraphicsObjectHandle h) const {
+    SCOPED_CS(_render_target_cs);
+    return _render_targets.get(h);
+  }
+  int _frame_index;
+
+  SearchableIdBuffer<std::string, TextureResource *> _textures;
+  SearchableIdBuffer<std::string, RenderTargetResource *> _render_targets;
+  SearchableIdBuffer<std::string, SimpleResource *> _resources;
+  IdBuffer<ID3D11ShaderResourceView *> _shader_resource_views;
+  IdBuffer<StructuredBuffer *> _structured_buffers;
 
   static Graphics* _instance;
 
@@ -289,7 +363,33 @@ public:
   const char *_gs_profile;
 
   bool _vsync;
-  int _totalBytesAllocated;
+  bool _headless;
+  bool _null_device;
+  std::unique_ptr<CommandRecorder> _recorder;
+  std::vector<DeferredContext *> _deferred_contexts;
+  struct CommandList {
+    ID3D11CommandList *cmd_list;
+    ID3D11Buffer *upload_buffer;
+    const void *upload_data;
+    int upload_len;
+  };
+  void execute_command_list(const CommandList &cmd_list);
+  std::vector<std::vector<CommandList> > _slot_command_lists;
+  // indexed by constant buffer id. The buffers are created on the main thread while loading,
+  // so it doesn't grow while the contexts record
+  std::vector<LONG> _cbuffer_versions;
+  std::vector<std::unique_ptr<CommandRecorder> > _slot_recorders;
+  std::string _capture_filename;
+  int _capture_frames_left;
+  std::unique_ptr<FrameCapture> _frame_capture;
+  // the dump pattern, split around the frame index
+  std::string _frame_dump_pattern;
+  std::string _frame_dump_prefix;
+  std::string _frame_dump_suffix;
+  int _frame_dump_width;
+  bool _frame_dump_zero_pad;
+  // buffers are created by effects recording in parallel too
+  volatile LONG _totalBytesAllocated;
 
   std::map<PredefinedGeometry, std::pair<GraphicsObjectHandle, GraphicsObjectHandle> > _predefined_geometry;
 
@@ -1,9 +1,11 @@
 #pragma once
 
+template<class Traits> class IdBufferBase;
+
 class GraphicsObjectHandle {
 public:
   enum Type {
-    kInvalid = -1,    // NB: You have to compare _raw against kInvalid to test
+    kInvalid = -1,    // NB: Use is_valid() to test, an invalid handle has all its bits set
     kContext,
     kVertexBuffer,
     kIndexBuffer,
@@ -27,38 +29,43 @@ public:
     kStructuredBuffer,
     cNumTypes
   };	
-private:
-  friend class Graphics;
-  friend class MaterialManager;
   enum { 
     cTypeBits = 8,
-    cIdBits = 12,
-    cDataBits = 32 - (cTypeBits + cIdBits),
+    cIdBits = 20,
+    cGenerationBits = 12,
+    cDataBits = 64 - (cTypeBits + cIdBits + cGenerationBits),
   };
+private:
+  friend class Graphics;
+  friend class MaterialManager;
+  friend class CommandReplayer;
+  template<class Traits> friend class IdBufferBase;
   static_assert(1 << GraphicsObjectHandle::cTypeBits > GraphicsObjectHandle::cNumTypes, "Not enough type bits");
 
-  GraphicsObjectHandle(uint32 type, uint32 id) : _type(type), _id(id), _data(0) {}
-  GraphicsObjectHandle(uint32 type, uint32 id, uint32 data) : _type(type), _id(id), _data(data) 
+  GraphicsObjectHandle(uint32 type, uint32 id, uint32 generation) : _type(type), _id(id), _generation(generation), _data(0) {}
+  GraphicsObjectHandle(uint32 type, uint32 id, uint32 generation, uint32 data) : _type(type), _id(id), _generation(generation), _data(data) 
   {
     KASSERT(data < (1 << cDataBits));
   }
 
   union {
     struct {
-      uint32 _type : cTypeBits;
-      uint32 _id : cIdBits;
-      uint32 _data : cDataBits;
+      uint64 _type : cTypeBits;
+      uint64 _id : cIdBits;
+      // the generation of the slot when the handle was created, used to detect stale handles
+      uint64 _generation : cGenerationBits;
+      uint64 _data : cDataBits;
     };
-    uint32 _raw;
+    uint64 _raw;
   };
 public:
-  GraphicsObjectHandle() : _raw(kInvalid) {}
-  bool is_valid() const { return _raw != kInvalid; }
-  operator int() const { return _raw; }
-  uint32 id() const { return _id; }
-  uint32 data() const { return _data; }
+  GraphicsObjectHandle() : _raw(~0ull) {}
+  bool is_valid() const { return _raw != ~0ull; }
+  operator uint64() const { return _raw; }
+  uint32 id() const { return (uint32)_id; }
+  uint32 generation() const { return (uint32)_generation; }
+  uint32 data() const { return (uint32)_data; }
   Type type() const { return (Type)_type; }
 };
 
-static_assert(sizeof(GraphicsObjectHandle) <= sizeof(uint32_t), "GraphicsObjectHandle too large");
-
+static_assert(sizeof(GraphicsObjectHandle) <= sizeof(uint64), "GraphicsObjectHandle too large");
@@ -10,10 +10,13 @@ class Effect;
 #pragma pack(push, 1)
 
 struct MeshGeometry {
-  MeshGeometry() : topology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST) {}
+  MeshGeometry() : start_index(0), base_vertex(0), topology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST) {}
+  // the buffers are shared between meshes, so the geometry is drawn from start_index/base_vertex
   GraphicsObjectHandle vb, ib;
   DXGI_FORMAT index_format;
   int index_count;
+  int start_index;
+  int base_vertex;
   int vertex_size;
   int vertex_count;
   D3D_PRIMITIVE_TOPOLOGY topology;
@@ -81,53 +84,71 @@ struct RenderTargetData {
   GraphicsObjectHandle render_targets[8]; // if there's a depth buffer, it's attached to rt0
   bool clear_target[8];
 };
-/*
+#pragma pack(pop)
+
 // from http://realtimecollisiondetection.net/blog/?p=86
+// The key is sorted as a plain integer, so the fields are packed from most to least
+// significant: pass, command, technique, material, depth
 struct RenderKey {
+  // within a pass, the commands run in this order
   enum Cmd {
-    kSetRenderTarget,
+    kBeginPass,       // callbacks that set up the pass, like binding its render targets
     kRenderMesh,
     kRenderTechnique, // this should probably be changed to "render fullscreen"
-    kRenderBuffers,
-    kRenderText,
-    kSetScissorRect,
-    kReleaseRenderTarget,
-    kGenerateMips,
+    kEndPass,         // callbacks that run after the pass' draws
     kNumCommands
   };
-  static_assert(kNumCommands < (1 << 16), "Too many commands");
+
+  // the technique and material fields hold any handle id, and the depth keeps the top bits
+  // of the float
+  enum {
+    kDepthBits = 18,
+    kMaterialBits = GraphicsObjectHandle::cIdBits,
+    kTechniqueBits = GraphicsObjectHandle::cIdBits,
+    kCmdBits = 2,
+    kPassBits = 4,
+
+    kDepthShift = 0,
+    kMaterialShift = kDepthShift + kDepthBits,
+    kTechniqueShift = kMaterialShift + kMaterialBits,
+    kCmdShift = kTechniqueShift + kTechniqueBits,
+    kPassShift = kCmdShift + kCmdBits,
+  };
+  static_assert(kPassShift + kPassBits == 64, "RenderKey fields don't add up to 64 bits");
+  static_assert(kNumCommands <= (1 << kCmdBits), "Too many commands");
 
   RenderKey() : data(0) {}
-  RenderKey(Cmd cmd) : data(0) {
-    this->cmd = cmd;
-  }
-  RenderKey(Cmd cmd, GraphicsObjectHandle h) : data(0) {
-    this->cmd = cmd;
-    this->handle = h;
+  RenderKey(int pass, Cmd cmd, GraphicsObjectHandle technique, GraphicsObjectHandle material, uint32 depth)
+    : data(
+      field(pass, kPassBits, kPassShift) |
+      field(cmd, kCmdBits, kCmdShift) |
+      field(technique.is_valid() ? technique.id() : 0, kTechniqueBits, kTechniqueShift) |
+      field(material.is_valid() ? material.id() : 0, kMaterialBits, kMaterialShift) |
+      field(depth, kDepthBits, kDepthShift)) {}
+  RenderKey(int pass, Cmd cmd)
+    : data(field(pass, kPassBits, kPassShift) | field(cmd, kCmdBits, kCmdShift)) {}
+
+  int pass() const { return (int)((data >> kPassShift) & ((1 << kPassBits) - 1)); }
+  Cmd cmd() const { return (Cmd)((data >> kCmdShift) & ((1 << kCmdBits) - 1)); }
+
+  // Maps a view space depth to an integer with the same ordering. Positive IEEE floats
+  // sort like their bit patterns, so we just clamp negative values to 0, and keep the
+  // exponent and the top of the mantissa (the sign bit is always 0).
+  static uint32 depth_bits(float depth) {
+    if (!(depth > 0))
+      return 0;
+    union { float f; uint32 u; } v;
+    v.f = depth;
+    return v.u >> (31 - kDepthBits);
   }
 
-  union {
-    // Written for little endianess
-    struct {
-      union {
-        struct {
-          uint32 padding : 6;
-          uint32 material : 16;
-          uint32 shader : 10;
-        };
-        uint32 handle : 32;  // a GraphicsObjectHandle
-      };
-      uint16 cmd;
-      union {
-        uint16 seq_nr;
-        uint16 depth;
-      };
-    };
-    uint64 data;
-  };
+  uint64 data;
+
+private:
+  static uint64 field(uint32 value, int bits, int shift) {
+    KASSERT(bits == 32 || value < (1u << bits));
+    return (uint64)value << shift;
+  }
 };
 
-#pragma pack(pop)
-static_assert(sizeof(RenderKey) <= sizeof(uint64_t), "RenderKey too large");
-*/
-#pragma pack(pop)
+static_assert(sizeof(RenderKey) == sizeof(uint64), "RenderKey too large");
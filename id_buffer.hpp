@@ -1,79 +1,132 @@
 #pragma once
+#include "graphics_object_handle.hpp"
 
 using std::stack;
 using std::vector;
 using std::pair;
 
-class GraphicsObjectHandle;
-
-template<class Traits, int N>
+// Growable table of objects referenced through GraphicsObjectHandles. Released slots are
+// kept on an intrusive free list, so allocating and releasing are both O(1). Every slot has
+// a generation that is bumped when the slot is released, and handles carry the generation
+// of the object they were created for, so using a handle to a released object is caught.
+template<class Traits>
 class IdBufferBase {
 public:
   typedef typename Traits::Value T;
   typedef typename Traits::Elem E;
   typedef std::function<void(T)> Deleter;
 
-  enum { Size = N };
+  enum {
+    MaxSize = 1 << GraphicsObjectHandle::cIdBits,
+    GenerationMask = (1 << GraphicsObjectHandle::cGenerationBits) - 1,
+  };
 
-  IdBufferBase(const Deleter &deleter) : _deleter(deleter) {
-    for (int i = 0; i < Size; ++i)
-      Traits::get(_buffer[i]) = 0;
+  IdBufferBase(const Deleter &deleter) : _deleter(deleter), _free_head(-1), _pending(-1) {
   }
 
   virtual ~IdBufferBase() {
     if (_deleter) {
-      for (int i = 0; i < Size; ++i) {
-        T t = Traits::get(_buffer[i]);
+      for (size_t i = 0; i < _slots.size(); ++i) {
+        T t = Traits::get(_slots[i].elem);
         if (t)
           _deleter(t);
       }
     }
-
-    while (!reclaimed_indices.empty())
-      reclaimed_indices.pop();
   }
 
+  // Returns the index of a free slot. The slot is only taken once a value is stored in it,
+  // so if the caller fails to create its object, the next call returns the same slot.
   int find_free_index() {
-    if (!reclaimed_indices.empty()) {
-      int tmp = reclaimed_indices.top();
-      reclaimed_indices.pop();
-      return tmp;
+    if (_pending != -1 && !Traits::get(_slots[_pending].elem))
+      return _pending;
+
+    if (_free_head != -1) {
+      _pending = _free_head;
+      _free_head = _slots[_pending].next_free;
+      _slots[_pending].next_free = -1;
+      return _pending;
     }
-    for (int i = 0; i < Size; ++i) {
-      if (!Traits::get(_buffer[i]))
-        return i;
+
+    if ((int)_slots.size() == MaxSize) {
+      LOG_ERROR_LN("No free index found!");
+      return -1;
     }
-    LOG_ERROR_LN("No free index found!");
-    return -1;
+
+    // a deque doesn't move the existing slots when growing, so references stay valid
+    _pending = (int)_slots.size();
+    _slots.push_back(Slot());
+    return _pending;
+  }
+
+  // Destroys the object in the slot, and returns the slot to the free list. Any handles
+  // to the object are stale after this. Releasing a slot that's already free does nothing,
+  // as it's on the free list already.
+  void release(int idx) {
+    if (idx < 0 || idx >= (int)_slots.size() || !Traits::get(_slots[idx].elem)) {
+      LOG_WARNING_LN_ONESHOT("Releasing a free slot: %d", idx);
+      return;
+    }
+    T &t = (*this)[idx];
+    if (_deleter)
+      _deleter(t);
+    t = 0;
+
+    Slot &slot = _slots[idx];
+    slot.generation = (slot.generation + 1) & GenerationMask;
+    slot.next_free = _free_head;
+    _free_head = idx;
+    if (_pending == idx)
+      _pending = -1;
   }
 
   T &operator[](int idx) {
-    KASSERT(idx >= 0 && idx < N);
-    return Traits::get(_buffer[idx]);
+    KASSERT(idx >= 0 && idx < (int)_slots.size());
+    return Traits::get(_slots[idx].elem);
   }
 
   const T &operator[](int idx) const {
-    KASSERT(idx >= 0 && idx < N);
-    return Traits::get(_buffer[idx]);
+    KASSERT(idx >= 0 && idx < (int)_slots.size());
+    return Traits::get(_slots[idx].elem);
   }
 
-  void reclaim_index(int idx) {
-    _reclaimed_indices.push(idx);
+  uint32 generation(int idx) const {
+    KASSERT(idx >= 0 && idx < (int)_slots.size());
+    return _slots[idx].generation;
   }
 
-  T get(GraphicsObjectHandle handle) {
-    return Traits::get(_buffer[handle.id()]);
+  bool is_live(GraphicsObjectHandle handle) const {
+    const int idx = handle.id();
+    return handle.is_valid() && idx < (int)_slots.size() &&
+      _slots[idx].generation == handle.generation() && Traits::get(_slots[idx].elem);
   }
 
-  const T get(GraphicsObjectHandle handle) const {
-    return Traits::get(_buffer[handle.id()]);
+  T get(GraphicsObjectHandle handle) const {
+    if (!handle.is_valid() || handle.id() >= (int)_slots.size())
+      return T();
+    const Slot &slot = _slots[handle.id()];
+    if (slot.generation != handle.generation()) {
+      LOG_WARNING_LN_ONESHOT("Stale handle: %d, generation %d instead of %d", handle.id(), handle.generation(), slot.generation);
+      return T();
+    }
+    return Traits::get(slot.elem);
   }
 
+  int size() const { return (int)_slots.size(); }
+
 protected:
+  struct Slot {
+    Slot() : generation(0), next_free(-1) {
+      Traits::get(elem) = 0;
+    }
+    E elem;
+    uint32 generation;
+    int next_free;
+  };
+
   Deleter _deleter;
-  std::array<E, N> _buffer;
-  //E _buffer[N];
-  stack<int> reclaimed_indices;
+  std::deque<Slot> _slots;
+  int _free_head;
+  int _pending;
 };
 
 template<class Key, class Value>
@@ -88,9 +141,17 @@ struct SearchableTraits {
     return kv.first;
   }
 
+  static const Key &get_key(const KeyValuePair &kv) {
+    return kv.first;
+  }
+
   static Value &get(KeyValuePair &kv) {
     return kv.second;
   }
+
+  static const Value &get(const KeyValuePair &kv) {
+    return kv.second;
+  }
 };
 
 template<class T>
@@ -101,57 +162,116 @@ struct SingleTraits {
   static T& get(Elem& t) {
     return t;
   }
+  static const T& get(const Elem& t) {
+    return t;
+  }
 };
 
-template<typename Key, typename Value, int N>
-struct SearchableIdBuffer : public IdBufferBase<SearchableTraits<Key, Value>, N> {
+template<typename Key, typename Value>
+struct SearchableIdBuffer : public IdBufferBase<SearchableTraits<Key, Value> > {
 
   typedef SearchableTraits<Key, Value> Traits;
-  typedef IdBufferBase<Traits, N> Parent;
+  typedef IdBufferBase<Traits> Parent;
 
-  SearchableIdBuffer(const typename Parent::Deleter &fn_deleter) 
+  SearchableIdBuffer(const typename Parent::Deleter &fn_deleter)
     : Parent(fn_deleter)
   {
   }
 
   void set_pair(int idx, const typename Traits::Elem &e) {
-    KASSERT(idx >= 0 && idx < N);
-    _buffer[idx] = e;
-    auto &key = Traits::get_key(_buffer[idx]);
-    _key_to_idx[key] = idx;
-    _idx_to_key[idx] = key;
+    KASSERT(idx >= 0 && idx < (int)_slots.size());
+    _slots[idx].elem = e;
+    add_key(Traits::get_key(_slots[idx].elem), idx, false);
+  }
+
+  // The names aren't removed from the map when a slot is released or renamed. Lookups
+  // check that the slot still holds the object the name was added for, and drop the
+  // stale names as they find them.
+  void release(int idx) {
+    Traits::get_key(_slots[idx].elem) = Key();
+    Parent::release(idx);
+  }
+
+  // gives the object in 'idx' a new name. The old name goes stale
+  void rename(int idx, const typename Traits::Key &key) {
+    KASSERT(idx >= 0 && idx < (int)_slots.size());
+    Traits::get_key(_slots[idx].elem) = key;
+    add_key(key, idx, false);
+  }
+
+  // removes the object's name, without touching the map
+  void clear_key(int idx) {
+    KASSERT(idx >= 0 && idx < (int)_slots.size());
+    Traits::get_key(_slots[idx].elem) = Key();
+  }
+
+  // makes 'key' refer to the object in 'idx' as well as its own name, until it's released
+  void add_alias(const typename Traits::Key &key, int idx) {
+    KASSERT(idx >= 0 && idx < (int)_slots.size());
+    add_key(key, idx, true);
   }
 
   int idx_from_token(const typename Traits::Key &key) {
     auto it = _key_to_idx.find(key);
-    return it == end(_key_to_idx) ? -1 : it->second;
+    if (it == end(_key_to_idx))
+      return -1;
+    if (is_current(it->first, it->second))
+      return it->second.idx;
+    _key_to_idx.erase(it);
+    return -1;
+  }
+
+  // drops all the stale names
+  void remove_stale_keys() {
+    for (auto it = begin(_key_to_idx); it != end(_key_to_idx); )
+      it = is_current(it->first, it->second) ? ++it : _key_to_idx.erase(it);
   }
 
   int find_free_index() {
-    return IdBufferBase<Traits, N>::find_free_index();
+    return Parent::find_free_index();
   }
 
   int find_free_index(const typename Traits::Key &key) {
     auto idx = idx_from_token(key);
-    return idx != -1 ? idx : IdBufferBase<Traits, N>::find_free_index();
+    return idx != -1 ? idx : Parent::find_free_index();
   }
 
   template<typename R>
   R find(const typename Traits::Key &key, R def) {
     int idx = idx_from_token(key);
-    return idx == -1 ? def : Traits::get(_buffer[idx]);
+    return idx == -1 ? def : Traits::get(_slots[idx].elem);
+  }
+
+  int num_keys() const { return (int)_key_to_idx.size(); }
+
+private:
+  struct KeyEntry {
+    int idx;
+    uint32 generation;
+    bool alias;
+  };
+
+  void add_key(const typename Traits::Key &key, int idx, bool alias) {
+    KeyEntry e = { idx, _slots[idx].generation, alias };
+    _key_to_idx[key] = e;
+  }
+
+  // an alias lives as long as the object, and a name as long as the object has it
+  bool is_current(const typename Traits::Key &key, const KeyEntry &e) const {
+    const Slot &slot = _slots[e.idx];
+    return slot.generation == e.generation && Traits::get(slot.elem) &&
+      (e.alias || Traits::get_key(slot.elem) == key);
   }
 
-  std::map<typename Traits::Key, int> _key_to_idx;
-  std::map<int, typename Traits::Key> _idx_to_key;
+  std::unordered_map<typename Traits::Key, KeyEntry> _key_to_idx;
 };
 
-template<typename T, int N>
-struct IdBuffer : IdBufferBase<SingleTraits<T>, N> {
+template<typename T>
+struct IdBuffer : IdBufferBase<SingleTraits<T> > {
   typedef SingleTraits<T> Traits;
-  typedef IdBufferBase<Traits, N> Parent;
+  typedef IdBufferBase<Traits> Parent;
 
-  IdBuffer(const typename Parent::Deleter &fn_deleter) 
+  IdBuffer(const typename Parent::Deleter &fn_deleter)
     : Parent(fn_deleter)
   {
   }
@@ -34,7 +34,7 @@ int CALLBACK WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR cmd_line
   if (!global_init())
     return 1;
 
-  if (!APP.init(instance))
+  if (!APP.init(instance, cmd_line))
     return 1;
 
   int res = APP.run(NULL);
@@ -16,6 +16,9 @@ using namespace std;
 
 #define FILE_VERSION 13
 
+// meshes with more triangles than this are too expensive to rasterize as occluders
+static const int kMaxOccluderTriangles = 1024;
+
 #pragma pack(push, 1)
 namespace BlockId {
   enum Enum {
@@ -163,6 +166,10 @@ bool KumiLoader::load_meshes(const char *buf, Scene *scene) {
   BlockHeader *header = (BlockHeader *)buf;
   buf += sizeof(BlockHeader);
 
+  _num_batch_buffers = 0;
+  int num_submeshes = 0;
+  int num_occluders = 0;
+
   const int mesh_count = read_and_advance<int>(&buf);
   for (int i = 0; i < mesh_count; ++i) {
 
@@ -178,6 +185,7 @@ bool KumiLoader::load_meshes(const char *buf, Scene *scene) {
 
     scene->meshes.push_back(mesh);
     const int sub_meshes = read_and_advance<int>(&buf);
+    int mesh_triangles = 0;
 
     for (int j = 0; j < sub_meshes; ++j) {
       SubMesh *submesh = new SubMesh(mesh);
@@ -214,8 +222,6 @@ bool KumiLoader::load_meshes(const char *buf, Scene *scene) {
       decompress_vb(mesh, &vb_reader, num_verts, vertex_size, vb_flags, &decompressed_vb);
 
       submesh->_geometry.vertex_count = num_verts;
-      submesh->_geometry.vb = GFX_create_buffer(D3D11_BIND_VERTEX_BUFFER, decompressed_vb.size(), false, decompressed_vb.data(), vertex_size);
-
 
       const int *ib = read_and_advance<const int*>(&buf);
       const int ib_size = *ib;
@@ -224,10 +230,129 @@ bool KumiLoader::load_meshes(const char *buf, Scene *scene) {
       decompress_ib(&ib_reader, num_indices, index_size, &decompressed_ib);
 
       submesh->_geometry.index_count = num_indices;
-      submesh->_geometry.ib = GFX_create_buffer(D3D11_BIND_INDEX_BUFFER, decompressed_ib.size(), false, decompressed_ib.data(), fmt);
+
+      if (!add_geometry(&submesh->_geometry, decompressed_vb, decompressed_ib)) {
+        _geometry_batches.clear();
+        return false;
+      }
+      ++num_submeshes;
+#if WITH_SOFTWARE_RASTERIZER
+      add_cpu_geometry(submesh, decompressed_vb, vertex_size, vb_flags, decompressed_ib, index_size);
+#endif
+
+      mesh_triangles += num_indices / 3;
+      if (mesh_triangles <= kMaxOccluderTriangles)
+        add_occluder_geometry(mesh, decompressed_vb, vertex_size, decompressed_ib, index_size);
     }
+
+    if (mesh_triangles > kMaxOccluderTriangles) {
+      vector<XMFLOAT3>().swap(mesh->_occluder_verts);
+      vector<int>().swap(mesh->_occluder_indices);
+    } else if (mesh_triangles > 0) {
+      ++num_occluders;
+    }
+  }
+
+  // the batches are cleared on failure too, so the next load starts from scratch
+  bool res = true;
+  for (size_t i = 0; i < _geometry_batches.size() && res; ++i)
+    res = create_batch_buffers(&_geometry_batches[i]);
+  _geometry_batches.clear();
+  if (!res)
+    return false;
+
+  LOG_INFO_LN("Packed the geometry of %d submeshes into %d shared vertex/index buffer pairs", num_submeshes, _num_batch_buffers);
+  LOG_INFO_LN("%d meshes are simple enough to be occluders", num_occluders);
+  return true;
+}
+
+void KumiLoader::add_occluder_geometry(Mesh *mesh, const vector<char> &vertices, int vertex_size, const vector<char> &indices, int index_size) {
+  // the position is the first element of every vertex
+  const int base = (int)mesh->_occluder_verts.size();
+  const int num_verts = (int)vertices.size() / vertex_size;
+  for (int i = 0; i < num_verts; ++i)
+    mesh->_occluder_verts.push_back(*(const XMFLOAT3 *)&vertices[i * vertex_size]);
+
+  const int num_indices = (int)indices.size() / index_size;
+  for (int i = 0; i < num_indices; ++i) {
+    const int idx = index_size == 2 ? ((const uint16 *)indices.data())[i] : ((const uint32 *)indices.data())[i];
+    mesh->_occluder_indices.push_back(base + idx);
+  }
+}
+
+void KumiLoader::add_cpu_geometry(SubMesh *submesh, const vector<char> &vertices, int vertex_size, int vb_flags, const vector<char> &indices, int index_size) {
+  // the vertices are a position and a normal, followed by the texture coordinates
+  const int num_verts = (int)vertices.size() / vertex_size;
+  submesh->_cpu_verts.resize(num_verts);
+  if (vb_flags & kTex0)
+    submesh->_cpu_uvs.resize(num_verts);
+  for (int i = 0; i < num_verts; ++i) {
+    const char *v = &vertices[i * vertex_size];
+    submesh->_cpu_verts[i] = *(const XMFLOAT3 *)v;
+    if (vb_flags & kTex0)
+      submesh->_cpu_uvs[i] = *(const XMFLOAT2 *)(v + 2 * sizeof(XMFLOAT3));
+  }
+
+  const int num_indices = (int)indices.size() / index_size;
+  submesh->_cpu_indices.resize(num_indices);
+  for (int i = 0; i < num_indices; ++i)
+    submesh->_cpu_indices[i] = index_size == 2 ? ((const uint16 *)indices.data())[i] : ((const uint32 *)indices.data())[i];
+}
+
+bool KumiLoader::add_geometry(MeshGeometry *geometry, const vector<char> &vertices, const vector<char> &indices) {
+  // keeps the individual buffers below the size where allocating them might fail
+  const size_t cMaxBatchSize = 32 * 1024 * 1024;
+
+  GeometryBatch *batch = nullptr;
+  for (size_t i = 0; i < _geometry_batches.size(); ++i) {
+    GeometryBatch *cur = &_geometry_batches[i];
+    if (cur->vertex_size == geometry->vertex_size && cur->index_format == geometry->index_format) {
+      batch = cur;
+      break;
+    }
+  }
+
+  if (!batch) {
+    _geometry_batches.push_back(GeometryBatch());
+    batch = &_geometry_batches.back();
+    batch->vertex_size = geometry->vertex_size;
+    batch->index_format = geometry->index_format;
+  } else if (batch->vertices.size() + vertices.size() > cMaxBatchSize || batch->indices.size() + indices.size() > cMaxBatchSize) {
+    if (!create_batch_buffers(batch))
+      return false;
+  }
+
+  // the indices are relative to the mesh's first vertex, so they're kept as is, and drawn with a base vertex
+  const int index_size = geometry->index_format == DXGI_FORMAT_R16_UINT ? 2 : 4;
+  geometry->base_vertex = (int)(batch->vertices.size() / geometry->vertex_size);
+  geometry->start_index = (int)(batch->indices.size() / index_size);
+  batch->vertices.insert(batch->vertices.end(), vertices.begin(), vertices.end());
+  batch->indices.insert(batch->indices.end(), indices.begin(), indices.end());
+  batch->users.push_back(geometry);
+  return true;
+}
+
+bool KumiLoader::create_batch_buffers(GeometryBatch *batch) {
+  if (batch->users.empty())
+    return true;
+
+  auto vb = GFX_create_buffer(D3D11_BIND_VERTEX_BUFFER, (int)batch->vertices.size(), false, batch->vertices.data(), batch->vertex_size);
+  auto ib = GFX_create_buffer(D3D11_BIND_INDEX_BUFFER, (int)batch->indices.size(), false, batch->indices.data(), batch->index_format);
+  if (!vb.is_valid() || !ib.is_valid()) {
+    LOG_ERROR_LN("Unable to create the buffers for a batch of %d meshes (%d bytes of vertices, %d bytes of indices)",
+      (int)batch->users.size(), (int)batch->vertices.size(), (int)batch->indices.size());
+    return false;
+  }
+
+  for (size_t i = 0; i < batch->users.size(); ++i) {
+    batch->users[i]->vb = vb;
+    batch->users[i]->ib = ib;
   }
 
+  ++_num_batch_buffers;
+  batch->vertices.clear();
+  batch->indices.clear();
+  batch->users.clear();
   return true;
 }
 
@@ -2,8 +2,10 @@
 
 #include "graphics_object_handle.hpp"
 #include "path_utils.hpp"
+#include "graphics_submit.hpp"
 
 class Mesh;
+class SubMesh;
 struct Scene;
 struct ResourceInterface;
 class BitReader;
@@ -45,6 +47,24 @@ private:
   void decompress_ib(BitReader *reader, int num_indices, int index_size, std::vector<char> *out);
   void decompress_vb(Mesh *mesh, BitReader *reader, int num_verts, int vertex_size, int vb_flags, std::vector<char> *out);
 
+  // Static geometry is packed into shared buffers per vertex size and index format, so
+  // consecutive draws of meshes that share a batch don't need to rebind the buffers
+  struct GeometryBatch {
+    GeometryBatch() : vertex_size(0), index_format(DXGI_FORMAT_UNKNOWN) {}
+    int vertex_size;
+    DXGI_FORMAT index_format;
+    std::vector<char> vertices;
+    std::vector<char> indices;
+    std::vector<MeshGeometry *> users;
+  };
+  bool add_geometry(MeshGeometry *geometry, const std::vector<char> &vertices, const std::vector<char> &indices);
+  bool create_batch_buffers(GeometryBatch *batch);
+  std::vector<GeometryBatch> _geometry_batches;
+  int _num_batch_buffers;
+
+  void add_occluder_geometry(Mesh *mesh, const std::vector<char> &vertices, int vertex_size, const std::vector<char> &indices, int index_size);
+  void add_cpu_geometry(SubMesh *submesh, const std::vector<char> &vertices, int vertex_size, int vb_flags, const std::vector<char> &indices, int index_size);
+
   MainHeader _header;
   std::map<std::string, std::pair<std::string, std::string> > _material_overrides;
   std::string _filename;
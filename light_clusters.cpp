@@ -0,0 +1,192 @@
+#include "stdafx.h"
+#include "light_clusters.hpp"
+#include "logger.hpp"
+#include <float.h>
+
+using namespace std;
+
+LightClusters::LightClusters()
+  : _scale_x(1)
+  , _scale_y(1)
+  , _near(1)
+  , _far(1000)
+  , _num_lights(0)
+  , _clusters(kNumClusters)
+  , _num_used_lights(0)
+  , _slices(kSlicesZ)
+{
+}
+
+void LightClusters::set_projection(const XMFLOAT4X4 &proj) {
+  // the 3rd row is (0, 0, f/(f-n), -n*f/(f-n))
+  _scale_x = proj.m[0][0];
+  _scale_y = proj.m[1][1];
+  const float a = proj.m[2][2], b = proj.m[2][3];
+  _near = -b / a;
+  _far = a * _near / (a - 1);
+}
+
+float LightClusters::slice_near(int slice) const {
+  return _near * powf(_far / _near, (float)slice / kSlicesZ);
+}
+
+int LightClusters::slice_for_depth(float z) const {
+  if (z <= _near)
+    return 0;
+  const int slice = (int)(logf(z / _near) / logf(_far / _near) * kSlicesZ);
+  return min((int)kSlicesZ - 1, slice);
+}
+
+void LightClusters::build(const XMFLOAT4 *lights, int count, bool parallel) {
+
+  // the light lists are 16 bit
+  if (count > kMaxLights)
+    LOG_WARNING_LN_ONESHOT("%d lights, only the first %d are binned", count, (int)kMaxLights);
+  _num_lights = min((int)kMaxLights, count);
+  const int padded = (_num_lights + 3) & ~3;
+  _light_x.resize(padded);
+  _light_y.resize(padded);
+  _light_z.resize(padded);
+  _light_r.resize(padded);
+  for (int i = 0; i < padded; ++i) {
+    // the padding lights are behind the camera, with no radius, so they never touch a cluster
+    const XMFLOAT4 &l = i < _num_lights ? lights[i] : XMFLOAT4(0, 0, -FLT_MAX, 0);
+    _light_x[i] = l.x;
+    _light_y[i] = l.y;
+    _light_z[i] = l.z;
+    _light_r[i] = l.w;
+  }
+
+  if (parallel) {
+    Concurrency::parallel_for(0, (int)kSlicesZ, [&](int slice) { build_slice(slice); });
+  } else {
+    for (int i = 0; i < kSlicesZ; ++i)
+      build_slice(i);
+  }
+
+  // the slices have offsets relative to their own index lists
+  size_t total = 0;
+  for (int i = 0; i < kSlicesZ; ++i)
+    total += _slices[i].indices.size();
+  _indices.resize(total);
+
+  _light_used.assign(_num_lights, 0);
+  uint32 base = 0;
+  for (int i = 0; i < kSlicesZ; ++i) {
+    const vector<uint16> &slice_indices = _slices[i].indices;
+    for (int j = 0; j < kTilesX * kTilesY; ++j)
+      _clusters[i * kTilesX * kTilesY + j].offset += base;
+    for (size_t j = 0; j < slice_indices.size(); ++j)
+      _light_used[slice_indices[j]] = 1;
+    if (!slice_indices.empty())
+      memcpy(&_indices[base], slice_indices.data(), slice_indices.size() * sizeof(uint16));
+    base += (uint32)slice_indices.size();
+  }
+
+  _num_used_lights = 0;
+  for (int i = 0; i < _num_lights; ++i)
+    _num_used_lights += _light_used[i];
+}
+
+void LightClusters::build_slice(int slice) {
+  SliceData &data = _slices[slice];
+  data.indices.clear();
+  data.candidates.clear();
+
+  const float z0 = slice_near(slice);
+  const float z1 = slice_near(slice + 1);
+
+  // find the lights whose depth range overlaps the slice
+  const __m128 slice_z0 = _mm_set1_ps(z0);
+  const __m128 slice_z1 = _mm_set1_ps(z1);
+  for (int i = 0; i < _num_lights; i += 4) {
+    const __m128 z = _mm_loadu_ps(&_light_z[i]);
+    const __m128 r = _mm_loadu_ps(&_light_r[i]);
+    int mask = _mm_movemask_ps(_mm_and_ps(
+      _mm_cmple_ps(_mm_sub_ps(z, r), slice_z1),
+      _mm_cmpge_ps(_mm_add_ps(z, r), slice_z0)));
+    while (mask) {
+      unsigned long bit;
+      _BitScanForward(&bit, mask);
+      data.candidates.push_back((uint16)(i + bit));
+      mask &= mask - 1;
+    }
+  }
+
+  // gather the candidates, so they can be tested four at a time
+  const int num_candidates = (int)data.candidates.size();
+  const int padded = (num_candidates + 3) & ~3;
+  data.x.resize(padded);
+  data.y.resize(padded);
+  data.z.resize(padded);
+  data.r.resize(padded);
+  data.row.resize(padded);
+  for (int i = 0; i < padded; ++i) {
+    const int idx = i < num_candidates ? data.candidates[i] : 0;
+    data.x[i] = i < num_candidates ? _light_x[idx] : 0;
+    data.y[i] = i < num_candidates ? _light_y[idx] : 0;
+    data.z[i] = i < num_candidates ? _light_z[idx] : -FLT_MAX;
+    data.r[i] = i < num_candidates ? _light_r[idx] : 0;
+  }
+
+  const __m128 zero = _mm_setzero_ps();
+  const float tile_w = 2.0f / kTilesX;
+  const float tile_h = 2.0f / kTilesY;
+
+  for (int ty = 0; ty < kTilesY; ++ty) {
+    // view space y is ndc * z / scale, so the tile's extremes are at the near or far depth
+    const float ndc_y1 = 1 - ty * tile_h;
+    const float ndc_y0 = ndc_y1 - tile_h;
+    const __m128 bmin_y = _mm_set1_ps(min(ndc_y0 * z0, ndc_y0 * z1) / _scale_y);
+    const __m128 bmax_y = _mm_set1_ps(max(ndc_y1 * z0, ndc_y1 * z1) / _scale_y);
+
+    // the y and z distances are the same for the whole row, so only the x distance is left
+    // for the tiles. The row keeps the candidates that are close enough, with their
+    // remaining squared radius
+    int num_row = 0;
+    for (int i = 0; i < num_candidates; i += 4) {
+      const __m128 y = _mm_loadu_ps(&data.y[i]);
+      const __m128 z = _mm_loadu_ps(&data.z[i]);
+      const __m128 r = _mm_loadu_ps(&data.r[i]);
+      const __m128 dy = _mm_max_ps(zero, _mm_max_ps(_mm_sub_ps(bmin_y, y), _mm_sub_ps(y, bmax_y)));
+      const __m128 dz = _mm_max_ps(zero, _mm_max_ps(_mm_sub_ps(slice_z0, z), _mm_sub_ps(z, slice_z1)));
+      const __m128 left = _mm_sub_ps(_mm_mul_ps(r, r), _mm_add_ps(_mm_mul_ps(dy, dy), _mm_mul_ps(dz, dz)));
+
+      int mask = _mm_movemask_ps(_mm_cmpge_ps(left, zero));
+      if (i + 4 > num_candidates)
+        mask &= (1 << (num_candidates - i)) - 1;
+      if (!mask)
+        continue;
+
+      float x[4], r2[4];
+      _mm_storeu_ps(x, _mm_loadu_ps(&data.x[i]));
+      _mm_storeu_ps(r2, left);
+      while (mask) {
+        unsigned long bit;
+        _BitScanForward(&bit, mask);
+        data.row[num_row].x = x[bit];
+        data.row[num_row].r2 = r2[bit];
+        data.row[num_row].idx = data.candidates[i + bit];
+        ++num_row;
+        mask &= mask - 1;
+      }
+    }
+
+    for (int tx = 0; tx < kTilesX; ++tx) {
+      const float ndc_x0 = -1 + tx * tile_w;
+      const float ndc_x1 = ndc_x0 + tile_w;
+      const float min_x = min(ndc_x0 * z0, ndc_x0 * z1) / _scale_x;
+      const float max_x = max(ndc_x1 * z0, ndc_x1 * z1) / _scale_x;
+
+      Cluster &cluster = _clusters[cluster_index(tx, ty, slice)];
+      cluster.offset = (uint32)data.indices.size();
+      for (int i = 0; i < num_row; ++i) {
+        const RowLight &l = data.row[i];
+        const float dx = max(0.0f, max(min_x - l.x, l.x - max_x));
+        if (dx * dx <= l.r2)
+          data.indices.push_back(l.idx);
+      }
+      cluster.count = (uint32)data.indices.size() - cluster.offset;
+    }
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+// Assigns point lights to a grid of view space clusters (screen tiles, split into slices
+// that get exponentially deeper), and keeps a compact list of light indices per cluster, so
+// the shading only has to consider the lights that can reach a pixel's cluster. Every
+// slice is built independently, so they're built in parallel, and the lights are tested
+// four at a time with SSE.
+class LightClusters {
+public:
+  enum {
+    kTilesX = 16,
+    kTilesY = 9,
+    kSlicesZ = 24,
+    kNumClusters = kTilesX * kTilesY * kSlicesZ,
+    kMaxLights = 65535,
+  };
+
+  struct Cluster {
+    uint32 offset;
+    uint32 count;
+  };
+
+  LightClusters();
+
+  // 'proj' is a transposed left handed perspective matrix, like System::proj
+  void set_projection(const XMFLOAT4X4 &proj);
+  // the lights are view space positions, with the radius in w. Only the first kMaxLights
+  // lights are binned, and a warning is logged if there are more
+  void build(const XMFLOAT4 *lights, int count, bool parallel);
+
+  // tile rows go from the top of the screen, and slices from the near plane
+  static int cluster_index(int x, int y, int z) { return (z * kTilesY + y) * kTilesX + x; }
+  int slice_for_depth(float z) const;
+  float near_plane() const { return _near; }
+  float far_plane() const { return _far; }
+  const Cluster &cluster(int idx) const { return _clusters[idx]; }
+  const std::vector<uint16> &indices() const { return _indices; }
+
+  // if the light is in any of the clusters
+  bool light_used(int idx) const { return idx < (int)_light_used.size() && _light_used[idx] != 0; }
+  int num_used_lights() const { return _num_used_lights; }
+
+private:
+  float slice_near(int slice) const;
+  void build_slice(int slice);
+
+  float _scale_x, _scale_y;
+  float _near, _far;
+
+  int _num_lights;
+  // the lights as a structure of arrays, padded to a multiple of 4
+  std::vector<float> _light_x, _light_y, _light_z, _light_r;
+
+  std::vector<Cluster> _clusters;
+  std::vector<uint16> _indices;
+  std::vector<uint8> _light_used;
+  int _num_used_lights;
+
+  // a light that reaches a row of clusters, with what's left of its squared radius after
+  // the row's y and z distance
+  struct RowLight {
+    float x;
+    float r2;
+    uint16 idx;
+  };
+
+  // the indices for each slice are collected separately, and then concatenated
+  struct SliceData {
+    std::vector<uint16> indices;
+    std::vector<uint16> candidates;
+    std::vector<float> x, y, z, r;
+    std::vector<RowLight> row;
+  };
+  std::vector<SliceData> _slices;
+};
@@ -18,7 +18,7 @@ private:
   MaterialManager();
   static MaterialManager *_instance;
 
-  SearchableIdBuffer<std::string, Material *, 1024> _materials;
+  SearchableIdBuffer<std::string, Material *> _materials;
 
 };
 
@@ -10,7 +10,6 @@
 SubMesh::SubMesh(Mesh *mesh) 
   : _mesh(mesh)
 {
-  //_render_key.cmd = RenderKey::kRenderMesh;
 }
 
 SubMesh::~SubMesh() {
@@ -138,7 +137,7 @@ void Mesh::render(DeferredContext *ctx, GraphicsObjectHandle technique_handle) {
       }
     }
 
-    ctx->draw_indexed(geometry->index_count, 0, 0);
+    ctx->draw_indexed(geometry->index_count, geometry->start_index, geometry->base_vertex);
 
     if (has_resources)
       ctx->unset_shader_resource(0, MAX_TEXTURES, ShaderType::kPixelShader);
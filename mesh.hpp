@@ -15,7 +15,6 @@ public:
   ~SubMesh();
   void update();
   void fill_renderdata(MeshRenderData *render_data) const;
-  //RenderKey render_key() const { return _render_key; }
 
   const std::string &name() const { return _name; }
   GraphicsObjectHandle material_id() const { return _material_id; }
@@ -23,6 +22,12 @@ public:
   const MeshGeometry *geometry() const { return &_geometry; }
   Mesh *mesh() { return _mesh; }
 
+  // object space geometry for the software rasterizer. Only kept with WITH_SOFTWARE_RASTERIZER,
+  // and the texture coordinates are empty if the vertices don't have any
+  const std::vector<XMFLOAT3> &cpu_verts() const { return _cpu_verts; }
+  const std::vector<XMFLOAT2> &cpu_uvs() const { return _cpu_uvs; }
+  const std::vector<int> &cpu_indices() const { return _cpu_indices; }
+
 private:
 
   std::vector<CBufferVariable> cbuffer_vars;
@@ -30,9 +35,12 @@ private:
 
   std::string _name;
   Mesh *_mesh;
-  //RenderKey _render_key;
   GraphicsObjectHandle _material_id;
   MeshGeometry _geometry;
+
+  std::vector<XMFLOAT3> _cpu_verts;
+  std::vector<XMFLOAT2> _cpu_uvs;
+  std::vector<int> _cpu_indices;
 };
 
 class Mesh {
@@ -45,7 +53,15 @@ public:
 
   void fill_cbuffer(CBuffer *cbuffer) const;
   PropertyId anim_id() const { return _anim_id; }
+  const XMFLOAT3 &center() const { return _center; }
+  const XMFLOAT3 &extents() const { return _extents; }
+  const XMFLOAT4X4 &obj_to_world() const { return _obj_to_world; }
   const std::string &name() const { return _name; }
+  bool is_static() const { return _is_static; }
+
+  // object space triangles, kept on the cpu for meshes that are simple enough to be occluders
+  const std::vector<XMFLOAT3> &occluder_verts() const { return _occluder_verts; }
+  const std::vector<int> &occluder_indices() const { return _occluder_indices; }
 
   const std::vector<SubMesh *> &submeshes() const { return _submeshes; }
 
@@ -60,6 +76,8 @@ private:
   std::vector<SubMesh *> _submeshes;
 
   XMFLOAT3 _center, _extents;
+  std::vector<XMFLOAT3> _occluder_verts;
+  std::vector<int> _occluder_indices;
 
   bool _is_static;
   PropertyId _anim_id;
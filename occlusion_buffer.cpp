@@ -0,0 +1,214 @@
+#include "stdafx.h"
+#include "occlusion_buffer.hpp"
+#include <float.h>
+
+using namespace std;
+
+namespace {
+  // boxes are only occluded if they're behind the occluders by at least this much, so
+  // geometry that's coplanar with an occluder isn't culled by rounding errors
+  const float kDepthBias = 1e-5f;
+
+  XMFLOAT4 transform(const XMFLOAT4X4 &m, float x, float y, float z) {
+    return XMFLOAT4(
+      m.m[0][0] * x + m.m[0][1] * y + m.m[0][2] * z + m.m[0][3],
+      m.m[1][0] * x + m.m[1][1] * y + m.m[1][2] * z + m.m[1][3],
+      m.m[2][0] * x + m.m[2][1] * y + m.m[2][2] * z + m.m[2][3],
+      m.m[3][0] * x + m.m[3][1] * y + m.m[3][2] * z + m.m[3][3]);
+  }
+
+  // only points in front of the near plane are projected. Clipping the occluders would
+  // only give more occlusion, so triangles that cross it are dropped instead
+  bool in_front(const XMFLOAT4 &p) {
+    return p.w > 0 && p.z >= 0;
+  }
+
+  void to_screen(const XMFLOAT4 &p, float *x, float *y, float *z) {
+    const float inv_w = 1 / p.w;
+    *x = (0.5f + 0.5f * p.x * inv_w) * OcclusionBuffer::kWidth;
+    *y = (0.5f - 0.5f * p.y * inv_w) * OcclusionBuffer::kHeight;
+    *z = p.z * inv_w;
+  }
+
+  // rounds a screen coordinate, clamped to [-1, size] so points close to the camera plane
+  // don't overflow the conversion
+  int floor_px(float v, int size) {
+    return (int)floorf(min(max(v, -1.0f), (float)size));
+  }
+
+  int ceil_px(float v, int size) {
+    return (int)ceilf(min(max(v, -1.0f), (float)size));
+  }
+}
+
+OcclusionBuffer::OcclusionBuffer() : _depth(kWidth * kHeight, 1.0f) {
+  memset(&_view_proj, 0, sizeof(_view_proj));
+}
+
+void OcclusionBuffer::begin_frame(const XMFLOAT4X4 &view_proj) {
+  _view_proj = view_proj;
+  _triangles.clear();
+  for (int i = 0; i < kNumTiles; ++i)
+    _bins[i].clear();
+  fill(_depth.begin(), _depth.end(), 1.0f);
+}
+
+void OcclusionBuffer::add_occluder(const XMFLOAT4X4 &obj_to_world, const XMFLOAT3 *verts, int num_verts, const int *indices, int num_indices) {
+
+  // the view-projection and world matrices are both transposed, so obj_to_clip = vp * w
+  XMFLOAT4X4 m;
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      m.m[i][j] = _view_proj.m[i][0] * obj_to_world.m[0][j] + _view_proj.m[i][1] * obj_to_world.m[1][j] +
+        _view_proj.m[i][2] * obj_to_world.m[2][j] + _view_proj.m[i][3] * obj_to_world.m[3][j];
+    }
+  }
+
+  _clip_verts.resize(num_verts);
+  for (int i = 0; i < num_verts; ++i)
+    _clip_verts[i] = transform(m, verts[i].x, verts[i].y, verts[i].z);
+
+  for (int i = 0; i + 2 < num_indices; i += 3) {
+    const XMFLOAT4 &p0 = _clip_verts[indices[i+0]];
+    const XMFLOAT4 &p1 = _clip_verts[indices[i+1]];
+    const XMFLOAT4 &p2 = _clip_verts[indices[i+2]];
+    if (!in_front(p0) || !in_front(p1) || !in_front(p2))
+      continue;
+
+    float x[3], y[3], z[3];
+    to_screen(p0, &x[0], &y[0], &z[0]);
+    to_screen(p1, &x[1], &y[1], &z[1]);
+    to_screen(p2, &x[2], &y[2], &z[2]);
+
+    // both windings are rasterized, so flip the clockwise ones
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area == 0)
+      continue;
+    if (area < 0) {
+      swap(x[1], x[2]);
+      swap(y[1], y[2]);
+      swap(z[1], z[2]);
+      area = -area;
+    }
+
+    Triangle tri;
+    tri.min_x = max(0, floor_px(min(x[0], min(x[1], x[2])), kWidth));
+    tri.min_y = max(0, floor_px(min(y[0], min(y[1], y[2])), kHeight));
+    tri.max_x = min(kWidth - 1, ceil_px(max(x[0], max(x[1], x[2])), kWidth));
+    tri.max_y = min(kHeight - 1, ceil_px(max(y[0], max(y[1], y[2])), kHeight));
+    if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+      continue;
+
+    for (int j = 0; j < 3; ++j) {
+      const int k = (j + 1) % 3;
+      tri.a[j] = y[j] - y[k];
+      tri.b[j] = x[k] - x[j];
+      tri.c[j] = x[j] * y[k] - x[k] * y[j];
+    }
+
+    tri.dzdx = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+    tri.dzdy = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+    tri.z0 = z[0] - tri.dzdx * x[0] - tri.dzdy * y[0];
+
+    const int idx = (int)_triangles.size();
+    _triangles.push_back(tri);
+    for (int ty = tri.min_y / kTileHeight; ty <= tri.max_y / kTileHeight; ++ty) {
+      for (int tx = tri.min_x / kTileWidth; tx <= tri.max_x / kTileWidth; ++tx)
+        _bins[ty * kTilesX + tx].push_back(idx);
+    }
+  }
+}
+
+void OcclusionBuffer::rasterize(bool parallel) {
+  // every tile is only touched by its own task, so they don't need any synchronization
+  if (parallel) {
+    Concurrency::parallel_for(0, (int)kNumTiles, [&](int tile) { rasterize_tile(tile); });
+  } else {
+    for (int i = 0; i < kNumTiles; ++i)
+      rasterize_tile(i);
+  }
+}
+
+void OcclusionBuffer::rasterize_tile(int tile) {
+  const int tile_x0 = (tile % kTilesX) * kTileWidth;
+  const int tile_y0 = (tile / kTilesX) * kTileHeight;
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+  const __m128 four = _mm_set1_ps(4);
+
+  const vector<int> &bin = _bins[tile];
+  for (size_t i = 0; i < bin.size(); ++i) {
+    const Triangle &tri = _triangles[bin[i]];
+    // the tiles start on a multiple of 4, so aligning the start keeps the quads inside it
+    const int x0 = max(tile_x0, tri.min_x) & ~3;
+    const int x1 = min(tile_x0 + kTileWidth - 1, tri.max_x);
+    const int y0 = max(tile_y0, tri.min_y);
+    const int y1 = min(tile_y0 + kTileHeight - 1, tri.max_y);
+
+    const __m128 a0 = _mm_set1_ps(tri.a[0]), a1 = _mm_set1_ps(tri.a[1]), a2 = _mm_set1_ps(tri.a[2]);
+    const __m128 step0 = _mm_mul_ps(a0, four), step1 = _mm_mul_ps(a1, four), step2 = _mm_mul_ps(a2, four);
+    const __m128 dzdx = _mm_set1_ps(tri.dzdx);
+    const __m128 step_z = _mm_mul_ps(dzdx, four);
+    const __m128 px = _mm_add_ps(_mm_set1_ps((float)x0), offsets);
+
+    for (int y = y0; y <= y1; ++y) {
+      // evaluate the edge functions and depth at the pixel centers of the first quad, and step from there
+      const float py = y + 0.5f;
+      __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), _mm_set1_ps(tri.b[0] * py + tri.c[0]));
+      __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), _mm_set1_ps(tri.b[1] * py + tri.c[1]));
+      __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), _mm_set1_ps(tri.b[2] * py + tri.c[2]));
+      __m128 z = _mm_add_ps(_mm_mul_ps(dzdx, px), _mm_set1_ps(tri.z0 + tri.dzdy * py));
+
+      float *row = &_depth[y * kWidth];
+      for (int x = x0; x <= x1; x += 4) {
+        const __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+        if (_mm_movemask_ps(inside)) {
+          const __m128 old_depth = _mm_loadu_ps(row + x);
+          const __m128 new_depth = _mm_min_ps(old_depth, z);
+          _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, new_depth), _mm_andnot_ps(inside, old_depth)));
+        }
+        e0 = _mm_add_ps(e0, step0);
+        e1 = _mm_add_ps(e1, step1);
+        e2 = _mm_add_ps(e2, step2);
+        z = _mm_add_ps(z, step_z);
+      }
+    }
+  }
+}
+
+bool OcclusionBuffer::is_occluded(const XMFLOAT3 &center, const XMFLOAT3 &extents) const {
+
+  // project the corners, and test the closest depth against the screen rect they cover
+  float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX, min_z = FLT_MAX;
+  for (int i = 0; i < 8; ++i) {
+    const XMFLOAT4 p = transform(_view_proj,
+      center.x + (i & 1 ? extents.x : -extents.x),
+      center.y + (i & 2 ? extents.y : -extents.y),
+      center.z + (i & 4 ? extents.z : -extents.z));
+    if (!in_front(p))
+      return false;
+    float x, y, z;
+    to_screen(p, &x, &y, &z);
+    min_x = min(min_x, x); max_x = max(max_x, x);
+    min_y = min(min_y, y); max_y = max(max_y, y);
+    min_z = min(min_z, z);
+  }
+
+  const int x0 = max(0, floor_px(min_x, kWidth)) & ~3;
+  const int y0 = max(0, floor_px(min_y, kHeight));
+  const int x1 = min(kWidth - 1, ceil_px(max_x, kWidth));
+  const int y1 = min(kHeight - 1, ceil_px(max_y, kHeight));
+  if (x0 > x1 || y0 > y1)
+    return false;
+
+  // the box is visible if any of the pixels is further away than its closest point
+  const __m128 box_depth = _mm_set1_ps(min_z - kDepthBias);
+  for (int y = y0; y <= y1; ++y) {
+    const float *row = &_depth[y * kWidth];
+    for (int x = x0; x <= x1; x += 4) {
+      if (_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(row + x), box_depth)))
+        return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// Low resolution depth buffer that occluders are rasterized into on the cpu, so bounding
+// boxes can be tested against it before anything is submitted. The triangles are binned
+// per tile, and the tiles are rasterized in parallel, four pixels at a time with SSE.
+// Depth is z/w, with 0 at the near plane.
+class OcclusionBuffer {
+public:
+  enum {
+    kWidth = 320,
+    kHeight = 180,
+    kTileWidth = 64,
+    kTileHeight = 36,
+    kTilesX = kWidth / kTileWidth,
+    kTilesY = kHeight / kTileHeight,
+    kNumTiles = kTilesX * kTilesY,
+  };
+
+  OcclusionBuffer();
+
+  // 'view_proj' uses the same convention as Frustum::from_view_proj. Clears the buffer and
+  // the binned triangles
+  void begin_frame(const XMFLOAT4X4 &view_proj);
+  // Transforms, sets up and bins the triangles of an occluder. 'obj_to_world' is transposed,
+  // like the mesh matrices
+  void add_occluder(const XMFLOAT4X4 &obj_to_world, const XMFLOAT3 *verts, int num_verts, const int *indices, int num_indices);
+  void rasterize(bool parallel);
+
+  // Returns true if the world space box is completely behind the rasterized occluders.
+  // Boxes that cross the near plane, or are outside the screen, are never occluded
+  bool is_occluded(const XMFLOAT3 &center, const XMFLOAT3 &extents) const;
+
+  const float *depth() const { return _depth.data(); }
+  int num_triangles() const { return (int)_triangles.size(); }
+
+private:
+  struct Triangle {
+    // edge functions (a * x + b * y + c), which are all >= 0 inside the triangle
+    float a[3], b[3], c[3];
+    // depth as a plane equation in screen space
+    float z0, dzdx, dzdy;
+    int min_x, min_y, max_x, max_y;
+  };
+
+  void rasterize_tile(int tile);
+
+  XMFLOAT4X4 _view_proj;
+  std::vector<XMFLOAT4> _clip_verts;
+  std::vector<Triangle> _triangles;
+  std::vector<int> _bins[kNumTiles];
+  std::vector<float> _depth;
+};
@@ -72,6 +72,11 @@ void ProfileManager::leave_scope(ProfileScope *scope) {
   QueryPerformanceCounter(&timeline->events[idx].end);
 }
 
+void ProfileManager::add_counter(const char *name, int value) {
+  SCOPED_CS(_callstack_cs);
+  _counters[name] += value;
+}
+
 void ProfileManager::start_frame() {
   QueryPerformanceCounter(&_frame_start);
 }
@@ -118,6 +123,12 @@ JsonValue::JsonValuePtr ProfileManager::end_frame() {
     threads->add_value(cur_thread);
   }
 
+  auto &counters = JsonValue::create_object();
+  for (auto it = begin(_counters); it != end(_counters); ++it)
+    counters->add_key_value(it->first, it->second);
+  container->add_key_value("counters", counters);
+  _counters.clear();
+
   assoc_delete(&_timeline);
 
   return root;
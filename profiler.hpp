@@ -23,6 +23,9 @@ public:
 
   void enter_scope(ProfileScope *scope);
   void leave_scope(ProfileScope *scope);
+
+  // counters are summed over the frame, and reset at end_frame
+  void add_counter(const char *name, int value);
 private:
 
   ProfileManager();
@@ -49,6 +52,7 @@ private:
   };
 
   std::unordered_map<DWORD, Timeline *> _timeline;
+  std::map<std::string, int> _counters;
 
   CriticalSection _callstack_cs;
 
@@ -60,10 +64,12 @@ private:
 #define PROFILE_MANAGER ProfileManager::instance()
 #define ADD_PROFILE_SCOPE() ProfileScope GEN_NAME(PROFILE, __LINE__)(__FUNCTION__);
 #define ADD_NAMED_PROFILE_SCOPE(name) ProfileScope GEN_NAME(PROFILE, __LINE__)(name);
+#define ADD_PROFILE_COUNTER(name, value) PROFILE_MANAGER.add_counter(name, value);
 
 #else
 #define PROFILE_MANAGER //
 #define ADD_PROFILE_SCOPE()
 #define ADD_NAMED_PROFILE_SCOPE(name)
+#define ADD_PROFILE_COUNTER(name, value)
 
 #endif
\ No newline at end of file
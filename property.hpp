@@ -34,6 +34,7 @@ namespace PropertyType {
     kColor,
     kFloat4x4,
     kTexture2d,
+    kStructuredBuffer,
     kSampler,
     kInt,
   };
@@ -0,0 +1,336 @@
+#include "stdafx.h"
+#include "render_graph.hpp"
+#include "graphics.hpp"
+#include "deferred_context.hpp"
+#include "render_queue.hpp"
+#include "property_manager.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+namespace {
+  int bytes_per_pixel(DXGI_FORMAT format) {
+    switch (format) {
+      case DXGI_FORMAT_R32G32B32A32_FLOAT: return 16;
+      case DXGI_FORMAT_R16G16B16A16_FLOAT: return 8;
+      case DXGI_FORMAT_R32G32_FLOAT: return 8;
+      case DXGI_FORMAT_R8G8B8A8_UNORM: return 4;
+      case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB: return 4;
+      case DXGI_FORMAT_R32_FLOAT: return 4;
+      case DXGI_FORMAT_R16G16_FLOAT: return 4;
+      case DXGI_FORMAT_R16_FLOAT: return 2;
+      case DXGI_FORMAT_R8_UNORM: return 1;
+    }
+    LOG_WARNING_LN_ONESHOT("Unknown render target format: %d", format);
+    return 4;
+  }
+
+  int64 target_bytes(const RenderGraph::TargetDesc &desc) {
+    int64 pixels = (int64)desc.width * desc.height;
+    int64 bytes = pixels * bytes_per_pixel(desc.format);
+    // a full mip chain adds about a third
+    if (desc.flags & Graphics::kCreateMipMaps)
+      bytes += bytes / 3;
+    // D24S8
+    if (desc.flags & Graphics::kCreateDepthBuffer)
+      bytes += pixels * 4;
+    return bytes;
+  }
+
+  bool same_desc(const RenderGraph::TargetDesc &a, const RenderGraph::TargetDesc &b) {
+    return a.width == b.width && a.height == b.height && a.format == b.format && a.flags == b.flags;
+  }
+}
+
+RenderGraph::RenderGraph() : _queue(new RenderQueue) {
+  reset();
+}
+
+RenderGraph::~RenderGraph() {
+  delete exch_null(_queue);
+}
+
+void RenderGraph::reset() {
+  _resources.clear();
+  _passes.clear();
+  _physical.clear();
+  _compiled = false;
+  _num_culled_passes = 0;
+  _num_transient_targets = 0;
+  _transient_bytes = 0;
+  _unaliased_transient_bytes = 0;
+}
+
+RenderGraph::ResourceId RenderGraph::create_target(const string &name, const TargetDesc &desc) {
+  Resource r;
+  r.name = name;
+  r.desc = desc;
+  _resources.push_back(r);
+  return (ResourceId)_resources.size() - 1;
+}
+
+RenderGraph::ResourceId RenderGraph::import_target(const string &name, GraphicsObjectHandle h) {
+  Resource r;
+  r.name = name;
+  r.handle = h;
+  r.imported = true;
+  r.output = true;
+  _resources.push_back(r);
+  return (ResourceId)_resources.size() - 1;
+}
+
+RenderGraph::ResourceId RenderGraph::import_backbuffer() {
+  ResourceId r = import_target("backbuffer", GraphicsObjectHandle());
+  _resources[r].backbuffer = true;
+  return r;
+}
+
+void RenderGraph::mark_output(ResourceId r) {
+  _resources[r].output = true;
+}
+
+RenderGraph::ResourceId RenderGraph::find_target(const string &name) const {
+  for (size_t i = 0; i < _resources.size(); ++i) {
+    if (_resources[i].name == name)
+      return (ResourceId)i;
+  }
+  return -1;
+}
+
+int RenderGraph::add_pass(const string &name, const SubmitFn &fn) {
+  Pass pass;
+  pass.name = name;
+  pass.fn = fn;
+  _passes.push_back(pass);
+  return (int)_passes.size() - 1;
+}
+
+void RenderGraph::read(int pass, ResourceId r) {
+  _passes[pass].reads.push_back(r);
+}
+
+void RenderGraph::write(int pass, ResourceId r, uint32 flags) {
+  _passes[pass].writes.push_back(make_pair(r, flags));
+}
+
+bool RenderGraph::compile() {
+  _compiled = false;
+
+  // walk the passes backwards from the outputs. A pass is kept if it writes something that's
+  // needed, and then everything it reads is needed too. Writes don't end a resource's need,
+  // as passes that blend onto a target rely on the passes that wrote it before them
+  vector<bool> needed(_resources.size());
+  for (size_t i = 0; i < _resources.size(); ++i) {
+    Resource &r = _resources[i];
+    r.first_pass = r.last_pass = r.physical = -1;
+    needed[i] = r.output;
+  }
+
+  _num_culled_passes = 0;
+  for (int i = (int)_passes.size() - 1; i >= 0; --i) {
+    Pass &pass = _passes[i];
+    pass.culled = true;
+    for (size_t j = 0; j < pass.writes.size(); ++j)
+      pass.culled &= !needed[pass.writes[j].first];
+
+    if (pass.culled) {
+      ++_num_culled_passes;
+      continue;
+    }
+
+    for (size_t j = 0; j < pass.reads.size(); ++j)
+      needed[pass.reads[j]] = true;
+  }
+
+  // every live pass needs its own key pass, and targets that fit in one set_render_targets
+  const int live_passes = (int)_passes.size() - _num_culled_passes;
+  if (live_passes > (1 << RenderKey::kPassBits)) {
+    LOG_ERROR_LN("Render graph has %d live passes, but render keys only have room for %d", live_passes, 1 << RenderKey::kPassBits);
+    return false;
+  }
+
+  for (size_t i = 0; i < _passes.size(); ++i) {
+    const Pass &pass = _passes[i];
+    if (pass.culled)
+      continue;
+    int num_targets = 0;
+    bool backbuffer = false;
+    for (size_t j = 0; j < pass.writes.size(); ++j) {
+      if (pass.writes[j].second & kUav)
+        continue;
+      if (_resources[pass.writes[j].first].backbuffer)
+        backbuffer = true;
+      else
+        ++num_targets;
+    }
+    if (num_targets > D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT) {
+      LOG_ERROR_LN("Render graph pass \"%s\" writes %d render targets, only %d can be bound", 
+        pass.name.c_str(), num_targets, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT);
+      return false;
+    }
+    if (backbuffer && num_targets > 0) {
+      LOG_ERROR_LN("Render graph pass \"%s\" writes the backbuffer and other render targets", pass.name.c_str());
+      return false;
+    }
+  }
+
+  // lifetimes of the transient targets, in pass indices
+  vector<bool> written(_resources.size());
+  for (int i = 0; i < (int)_passes.size(); ++i) {
+    const Pass &pass = _passes[i];
+    if (pass.culled)
+      continue;
+
+    for (size_t j = 0; j < pass.reads.size(); ++j) {
+      Resource &r = _resources[pass.reads[j]];
+      if (!r.imported && !written[pass.reads[j]]) {
+        LOG_ERROR_LN("Render graph pass \"%s\" reads \"%s\" before it's written", pass.name.c_str(), r.name.c_str());
+        return false;
+      }
+      r.last_pass = i;
+    }
+
+    for (size_t j = 0; j < pass.writes.size(); ++j) {
+      Resource &r = _resources[pass.writes[j].first];
+      written[pass.writes[j].first] = true;
+      if (r.first_pass == -1)
+        r.first_pass = i;
+      r.last_pass = i;
+    }
+  }
+
+  // assign the transient targets to physical targets in the order they're first used,
+  // reusing a physical target when its previous user is done with it
+  vector<int> order;
+  for (int i = 0; i < (int)_resources.size(); ++i) {
+    if (!_resources[i].imported && _resources[i].first_pass != -1)
+      order.push_back(i);
+  }
+  stable_sort(order.begin(), order.end(), [&](int a, int b) { return _resources[a].first_pass < _resources[b].first_pass; });
+
+  _physical.clear();
+  _transient_bytes = 0;
+  _unaliased_transient_bytes = 0;
+  _num_transient_targets = (int)order.size();
+  for (size_t i = 0; i < order.size(); ++i) {
+    Resource &r = _resources[order[i]];
+    _unaliased_transient_bytes += target_bytes(r.desc);
+
+    for (size_t j = 0; j < _physical.size(); ++j) {
+      PhysicalTarget &p = _physical[j];
+      if (p.last_pass < r.first_pass && same_desc(p.desc, r.desc)) {
+        r.physical = (int)j;
+        p.last_pass = r.last_pass;
+        break;
+      }
+    }
+
+    if (r.physical == -1) {
+      PhysicalTarget p;
+      p.name = r.name;
+      p.desc = r.desc;
+      p.last_pass = r.last_pass;
+      _physical.push_back(p);
+      r.physical = (int)_physical.size() - 1;
+      _transient_bytes += target_bytes(r.desc);
+    }
+  }
+
+  _compiled = true;
+  return true;
+}
+
+void RenderGraph::execute(DeferredContext *ctx) {
+  KASSERT(_compiled);
+
+  // the physical targets are held for the whole graph, like the ScopedRts they replace, so
+  // the recorded commands never share a target with another effect's
+  for (size_t i = 0; i < _physical.size(); ++i) {
+    PhysicalTarget &p = _physical[i];
+    p.handle = GRAPHICS.get_temp_render_target(FROM_HERE, p.desc.width, p.desc.height, p.desc.format, p.desc.flags, p.name);
+  }
+
+  // the temp pool only sets the property of the name a physical target is acquired with, so
+  // the shaders that read the other targets aliased to it get theirs here
+  for (size_t i = 0; i < _resources.size(); ++i) {
+    const Resource &r = _resources[i];
+    if (!r.imported && r.physical != -1 && r.name != _physical[r.physical].name) {
+      auto pid = PROPERTY_MANAGER.get_or_create<GraphicsObjectHandle>(r.name);
+      PROPERTY_MANAGER.set_property(pid, _physical[r.physical].handle);
+    }
+  }
+
+  struct PassTargets {
+    GraphicsObjectHandle targets[D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT];
+    bool clear[D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT];
+    int num_targets;
+    bool backbuffer, clear_backbuffer;
+  };
+
+  _queue->reset();
+  int key_pass = 0;
+  for (size_t i = 0; i < _passes.size(); ++i) {
+    const Pass &pass = _passes[i];
+    if (pass.culled)
+      continue;
+
+    PassTargets t;
+    t.num_targets = 0;
+    t.backbuffer = t.clear_backbuffer = false;
+    for (size_t j = 0; j < pass.writes.size(); ++j) {
+      const Resource &r = _resources[pass.writes[j].first];
+      const uint32 flags = pass.writes[j].second;
+      if (flags & kUav)
+        continue;
+      if (r.backbuffer) {
+        t.backbuffer = true;
+        t.clear_backbuffer = !!(flags & kClear);
+      } else {
+        KASSERT(t.num_targets < D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT);
+        t.targets[t.num_targets] = handle(pass.writes[j].first);
+        t.clear[t.num_targets] = !!(flags & kClear);
+        ++t.num_targets;
+      }
+    }
+    // compile rejects graphs with too many passes or targets
+    KASSERT(!(t.backbuffer && t.num_targets > 0));
+    KASSERT(key_pass < (1 << RenderKey::kPassBits));
+    // mutable, as set_render_targets takes non-const arrays
+    _queue->add_callback(RenderKey(key_pass, RenderKey::kBeginPass), [=](DeferredContext *ctx) mutable {
+      if (t.backbuffer)
+        ctx->set_default_render_target(t.clear_backbuffer);
+      else if (t.num_targets > 0)
+        ctx->set_render_targets(t.targets, t.clear, t.num_targets);
+    });
+
+    pass.fn(_queue, key_pass);
+
+    // added after the pass' own end callbacks, which keep their order in the sort
+    if (t.num_targets > 0) {
+      _queue->add_callback(RenderKey(key_pass, RenderKey::kEndPass), [=](DeferredContext *ctx) {
+        ctx->unset_render_targets(0, t.num_targets);
+      });
+    }
+    ++key_pass;
+  }
+
+  _queue->execute(ctx);
+
+  for (size_t i = 0; i < _physical.size(); ++i) {
+    GRAPHICS.release_temp_render_target(_physical[i].handle);
+    _physical[i].handle = GraphicsObjectHandle();
+  }
+}
+
+GraphicsObjectHandle RenderGraph::handle(ResourceId r) const {
+  const Resource &res = _resources[r];
+  if (res.imported)
+    return res.handle;
+  return res.physical != -1 ? _physical[res.physical].handle : GraphicsObjectHandle();
+}
+
+void RenderGraph::log_stats() const {
+  LOG_INFO_LN("Render graph: %d passes (%d culled), %d transient targets in %d physical targets, %.1f MB (%.1f MB without aliasing)",
+    (int)_passes.size(), _num_culled_passes, _num_transient_targets, (int)_physical.size(),
+    _transient_bytes / (1024.0 * 1024.0), _unaliased_transient_bytes / (1024.0 * 1024.0));
+}
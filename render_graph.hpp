@@ -0,0 +1,105 @@
+#pragma once
+#include "graphics_object_handle.hpp"
+
+class DeferredContext;
+class RenderQueue;
+
+// A frame's passes, and the render targets they read and write. Compiling the graph culls
+// the passes whose outputs are never used, computes the lifetime of the transient targets,
+// and lets targets with the same description and non-overlapping lifetimes share one
+// physical render target. Executing it acquires the physical targets from the temp pool,
+// and has every live pass submit its commands to a RenderQueue, with the pass' position
+// in the frame as the key's pass. The render targets are bound and unbound by callbacks
+// around each pass' commands, and the whole frame is sorted and executed at once.
+class RenderGraph {
+public:
+  typedef int ResourceId;
+  typedef std::function<void(RenderQueue *queue, int key_pass)> SubmitFn;
+
+  enum WriteFlags {
+    kLoad   = 0,
+    kClear  = 1 << 0,
+    // written through a uav by the pass itself, so it isn't bound as a render target
+    kUav    = 1 << 1,
+  };
+
+  struct TargetDesc {
+    TargetDesc() : width(0), height(0), format(DXGI_FORMAT_UNKNOWN), flags(0) {}
+    TargetDesc(int width, int height, DXGI_FORMAT format, uint32 flags) : width(width), height(height), format(format), flags(flags) {}
+    int width, height;
+    DXGI_FORMAT format;
+    uint32 flags;
+  };
+
+  RenderGraph();
+  ~RenderGraph();
+
+  void reset();
+
+  ResourceId create_target(const std::string &name, const TargetDesc &desc);
+  // imported targets live outside the graph, and are always treated as outputs
+  ResourceId import_target(const std::string &name, GraphicsObjectHandle h);
+  ResourceId import_backbuffer();
+  void mark_output(ResourceId r);
+  // -1 if there's no target with the name
+  ResourceId find_target(const std::string &name) const;
+
+  int add_pass(const std::string &name, const SubmitFn &fn);
+  void read(int pass, ResourceId r);
+  void write(int pass, ResourceId r, uint32 flags);
+
+  bool compile();
+  void execute(DeferredContext *ctx);
+
+  // only valid while the graph is executing
+  GraphicsObjectHandle handle(ResourceId r) const;
+
+  int num_passes() const { return (int)_passes.size(); }
+  int num_culled_passes() const { return _num_culled_passes; }
+  int num_transient_targets() const { return _num_transient_targets; }
+  int num_physical_targets() const { return (int)_physical.size(); }
+  // memory for the transient targets, with and without aliasing
+  int64 transient_bytes() const { return _transient_bytes; }
+  int64 unaliased_transient_bytes() const { return _unaliased_transient_bytes; }
+  void log_stats() const;
+
+private:
+  struct Resource {
+    Resource() : imported(false), backbuffer(false), output(false), first_pass(-1), last_pass(-1), physical(-1) {}
+    std::string name;
+    TargetDesc desc;
+    GraphicsObjectHandle handle;
+    bool imported;
+    bool backbuffer;
+    bool output;
+    int first_pass, last_pass;
+    int physical;
+  };
+
+  struct Pass {
+    Pass() : culled(false) {}
+    std::string name;
+    SubmitFn fn;
+    std::vector<ResourceId> reads;
+    std::vector<std::pair<ResourceId, uint32> > writes;
+    bool culled;
+  };
+
+  struct PhysicalTarget {
+    std::string name;
+    TargetDesc desc;
+    int last_pass;
+    GraphicsObjectHandle handle;
+  };
+
+  std::vector<Resource> _resources;
+  std::vector<Pass> _passes;
+  std::vector<PhysicalTarget> _physical;
+  RenderQueue *_queue;
+
+  bool _compiled;
+  int _num_culled_passes;
+  int _num_transient_targets;
+  int64 _transient_bytes;
+  int64 _unaliased_transient_bytes;
+};
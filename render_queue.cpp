@@ -0,0 +1,247 @@
+#include "stdafx.h"
+#include "render_queue.hpp"
+#include "graphics.hpp"
+#include "technique.hpp"
+#include "material.hpp"
+#include "material_manager.hpp"
+#include "mesh.hpp"
+#include "effect.hpp"
+#include "logger.hpp"
+
+using namespace std;
+using namespace std::tr1::placeholders;
+
+RenderQueue::RenderQueue()
+  : _num_techniques(0)
+  , _sorted(true)
+{
+}
+
+void RenderQueue::reset() {
+  _commands.clear();
+  _meshes.clear();
+  // the technique commands are kept around, so their instance data buffers can be reused
+  _num_techniques = 0;
+  _callbacks.clear();
+  _sorted = true;
+}
+
+void RenderQueue::add_mesh(RenderKey key, const MeshRenderData &data) {
+  KASSERT(key.cmd() == RenderKey::kRenderMesh);
+  Command cmd = { key.data, (uint32)_meshes.size() };
+  _commands.push_back(cmd);
+  _meshes.push_back(data);
+  _sorted = false;
+}
+
+void RenderQueue::add_technique(RenderKey key, GraphicsObjectHandle technique, const Effect *effect,
+                                const TextureArray &textures, const DeferredContext::InstanceData &instances) {
+  KASSERT(key.cmd() == RenderKey::kRenderTechnique);
+  if (_num_techniques == _techniques.size())
+    _techniques.push_back(TechniqueCommand());
+
+  TechniqueCommand &t = _techniques[_num_techniques];
+  t.technique = technique;
+  t.effect = effect;
+  t.textures = textures;
+  t.instances = instances;
+
+  Command cmd = { key.data, (uint32)_num_techniques++ };
+  _commands.push_back(cmd);
+  _sorted = false;
+}
+
+void RenderQueue::add_technique(int pass, GraphicsObjectHandle technique, const Effect *effect,
+                                const TextureArray &textures, const DeferredContext::InstanceData &instances) {
+  RenderKey key(pass, RenderKey::kRenderTechnique, technique, GraphicsObjectHandle(), 0);
+  add_technique(key, technique, effect, textures, instances);
+}
+
+void RenderQueue::add_callback(RenderKey key, const Callback &fn) {
+  KASSERT(key.cmd() == RenderKey::kBeginPass || key.cmd() == RenderKey::kEndPass);
+  Command cmd = { key.data, (uint32)_callbacks.size() };
+  _commands.push_back(cmd);
+  _callbacks.push_back(fn);
+  _sorted = false;
+}
+
+void RenderQueue::sort() {
+  if (_sorted)
+    return;
+  _sorted = true;
+
+  // LSD radix sort, 8 bits per pass. All the histograms are built in a single pass
+  // over the keys, and passes where every key has the same digit are skipped, which
+  // is the common case for the pass and command bytes.
+  const size_t num_cmds = _commands.size();
+  if (num_cmds < 2)
+    return;
+
+  uint32 histograms[8][256];
+  memset(histograms, 0, sizeof(histograms));
+  for (size_t i = 0; i < num_cmds; ++i) {
+    uint64 key = _commands[i].key;
+    for (int b = 0; b < 8; ++b)
+      histograms[b][(key >> (b * 8)) & 0xff]++;
+  }
+
+  _scratch.resize(num_cmds);
+  Command *src = _commands.data();
+  Command *dst = _scratch.data();
+
+  for (int b = 0; b < 8; ++b) {
+    const int shift = b * 8;
+    uint32 *histogram = histograms[b];
+    if (histogram[(src[0].key >> shift) & 0xff] == num_cmds)
+      continue;
+
+    uint32 ofs = 0;
+    for (int i = 0; i < 256; ++i) {
+      uint32 tmp = histogram[i];
+      histogram[i] = ofs;
+      ofs += tmp;
+    }
+
+    for (size_t i = 0; i < num_cmds; ++i)
+      dst[histogram[(src[i].key >> shift) & 0xff]++] = src[i];
+
+    swap(src, dst);
+  }
+
+  if (src != _commands.data())
+    _commands.swap(_scratch);
+}
+
+void RenderQueue::execute(DeferredContext *ctx) {
+  sort();
+
+  size_t i = 0;
+  const size_t num_cmds = _commands.size();
+  while (i < num_cmds) {
+    RenderKey key;
+    key.data = _commands[i].key;
+    switch (key.cmd()) {
+
+      case RenderKey::kRenderMesh: {
+        // meshes are drawn in runs, so state can be shared between consecutive draws
+        size_t last = i + 1;
+        while (last < num_cmds) {
+          RenderKey next;
+          next.data = _commands[last].key;
+          if (next.cmd() != RenderKey::kRenderMesh)
+            break;
+          ++last;
+        }
+        execute_meshes(ctx, i, last);
+        i = last;
+        break;
+      }
+
+      case RenderKey::kRenderTechnique: {
+        const TechniqueCommand &t = _techniques[_commands[i].idx];
+        if (t.effect)
+          ctx->render_technique(t.technique, bind(&Effect::fill_cbuffer, t.effect, _1), t.textures, t.instances);
+        else
+          ctx->render_technique(t.technique, [](CBuffer *) {}, t.textures, t.instances);
+        ++i;
+        break;
+      }
+
+      case RenderKey::kBeginPass:
+      case RenderKey::kEndPass:
+        _callbacks[_commands[i].idx](ctx);
+        ++i;
+        break;
+
+      default:
+        LOG_ERROR_LN("Unknown render command: %d", key.cmd());
+        ++i;
+        break;
+    }
+  }
+}
+
+void RenderQueue::execute_meshes(DeferredContext *ctx, size_t first, size_t last) {
+
+  GraphicsObjectHandle cur_technique, cur_material;
+  Technique *technique = nullptr;
+  const Material *material = nullptr;
+  Shader *vs = nullptr, *ps = nullptr;
+  bool has_resources = false;
+
+  for (size_t i = first; i < last; ++i) {
+    const MeshRenderData &data = _meshes[_commands[i].idx];
+
+    if (data.technique != cur_technique) {
+      cur_technique = data.technique;
+      technique = GRAPHICS.get_technique(cur_technique);
+      ctx->set_rs(technique->rasterizer_state());
+      ctx->set_dss(technique->depth_stencil_state(), GRAPHICS.default_stencil_ref());
+      ctx->set_bs(technique->blend_state(), GRAPHICS.default_blend_factors(), GRAPHICS.default_sample_mask());
+      // the shaders depend on the technique, so force the material state to be reapplied
+      cur_material = GraphicsObjectHandle();
+    }
+
+    if (data.material != cur_material) {
+      if (has_resources)
+        ctx->unset_shader_resource(0, MAX_TEXTURES, ShaderType::kPixelShader);
+
+      cur_material = data.material;
+      material = MATERIAL_MANAGER.get_material(cur_material);
+
+      // get the shader for the current technique, based on the flags used by the material
+      int flags = material->flags();
+      vs = technique->vertex_shader(flags);
+      ps = technique->pixel_shader(flags);
+      ctx->set_layout(vs->input_layout());
+
+      material->fill_cbuffer(&vs->material_cbuffer());
+      material->fill_cbuffer(&ps->material_cbuffer());
+      ctx->set_cbuffer(vs->material_cbuffer(), ps->material_cbuffer());
+
+      if (data.effect) {
+        data.effect->fill_cbuffer(&vs->system_cbuffer());
+        data.effect->fill_cbuffer(&ps->system_cbuffer());
+      }
+      ctx->set_cbuffer(vs->system_cbuffer(), ps->system_cbuffer());
+
+      ctx->set_vs(vs->handle());
+      ctx->set_ps(ps->handle());
+
+      // set samplers
+      auto &samplers = ps->samplers();
+      if (!samplers.empty()) {
+        ctx->set_samplers(samplers);
+      }
+
+      // set resource views
+      auto &rv = ps->resource_views();
+      TextureArray all_views;
+      ctx->fill_system_resource_views(rv, &all_views);
+      material->fill_resource_views(rv, &all_views);
+      has_resources = false;
+      for (size_t j = 0; j < all_views.size(); ++j) {
+        if (all_views[j].is_valid()) {
+          has_resources = true;
+          ctx->set_shader_resources(all_views, ShaderType::kPixelShader);
+          break;
+        }
+      }
+    }
+
+    const MeshGeometry *geometry = data.geometry;
+    ctx->set_vb(geometry->vb);
+    ctx->set_ib(geometry->ib);
+    ctx->set_topology(geometry->topology);
+
+    // set cbuffers
+    data.mesh->fill_cbuffer(&vs->mesh_cbuffer());
+    data.mesh->fill_cbuffer(&ps->mesh_cbuffer());
+    ctx->set_cbuffer(vs->mesh_cbuffer(), ps->mesh_cbuffer());
+
+    ctx->draw_indexed(geometry->index_count, geometry->start_index, geometry->base_vertex);
+  }
+
+  if (has_resources)
+    ctx->unset_shader_resource(0, MAX_TEXTURES, ShaderType::kPixelShader);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "graphics_submit.hpp"
+#include "deferred_context.hpp"
+
+class Effect;
+
+// Commands are tagged with a RenderKey, and radix sorted once per frame before being
+// executed. All storage is reused between frames, so after the first few frames
+// submitting doesn't allocate. Besides draws, a pass can queue callbacks that run before
+// (kBeginPass) or after (kEndPass) its draws, for binding targets and the like.
+class RenderQueue {
+public:
+  typedef std::function<void(DeferredContext *)> Callback;
+
+  RenderQueue();
+
+  void reset();
+
+  void add_mesh(RenderKey key, const MeshRenderData &data);
+  void add_technique(RenderKey key, GraphicsObjectHandle technique, const Effect *effect, const TextureArray &textures,
+    const DeferredContext::InstanceData &instances = DeferredContext::InstanceData());
+  // fullscreen techniques are only ordered by pass and technique
+  void add_technique(int pass, GraphicsObjectHandle technique, const Effect *effect, const TextureArray &textures,
+    const DeferredContext::InstanceData &instances = DeferredContext::InstanceData());
+  void add_callback(RenderKey key, const Callback &fn);
+
+  void sort();
+  void execute(DeferredContext *ctx);
+
+  size_t size() const { return _commands.size(); }
+  // the commands in submission order, or sorted order after sort()
+  RenderKey key(size_t i) const { RenderKey k; k.data = _commands[i].key; return k; }
+  const MeshRenderData &mesh_data(size_t i) const { return _meshes[_commands[i].idx]; }
+
+private:
+
+  struct Command {
+    uint64 key;
+    uint32 idx;
+  };
+
+  struct TechniqueCommand {
+    GraphicsObjectHandle technique;
+    const Effect *effect;
+    TextureArray textures;
+    DeferredContext::InstanceData instances;
+  };
+
+  void execute_meshes(DeferredContext *ctx, size_t first, size_t last);
+
+  std::vector<Command> _commands;
+  std::vector<Command> _scratch;
+  std::vector<MeshRenderData> _meshes;
+  std::vector<TechniqueCommand> _techniques;
+  size_t _num_techniques;
+  std::vector<Callback> _callbacks;
+  bool _sorted;
+};
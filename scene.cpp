@@ -7,11 +7,46 @@
 #include "deferred_context.hpp"
 #include "material_manager.hpp"
 #include "effect.hpp"
-
-Scene::Scene() {
+#include "render_queue.hpp"
+#include "frustum_culler.hpp"
+#include "bvh.hpp"
+#include "occlusion_buffer.hpp"
+#include "software_rasterizer.hpp"
+
+using namespace std;
+
+Scene::Scene() 
+  : _view_mtx_id(~0)
+  , _proj_mtx_id(~0)
+  , _culler(new FrustumCuller)
+  , _bvh(new Bvh)
+  , _has_animated_meshes(false)
+  , _occlusion(new OcclusionBuffer)
+  , _occlusion_dirty(true)
+  , _occlusion_frames(0)
+  , _occlusion_raster_frames(0)
+  , _occlusion_tested(0)
+  , _occlusion_culled(0)
+  , _occlusion_raster_ticks(0)
+  , _occlusion_test_ticks(0)
+{
 }
 
 Scene::~Scene() {
+  if (_occlusion_frames > 0) {
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    const double ms = 1000.0 / freq.QuadPart;
+    LOG_INFO_LN("Occlusion culling: %d occluders, culled %.1f%% of the meshes in the frustum, %.3f ms/frame "
+      "(testing %.3f ms/frame, rasterizing %.3f ms on %d of %d frames)",
+      (int)_occluders.size(), 100.0 * _occlusion_culled / max<int64>(1, _occlusion_tested),
+      ms * (_occlusion_raster_ticks + _occlusion_test_ticks) / _occlusion_frames,
+      ms * _occlusion_test_ticks / _occlusion_frames,
+      ms * _occlusion_raster_ticks / max(1, _occlusion_raster_frames), _occlusion_raster_frames, _occlusion_frames);
+  }
+  delete exch_null(_culler);
+  delete exch_null(_bvh);
+  delete exch_null(_occlusion);
   seq_delete(&meshes);
   seq_delete(&cameras);
   seq_delete(&lights);
@@ -28,6 +63,7 @@ bool Scene::on_loaded() {
     Mesh *mesh = *it;
     mesh->on_loaded();
     _meshes_by_name[mesh->name()] = mesh;
+    _has_animated_meshes |= !mesh->is_static();
   }
 
   for (size_t i = 0; i < cameras.size(); ++i) {
@@ -44,7 +80,25 @@ bool Scene::on_loaded() {
       light->pos_id = PROPERTY_MANAGER.get_id(light->name + "::Anim");
   }
 
-  sort_by_material();
+  _view_mtx_id = PROPERTY_MANAGER.get_or_create<XMFLOAT4X4>("System::view");
+  _proj_mtx_id = PROPERTY_MANAGER.get_or_create<XMFLOAT4X4>("System::proj");
+
+  update_bounds();
+  _bvh->build(_world_centers.data(), _world_extents.data(), (int)meshes.size());
+
+  // use the simple meshes with the largest bounds as occluders
+  const size_t cMaxOccluders = 16;
+  vector<pair<float, int> > candidates;
+  for (size_t i = 0; i < meshes.size(); ++i) {
+    if (meshes[i]->occluder_indices().empty())
+      continue;
+    const XMFLOAT3 &e = _world_extents[i];
+    candidates.push_back(make_pair(e.x * e.y + e.y * e.z + e.z * e.x, (int)i));
+  }
+  sort(candidates.begin(), candidates.end(), greater<pair<float, int> >());
+  for (size_t i = 0; i < min(cMaxOccluders, candidates.size()); ++i)
+    _occluders.push_back(candidates[i].second);
+  sort(_occluders.begin(), _occluders.end());
 
   return true;
 }
@@ -52,86 +106,129 @@ bool Scene::on_loaded() {
 void Scene::update() {
   for (auto i = begin(meshes), e = end(meshes); i != e; ++i)
     (*i)->update();
+  update_bounds();
+  if (_has_animated_meshes) {
+    _bvh->refit(_world_centers.data(), _world_extents.data());
+    _occlusion_dirty = true;
+  }
 }
 
-void Scene::sort_by_material() {
-
+void Scene::update_bounds() {
+  _culler->resize((int)meshes.size());
+  _visible.resize(meshes.size());
+  _world_centers.resize(meshes.size());
+  _world_extents.resize(meshes.size());
   for (size_t i = 0; i < meshes.size(); ++i) {
-    auto &submeshes = meshes[i]->submeshes();
+    const Mesh *mesh = meshes[i];
+    transform_bounds(mesh->obj_to_world(), mesh->center(), mesh->extents(), &_world_centers[i], &_world_extents[i]);
+    _culler->set_bounds((int)i, _world_centers[i], _world_extents[i]);
+  }
+}
+
+void Scene::submit(RenderQueue *queue, int pass, GraphicsObjectHandle technique_handle, const Effect *effect) {
+
+  // the view and world matrices are stored transposed, so the view space depth is the
+  // dot product of the view matrix' 3rd row with the world position
+  XMFLOAT4X4 view = PROPERTY_MANAGER.get_property<XMFLOAT4X4>(_view_mtx_id);
+  XMFLOAT4X4 proj = PROPERTY_MANAGER.get_property<XMFLOAT4X4>(_proj_mtx_id);
+
+  // NB: if the projection matrix isn't set, all the planes are zero, and nothing is culled
+  XMFLOAT4X4 view_proj;
+  XMStoreFloat4x4(&view_proj, XMMatrixMultiply(XMLoadFloat4x4(&proj), XMLoadFloat4x4(&view)));
+  Frustum frustum;
+  frustum.from_view_proj(view_proj);
+  int num_visible = _culler->cull(frustum, _visible.data());
+#if WITH_OCCLUSION_CULLING
+  num_visible = cull_occluded(view_proj, num_visible);
+#endif
+
+  for (int i = 0; i < num_visible; ++i) {
+    const Mesh *mesh = meshes[_visible[i]];
+    const XMFLOAT3 &c = mesh->center();
+    const XMFLOAT4X4 &w = mesh->obj_to_world();
+    float pos[4];
+    for (int j = 0; j < 3; ++j)
+      pos[j] = w.m[j][0] * c.x + w.m[j][1] * c.y + w.m[j][2] * c.z + w.m[j][3];
+    pos[3] = 1;
+    float depth = view.m[2][0] * pos[0] + view.m[2][1] * pos[1] + view.m[2][2] * pos[2] + view.m[2][3] * pos[3];
+
+    auto &submeshes = mesh->submeshes();
     for (size_t j = 0; j < submeshes.size(); ++j) {
-      auto &submesh = submeshes[j];
-      _submesh_by_material[submesh->material_id()].push_back(submesh);
+      const SubMesh *submesh = submeshes[j];
+      MeshRenderData data;
+      submesh->fill_renderdata(&data);
+      data.technique = technique_handle;
+      data.effect = effect;
+      RenderKey key(pass, RenderKey::kRenderMesh, technique_handle, data.material, RenderKey::depth_bits(depth));
+      queue->add_mesh(key, data);
     }
   }
 }
 
-void Scene::render(DeferredContext *ctx, Effect *effect, GraphicsObjectHandle technique_handle) {
-
-  Technique *technique = GRAPHICS.get_technique(technique_handle);
-  ctx->set_rs(technique->rasterizer_state());
-  ctx->set_dss(technique->depth_stencil_state(), GRAPHICS.default_stencil_ref());
-  ctx->set_bs(technique->blend_state(), GRAPHICS.default_blend_factors(), GRAPHICS.default_sample_mask());
-
-  for (auto it = begin(_submesh_by_material); it != end(_submesh_by_material); ++it) {
-    GraphicsObjectHandle m = it->first;
-    const Material *material = MATERIAL_MANAGER.get_material(m);
-
-    // get the shader for the current technique, based on the flags used by the material
-    int flags = material->flags();
-    Shader *vs = technique->vertex_shader(flags);
-    Shader *ps = technique->pixel_shader(flags);
-    ctx->set_layout(vs->input_layout());
-
-    material->fill_cbuffer(&vs->material_cbuffer());
-    material->fill_cbuffer(&ps->material_cbuffer());
-    ctx->set_cbuffer(vs->material_cbuffer(), ps->material_cbuffer());
-
-
-    effect->fill_cbuffer(&vs->system_cbuffer());
-    effect->fill_cbuffer(&ps->system_cbuffer());
-    ctx->set_cbuffer(vs->system_cbuffer(), ps->system_cbuffer());
-
-    ctx->set_vs(vs->handle());
-    ctx->set_ps(ps->handle());
-
-    // set samplers
-    auto &samplers = ps->samplers();
-    if (!samplers.empty()) {
-      ctx->set_samplers(samplers);
+int Scene::cull_occluded(const XMFLOAT4X4 &view_proj, int num_visible) {
+  if (_occluders.empty())
+    return num_visible;
+
+  LARGE_INTEGER start, rasterized, end;
+  QueryPerformanceCounter(&start);
+  rasterized = start;
+
+  if (_occlusion_dirty || memcmp(&view_proj, &_occlusion_view_proj, sizeof(view_proj)) != 0) {
+    _occlusion_view_proj = view_proj;
+    _occlusion_dirty = false;
+    _occlusion->begin_frame(view_proj);
+    for (size_t i = 0; i < _occluders.size(); ++i) {
+      const Mesh *mesh = meshes[_occluders[i]];
+      auto &verts = mesh->occluder_verts();
+      auto &indices = mesh->occluder_indices();
+      _occlusion->add_occluder(mesh->obj_to_world(), verts.data(), (int)verts.size(), indices.data(), (int)indices.size());
     }
+    _occlusion->rasterize(true);
+    ++_occlusion_raster_frames;
+    QueryPerformanceCounter(&rasterized);
+  }
 
-    // set resource views
-    auto &rv = ps->resource_views();
-    TextureArray all_views;
-    ctx->fill_system_resource_views(rv, &all_views);
-    material->fill_resource_views(rv, &all_views);
-    bool has_resources = false;
-    for (size_t i = 0; i < all_views.size(); ++i) {
-      if (all_views[i].is_valid()) {
-        has_resources = true;
-        ctx->set_shader_resources(all_views, ShaderType::kPixelShader);
-        break;
-      }
-    }
+  // the occluders are in the depth buffer themselves, so they're never tested
+  int num_left = 0;
+  for (int i = 0; i < num_visible; ++i) {
+    const int idx = _visible[i];
+    if (binary_search(_occluders.begin(), _occluders.end(), idx) || !_occlusion->is_occluded(_world_centers[idx], _world_extents[idx]))
+      _visible[num_left++] = idx;
+  }
 
-    for (auto jt = begin(it->second); jt != end(it->second); ++jt) {
-      SubMesh *submesh = *jt;
-      const MeshGeometry *geometry = submesh->geometry();
-      Mesh *mesh = submesh->mesh();
+  QueryPerformanceCounter(&end);
+  ++_occlusion_frames;
+  _occlusion_tested += num_visible;
+  _occlusion_culled += num_visible - num_left;
+  _occlusion_raster_ticks += rasterized.QuadPart - start.QuadPart;
+  _occlusion_test_ticks += end.QuadPart - rasterized.QuadPart;
+  return num_left;
+}
 
-      ctx->set_vb(geometry->vb);
-      ctx->set_ib(geometry->ib);
-      ctx->set_topology(geometry->topology);
+void Scene::render_software(SoftwareRasterizer *rasterizer, const XMFLOAT4X4 &view_proj) {
+  Frustum frustum;
+  frustum.from_view_proj(view_proj);
+  const int num_visible = _culler->cull(frustum, _visible.data());
 
-      // set cbuffers
-      mesh->fill_cbuffer(&vs->mesh_cbuffer());
-      mesh->fill_cbuffer(&ps->mesh_cbuffer());
-      ctx->set_cbuffer(vs->mesh_cbuffer(), ps->mesh_cbuffer());
+  // the material textures only live on the gpu, so everything is flat shaded
+  for (int i = 0; i < num_visible; ++i) {
+    const Mesh *mesh = meshes[_visible[i]];
+    auto &submeshes = mesh->submeshes();
+    for (size_t j = 0; j < submeshes.size(); ++j) {
+      const SubMesh *submesh = submeshes[j];
+      auto &verts = submesh->cpu_verts();
+      auto &indices = submesh->cpu_indices();
+      if (indices.empty())
+        continue;
+
+      XMFLOAT4 color(1, 1, 1, 1);
+      if (Material *material = MATERIAL_MANAGER.get_material(submesh->material_id())) {
+        if (Material::Property *diffuse = material->property_by_name("Diffuse"))
+          color = XMFLOAT4(diffuse->_float4[0], diffuse->_float4[1], diffuse->_float4[2], 1);
+      }
 
-      ctx->draw_indexed(geometry->index_count, 0, 0);
+      rasterizer->draw_indexed(mesh->obj_to_world(), verts.data(), nullptr, (int)verts.size(),
+        indices.data(), (int)indices.size(), color, nullptr);
     }
-
-    if (has_resources)
-      ctx->unset_shader_resource(0, MAX_TEXTURES, ShaderType::kPixelShader);
   }
 }
@@ -7,6 +7,11 @@ class SubMesh;
 class Material;
 class DeferredContext;
 class Effect;
+class RenderQueue;
+class FrustumCuller;
+class Bvh;
+class OcclusionBuffer;
+class SoftwareRasterizer;
 
 struct Camera {
   Camera(const std::string &name) : name(name) {}
@@ -47,9 +52,13 @@ struct Scene {
 
   std::unordered_map<std::string, Mesh *> _meshes_by_name;
 
-  void sort_by_material();
+  // adds a draw command for every submesh of the meshes inside the view frustum, keyed on
+  // technique, material and view depth
+  void submit(RenderQueue *queue, int pass, GraphicsObjectHandle technique_handle, const Effect *effect);
 
-  void render(DeferredContext *ctx, Effect *effect, GraphicsObjectHandle technique_handle);
+  // draws the meshes inside the view frustum with the software rasterizer, shaded with their
+  // materials' diffuse color. The cpu geometry is only kept with WITH_SOFTWARE_RASTERIZER
+  void render_software(SoftwareRasterizer *rasterizer, const XMFLOAT4X4 &view_proj);
 
   XMFLOAT4 ambient;
   std::vector<Mesh *> meshes;
@@ -59,5 +68,34 @@ struct Scene {
   // TODO: move this to material mgr
   std::vector<Material *> materials;
 
-  std::map<GraphicsObjectHandle, std::vector<SubMesh*>> _submesh_by_material;
+  PropertyId _view_mtx_id;
+  PropertyId _proj_mtx_id;
+
+  // world space bounds of the meshes, updated with the meshes
+  void update_bounds();
+  FrustumCuller *_culler;
+  std::vector<int> _visible;
+
+  // hierarchy over the same bounds, for picking and region queries. It's built once on load,
+  // and only refitted when animated meshes move
+  const Bvh &bvh() const { return *_bvh; }
+  Bvh *_bvh;
+  std::vector<XMFLOAT3> _world_centers;
+  std::vector<XMFLOAT3> _world_extents;
+  bool _has_animated_meshes;
+
+  // removes the meshes hidden behind the occluders from '_visible'. The occluders are only
+  // rasterized again when the camera or the meshes have moved
+  int cull_occluded(const XMFLOAT4X4 &view_proj, int num_visible);
+  OcclusionBuffer *_occlusion;
+  std::vector<int> _occluders;
+  XMFLOAT4X4 _occlusion_view_proj;
+  bool _occlusion_dirty;
+  // all the frames that were culled, and the ones where the occluders were rasterized
+  int _occlusion_frames;
+  int _occlusion_raster_frames;
+  int64 _occlusion_tested;
+  int64 _occlusion_culled;
+  int64 _occlusion_raster_ticks;
+  int64 _occlusion_test_ticks;
 };
@@ -20,6 +20,22 @@ struct ResourceView {
 
 typedef std::array<ResourceView, MAX_TEXTURES> ResourceViewArray;
 
+// max number of instances drawn with a single call
+static const int MAX_INSTANCES = 1024;
+
+// Per instance variables, read by the shader from a "PerInstance" structured buffer
+// indexed by SV_InstanceID, which the quad_base_instanced vertex shader passes on. Only
+// valid if the shader declares such a buffer.
+struct InstanceBuffer {
+  InstanceBuffer() : stride(0), slot(-1), capacity(0) {}
+  bool is_valid() const { return slot != -1 && handle.is_valid(); }
+  int stride;
+  int slot;
+  int capacity;
+  GraphicsObjectHandle handle;
+  std::vector<CBufferVariable> vars;
+};
+
 class Shader {
   friend class TechniqueParser;
   friend class Technique;
@@ -37,6 +53,7 @@ public:
   CBuffer &material_cbuffer() { return _material_cbuffer; }
   CBuffer &system_cbuffer() { return _system_cbuffer; }
   CBuffer &instance_cbuffer() { return _instance_cbuffer; }
+  const InstanceBuffer &instance_buffer() const { return _instance_buffer; }
   const std::vector<CBuffer *> cbuffers() const { return _cbuffers; }
   const SamplerArray &samplers() { return _samplers; }
   const ResourceViewArray &resource_views() { return _resource_views; }
@@ -58,6 +75,7 @@ private:
   CBuffer _material_cbuffer;
   CBuffer _system_cbuffer;
   CBuffer _instance_cbuffer;
+  InstanceBuffer _instance_buffer;
   std::vector<CBuffer *> _cbuffers;
   std::string _source_filename;
 #if _DEBUG
@@ -6,6 +6,9 @@
 #include "graphics.hpp"
 #include "logger.hpp"
 #include "dx_utils.hpp"
+#include "path_utils.hpp"
+#include "file_utils.hpp"
+#include "resource_interface.hpp"
 
 using namespace std;
 using namespace boost::assign;
@@ -114,93 +117,164 @@ static PropertySource::Enum source_from_name(const std::string &cbuffer_name) {
   return PropertySource::kUnknown;
 }
 
-bool ShaderReflection::do_reflection(char *text, int textLen, Shader *shader, ShaderTemplate *shader_template, const vector<char> &obj) {
+namespace {
+
+  // Binary sidecar format. All integers are stored little endian, and strings are
+  // stored as a uint16 length followed by the characters (no terminator)
+  const uint32 CACHE_MAGIC = 'KREF';
+  const uint32 CACHE_VERSION = 3;
+
+#pragma pack(push, 1)
+  struct CacheHeader {
+    uint32 magic;
+    uint32 version;
+    uint32 obj_hash;  // hash of the shader bytecode the sidecar was generated from
+    int num_cbuffers;
+    int num_bindings;
+    int num_input_elements;
+    int has_input_signature;
+  };
+#pragma pack(pop)
+
+  class CacheWriter {
+  public:
+    template<typename T>
+    void write(const T &t) {
+      const char *p = (const char *)&t;
+      _buf.insert(end(_buf), p, p + sizeof(T));
+    }
+
+    void write_string(const string &str) {
+      KASSERT(str.size() < (1 << 16));
+      write((uint16)str.size());
+      _buf.insert(end(_buf), begin(str), end(str));
+    }
+
+    const vector<char> &buf() const { return _buf; }
+
+  private:
+    vector<char> _buf;
+  };
+
+  class CacheReader {
+  public:
+    CacheReader(const vector<char> &buf) : _cur(buf.data()), _end(buf.data() + buf.size()) {}
+
+    template<typename T>
+    bool read(T *t) {
+      if (remaining() < sizeof(T))
+        return false;
+      memcpy(t, _cur, sizeof(T));
+      _cur += sizeof(T);
+      return true;
+    }
+
+    bool read_string(string *str) {
+      uint16 len;
+      if (!read(&len) || remaining() < len)
+        return false;
+      str->assign(_cur, len);
+      _cur += len;
+      return true;
+    }
+
+    // reads an element count, which can't be negative, or more than the remaining bytes
+    // could hold, so a corrupt count fails here instead of in a huge allocation
+    bool read_count(int *count, size_t min_elem_size) {
+      return read(count) && *count >= 0 && (size_t)*count <= remaining() / min_elem_size;
+    }
+
+    size_t remaining() const { return _end - _cur; }
+
+  private:
+    const char *_cur;
+    const char *_end;
+  };
+
+  // The bind points index fixed size arrays, in the shader and in the context, so a binding
+  // past the stage's slots would write past them
+  bool valid_bind_point(ShaderReflectionData::BindingType type, int bind_point) {
+    int num_slots = MAX_TEXTURES;
+    if (type == ShaderReflectionData::kBindCBuffer)
+      num_slots = D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT;
+    else if (type == ShaderReflectionData::kBindSampler)
+      num_slots = MAX_SAMPLERS;
+    return bind_point >= 0 && bind_point < num_slots;
+  }
+}
+
+bool ShaderReflection::parse_header(char *text, int textLen, bool parse_input_signature, ShaderReflectionData *out) {
 
   // extract the relevant text
   vector<vector<Substring>> input;
   trim_input(text, textLen, &input);
 
-  set<string> cbuffers_found;
-
   // parse it!
   for (size_t i = 0; i < input.size(); ++i) {
     auto &cur_line = input[i];
 
     if (cur_line[0] == "cbuffer") {
-      string cbuffer_name(cur_line[1].to_string());
-      CBuffer cbuffer;
-      auto source = source_from_name(cbuffer_name);
-      int size = 0;
+      auto &cbuffer = dummy_push_back(&out->cbuffers);
+      cbuffer.name = cur_line[1].to_string();
 
       for (i += 2; i < input.size(); ++i) {
         auto &row = input[i];
         if (row[0] == "}")
           break;
         if (row.size() == 7 || row.size() == 8) {
-          bool unused = row.size() == 8 && row[7] == "[unused]";
-          if (!unused) {
-            string name = string(row[1].start, row[1].len - 1); // skip trailing ';'
-            // strip any []
-            int bracket = name.find('[');
-            if (bracket != name.npos) {
-              name = string(name.c_str(), bracket);
-            }
-
-            // Get the parameter source from the cbuffer name
-            auto source = source_from_name(cbuffer_name);
-
-            // If the cbuffer isn't qualified with a source name, the just assume that
-            // it's going to be filled in by hand
-
-            if (source == PropertySource::kUnknown) {
-              LOG_INFO_LN("Untyped cbuffer found: %s", cbuffer_name.c_str());
-            }
-
-            if (cbuffers_found.find(cbuffer_name) != cbuffers_found.end()) {
-              LOG_ERROR_LN("Found duplicate cbuffer: %s", cbuffer_name.c_str());
-              return false;
-            }
-
-            int ofs = atoi(row[4].c_str());
-            int len = atoi(row[6].c_str());
-            size = max(size, ofs + len);
-            PropertyId id = ~0;
-            string class_id;
-            if (source != PropertySource::kUnknown) {
-              // The id is either a classifer (for mesh/material), or a real id in the system case
-              class_id = PropertySource::qualify_name(name, source);
-              int var_size = source == PropertySource::kMesh ? sizeof(int) : len;
-              id = PROPERTY_MANAGER.get_or_create_raw(class_id.c_str(), var_size, nullptr);
-            }
-            CBufferVariable var(ofs, len, id);
-#ifdef _DEBUG
-            var.name = class_id.empty() ? name : class_id;
-#endif
-            cbuffer.vars.emplace_back(var);
-          } else {
-            // we need the size even for unused elements
-            int ofs = atoi(row[4].c_str());
-            int len = atoi(row[6].c_str());
-            size = max(size, ofs + len);
+          ShaderReflectionData::Variable var;
+          var.used = !(row.size() == 8 && row[7] == "[unused]");
+          var.name = string(row[1].start, row[1].len - 1); // skip trailing ';'
+          // strip any []
+          int bracket = var.name.find('[');
+          if (bracket != var.name.npos) {
+            var.name = string(var.name.c_str(), bracket);
           }
+          var.ofs = atoi(row[4].c_str());
+          var.len = atoi(row[6].c_str());
+          cbuffer.vars.push_back(var);
         }
       }
 
-      if (size > 0) {
-        cbuffer.handle = GFX_create_buffer(D3D11_BIND_CONSTANT_BUFFER, size, true, nullptr, 0);
-        cbuffer.staging.resize(size);
+    } else if (cur_line.size() == 5 && cur_line[0] == "Resource" && cur_line[1] == "bind" && cur_line[2] == "info") {
 
-        if (source != PropertySource::kUnknown)
-          shader->set_cbuffer(source, cbuffer);
-        shader->add_named_cbuffer(cbuffer_name.c_str(), cbuffer);
-      } else {
-        LOG_WARNING_LN("Zero size cbuffer found: ", cbuffer_name.c_str());
+      // structured buffer. the layout is given as a struct, where each member only has
+      // an offset, so the sizes are derived from the following member (or the element size)
+      auto &sbuffer = dummy_push_back(&out->cbuffers);
+      sbuffer.name = cur_line[4].to_string();
+
+      for (i += 1; i < input.size(); ++i) {
+        auto &row = input[i];
+        if (row[0] == "}") {
+          if (row.size() == 7 && row[1] == "$Element;") {
+            sbuffer.structured_stride = atoi(row[6].c_str());
+            continue;
+          }
+          break;
+        }
+
+        if (row.size() == 5 && row[2] == "//" && row[3] == "Offset:") {
+          ShaderReflectionData::Variable var;
+          var.used = true;
+          var.name = string(row[1].start, row[1].len - 1); // skip trailing ';'
+          int bracket = var.name.find('[');
+          if (bracket != var.name.npos) {
+            var.name = string(var.name.c_str(), bracket);
+          }
+          var.ofs = atoi(row[4].c_str());
+          var.len = 0;
+          sbuffer.vars.push_back(var);
+        }
       }
 
-    } else if (shader->type() == ShaderType::kVertexShader && cur_line[0] == "Input" && cur_line[1] == "signature:") {
+      auto &vars = sbuffer.vars;
+      for (size_t j = 0; j < vars.size(); ++j)
+        vars[j].len = (j + 1 < vars.size() ? vars[j+1].ofs : sbuffer.structured_stride) - vars[j].ofs;
+
+    } else if (parse_input_signature && cur_line[0] == "Input" && cur_line[1] == "signature:") {
 
       // Parse input layout
-      vector<D3D11_INPUT_ELEMENT_DESC> inputs;
+      out->has_input_signature = true;
       for (i += 3; i < input.size(); ++i) {
         auto &row = input[i];
         if (row.size() < 6) {
@@ -208,8 +282,12 @@ bool ShaderReflection::do_reflection(char *text, int textLen, Shader *shader, Sh
           break;
         }
 
+        // system generated values (like SV_InstanceID) aren't part of the input layout
+        if (row[4] == "VERTID" || row[4] == "INSTID")
+          continue;
+
         // determine the format from the type and mask
-        DXGI_FORMAT fmt;
+        DXGI_FORMAT fmt = DXGI_FORMAT_UNKNOWN;
         int count = row[2].len;
         if (row[5] == "float") {
           switch (count) {
@@ -219,16 +297,16 @@ bool ShaderReflection::do_reflection(char *text, int textLen, Shader *shader, Sh
             case 4: fmt = DXGI_FORMAT_R32G32B32A32_FLOAT; break;
           }
         } else {
-          LOG_ERROR_LN("Unknown type: %s", row[5]);
+          LOG_ERROR_LN("Unknown type: %s", row[5].c_str());
         }
-        inputs.push_back(CD3D11_INPUT_ELEMENT_DESC(row[0].c_str(), atoi(row[1].c_str()), fmt, 0));
-      }
 
-      shader->_input_layout = GRAPHICS.create_input_layout(FROM_HERE, inputs, obj);
-      if (!shader->_input_layout.is_valid()) {
-        LOG_ERROR_LN("Invalid input layout");
-        return false;
+        ShaderReflectionData::InputElement elem;
+        elem.semantic = row[0].to_string();
+        elem.index = atoi(row[1].c_str());
+        elem.format = fmt;
+        out->input_elements.push_back(elem);
       }
+
     } else if (cur_line[0] == "Resource" && cur_line[1] == "Bindings:") {
 
       for (i += 3; i < input.size(); ++i) {
@@ -238,56 +316,338 @@ bool ShaderReflection::do_reflection(char *text, int textLen, Shader *shader, Sh
           break;
         }
 
-        const string &name = row[0].to_string();
-        const string &type = row[1].to_string();
-        int bind_point = atoi(row[4].c_str());
-
-        if (type == "cbuffer") {
-          // arrange the cbuffer in the correct slot
-          shader->set_cbuffer_slot(source_from_name(name), bind_point);
-
-        } else if (type == "texture") {
-          ResourceViewParam *param = shader_template->find_resource_view(name.c_str());
-          // If we can't find a resource, assume it's going to be set by hand
-          if (!param) {
-            LOG_INFO_LN("Found unbound resource: %s", name.c_str());
-          } else {
-            string &friendly = param->friendly_name;
-            string qualified_name = PropertySource::qualify_name(friendly.empty() ? param->name : friendly, param->source);
-
-            if (param->source == PropertySource::kMaterial) {
-              auto pid = PROPERTY_MANAGER.get_or_create_placeholder(qualified_name);
-              shader->_resource_views2.material_views.emplace_back(ResourceId<PropertyId>(pid, bind_point, name));
-
-            } else if (param->source == PropertySource::kSystem) {
-              GraphicsObjectHandle h = GRAPHICS.find_resource(name);
-              shader->_resource_views2.system_views.emplace_back(ResourceId<GraphicsObjectHandle>(h, bind_point, name));
-
-            } else if (param->source == PropertySource::kUser) {
-              shader->_resource_views2.user_views.push_back(bind_point);
-
-            } else {
-              LOG_WARNING_LN("Unsupported property source for texture: %s", name.c_str());
-            }
-
-            auto &rv = shader->_resource_views;
-            rv[bind_point].source = param->source;
-            rv[bind_point].used = true;
-
-            if (param->source == PropertySource::kSystem) {
-              rv[bind_point].class_id = PROPERTY_MANAGER.get_or_create<GraphicsObjectHandle>(qualified_name);
-            } else {
-              rv[bind_point].class_id = PROPERTY_MANAGER.get_or_create_placeholder(qualified_name);
-            }
-          }
+        ShaderReflectionData::Binding binding;
+        if (row[1] == "cbuffer")
+          binding.type = ShaderReflectionData::kBindCBuffer;
+        else if (row[1] == "texture" && row[2] == "struct")
+          binding.type = ShaderReflectionData::kBindStructuredBuffer;
+        else if (row[1] == "texture")
+          binding.type = ShaderReflectionData::kBindTexture;
+        else if (row[1] == "sampler")
+          binding.type = ShaderReflectionData::kBindSampler;
+        else
+          continue;
+
+        binding.name = row[0].to_string();
+        binding.bind_point = atoi(row[4].c_str());
+        if (!valid_bind_point(binding.type, binding.bind_point)) {
+          LOG_ERROR_LN("%s is bound to slot %d, past the slots the engine supports", binding.name.c_str(), binding.bind_point);
+          return false;
+        }
+        out->bindings.push_back(binding);
+      }
+    }
+  }
+
+  return true;
+}
+
+void ShaderReflection::write_cache(uint32 obj_hash, const ShaderReflectionData &data, vector<char> *out) {
+
+  CacheWriter w;
+  CacheHeader header;
+  header.magic = CACHE_MAGIC;
+  header.version = CACHE_VERSION;
+  header.obj_hash = obj_hash;
+  header.num_cbuffers = (int)data.cbuffers.size();
+  header.num_bindings = (int)data.bindings.size();
+  header.num_input_elements = (int)data.input_elements.size();
+  header.has_input_signature = data.has_input_signature ? 1 : 0;
+  w.write(header);
+
+  for (auto it = begin(data.cbuffers); it != end(data.cbuffers); ++it) {
+    w.write_string(it->name);
+    w.write(it->structured_stride);
+    w.write((int)it->vars.size());
+    for (auto jt = begin(it->vars); jt != end(it->vars); ++jt) {
+      w.write_string(jt->name);
+      w.write(jt->ofs);
+      w.write(jt->len);
+      w.write((uint8)jt->used);
+    }
+  }
+
+  for (auto it = begin(data.bindings); it != end(data.bindings); ++it) {
+    w.write_string(it->name);
+    w.write((uint8)it->type);
+    w.write(it->bind_point);
+  }
+
+  for (auto it = begin(data.input_elements); it != end(data.input_elements); ++it) {
+    w.write_string(it->semantic);
+    w.write(it->index);
+    w.write((int)it->format);
+  }
 
-        } else if (type == "sampler") {
-          GraphicsObjectHandle sampler = GRAPHICS.find_sampler(name);
-          KASSERT(sampler.is_valid());
-          shader->_samplers[bind_point] = sampler;
-          //shader->_first_sampler = min(shader->_first_sampler, bind_point);
+  out->assign(begin(w.buf()), end(w.buf()));
+}
+
+bool ShaderReflection::save_cache(const char *filename, uint32 obj_hash, const ShaderReflectionData &data) {
+  vector<char> buf;
+  write_cache(obj_hash, data, &buf);
+  return save_file(filename, buf.data(), (int)buf.size());
+}
+
+bool ShaderReflection::load_cache(const vector<char> &buf, uint32 obj_hash, ShaderReflectionData *out) {
+  // anything that doesn't parse is a cache miss, and leaves 'out' empty
+  if (!read_cache(buf, obj_hash, out)) {
+    *out = ShaderReflectionData();
+    return false;
+  }
+  return true;
+}
+
+bool ShaderReflection::read_cache(const vector<char> &buf, uint32 obj_hash, ShaderReflectionData *out) {
+
+  // the smallest encoding of each element, used to bound the counts
+  const size_t cMinVarSize = sizeof(uint16) + 2 * sizeof(int) + sizeof(uint8);
+  const size_t cMinCBufferSize = sizeof(uint16) + 2 * sizeof(int);
+  const size_t cMinBindingSize = sizeof(uint16) + sizeof(uint8) + sizeof(int);
+  const size_t cMinInputElementSize = sizeof(uint16) + 2 * sizeof(int);
+
+  CacheReader r(buf);
+  CacheHeader header;
+  if (!r.read(&header) || header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.obj_hash != obj_hash)
+    return false;
+
+  if (header.num_cbuffers < 0 || header.num_bindings < 0 || header.num_input_elements < 0)
+    return false;
+
+  const size_t min_size = header.num_cbuffers * cMinCBufferSize + header.num_bindings * cMinBindingSize
+    + header.num_input_elements * cMinInputElementSize;
+  if (header.num_cbuffers > (int)r.remaining() || header.num_bindings > (int)r.remaining() ||
+      header.num_input_elements > (int)r.remaining() || min_size > r.remaining())
+    return false;
+
+  out->has_input_signature = !!header.has_input_signature;
+
+  out->cbuffers.resize(header.num_cbuffers);
+  for (int i = 0; i < header.num_cbuffers; ++i) {
+    auto &cbuffer = out->cbuffers[i];
+    int num_vars;
+    if (!r.read_string(&cbuffer.name) || !r.read(&cbuffer.structured_stride) || !r.read_count(&num_vars, cMinVarSize))
+      return false;
+    if (cbuffer.structured_stride < 0)
+      return false;
+    cbuffer.vars.resize(num_vars);
+    for (int j = 0; j < num_vars; ++j) {
+      auto &var = cbuffer.vars[j];
+      uint8 used;
+      if (!r.read_string(&var.name) || !r.read(&var.ofs) || !r.read(&var.len) || !r.read(&used))
+        return false;
+      if (var.ofs < 0 || var.len < 0)
+        return false;
+      var.used = !!used;
+    }
+  }
+
+  out->bindings.resize(header.num_bindings);
+  for (int i = 0; i < header.num_bindings; ++i) {
+    auto &binding = out->bindings[i];
+    uint8 type;
+    if (!r.read_string(&binding.name) || !r.read(&type) || !r.read(&binding.bind_point))
+      return false;
+    if (type > ShaderReflectionData::kBindStructuredBuffer)
+      return false;
+    binding.type = (ShaderReflectionData::BindingType)type;
+    if (!valid_bind_point(binding.type, binding.bind_point))
+      return false;
+  }
+
+  out->input_elements.resize(header.num_input_elements);
+  for (int i = 0; i < header.num_input_elements; ++i) {
+    auto &elem = out->input_elements[i];
+    int fmt;
+    if (!r.read_string(&elem.semantic) || !r.read(&elem.index) || !r.read(&fmt))
+      return false;
+    elem.format = (DXGI_FORMAT)fmt;
+  }
+
+  // trailing bytes mean the sidecar isn't what we think it is
+  return r.remaining() == 0;
+}
+
+bool ShaderReflection::do_reflection(const string &obj_filename, Shader *shader, ShaderTemplate *shader_template, const vector<char> &obj) {
+
+  string header_file = Path::replace_extension(obj_filename, "h");
+  string cache_file = Path::replace_extension(obj_filename, "refl");
+
+  // The sidecar is keyed on the bytecode, so a stale sidecar (or, in the packed case, a
+  // missing one that resolves to some other file) is treated as a cache miss
+  uint32 obj_hash = fnv_hash(obj.data(), (int)obj.size());
+
+  ShaderReflectionData data;
+  vector<char> buf;
+  if (!RESOURCE_MANAGER.load_file(cache_file.c_str(), &buf) || !load_cache(buf, obj_hash, &data)) {
+
+    // cache miss, so parse the header file
+    data = ShaderReflectionData();
+    vector<char> text;
+    if (!RESOURCE_MANAGER.load_file(header_file.c_str(), &text)) {
+      LOG_ERROR_LN("Unable to load .h file: %s", header_file.c_str());
+      return false;
+    }
+    text.push_back('\0');
+
+    if (!parse_header(text.data(), (int)text.size() - 1, shader->type() == ShaderType::kVertexShader, &data))
+      return false;
+
+#if WITH_UNPACKED_RESOUCES
+    if (!save_cache(cache_file.c_str(), obj_hash, data))
+      LOG_WARNING_LN("Unable to save reflection cache: %s", cache_file.c_str());
+#endif
+  }
+
+  return apply(data, shader, shader_template, obj);
+}
+
+bool ShaderReflection::apply(const ShaderReflectionData &data, Shader *shader, ShaderTemplate *shader_template, const vector<char> &obj) {
+
+  set<string> cbuffers_found;
+
+  for (auto it = begin(data.cbuffers); it != end(data.cbuffers); ++it) {
+    const string &cbuffer_name = it->name;
+    CBuffer cbuffer;
+    // Get the parameter source from the cbuffer name
+    auto source = source_from_name(cbuffer_name);
+    int size = 0;
+
+    if (cbuffers_found.find(cbuffer_name) != cbuffers_found.end()) {
+      LOG_ERROR_LN("Found duplicate cbuffer: %s", cbuffer_name.c_str());
+      return false;
+    }
+    cbuffers_found.insert(cbuffer_name);
+
+    // If the cbuffer isn't qualified with a source name, the just assume that
+    // it's going to be filled in by hand
+    if (source == PropertySource::kUnknown) {
+      LOG_INFO_LN("Untyped cbuffer found: %s", cbuffer_name.c_str());
+    }
+
+    if (it->structured_stride) {
+      if (source != PropertySource::kInstance) {
+        LOG_INFO_LN("Structured buffer filled by hand: %s", cbuffer_name.c_str());
+        continue;
+      }
+
+      InstanceBuffer &ib = shader->_instance_buffer;
+      ib.stride = it->structured_stride;
+      ib.capacity = MAX_INSTANCES;
+      ib.handle = GRAPHICS.create_structured_buffer(FROM_HERE, ib.stride, ib.capacity, true, true);
+      for (auto jt = begin(it->vars); jt != end(it->vars); ++jt) {
+        string class_id = PropertySource::qualify_name(jt->name, source);
+        CBufferVariable var(jt->ofs, jt->len, PROPERTY_MANAGER.get_or_create_raw(class_id.c_str(), jt->len, nullptr));
+#ifdef _DEBUG
+        var.name = class_id;
+#endif
+        ib.vars.emplace_back(var);
+      }
+      continue;
+    }
+
+    for (auto jt = begin(it->vars); jt != end(it->vars); ++jt) {
+      // we need the size even for unused elements
+      size = max(size, jt->ofs + jt->len);
+      if (!jt->used)
+        continue;
+
+      PropertyId id = ~0;
+      string class_id;
+      if (source != PropertySource::kUnknown) {
+        // The id is either a classifer (for mesh/material), or a real id in the system case
+        class_id = PropertySource::qualify_name(jt->name, source);
+        int var_size = source == PropertySource::kMesh ? sizeof(int) : jt->len;
+        id = PROPERTY_MANAGER.get_or_create_raw(class_id.c_str(), var_size, nullptr);
+      }
+      CBufferVariable var(jt->ofs, jt->len, id);
+#ifdef _DEBUG
+      var.name = class_id.empty() ? jt->name : class_id;
+#endif
+      cbuffer.vars.emplace_back(var);
+    }
+
+    if (size > 0) {
+      cbuffer.handle = GFX_create_buffer(D3D11_BIND_CONSTANT_BUFFER, size, true, nullptr, 0);
+      cbuffer.staging.resize(size);
+
+      if (source != PropertySource::kUnknown)
+        shader->set_cbuffer(source, cbuffer);
+      shader->add_named_cbuffer(cbuffer_name.c_str(), cbuffer);
+    } else {
+      LOG_WARNING_LN("Zero size cbuffer found: %s", cbuffer_name.c_str());
+    }
+  }
+
+  for (auto it = begin(data.bindings); it != end(data.bindings); ++it) {
+
+    const string &name = it->name;
+    int bind_point = it->bind_point;
+
+    if (it->type == ShaderReflectionData::kBindCBuffer) {
+      // arrange the cbuffer in the correct slot
+      shader->set_cbuffer_slot(source_from_name(name), bind_point);
+
+    } else if (it->type == ShaderReflectionData::kBindStructuredBuffer && shader->_instance_buffer.stride && source_from_name(name) == PropertySource::kInstance) {
+      shader->_instance_buffer.slot = bind_point;
+
+    } else if (it->type == ShaderReflectionData::kBindTexture || it->type == ShaderReflectionData::kBindStructuredBuffer) {
+      ResourceViewParam *param = shader_template->find_resource_view(name.c_str());
+      const PropertyType::Enum expected = it->type == ShaderReflectionData::kBindTexture ? PropertyType::kTexture2d : PropertyType::kStructuredBuffer;
+      // If we can't find a resource, assume it's going to be set by hand
+      if (!param) {
+        LOG_INFO_LN("Found unbound resource: %s", name.c_str());
+      } else {
+        if (LOWORD(param->type) != expected)
+          LOG_WARNING_LN("Resource %s is declared as a %s, but the shader binds it as a %s", name.c_str(),
+            expected == PropertyType::kTexture2d ? "structured_buffer" : "texture2d",
+            expected == PropertyType::kTexture2d ? "texture2d" : "structured_buffer");
+
+        string &friendly = param->friendly_name;
+        string qualified_name = PropertySource::qualify_name(friendly.empty() ? param->name : friendly, param->source);
+
+        if (param->source == PropertySource::kMaterial) {
+          auto pid = PROPERTY_MANAGER.get_or_create_placeholder(qualified_name);
+          shader->_resource_views2.material_views.emplace_back(ResourceId<PropertyId>(pid, bind_point, name));
+
+        } else if (param->source == PropertySource::kSystem) {
+          GraphicsObjectHandle h = GRAPHICS.find_resource(name);
+          shader->_resource_views2.system_views.emplace_back(ResourceId<GraphicsObjectHandle>(h, bind_point, name));
+
+        } else if (param->source == PropertySource::kUser) {
+          shader->_resource_views2.user_views.push_back(bind_point);
+
+        } else {
+          LOG_WARNING_LN("Unsupported property source for texture: %s", name.c_str());
+        }
+
+        auto &rv = shader->_resource_views;
+        rv[bind_point].source = param->source;
+        rv[bind_point].used = true;
+
+        if (param->source == PropertySource::kSystem) {
+          rv[bind_point].class_id = PROPERTY_MANAGER.get_or_create<GraphicsObjectHandle>(qualified_name);
+        } else {
+          rv[bind_point].class_id = PROPERTY_MANAGER.get_or_create_placeholder(qualified_name);
         }
       }
+
+    } else if (it->type == ShaderReflectionData::kBindSampler) {
+      GraphicsObjectHandle sampler = GRAPHICS.find_sampler(name);
+      KASSERT(sampler.is_valid());
+      shader->_samplers[bind_point] = sampler;
+    }
+  }
+
+  if (data.has_input_signature) {
+    // the element descs point into the reflection data, which outlives the layout creation
+    vector<D3D11_INPUT_ELEMENT_DESC> inputs;
+    for (auto it = begin(data.input_elements); it != end(data.input_elements); ++it)
+      inputs.push_back(CD3D11_INPUT_ELEMENT_DESC(it->semantic.c_str(), it->index, it->format, 0));
+
+    shader->_input_layout = GRAPHICS.create_input_layout(FROM_HERE, inputs, obj);
+    if (!shader->_input_layout.is_valid()) {
+      LOG_ERROR_LN("Invalid input layout");
+      return false;
     }
   }
 
@@ -3,7 +3,65 @@
 class Shader;
 struct ShaderTemplate;
 
+// Reflection data extracted from the fxc generated header. This is what gets cached
+// in the binary sidecar, so it only contains plain data, and no run-time handles or ids.
+struct ShaderReflectionData {
+
+  enum BindingType {
+    kBindCBuffer,
+    kBindTexture,
+    kBindSampler,
+    kBindStructuredBuffer,
+  };
+
+  struct Variable {
+    std::string name;
+    int ofs;
+    int len;
+    bool used;
+  };
+
+  struct CBufferDesc {
+    CBufferDesc() : structured_stride(0) {}
+    std::string name;
+    std::vector<Variable> vars;
+    int structured_stride;  // element size if this is a structured buffer, and 0 for cbuffers
+  };
+
+  struct InputElement {
+    std::string semantic;
+    int index;
+    DXGI_FORMAT format;
+  };
+
+  struct Binding {
+    std::string name;
+    BindingType type;
+    int bind_point;
+  };
+
+  ShaderReflectionData() : has_input_signature(false) {}
+
+  std::vector<CBufferDesc> cbuffers;
+  std::vector<Binding> bindings;
+  std::vector<InputElement> input_elements;
+  bool has_input_signature;
+};
+
 class ShaderReflection {
 public:
-  bool do_reflection(char *text, int textLen, Shader *shader, ShaderTemplate *shader_template, const std::vector<char> &obj);
+  // Reflects the shader in 'obj_filename', using the binary sidecar if it's up to date, and
+  // falling back to parsing the fxc generated header (and refreshing the sidecar) otherwise
+  bool do_reflection(const std::string &obj_filename, Shader *shader, ShaderTemplate *shader_template, const std::vector<char> &obj);
+
+  static bool parse_header(char *text, int textLen, bool parse_input_signature, ShaderReflectionData *out);
+  static void write_cache(uint32 obj_hash, const ShaderReflectionData &data, std::vector<char> *out);
+  static bool save_cache(const char *filename, uint32 obj_hash, const ShaderReflectionData &data);
+  // validates the counts and every read against the size of 'buf', and returns false for
+  // anything that doesn't parse, or belongs to other bytecode
+  static bool load_cache(const std::vector<char> &buf, uint32 obj_hash, ShaderReflectionData *out);
+
+private:
+  static bool read_cache(const std::vector<char> &buf, uint32 obj_hash, ShaderReflectionData *out);
+  bool apply(const ShaderReflectionData &data, Shader *shader, ShaderTemplate *shader_template, const std::vector<char> &obj);
 };
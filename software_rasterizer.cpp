@@ -0,0 +1,359 @@
+#include "stdafx.h"
+#include "software_rasterizer.hpp"
+#include "bitmap_utils.hpp"
+#include "logger.hpp"
+#include "xmath.hpp"
+
+using namespace std;
+
+namespace {
+  // a clipped triangle gains at most one vertex per plane
+  const int cMaxClippedVerts = 3 + 5;
+
+  XMFLOAT3 transform3(const XMFLOAT4X4 &m, const XMFLOAT3 &p) {
+    return XMFLOAT3(
+      m.m[0][0] * p.x + m.m[0][1] * p.y + m.m[0][2] * p.z + m.m[0][3],
+      m.m[1][0] * p.x + m.m[1][1] * p.y + m.m[1][2] * p.z + m.m[1][3],
+      m.m[2][0] * p.x + m.m[2][1] * p.y + m.m[2][2] * p.z + m.m[2][3]);
+  }
+
+  XMFLOAT4 transform4(const XMFLOAT4X4 &m, const XMFLOAT3 &p) {
+    return XMFLOAT4(
+      m.m[0][0] * p.x + m.m[0][1] * p.y + m.m[0][2] * p.z + m.m[0][3],
+      m.m[1][0] * p.x + m.m[1][1] * p.y + m.m[1][2] * p.z + m.m[1][3],
+      m.m[2][0] * p.x + m.m[2][1] * p.y + m.m[2][2] * p.z + m.m[2][3],
+      m.m[3][0] * p.x + m.m[3][1] * p.y + m.m[3][2] * p.z + m.m[3][3]);
+  }
+
+  // signed distances to the clip planes: near (z >= 0), and the sides (-w <= x, y <= w).
+  // Clipping to the sides keeps the screen coordinates small enough for the float edge functions
+  float clip_distance(const XMFLOAT4 &p, int plane) {
+    switch (plane) {
+      case 0: return p.z;
+      case 1: return p.w + p.x;
+      case 2: return p.w - p.x;
+      case 3: return p.w + p.y;
+      default: return p.w - p.y;
+    }
+  }
+
+  uint32 pack_color(float r, float g, float b, float a) {
+    return
+      (uint32)(min(max(a, 0.0f), 1.0f) * 255 + 0.5f) << 24 |
+      (uint32)(min(max(r, 0.0f), 1.0f) * 255 + 0.5f) << 16 |
+      (uint32)(min(max(g, 0.0f), 1.0f) * 255 + 0.5f) << 8 |
+      (uint32)(min(max(b, 0.0f), 1.0f) * 255 + 0.5f);
+  }
+
+  uint32 modulate(uint32 texel, const XMFLOAT4 &color) {
+    return pack_color(
+      ((texel >> 16) & 0xff) / 255.0f * color.x,
+      ((texel >> 8) & 0xff) / 255.0f * color.y,
+      (texel & 0xff) / 255.0f * color.z,
+      (texel >> 24) / 255.0f * color.w);
+  }
+
+  int wrap(float t, int size) {
+    return min(size - 1, (int)((t - floorf(t)) * size));
+  }
+}
+
+SoftwareRasterizer::SoftwareRasterizer()
+  : _width(0)
+  , _height(0)
+  , _tiles_x(0)
+  , _tiles_y(0)
+{
+  memset(&_view_proj, 0, sizeof(_view_proj));
+}
+
+void SoftwareRasterizer::resize(int width, int height) {
+  _width = width;
+  _height = height;
+  _tiles_x = (width + kTileSize - 1) / kTileSize;
+  _tiles_y = (height + kTileSize - 1) / kTileSize;
+  // the rows are padded to whole quads, so the last quad of a row can be stored without masking
+  _color.resize(_tiles_x * kTileSize * height);
+  _depth.resize(_tiles_x * kTileSize * height);
+  _bins.resize(_tiles_x * _tiles_y);
+  _tile_pixels.resize(_tiles_x * _tiles_y);
+}
+
+void SoftwareRasterizer::begin_frame(const XMFLOAT4X4 &view_proj, const XMFLOAT4 &clear_color) {
+  _view_proj = view_proj;
+  _triangles.clear();
+  for (size_t i = 0; i < _bins.size(); ++i)
+    _bins[i].clear();
+  fill(_color.begin(), _color.end(), pack_color(clear_color.x, clear_color.y, clear_color.z, clear_color.w));
+  fill(_depth.begin(), _depth.end(), 1.0f);
+}
+
+void SoftwareRasterizer::draw_indexed(const XMFLOAT4X4 &obj_to_world, const XMFLOAT3 *verts, const XMFLOAT2 *uvs, int num_verts,
+                                      const int *indices, int num_indices, const XMFLOAT4 &color, const Texture *texture) {
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+
+  if (!uvs)
+    texture = nullptr;
+
+  _world_verts.resize(num_verts);
+  _clip_verts.resize(num_verts);
+  for (int i = 0; i < num_verts; ++i) {
+    _world_verts[i] = transform3(obj_to_world, verts[i]);
+    Vertex &v = _clip_verts[i];
+    v.pos = transform4(_view_proj, _world_verts[i]);
+    v.u = uvs ? uvs[i].x : 0;
+    v.v = uvs ? uvs[i].y : 0;
+  }
+
+  const XMFLOAT3 light = normalize(XMFLOAT3(0.4f, 0.8f, -0.45f));
+  for (int i = 0; i + 2 < num_indices; i += 3) {
+    const int i0 = indices[i+0], i1 = indices[i+1], i2 = indices[i+2];
+
+    XMFLOAT4 shaded = color;
+    if (!texture) {
+      // both sides are lit the same, as both windings are drawn
+      const XMFLOAT3 n = cross(_world_verts[i1] - _world_verts[i0], _world_verts[i2] - _world_verts[i0]);
+      const float len = sqrtf(dot(n, n));
+      const float shade = 0.35f + 0.65f * (len > 0 ? fabsf(dot(n, light)) / len : 0);
+      shaded = XMFLOAT4(color.x * shade, color.y * shade, color.z * shade, color.w);
+    }
+
+    Vertex poly[cMaxClippedVerts];
+    poly[0] = _clip_verts[i0];
+    poly[1] = _clip_verts[i1];
+    poly[2] = _clip_verts[i2];
+    const int count = clip(poly, 3);
+    for (int j = 2; j < count; ++j)
+      setup(poly[0], poly[j-1], poly[j], shaded, texture);
+  }
+
+  _stats.triangles += num_indices / 3;
+  QueryPerformanceCounter(&end);
+  _stats.setup_ticks += end.QuadPart - start.QuadPart;
+}
+
+int SoftwareRasterizer::clip(Vertex *verts, int count) {
+  // most triangles are completely inside, and are passed through as they are
+  int outside = 0;
+  for (int plane = 0; plane < 5; ++plane) {
+    for (int i = 0; i < count; ++i) {
+      if (clip_distance(verts[i].pos, plane) < 0)
+        outside |= 1 << plane;
+    }
+  }
+  if (!outside)
+    return count;
+
+  Vertex tmp[cMaxClippedVerts];
+  for (int plane = 0; plane < 5 && count > 0; ++plane) {
+    if (!(outside & (1 << plane)))
+      continue;
+
+    int num_out = 0;
+    for (int i = 0; i < count; ++i) {
+      const Vertex &a = verts[i];
+      const Vertex &b = verts[(i + 1) % count];
+      const float da = clip_distance(a.pos, plane);
+      const float db = clip_distance(b.pos, plane);
+      if (da >= 0)
+        tmp[num_out++] = a;
+      if ((da >= 0) != (db >= 0)) {
+        const float t = da / (da - db);
+        Vertex &v = tmp[num_out++];
+        v.pos = XMFLOAT4(
+          a.pos.x + t * (b.pos.x - a.pos.x),
+          a.pos.y + t * (b.pos.y - a.pos.y),
+          a.pos.z + t * (b.pos.z - a.pos.z),
+          a.pos.w + t * (b.pos.w - a.pos.w));
+        v.u = a.u + t * (b.u - a.u);
+        v.v = a.v + t * (b.v - a.v);
+      }
+    }
+    count = num_out;
+    memcpy(verts, tmp, count * sizeof(Vertex));
+  }
+  return count;
+}
+
+void SoftwareRasterizer::setup(const Vertex &v0, const Vertex &v1, const Vertex &v2, const XMFLOAT4 &color, const Texture *texture) {
+  const Vertex *v[] = { &v0, &v1, &v2 };
+  float x[3], y[3], z[3], inv_w[3], u[3], t[3];
+  for (int i = 0; i < 3; ++i) {
+    const XMFLOAT4 &p = v[i]->pos;
+    if (p.w <= 0)
+      return;
+    inv_w[i] = 1 / p.w;
+    x[i] = (0.5f + 0.5f * p.x * inv_w[i]) * _width;
+    y[i] = (0.5f - 0.5f * p.y * inv_w[i]) * _height;
+    z[i] = p.z * inv_w[i];
+    u[i] = v[i]->u * inv_w[i];
+    t[i] = v[i]->v * inv_w[i];
+  }
+
+  // both windings are rasterized, so flip the clockwise ones
+  float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+  if (area == 0)
+    return;
+  if (area < 0) {
+    swap(x[1], x[2]);
+    swap(y[1], y[2]);
+    swap(z[1], z[2]);
+    swap(inv_w[1], inv_w[2]);
+    swap(u[1], u[2]);
+    swap(t[1], t[2]);
+    area = -area;
+  }
+
+  Triangle tri;
+  tri.min_x = max(0, (int)floorf(min(x[0], min(x[1], x[2]))));
+  tri.min_y = max(0, (int)floorf(min(y[0], min(y[1], y[2]))));
+  tri.max_x = min(_width - 1, (int)ceilf(max(x[0], max(x[1], x[2]))));
+  tri.max_y = min(_height - 1, (int)ceilf(max(y[0], max(y[1], y[2]))));
+  if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+    return;
+
+  for (int j = 0; j < 3; ++j) {
+    const int k = (j + 1) % 3;
+    tri.a[j] = y[j] - y[k];
+    tri.b[j] = x[k] - x[j];
+    tri.c[j] = x[j] * y[k] - x[k] * y[j];
+  }
+
+  auto plane = [&](const float *f, Plane *p) {
+    p->dx = ((f[1] - f[0]) * (y[2] - y[0]) - (f[2] - f[0]) * (y[1] - y[0])) / area;
+    p->dy = ((f[2] - f[0]) * (x[1] - x[0]) - (f[1] - f[0]) * (x[2] - x[0])) / area;
+    p->c = f[0] - p->dx * x[0] - p->dy * y[0];
+  };
+  plane(z, &tri.z);
+  plane(inv_w, &tri.inv_w);
+  plane(u, &tri.u);
+  plane(t, &tri.v);
+
+  tri.color = color;
+  tri.packed_color = pack_color(color.x, color.y, color.z, color.w);
+  tri.texture = texture;
+
+  const int idx = (int)_triangles.size();
+  _triangles.push_back(tri);
+  for (int ty = tri.min_y / kTileSize; ty <= tri.max_y / kTileSize; ++ty) {
+    for (int tx = tri.min_x / kTileSize; tx <= tri.max_x / kTileSize; ++tx)
+      _bins[ty * _tiles_x + tx].push_back(idx);
+  }
+}
+
+void SoftwareRasterizer::end_frame(bool parallel) {
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+
+  // every tile is only touched by its own task, so they don't need any synchronization
+  const int num_tiles = _tiles_x * _tiles_y;
+  if (parallel) {
+    Concurrency::parallel_for(0, num_tiles, [&](int tile) { rasterize_tile(tile); });
+  } else {
+    for (int i = 0; i < num_tiles; ++i)
+      rasterize_tile(i);
+  }
+
+  QueryPerformanceCounter(&end);
+  _stats.raster_ticks += end.QuadPart - start.QuadPart;
+  _stats.triangles_drawn += _triangles.size();
+  for (int i = 0; i < num_tiles; ++i)
+    _stats.pixels += _tile_pixels[i];
+  ++_stats.frames;
+}
+
+void SoftwareRasterizer::rasterize_tile(int tile) {
+  const int tile_x0 = (tile % _tiles_x) * kTileSize;
+  const int tile_y0 = (tile / _tiles_x) * kTileSize;
+  const int stride = pitch();
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+  const __m128 four = _mm_set1_ps(4);
+  int64 num_pixels = 0;
+
+  const vector<int> &bin = _bins[tile];
+  for (size_t i = 0; i < bin.size(); ++i) {
+    const Triangle &tri = _triangles[bin[i]];
+    // the tiles start on a multiple of 4, so aligning the start keeps the quads inside it
+    const int x0 = max(tile_x0, tri.min_x) & ~3;
+    const int x1 = min(tile_x0 + kTileSize - 1, tri.max_x);
+    const int y0 = max(tile_y0, tri.min_y);
+    const int y1 = min(tile_y0 + kTileSize - 1, tri.max_y);
+
+    const __m128 a0 = _mm_set1_ps(tri.a[0]), a1 = _mm_set1_ps(tri.a[1]), a2 = _mm_set1_ps(tri.a[2]);
+    const __m128 step0 = _mm_mul_ps(a0, four), step1 = _mm_mul_ps(a1, four), step2 = _mm_mul_ps(a2, four);
+    const __m128 dzdx = _mm_set1_ps(tri.z.dx);
+    const __m128 step_z = _mm_mul_ps(dzdx, four);
+    const __m128 px = _mm_add_ps(_mm_set1_ps((float)x0), offsets);
+
+    // the flat color is moved around as the bits of a float, which the logic ops leave alone
+    const __m128 flat = _mm_load1_ps((const float *)&tri.packed_color);
+
+    for (int y = y0; y <= y1; ++y) {
+      // evaluate the edge functions and depth at the pixel centers of the first quad, and step from there
+      const float py = y + 0.5f;
+      __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), _mm_set1_ps(tri.b[0] * py + tri.c[0]));
+      __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), _mm_set1_ps(tri.b[1] * py + tri.c[1]));
+      __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), _mm_set1_ps(tri.b[2] * py + tri.c[2]));
+      __m128 z = _mm_add_ps(_mm_mul_ps(dzdx, px), _mm_set1_ps(tri.z.c + tri.z.dy * py));
+
+      float *depth_row = &_depth[y * stride];
+      uint32 *color_row = &_color[y * stride];
+      for (int x = x0; x <= x1; x += 4) {
+        const __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+        const __m128 old_depth = _mm_loadu_ps(depth_row + x);
+        const __m128 pass = _mm_and_ps(inside, _mm_cmplt_ps(z, old_depth));
+        int mask = _mm_movemask_ps(pass);
+        if (mask) {
+          _mm_storeu_ps(depth_row + x, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old_depth)));
+          num_pixels += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + (mask >> 3);
+
+          if (!tri.texture) {
+            float *dst = (float *)(color_row + x);
+            _mm_storeu_ps(dst, _mm_or_ps(_mm_and_ps(pass, flat), _mm_andnot_ps(pass, _mm_loadu_ps(dst))));
+          } else {
+            const Texture &tex = *tri.texture;
+            while (mask) {
+              unsigned long bit;
+              _BitScanForward(&bit, mask);
+              const float fx = x + bit + 0.5f;
+              const float w = 1 / (tri.inv_w.dx * fx + tri.inv_w.dy * py + tri.inv_w.c);
+              const float u = (tri.u.dx * fx + tri.u.dy * py + tri.u.c) * w;
+              const float v = (tri.v.dx * fx + tri.v.dy * py + tri.v.c) * w;
+              const uint32 texel = tex.texels[wrap(v, tex.height) * tex.width + wrap(u, tex.width)];
+              color_row[x + bit] = modulate(texel, tri.color);
+              mask &= mask - 1;
+            }
+          }
+        }
+        e0 = _mm_add_ps(e0, step0);
+        e1 = _mm_add_ps(e1, step1);
+        e2 = _mm_add_ps(e2, step2);
+        z = _mm_add_ps(z, step_z);
+      }
+    }
+  }
+  _tile_pixels[tile] = num_pixels;
+}
+
+bool SoftwareRasterizer::save(const char *filename) const {
+  // drop the row padding
+  vector<uint32> packed(_width * _height);
+  const int stride = pitch();
+  for (int y = 0; y < _height; ++y)
+    memcpy(&packed[y * _width], &_color[y * stride], _width * sizeof(uint32));
+  return save_bmp32(filename, (uint8_t *)packed.data(), _width, _height);
+}
+
+void SoftwareRasterizer::log_stats() const {
+  if (!_stats.frames)
+    return;
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  const double secs = (double)(_stats.setup_ticks + _stats.raster_ticks) / freq.QuadPart;
+  LOG_INFO_LN("Software rasterizer: %.2f ms/frame (%.0f%% setup), %.2f Mtris/s (%.0f%% drawn), %.1f Mpixels/s",
+    1000 * secs / _stats.frames, 100.0 * _stats.setup_ticks / max<int64>(1, _stats.setup_ticks + _stats.raster_ticks),
+    _stats.triangles / secs / 1e6, 100.0 * _stats.triangles_drawn / max<int64>(1, _stats.triangles),
+    _stats.pixels / secs / 1e6);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+// Renders indexed triangles on the cpu, into its own color and depth buffers, so frames can
+// be produced without a device. It covers what the scene geometry needs: transforms, clipping,
+// a less-than depth test, and flat or textured shading. The triangles are set up and binned
+// per tile as they're drawn, and the tiles are rasterized in parallel at the end of the frame,
+// four pixels at a time with SSE. Every tile draws its triangles in submission order, so the
+// output doesn't depend on the number of threads.
+class SoftwareRasterizer {
+public:
+  enum {
+    kTileSize = 64,
+  };
+
+  // 32 bit BGRA texels, like the color buffer. Sampled with point filtering, and wrapped
+  struct Texture {
+    Texture() : width(0), height(0), texels(nullptr) {}
+    int width, height;
+    const uint32 *texels;
+  };
+
+  struct Stats {
+    Stats() : frames(0), triangles(0), triangles_drawn(0), pixels(0), setup_ticks(0), raster_ticks(0) {}
+    int64 frames;
+    // triangles submitted, and the ones left after clipping and culling
+    int64 triangles;
+    int64 triangles_drawn;
+    // pixels that passed the depth test
+    int64 pixels;
+    int64 setup_ticks;
+    int64 raster_ticks;
+  };
+
+  SoftwareRasterizer();
+
+  void resize(int width, int height);
+
+  // 'view_proj' uses the same convention as Frustum::from_view_proj. Clears the buffers and
+  // the binned triangles
+  void begin_frame(const XMFLOAT4X4 &view_proj, const XMFLOAT4 &clear_color);
+  // Transforms, clips, sets up and bins the triangles. 'obj_to_world' is transposed, like the
+  // mesh matrices. Without 'uvs' or 'texture', the triangles are flat shaded with 'color' and a
+  // fixed directional light, otherwise the texture is modulated by 'color'
+  void draw_indexed(const XMFLOAT4X4 &obj_to_world, const XMFLOAT3 *verts, const XMFLOAT2 *uvs, int num_verts,
+    const int *indices, int num_indices, const XMFLOAT4 &color, const Texture *texture);
+  void end_frame(bool parallel);
+
+  int width() const { return _width; }
+  int height() const { return _height; }
+  // the rows are padded to whole tiles, so they're 'pitch' pixels apart
+  int pitch() const { return _tiles_x * kTileSize; }
+  const uint32 *pixels() const { return _color.data(); }
+  const float *depth() const { return _depth.data(); }
+  bool save(const char *filename) const;
+
+  const Stats &stats() const { return _stats; }
+  void log_stats() const;
+
+private:
+  struct Vertex {
+    XMFLOAT4 pos;
+    float u, v;
+  };
+
+  // a value that's linear in screen space, as x * dx + y * dy + c
+  struct Plane {
+    float dx, dy, c;
+  };
+
+  struct Triangle {
+    // edge functions (a * x + b * y + c), which are all >= 0 inside the triangle
+    float a[3], b[3], c[3];
+    Plane z;
+    // 1/w, u/w and v/w, for perspective correct texture coordinates
+    Plane inv_w, u, v;
+    XMFLOAT4 color;
+    uint32 packed_color;
+    const Texture *texture;
+    int min_x, min_y, max_x, max_y;
+  };
+
+  int clip(Vertex *verts, int count);
+  void setup(const Vertex &v0, const Vertex &v1, const Vertex &v2, const XMFLOAT4 &color, const Texture *texture);
+  void rasterize_tile(int tile);
+
+  int _width, _height;
+  int _tiles_x, _tiles_y;
+  std::vector<uint32> _color;
+  std::vector<float> _depth;
+
+  XMFLOAT4X4 _view_proj;
+  std::vector<XMFLOAT3> _world_verts;
+  std::vector<Vertex> _clip_verts;
+  std::vector<Triangle> _triangles;
+  std::vector<std::vector<int> > _bins;
+  std::vector<int64> _tile_pixels;
+
+  Stats _stats;
+};
@@ -15,6 +15,26 @@
 #define WITH_LOGGER 1
 #endif
 
+// Sub-allocate constant buffers from a per-frame ring, and bind them by offset. The deferred
+// contexts stage the frame's constants on the cpu, and the ring is mapped once per frame,
+// before the frame's command list is executed. Binding by offset needs a D3D11.1 runtime,
+// whose interface is declared in d3d11_1_compat.hpp, as the June 2010 SDK doesn't have it.
+// Without it (or if the driver doesn't support constant buffer offsets), the contexts fall
+// back to per-buffer uploads at runtime.
+#define WITH_CBUFFER_RING 1
+
+// Give every effect its own deferred context, and record the effects in parallel. The
+// command lists are executed in effect order at the end of the tick.
+#define WITH_PARALLEL_RECORDING 0
+
+// Rasterize the largest simple meshes into a small depth buffer on the cpu, and skip the
+// meshes whose bounds are completely behind them.
+#define WITH_OCCLUSION_CULLING 1
+
+// Keep a cpu copy of the scene geometry, and draw every frame with the SoftwareRasterizer
+// as well, for machines without a gpu.
+#define WITH_SOFTWARE_RASTERIZER 0
+
 #if WITH_WEBSOCKETS
 #include <WinSock2.h>
 #include <ws2tcpip.h>
@@ -67,6 +87,7 @@ typedef uint64_t uint64;
 #include <vector>
 
 #include <concurrent_queue.h>
+#include <ppl.h>
 
 #include <d3d11.h>
 #include <D3D11Shader.h>
@@ -262,16 +262,8 @@ bool Technique::create_shaders(ShaderTemplate *shader_template) {
     shader->_flags = cur.flags;
 #endif
 
-    // load corresponding .h file
-    vector<char> text;
-    string headerFile = Path::replace_extension(obj, "h");
-    if (!RESOURCE_MANAGER.load_file(headerFile.c_str(), &text)) {
-      add_error_msg("Unable to load .h file: %s", headerFile.c_str());
-      return false;
-    }
-
     ShaderReflection ref;
-    if (!ref.do_reflection(text.data(), text.size(), shader, shader_template, buf)) {
+    if (!ref.do_reflection(obj, shader, shader_template, buf)) {
       add_error_msg("Reflection failed");
       return false;
     }
@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "technique_parser.hpp"
+#include "technique_symbols.hpp"
 #include "technique.hpp"
 #include "string_utils.hpp"
 #include "file_utils.hpp"
@@ -71,192 +72,6 @@ static void parse_float4(const char *str, float *v1, float *v2, float *v3, float
 
 namespace technique_parser_details {
 
-enum Symbol {
-  kSymInvalid = -1,
-  kSymUnknown,
-  kSymInclude,
-  kSymSingleLineComment,
-  kSymMultiLineCommentStart,
-  kSymMultiLineCommentEnd,
-  kSymListOpen,
-  kSymListClose,
-  kSymBlockOpen,
-  kSymBlockClose,
-  kSymSemicolon,
-  kSymComma,
-  kSymEquals,
-  kSymParenOpen,
-  kSymParenClose,
-
-  kSymTechnique,
-  kSymInherits,
-  kSymId,
-  kSymVertexShader,
-  kSymPixelShader,
-  kSymComputeShader,
-  kSymGeometryShader,
-    kSymFile,
-    kSymEntryPoint,
-    kSymParams,
-    kSymFlags,
-
-  kSymVertices,
-    kSymFormat,
-    kSymData,
-  kSymIndices,
-  kSymGeometry,
-
-  kSymMaterial,
-
-  kSymFloat,
-  kSymFloat2,
-  kSymFloat3,
-  kSymFloat4,
-  kSymColor,
-  kSymFloat4x4,
-  kSymTexture2d,
-  kSymSampler,
-  kSymInt,
-  kSymDefault,
-
-  kSymRasterizerDesc,
-    kSymFillMode,
-    kSymCullMode,
-    kSymFrontCounterClockwise,
-    kSymDepthBias,
-    kSymDepthBiasClamp,
-    kSymSlopeScaledDepthBias,
-    kSymDepthClipEnable,
-    kSymScissorEnable,
-    kSymMultisampleEnable,
-    kSymAntialiasedLineEnable,
-
-  kSymSamplerDesc,
-    kSymFilter,
-    kSymAddressU,
-    kSymAddressV,
-    kSymAddressW,
-    kSymMipLODBias,
-    kSymMaxAnisotropy,
-    kSymComparisonFunc,
-    kSymBorderColor,
-    kSymMinLOD,
-    kSymMaxLOD,
-
-  kSymDepthStencilDesc,
-    kSymDepthEnable,
-    kSymDepthFunc,
-    kSymDepthWriteMask,
-
-  kSymBlendDesc,
-    kSymAlphaToCoverageEnable,
-    kSymIndependentBlendEnable,
-    kSymRenderTarget,
-      kSymBlendEnable,
-      kSymSrcBlend,
-      kSymDestBlend,
-      kSymBlendOp,
-      kSymSrcBlendAlpha,
-      kSymDestBlendAlpha,
-      kSymBlendOpAlpha,
-      kSymRenderTargetWriteMask,
-};
-
-struct {
-  Symbol symbol;
-  const char *str;
-} g_symbols[] = {
-  { kSymInclude, "include" },
-  { kSymSingleLineComment, "//" },
-  { kSymMultiLineCommentStart, "/*" },
-  { kSymListOpen, "[" },
-  { kSymListClose, "]" },
-  { kSymBlockOpen, "{" },
-  { kSymBlockClose, "}" },
-  { kSymSemicolon, ";" },
-  { kSymComma, "," },
-  { kSymEquals, "=" },
-  { kSymParenOpen, "(" },
-  { kSymParenClose, ")" },
-
-  { kSymTechnique, "technique" },
-  { kSymInherits, "inherits" },
-
-  { kSymVertexShader, "vertex_shader" },
-  { kSymPixelShader, "pixel_shader" },
-  { kSymComputeShader, "compute_shader" },
-  { kSymGeometryShader, "geometry_shader" },
-    { kSymFile, "file" },
-    { kSymEntryPoint, "entry_point" },
-    { kSymParams, "params" },
-    { kSymFlags, "flags" },
-
-  { kSymMaterial, "material" },
-
-  { kSymGeometry, "geometry" },
-
-  { kSymVertices, "vertices" },
-  { kSymFormat, "format" },
-  { kSymData, "data" },
-  { kSymIndices, "indices" },
-
-  // params
-  { kSymFloat, "float" },
-  { kSymFloat, "float1" },
-  { kSymFloat2, "float2" },
-  { kSymFloat3, "float3" },
-  { kSymColor, "color" },
-  { kSymFloat4, "float4" },
-  { kSymFloat4x4, "float4x4" },
-  { kSymInt, "int" },
-  { kSymTexture2d, "texture2d" },
-  { kSymSampler, "sampler" },
-  { kSymDefault, "default" },
-
-  // descs
-  { kSymRasterizerDesc, "rasterizer_desc" },
-    { kSymFillMode, "fill_mode" },
-    { kSymCullMode, "cull_mode" },
-    { kSymFrontCounterClockwise, "front_counter_clockwise" },
-    { kSymDepthBias, "depth_bias" },
-    { kSymDepthBias, "depth_bias_clamp" },
-    { kSymSlopeScaledDepthBias, "slope_scaled_depth_bias" },
-    { kSymDepthClipEnable, "depth_clip_enable" },
-    { kSymScissorEnable, "scissor_enable" },
-    { kSymMultisampleEnable, "multisample_enable" },
-    { kSymAntialiasedLineEnable, "antialiased_line_enable" },
-
-  { kSymSamplerDesc, "sampler_desc" },
-    { kSymFilter, "filter" },
-    { kSymAddressU, "address_u" },
-    { kSymAddressV, "address_v" },
-    { kSymAddressW, "address_w" },
-    { kSymMipLODBias, "mip_lod_bias" },
-    { kSymMaxAnisotropy, "max_anisotropy" },
-    { kSymComparisonFunc, "comparison_func" },
-    { kSymBorderColor, "border_color" },
-    { kSymMinLOD, "min_lod" },
-    { kSymMaxLOD, "max_lod" },
-
-  { kSymDepthStencilDesc, "depth_stencil_desc" },
-    { kSymDepthEnable, "depth_enable" },
-    { kSymDepthFunc, "depth_func" },
-    { kSymDepthWriteMask, "depth_write_mask" },
-
-  { kSymBlendDesc, "blend_desc" },
-    { kSymAlphaToCoverageEnable, "alpha_to_coverage_enable" },
-    { kSymIndependentBlendEnable, "independent_blend_enable" },
-    { kSymRenderTarget, "render_target" },
-      { kSymBlendEnable, "blend_enable" },
-      { kSymSrcBlend, "src_blend" },
-      { kSymDestBlend, "dest_blend" },
-      { kSymBlendOp, "blend_op" },
-      { kSymSrcBlendAlpha, "src_blend_alpha" },
-      { kSymDestBlendAlpha, "dest_blend_alpha" },
-      { kSymBlendOpAlpha, "blend_op_alpha" },
-      { kSymRenderTargetWriteMask, "render_target_write_mask" },
-};
-
 static auto valid_property_types = map_list_of
   (kSymInt, PropertyType::kInt)
   (kSymFloat, PropertyType::kFloat)
@@ -265,6 +80,7 @@ static auto valid_property_types = map_list_of
   (kSymFloat4, PropertyType::kFloat4)
   (kSymFloat4x4, PropertyType::kFloat4x4)
   (kSymTexture2d, PropertyType::kTexture2d)
+  (kSymStructuredBuffer, PropertyType::kStructuredBuffer)
   (kSymSampler, PropertyType::kSampler);
 
 static auto valid_filters = map_list_of
@@ -335,72 +151,6 @@ static auto valid_blend_op = map_list_of
   ("min", D3D11_BLEND_OP_MIN)
   ("max", D3D11_BLEND_OP_MAX);
 
-
-class Trie {
-public:
-  void add_symbol(const char *str, int len, Symbol symbol) {
-    Node *cur = &root;
-    for (int i = 0; i < len; ++i) {
-      char ch = str[i];
-      if (!cur->children[ch]) {
-        // create new node
-        cur->children[ch] = new Node;
-      }
-      cur = cur->children[ch];
-    }
-    KASSERT(cur->symbol == kSymUnknown);
-    cur->symbol = symbol;
-  }
-
-  Symbol find_symbol(const string &str) {
-    return find_symbol(str.c_str(), str.size(), nullptr);
-  }
-
-  Symbol find_symbol(const char *str, int max_len, int *match_length) {
-    // traverse the trie, and return the longest matching string
-    Node *cur = &root;
-    Node *last_match = NULL;
-    int last_len = 0;
-    int len = 0;
-
-    while (cur && len < max_len) {
-      if (cur->symbol != kSymUnknown) {
-        last_match = cur;
-        last_len = len;
-      }
-      cur = cur->children[str[len++]];
-    }
-
-    if (cur == NULL || cur->symbol == kSymUnknown) {
-      if (last_match) {
-        if (match_length)
-          *match_length = last_len;
-        return last_match->symbol;
-      }
-      return kSymUnknown;
-    }
-
-    if (match_length)
-      *match_length = len;
-    return cur->symbol;
-  }
-
-private:
-  struct Node {
-    Node() : symbol(kSymUnknown) {
-      memset(children, 0, sizeof(children));
-    }
-    ~Node() {
-      for (int i = 0; i < 256; ++i)
-        SAFE_DELETE(children[i]);
-    }
-    Symbol symbol;
-    Node *children[256];
-  };
-
-  Node root;
-};
-
 }
 
 static void parse_value(const string &value, PropertyType::Enum type, float *out) {
@@ -427,12 +177,11 @@ static void parse_value(const string &value, PropertyType::Enum type, float *out
 using namespace technique_parser_details;
 
 TechniqueParser::TechniqueParser(const std::string &filename, TechniqueFile *result) 
-  : _symbol_trie(new Trie()) 
+  : _symbol_trie(&Trie::instance()) 
   , _result(result)
   , _filename(filename)
 {
-  for (int i = 0; i < ELEMS_IN_ARRAY(g_symbols); ++i) {
-    _symbol_trie->add_symbol(g_symbols[i].str, strlen(g_symbols[i].str), g_symbols[i].symbol);
+  for (int i = 0; i < g_num_symbols; ++i) {
     _symbol_to_string[g_symbols[i].symbol] = g_symbols[i].str;
   }
 }
@@ -678,7 +427,7 @@ void TechniqueParser::parse_param(const vector<string> &param, Technique *techni
   PropertySource::Enum source = lookup_throw<string, PropertySource::Enum>(param[src_pos], valid_sources);
 
   bool cbuffer_param = false;
-  if (type == PropertyType::kTexture2d) {
+  if (type == PropertyType::kTexture2d || type == PropertyType::kStructuredBuffer) {
     shader->_resource_view_params.push_back(ResourceViewParam(name, type, source, friendly_name));
   } else {
     shader->_cbuffer_params.push_back(CBufferParam(name, type, source));
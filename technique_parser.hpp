@@ -46,7 +46,7 @@ private:
 
   Technique *find_technique(const std::string &str);
 
-  std::unique_ptr<technique_parser_details::Trie> _symbol_trie;
+  const technique_parser_details::Trie *_symbol_trie;
   std::unordered_map<technique_parser_details::Symbol, std::string > _symbol_to_string;
 
   std::string _filename;
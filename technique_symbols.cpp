@@ -0,0 +1,147 @@
+#include "stdafx.h"
+#include "technique_symbols.hpp"
+
+using namespace std;
+
+namespace technique_parser_details {
+
+const SymbolString g_symbols[] = {
+  { kSymInclude, "include" },
+  { kSymSingleLineComment, "//" },
+  { kSymMultiLineCommentStart, "/*" },
+  { kSymListOpen, "[" },
+  { kSymListClose, "]" },
+  { kSymBlockOpen, "{" },
+  { kSymBlockClose, "}" },
+  { kSymSemicolon, ";" },
+  { kSymComma, "," },
+  { kSymEquals, "=" },
+  { kSymParenOpen, "(" },
+  { kSymParenClose, ")" },
+
+  { kSymTechnique, "technique" },
+  { kSymInherits, "inherits" },
+
+  { kSymVertexShader, "vertex_shader" },
+  { kSymPixelShader, "pixel_shader" },
+  { kSymComputeShader, "compute_shader" },
+  { kSymGeometryShader, "geometry_shader" },
+    { kSymFile, "file" },
+    { kSymEntryPoint, "entry_point" },
+    { kSymParams, "params" },
+    { kSymFlags, "flags" },
+
+  { kSymMaterial, "material" },
+
+  { kSymGeometry, "geometry" },
+
+  { kSymVertices, "vertices" },
+  { kSymFormat, "format" },
+  { kSymData, "data" },
+  { kSymIndices, "indices" },
+
+  // params
+  { kSymFloat, "float" },
+  { kSymFloat, "float1" },
+  { kSymFloat2, "float2" },
+  { kSymFloat3, "float3" },
+  { kSymColor, "color" },
+  { kSymFloat4, "float4" },
+  { kSymFloat4x4, "float4x4" },
+  { kSymInt, "int" },
+  { kSymTexture2d, "texture2d" },
+  { kSymStructuredBuffer, "structured_buffer" },
+  { kSymSampler, "sampler" },
+  { kSymDefault, "default" },
+
+  // descs
+  { kSymRasterizerDesc, "rasterizer_desc" },
+    { kSymFillMode, "fill_mode" },
+    { kSymCullMode, "cull_mode" },
+    { kSymFrontCounterClockwise, "front_counter_clockwise" },
+    { kSymDepthBias, "depth_bias" },
+    { kSymDepthBias, "depth_bias_clamp" },
+    { kSymSlopeScaledDepthBias, "slope_scaled_depth_bias" },
+    { kSymDepthClipEnable, "depth_clip_enable" },
+    { kSymScissorEnable, "scissor_enable" },
+    { kSymMultisampleEnable, "multisample_enable" },
+    { kSymAntialiasedLineEnable, "antialiased_line_enable" },
+
+  { kSymSamplerDesc, "sampler_desc" },
+    { kSymFilter, "filter" },
+    { kSymAddressU, "address_u" },
+    { kSymAddressV, "address_v" },
+    { kSymAddressW, "address_w" },
+    { kSymMipLODBias, "mip_lod_bias" },
+    { kSymMaxAnisotropy, "max_anisotropy" },
+    { kSymComparisonFunc, "comparison_func" },
+    { kSymBorderColor, "border_color" },
+    { kSymMinLOD, "min_lod" },
+    { kSymMaxLOD, "max_lod" },
+
+  { kSymDepthStencilDesc, "depth_stencil_desc" },
+    { kSymDepthEnable, "depth_enable" },
+    { kSymDepthFunc, "depth_func" },
+    { kSymDepthWriteMask, "depth_write_mask" },
+
+  { kSymBlendDesc, "blend_desc" },
+    { kSymAlphaToCoverageEnable, "alpha_to_coverage_enable" },
+    { kSymIndependentBlendEnable, "independent_blend_enable" },
+    { kSymRenderTarget, "render_target" },
+      { kSymBlendEnable, "blend_enable" },
+      { kSymSrcBlend, "src_blend" },
+      { kSymDestBlend, "dest_blend" },
+      { kSymBlendOp, "blend_op" },
+      { kSymSrcBlendAlpha, "src_blend_alpha" },
+      { kSymDestBlendAlpha, "dest_blend_alpha" },
+      { kSymBlendOpAlpha, "blend_op_alpha" },
+      { kSymRenderTargetWriteMask, "render_target_write_mask" },
+};
+
+const int g_num_symbols = ELEMS_IN_ARRAY(g_symbols);
+
+Trie::Trie() {
+  vector<pair<string, Symbol> > symbols;
+  for (int i = 0; i < g_num_symbols; ++i)
+    symbols.push_back(make_pair(string(g_symbols[i].str), g_symbols[i].symbol));
+  sort(RANGE(symbols));
+
+  _nodes.push_back(Node(0));
+  build(symbols, 0, symbols.size(), 0, 0);
+}
+
+const Trie &Trie::instance() {
+  static Trie trie;
+  return trie;
+}
+
+void Trie::build(const vector<pair<string, Symbol> > &symbols, size_t first, size_t last, size_t depth, int node_idx) {
+
+  if (symbols[first].first.size() == depth) {
+    KASSERT(_nodes[node_idx].symbol == kSymUnknown);
+    _nodes[node_idx].symbol = (int16)symbols[first].second;
+    ++first;
+  }
+
+  // allocate all the children up front to keep them contiguous
+  vector<pair<size_t, size_t> > ranges;
+  for (size_t i = first; i < last; ) {
+    uint8 ch = (uint8)symbols[i].first[depth];
+    size_t j = i + 1;
+    while (j < last && (uint8)symbols[j].first[depth] == ch)
+      ++j;
+    ranges.push_back(make_pair(i, j));
+    _nodes.push_back(Node(ch));
+    i = j;
+  }
+
+  KASSERT(ranges.size() < 256 && _nodes.size() < (1 << 16));
+  int first_child = _nodes.size() - ranges.size();
+  _nodes[node_idx].first_child = (uint16)first_child;
+  _nodes[node_idx].num_children = (uint8)ranges.size();
+
+  for (size_t i = 0; i < ranges.size(); ++i)
+    build(symbols, ranges[i].first, ranges[i].second, depth + 1, first_child + i);
+}
+
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+// The keywords and punctuation of the .tec files, and the trie the TechniqueParser
+// recognizes them with.
+namespace technique_parser_details {
+
+enum Symbol {
+  kSymInvalid = -1,
+  kSymUnknown,
+  kSymInclude,
+  kSymSingleLineComment,
+  kSymMultiLineCommentStart,
+  kSymMultiLineCommentEnd,
+  kSymListOpen,
+  kSymListClose,
+  kSymBlockOpen,
+  kSymBlockClose,
+  kSymSemicolon,
+  kSymComma,
+  kSymEquals,
+  kSymParenOpen,
+  kSymParenClose,
+
+  kSymTechnique,
+  kSymInherits,
+  kSymId,
+  kSymVertexShader,
+  kSymPixelShader,
+  kSymComputeShader,
+  kSymGeometryShader,
+    kSymFile,
+    kSymEntryPoint,
+    kSymParams,
+    kSymFlags,
+
+  kSymVertices,
+    kSymFormat,
+    kSymData,
+  kSymIndices,
+  kSymGeometry,
+
+  kSymMaterial,
+
+  kSymFloat,
+  kSymFloat2,
+  kSymFloat3,
+  kSymFloat4,
+  kSymColor,
+  kSymFloat4x4,
+  kSymTexture2d,
+  kSymStructuredBuffer,
+  kSymSampler,
+  kSymInt,
+  kSymDefault,
+
+  kSymRasterizerDesc,
+    kSymFillMode,
+    kSymCullMode,
+    kSymFrontCounterClockwise,
+    kSymDepthBias,
+    kSymDepthBiasClamp,
+    kSymSlopeScaledDepthBias,
+    kSymDepthClipEnable,
+    kSymScissorEnable,
+    kSymMultisampleEnable,
+    kSymAntialiasedLineEnable,
+
+  kSymSamplerDesc,
+    kSymFilter,
+    kSymAddressU,
+    kSymAddressV,
+    kSymAddressW,
+    kSymMipLODBias,
+    kSymMaxAnisotropy,
+    kSymComparisonFunc,
+    kSymBorderColor,
+    kSymMinLOD,
+    kSymMaxLOD,
+
+  kSymDepthStencilDesc,
+    kSymDepthEnable,
+    kSymDepthFunc,
+    kSymDepthWriteMask,
+
+  kSymBlendDesc,
+    kSymAlphaToCoverageEnable,
+    kSymIndependentBlendEnable,
+    kSymRenderTarget,
+      kSymBlendEnable,
+      kSymSrcBlend,
+      kSymDestBlend,
+      kSymBlendOp,
+      kSymSrcBlendAlpha,
+      kSymDestBlendAlpha,
+      kSymBlendOpAlpha,
+      kSymRenderTargetWriteMask,
+};
+
+struct SymbolString {
+  Symbol symbol;
+  const char *str;
+};
+
+extern const SymbolString g_symbols[];
+extern const int g_num_symbols;
+
+// Compact trie over the keyword table. All nodes live in a single array, and the
+// children of a node are stored contiguously, sorted on their character, so a lookup
+// is a short scan over a few bytes per character instead of a 256 pointer table per node.
+// The trie is built once from g_symbols and shared between all parser instances.
+class Trie {
+public:
+  Trie();
+
+  static const Trie &instance();
+
+  int num_nodes() const { return (int)_nodes.size(); }
+  size_t memory_footprint() const { return sizeof(*this) + _nodes.capacity() * sizeof(Node); }
+
+  Symbol find_symbol(const std::string &str) const {
+    return find_symbol(str.c_str(), str.size(), nullptr);
+  }
+
+  Symbol find_symbol(const char *str, int max_len, int *match_length) const {
+    // traverse the trie, and return the longest matching string
+    Symbol last_match = kSymUnknown;
+    int last_len = 0;
+    int cur = 0;
+    int len = 0;
+
+    while (true) {
+      if (_nodes[cur].symbol != kSymUnknown) {
+        last_match = (Symbol)_nodes[cur].symbol;
+        last_len = len;
+      }
+      if (len == max_len || (cur = find_child(cur, (uint8)str[len])) == -1)
+        break;
+      ++len;
+    }
+
+    if (match_length && last_match != kSymUnknown)
+      *match_length = last_len;
+    return last_match;
+  }
+
+private:
+  struct Node {
+    Node(uint8 ch) : symbol(kSymUnknown), ch(ch), num_children(0), first_child(0) {}
+    int16 symbol;
+    uint8 ch;
+    uint8 num_children;
+    uint16 first_child;
+  };
+
+  int find_child(int idx, uint8 ch) const {
+    const Node &node = _nodes[idx];
+    for (int i = node.first_child, e = node.first_child + node.num_children; i < e; ++i) {
+      // children are sorted, so we can bail as soon as we've passed the character
+      uint8 cur = _nodes[i].ch;
+      if (cur == ch)
+        return i;
+      if (cur > ch)
+        break;
+    }
+    return -1;
+  }
+
+  // 'symbols' is sorted, and [first, last) all share a prefix of length 'depth'
+  void build(const std::vector<std::pair<std::string, Symbol> > &symbols, size_t first, size_t last, size_t depth, int node_idx);
+
+  std::vector<Node> _nodes;
+};
+
+}
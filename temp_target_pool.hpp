@@ -0,0 +1,57 @@
+#pragma once
+
+// Free lists of released temp render targets, keyed by their (width, height, format, flags).
+// Acquiring pops the most recently released target with the key, and collect() hands back
+// the targets that have been free for too long, so the caller can destroy them. The pool
+// only deals in slot indices, so it doesn't care how the targets are created.
+class TempTargetPool {
+public:
+  TempTargetPool() : _num_free(0) {}
+
+  static uint64 make_key(int width, int height, DXGI_FORMAT format, uint32 flags) {
+    KASSERT(width < (1 << 16) && height < (1 << 16) && format < (1 << 16));
+    return (uint64)width << 48 | (uint64)height << 32 | (uint64)format << 16 | (flags & 0xffff);
+  }
+
+  // Returns -1 if there's no free target with the key
+  int acquire(uint64 key) {
+    auto it = _free.find(key);
+    if (it == _free.end() || it->second.empty())
+      return -1;
+    const int idx = it->second.back().idx;
+    it->second.pop_back();
+    --_num_free;
+    return idx;
+  }
+
+  void release(uint64 key, int idx, int frame) {
+    FreeTarget f = { idx, frame };
+    _free[key].push_back(f);
+    ++_num_free;
+  }
+
+  // Adds the targets that have been free for more than 'max_unused_frames' to 'stale', and
+  // removes them from the pool
+  void collect(int frame, int max_unused_frames, std::vector<int> *stale) {
+    for (auto it = _free.begin(); it != _free.end(); ) {
+      auto &free_list = it->second;
+      // the free list is ordered by release frame, so the stale targets are at the front
+      size_t num_stale = 0;
+      while (num_stale < free_list.size() && frame - free_list[num_stale].released_frame > max_unused_frames)
+        stale->push_back(free_list[num_stale++].idx);
+      free_list.erase(free_list.begin(), free_list.begin() + num_stale);
+      _num_free -= (int)num_stale;
+      it = free_list.empty() ? _free.erase(it) : ++it;
+    }
+  }
+
+  int num_free() const { return _num_free; }
+
+private:
+  struct FreeTarget {
+    int idx;
+    int released_frame;
+  };
+  std::unordered_map<uint64, std::vector<FreeTarget> > _free;
+  int _num_free;
+};
@@ -146,8 +146,6 @@ bool BoxThing::init() {
 
   _ctx = GRAPHICS.create_deferred_context(true);
 
-  _vb = GFX_create_buffer(D3D11_BIND_VERTEX_BUFFER, 16 * 1024 * 1024, true, nullptr, sizeof(PosTangentSpace2));
-
   GRAPHICS.load_techniques("effects/box_thing.tec", false);
   _technique = GRAPHICS.find_technique("box_thing");
 
@@ -187,14 +185,18 @@ bool BoxThing::render() {
   ADD_PROFILE_SCOPE();
   _ctx->begin_frame();
 
-  ScopedMap<PosTangentSpace2> pn(_ctx, D3D11_MAP_WRITE_DISCARD, _vb);
   int numSegments = 20;
   float step = 2 * XM_PI / numSegments;
+  int numCogs = 100;
 
-  PosTangentSpace2 *p = pn;
+  DeferredContext::TransientAlloc vb;
+  if (!_ctx->map_transient_vb(numCogs * numSegments * 36 * sizeof(PosTangentSpace2), &vb)) {
+    _ctx->end_frame();
+    return false;
+  }
+  PosTangentSpace2 *p = (PosTangentSpace2 *)vb.data;
 
   _numCubes = 0;
-  int numCogs = 100;
   for (int j = 0; j < numCogs; ++j) {
     float angle = (float)j;
     for (int i = 0; i < numSegments; ++i) {
@@ -227,7 +229,7 @@ bool BoxThing::render() {
     _numCubes++;
   }
 */
-  pn.unmap();
+  _ctx->unmap_transient(&vb, _numCubes * 36 * sizeof(PosTangentSpace2));
 
   int w = GRAPHICS.width();
   int h = GRAPHICS.height();
@@ -259,7 +261,7 @@ bool BoxThing::render() {
     _ctx->set_cbuffer(ps->cbuffer_by_index(0), 0, ShaderType::kPixelShader, &cbuffer, sizeof(cbuffer));
 
   _ctx->set_topology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-  _ctx->set_vb(_vb);
+  _ctx->set_vb(vb.buffer, sizeof(PosTangentSpace2), vb.offset);
   _ctx->draw(_numCubes * 36, 0);
 
   _ctx->end_frame();
@@ -19,7 +19,6 @@ public:
 private:
   void calc_camera_matrices(double time, double delta, XMFLOAT4X4 *view, XMFLOAT4X4 *proj);
 
-  GraphicsObjectHandle _vb;
   GraphicsObjectHandle _ib;
   GraphicsObjectHandle _technique;
 
@@ -158,8 +158,6 @@ bool ParticleTest::init() {
 
   _freefly_camera.setPos(0, 0, -50);
 
-  _vb = GFX_create_buffer(D3D11_BIND_VERTEX_BUFFER, numParticles * sizeof(ParticleVtx), true, nullptr, sizeof(ParticleVtx));
-
   {
     TweakableParameterBlock block("blur");
     block._params.emplace_back(TweakableParameter("blurX", 10.0f, 1.0f, 250.0f));
@@ -239,10 +237,12 @@ void ParticleTest::renderParticles() {
   int w = GRAPHICS.width();
   int h = GRAPHICS.height();
 
-  D3D11_MAPPED_SUBRESOURCE res;
-  _ctx->map(_vb, 0, D3D11_MAP_WRITE_DISCARD, 0, &res);
+  DeferredContext::TransientAlloc vb;
+  const int vb_size = _particle_data.numParticles * sizeof(ParticleVtx);
+  if (!_ctx->map_transient_vb(vb_size, &vb))
+    return;
 
-  ParticleVtx *verts = (ParticleVtx *)res.pData;
+  ParticleVtx *verts = (ParticleVtx *)vb.data;
   float *px = _particle_data.posX;
   float *py = _particle_data.posY;
   float *pz = _particle_data.posZ;
@@ -255,7 +255,7 @@ void ParticleTest::renderParticles() {
     verts[i].scale.y = *f++;
   }
 
-  _ctx->unmap(_vb, 0);
+  _ctx->unmap_transient(&vb, vb_size);
 
   //auto fmt = DXGI_FORMAT_R32G32B32A32_FLOAT;
 
@@ -290,7 +290,7 @@ void ParticleTest::renderParticles() {
   _ctx->set_cbuffer(vs->find_cbuffer("ParticleBuffer"), 0, ShaderType::kVertexShader, &cbuffer, sizeof(cbuffer));
   _ctx->set_cbuffer(gs->find_cbuffer("ParticleBuffer"), 0, ShaderType::kGeometryShader, &cbuffer, sizeof(cbuffer));
 
-  _ctx->set_vb(_vb);
+  _ctx->set_vb(vb.buffer, sizeof(ParticleVtx), vb.offset);
   _ctx->draw(numParticles, 0);
 
   _ctx->unset_render_targets(0, 1);
@@ -26,7 +26,6 @@ private:
 
   GraphicsObjectHandle _particle_technique;
   GraphicsObjectHandle _particle_texture;
-  GraphicsObjectHandle _vb;
 
   GraphicsObjectHandle _gradient_technique;
   GraphicsObjectHandle _compose_technique;
@@ -16,25 +16,36 @@
 #include "../animation_manager.hpp"
 #include "../app.hpp"
 #include "../dx_utils.hpp"
+#include "../frame_capture.hpp"
+#include "../render_queue.hpp"
 
 using namespace std;
 using namespace std::tr1::placeholders;
 
 static const int KERNEL_SIZE = 32;
 static const int NOISE_SIZE = 16;
+// the light lists can have an index for every light in every cluster, but past this the
+// lists are cut short
+static const int MAX_LIGHT_INDICES = 1 << 20;
+
+// matches LightInstance in ssao.hlsl
+struct LightData {
+  XMFLOAT4 color;
+  XMFLOAT4 pos;
+  float att_start, att_end;
+};
 
 ScenePlayer::ScenePlayer(const std::string &name) 
   : Effect(name)
   , _scene(nullptr) 
-  , _light_pos_id(PROPERTY_MANAGER.get_or_create_placeholder("Instance::LightPos"))
-  , _light_color_id(PROPERTY_MANAGER.get_or_create_placeholder("Instance::LightColor"))
-  , _light_att_start_id(PROPERTY_MANAGER.get_or_create_placeholder("Instance::AttenuationStart"))
-  , _light_att_end_id(PROPERTY_MANAGER.get_or_create_placeholder("Instance::AttenuationEnd"))
+  , _cluster_params_id(PROPERTY_MANAGER.get_or_create<XMFLOAT4>("System::ClusterParams"))
   , _view_mtx_id(PROPERTY_MANAGER.get_or_create<XMFLOAT4X4>("System::view"))
   , _proj_mtx_id(PROPERTY_MANAGER.get_or_create<XMFLOAT4X4>("System::proj"))
   , _ctx(nullptr)
   , _DofSettingsId(PROPERTY_MANAGER.get_or_create<XMFLOAT4X4>("System::DOFDepths"))
   , _screenSizeId(PROPERTY_MANAGER.get_or_create<XMFLOAT4X4>("System::screenSize"))
+  , _logged_graph_bytes(-1)
+  , _light_index_capacity(0)
 {
   ZeroMemory(_keystate, sizeof(_keystate));
 }
@@ -113,6 +124,14 @@ bool ScenePlayer::init() {
 
   _ctx = GRAPHICS.create_deferred_context(true);
 
+  const int num_lights = max(1, min((int)LightClusters::kMaxLights, (int)_scene->lights.size()));
+  _light_index_capacity = min(num_lights * (int)LightClusters::kNumClusters, MAX_LIGHT_INDICES);
+  _light_buffer = GRAPHICS.create_structured_buffer(FROM_HERE, sizeof(LightData), num_lights, true, true);
+  _cluster_buffer = GRAPHICS.create_structured_buffer(FROM_HERE, sizeof(LightClusters::Cluster), LightClusters::kNumClusters, true, true);
+  _light_index_buffer = GRAPHICS.create_structured_buffer(FROM_HERE, sizeof(uint32), _light_index_capacity, true, true);
+  if (!_light_buffer.is_valid() || !_cluster_buffer.is_valid() || !_light_index_buffer.is_valid())
+    return false;
+
   // create properties from the materials
   for (auto it = begin(_scene->materials); it != end(_scene->materials); ++it) {
     Material *mat = *it;
@@ -244,197 +263,248 @@ bool ScenePlayer::update(int64 global_time, int64 local_time, int64 delta, bool
   PROPERTY_MANAGER.set_property(_view_mtx_id, _view);
   PROPERTY_MANAGER.set_property(_proj_mtx_id, _proj);
 
-  return true;
-}
+  // bin the lights in view space, so every pixel of the light pass only shades the lights
+  // that reach its cluster
+  _light_view.resize(_scene->lights.size());
+  XMFLOAT4X4 view_t = transpose(_view);
+  XMMATRIX view_mtx = XMLoadFloat4x4(&view_t);
+  for (size_t i = 0; i < _scene->lights.size(); ++i) {
+    auto light = _scene->lights[i];
+    XMStoreFloat4(&_light_view[i], XMVector3Transform(XMLoadFloat4(&light->pos), view_mtx));
+    _light_view[i].w = light->far_attenuation_end;
+  }
+  _light_clusters.set_projection(_proj);
+  _light_clusters.build(_light_view.data(), (int)_light_view.size(), true);
 
-#pragma pack(push, 1)
-struct LightBase {
-  uint32 id;
-  int len;
-};
+  // the light pass finds a pixel's slice with log(z / near) * slices / log(far / near)
+  const float near_z = _light_clusters.near_plane(), far_z = _light_clusters.far_plane();
+  PROPERTY_MANAGER.set_property(_cluster_params_id, XMFLOAT4(near_z, LightClusters::kSlicesZ / logf(far_z / near_z), 0, 0));
 
-struct LightPos : public LightBase {
-#pragma warning(suppress: 4200)
-  XMFLOAT4 pos[];
-};
+  return true;
+}
 
-struct LightColor : public LightBase {
-#pragma warning(suppress: 4200)
-  XMFLOAT4 color[];
-};
+void ScenePlayer::upload_lights(DeferredContext *ctx) {
+
+  D3D11_MAPPED_SUBRESOURCE res;
+  const int num_lights = min((int)LightClusters::kMaxLights, (int)_scene->lights.size());
+  if (num_lights > 0 && ctx->map(_light_buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &res)) {
+    LightData *dst = (LightData *)res.pData;
+    for (int i = 0; i < num_lights; ++i) {
+      // the camera space pos was calculated when binning the lights
+      auto light = _scene->lights[i];
+      const XMFLOAT4 &v = _light_view[i];
+      dst[i].color = light->color;
+      dst[i].pos = XMFLOAT4(v.x, v.y, v.z, 1);
+      dst[i].att_start = light->far_attenuation_start;
+      dst[i].att_end = light->far_attenuation_end;
+    }
+    ctx->unmap(_light_buffer, 0);
+  }
 
-struct LightAttenuationStart : public LightBase {
-#pragma warning(suppress: 4200)
-  float start[];
-};
+  const vector<uint16> &indices = _light_clusters.indices();
+  const uint32 capacity = (uint32)_light_index_capacity;
+  if (indices.size() > capacity)
+    LOG_WARNING_LN_ONESHOT("%Iu light indices, only %d fit in the light lists", indices.size(), _light_index_capacity);
+
+  if (ctx->map(_cluster_buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &res)) {
+    LightClusters::Cluster *dst = (LightClusters::Cluster *)res.pData;
+    for (int i = 0; i < LightClusters::kNumClusters; ++i) {
+      dst[i] = _light_clusters.cluster(i);
+      dst[i].offset = min(dst[i].offset, capacity);
+      dst[i].count = min(dst[i].count, capacity - dst[i].offset);
+    }
+    ctx->unmap(_cluster_buffer, 0);
+  }
 
-struct LightAttenuationEnd : public LightBase {
-#pragma warning(suppress: 4200)
-  float end[];
-};
-#pragma pack(pop)
+  if (!indices.empty() && ctx->map(_light_index_buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &res)) {
+    uint32 *dst = (uint32 *)res.pData;
+    const size_t count = min(indices.size(), (size_t)capacity);
+    for (size_t i = 0; i < count; ++i)
+      dst[i] = indices[i];
+    ctx->unmap(_light_index_buffer, 0);
+  }
+}
 
 bool ScenePlayer::render() {
   ADD_PROFILE_SCOPE();
   _ctx->begin_frame();
   if (_scene) {
 
-    // allocate the required render targets
-
+    // declare the passes and the render targets they use. The graph only allocates the
+    // targets that live passes need, and shares them between passes where it can
     int w = GRAPHICS.width();
     int h = GRAPHICS.height();
+    declare_graph(&_graph, w, h);
 
-    ScopedRt rt_pos(w, h, DXGI_FORMAT_R16G16B16A16_FLOAT, Graphics::kCreateSrv | Graphics::kCreateDepthBuffer, "System::rt_pos");
-    ScopedRt rt_normal(w, h, DXGI_FORMAT_R16G16B16A16_FLOAT, Graphics::kCreateSrv, "System::rt_normal");
-    ScopedRt rt_diffuse(w, h, DXGI_FORMAT_R8G8B8A8_UNORM, Graphics::kCreateSrv, "System::rt_diffuse");
-    ScopedRt rt_specular(w, h, DXGI_FORMAT_R16G16B16A16_FLOAT, Graphics::kCreateSrv, "System::rt_specular");
-
-    ScopedRt rt_composite(w, h, DXGI_FORMAT_R16G16B16A16_FLOAT, Graphics::kCreateSrv, "System::rt_composite");
-    ScopedRt rt_blur(w, h, DXGI_FORMAT_R16G16B16A16_FLOAT, Graphics::kCreateSrv, "System::rt_blur");
-
-    ScopedRt rt_occlusion(w, h, DXGI_FORMAT_R16_FLOAT, Graphics::kCreateSrv, "System::rt_occlusion");
-    ScopedRt rt_occlusion_tmp(w/2, h/2, DXGI_FORMAT_R16_FLOAT, Graphics::kCreateSrv, "System::rt_occlusion_tmp");
-
-    ScopedRt rt_luminance(1024, 1024, DXGI_FORMAT_R16_FLOAT, Graphics::kCreateMipMaps | Graphics::kCreateSrv, "System::rt_luminance");
-
-    {
-      ADD_NAMED_PROFILE_SCOPE("render_meshes");
-      GraphicsObjectHandle render_targets[] = { rt_pos, rt_normal, rt_diffuse, rt_specular };
-      bool clear[] = { true, true, true, true };
-      _ctx->set_render_targets(render_targets, clear, 4);
-      _scene->render(_ctx, this, _ssao_fill);
+    if (_graph.compile()) {
+      if (_graph.transient_bytes() != _logged_graph_bytes) {
+        _graph.log_stats();
+        _logged_graph_bytes = _graph.transient_bytes();
+      }
+      _graph.execute(_ctx);
     }
 
-    {
-      // Calc the occlusion
-      _ctx->set_render_target(rt_occlusion_tmp, true);
-      TextureArray arr = { rt_pos, rt_normal };
-      _ctx->render_technique(_ssao_compute, bind(&ScenePlayer::fill_cbuffer, this, _1), arr, DeferredContext::InstanceData());
-      _ctx->unset_render_targets(0, 1);
+#if WITH_SOFTWARE_RASTERIZER
+    if (_software.width() != w || _software.height() != h)
+      _software.resize(w, h);
+    XMFLOAT4X4 view_proj;
+    XMStoreFloat4x4(&view_proj, XMMatrixMultiply(XMLoadFloat4x4(&_proj), XMLoadFloat4x4(&_view)));
+    _software.begin_frame(view_proj, XMFLOAT4(0, 0, 0, 1));
+    _scene->render_software(&_software, view_proj);
+    _software.end_frame(true);
+
+    // the null driver doesn't render anything, so frame dumps on it are the software frames
+    if (GRAPHICS.null_device()) {
+      const string filename = GRAPHICS.frame_dump_filename();
+      if (!filename.empty())
+        GRAPHICS.frame_capture()->capture(_software.pixels(), _software.width(), _software.height(), _software.pitch(), filename);
     }
+#endif
+  }
 
+  _ctx->end_frame();
 
-    // Downscale and blur the occlusion
-    //ScopedRt rt_occlusion_downscale(w/4, h/4, DXGI_FORMAT_R16_FLOAT, Graphics::kCreateSrv, "rt_occlusion_downscale");
-    post_process(rt_occlusion_tmp, rt_occlusion, _ssao_blur);
-
-    // Render Ambient * occlusion
-    post_process(rt_occlusion, rt_composite, _ssao_ambient);
-
-    {
-      _ctx->set_render_target(rt_composite, false);
-
-      DeferredContext::InstanceData data;
-      int num_lights = (int)_scene->lights.size();
-      data.add_variable(_light_pos_id, sizeof(XMFLOAT4));
-      data.add_variable(_light_color_id, sizeof(XMFLOAT4));
-      data.add_variable(_light_att_start_id, sizeof(float));
-      data.add_variable(_light_att_end_id, sizeof(float));
-      data.alloc(num_lights);
-
-      for (size_t i = 0; i < _scene->lights.size(); ++i) {
-
-        XMFLOAT4 *lightpos = (XMFLOAT4 *)data.data(0, i);
-        XMFLOAT4 *lightcolor = (XMFLOAT4 *)data.data(1, i);
-        float *lightattstart = (float *)data.data(2, i);
-        float *lightattend = (float *)data.data(3, i);
-
-        // transform pos to camera space
-        auto light = _scene->lights[i];
-        XMVECTOR v = XMLoadFloat4(&light->pos);
-        XMFLOAT4X4 tmp = transpose(_view);
-        XMMATRIX m = XMLoadFloat4x4(&tmp);
-        XMVECTOR v2 = XMVector3Transform(v, m);
-        XMStoreFloat4(lightpos, v2);
-        *lightcolor = light->color;
-        *lightattstart = light->far_attenuation_start;
-        *lightattend = light->far_attenuation_end;
-      }
-
-      TextureArray arr = { rt_pos, rt_normal, rt_diffuse, rt_specular, rt_occlusion };
-      _ctx->render_technique(_ssao_light, bind(&ScenePlayer::fill_cbuffer, this, _1), arr, data);
-      _ctx->unset_render_targets(0, 1);
-    }
+  return true;
+}
 
-    auto fmt = DXGI_FORMAT_R16G16B16A16_FLOAT;
+void ScenePlayer::declare_graph(RenderGraph *graph, int w, int h) {
+  graph->reset();
+  typedef RenderGraph::TargetDesc Desc;
+  auto fmt = DXGI_FORMAT_R16G16B16A16_FLOAT;
+
+  auto rt_pos = graph->create_target("System::rt_pos", Desc(w, h, fmt, Graphics::kCreateSrv | Graphics::kCreateDepthBuffer));
+  auto rt_normal = graph->create_target("System::rt_normal", Desc(w, h, fmt, Graphics::kCreateSrv));
+  auto rt_diffuse = graph->create_target("System::rt_diffuse", Desc(w, h, DXGI_FORMAT_R8G8B8A8_UNORM, Graphics::kCreateSrv));
+  auto rt_specular = graph->create_target("System::rt_specular", Desc(w, h, fmt, Graphics::kCreateSrv));
+  auto rt_composite = graph->create_target("System::rt_composite", Desc(w, h, fmt, Graphics::kCreateSrv));
+  auto rt_occlusion = graph->create_target("System::rt_occlusion", Desc(w, h, DXGI_FORMAT_R16_FLOAT, Graphics::kCreateSrv));
+  auto rt_occlusion_tmp = graph->create_target("System::rt_occlusion_tmp", Desc(w/2, h/2, DXGI_FORMAT_R16_FLOAT, Graphics::kCreateSrv));
+  auto rt_luminance = graph->create_target("System::rt_luminance", Desc(1024, 1024, DXGI_FORMAT_R16_FLOAT, Graphics::kCreateMipMaps | Graphics::kCreateSrv));
+  auto backbuffer = graph->import_backbuffer();
+
+  int pass = graph->add_pass("render_meshes", [=](RenderQueue *queue, int key_pass) {
+    ADD_NAMED_PROFILE_SCOPE("render_meshes");
+    _scene->submit(queue, key_pass, _ssao_fill, this);
+  });
+  graph->write(pass, rt_pos, RenderGraph::kClear);
+  graph->write(pass, rt_normal, RenderGraph::kClear);
+  graph->write(pass, rt_diffuse, RenderGraph::kClear);
+  graph->write(pass, rt_specular, RenderGraph::kClear);
+
+  // Calc the occlusion
+  pass = graph->add_pass("ssao_compute", [=](RenderQueue *queue, int key_pass) {
+    TextureArray arr = { graph->handle(rt_pos), graph->handle(rt_normal) };
+    queue->add_technique(key_pass, _ssao_compute, this, arr);
+  });
+  graph->read(pass, rt_pos);
+  graph->read(pass, rt_normal);
+  graph->write(pass, rt_occlusion_tmp, RenderGraph::kClear);
+
+  // Downscale and blur the occlusion
+  add_post_process(graph, "ssao_blur", rt_occlusion_tmp, rt_occlusion, _ssao_blur, RenderGraph::kClear);
+
+  // Render Ambient * occlusion
+  add_post_process(graph, "ssao_ambient", rt_occlusion, rt_composite, _ssao_ambient, RenderGraph::kClear);
+
+  pass = graph->add_pass("ssao_light", [=](RenderQueue *queue, int key_pass) {
+    // the lights and the cluster lists are uploaded before the pass, and every pixel only
+    // shades the lights in its own cluster
+    queue->add_callback(RenderKey(key_pass, RenderKey::kBeginPass), [=](DeferredContext *ctx) {
+      upload_lights(ctx);
+    });
+    TextureArray arr = { graph->handle(rt_pos), graph->handle(rt_normal), graph->handle(rt_diffuse), 
+      graph->handle(rt_specular), graph->handle(rt_occlusion), _cluster_buffer, _light_index_buffer, _light_buffer };
+    queue->add_technique(key_pass, _ssao_light, this, arr);
+  });
+  graph->read(pass, rt_pos);
+  graph->read(pass, rt_normal);
+  graph->read(pass, rt_diffuse);
+  graph->read(pass, rt_specular);
+  graph->read(pass, rt_occlusion);
+  // the lights are added to the ambient term
+  graph->read(pass, rt_composite);
+  graph->write(pass, rt_composite, RenderGraph::kLoad);
+
+  // calc luminance. Nothing reads it until the bloom is back, so the graph culls the pass
+  pass = graph->add_pass("luminance_map", [=](RenderQueue *queue, int key_pass) {
+    TextureArray arr = { graph->handle(rt_composite) };
+    queue->add_technique(key_pass, _luminance_map, this, arr);
+    queue->add_callback(RenderKey(key_pass, RenderKey::kEndPass), [=](DeferredContext *ctx) {
+      ctx->generate_mips(graph->handle(rt_luminance));
+    });
+  });
+  graph->read(pass, rt_composite);
+  graph->write(pass, rt_luminance, RenderGraph::kClear);
 
 /*
-    // calc luminance
-    post_process(rt_composite, rt_luminance, _luminance_map);
-    _ctx->generate_mips(rt_luminance);
-
-    ScopedRt downscale1(w/2, h/2, fmt, Graphics::kCreateSrv, "downscale1");
-    ScopedRt downscale2(w/4, h/4, fmt, Graphics::kCreateSrv, "downscale2");
-    ScopedRt downscale3(w/8, h/8, fmt, Graphics::kCreateSrv, "downscale3");
-    ScopedRt blur_tmp(w/8, h/8, fmt, Graphics::kCreateSrv, "blur_tmp");
-
-    // scale down
-    {
-      _ctx->set_render_target(rt_composite, true);
-      TextureArray arr = { downscale1, rt_luminance };
-      _ctx->render_technique(_scale_cutoff, bind(&ScenePlayer::fill_cbuffer, this, _1), arr, DeferredContext::InstanceData());
-      //post_process(rt_composite, downscale1, _scale_cutoff);
-      _ctx->unset_render_targets(0, 1);
-    }
-    post_process(downscale1, downscale2, _scale);
-    post_process(downscale2, downscale3, _scale);
+  ScopedRt downscale1(w/2, h/2, fmt, Graphics::kCreateSrv, "downscale1");
+  ScopedRt downscale2(w/4, h/4, fmt, Graphics::kCreateSrv, "downscale2");
+  ScopedRt downscale3(w/8, h/8, fmt, Graphics::kCreateSrv, "downscale3");
+  ScopedRt blur_tmp(w/8, h/8, fmt, Graphics::kCreateSrv, "blur_tmp");
+
+  // scale down
+  {
+    _ctx->set_render_target(rt_composite, true);
+    TextureArray arr = { downscale1, rt_luminance };
+    _ctx->render_technique(_scale_cutoff, bind(&ScenePlayer::fill_cbuffer, this, _1), arr, DeferredContext::InstanceData());
+    //post_process(rt_composite, downscale1, _scale_cutoff);
+    _ctx->unset_render_targets(0, 1);
+  }
+  post_process(downscale1, downscale2, _scale);
+  post_process(downscale2, downscale3, _scale);
 
-    // apply blur
-    for (int i = 0; i < 4; ++i) {
-      post_process(downscale3, blur_tmp, _blur_horiz);
-      post_process(blur_tmp, downscale3, _blur_vert);
-    }
+  // apply blur
+  for (int i = 0; i < 4; ++i) {
+    post_process(downscale3, blur_tmp, _blur_horiz);
+    post_process(blur_tmp, downscale3, _blur_vert);
+  }
 
-    // scale up
-    post_process(downscale3, downscale2, _scale);
-    post_process(downscale2, downscale1, _scale);
+  // scale up
+  post_process(downscale3, downscale2, _scale);
+  post_process(downscale2, downscale1, _scale);
 
-    int w4 = w/4;
-    int h4 = h/4;
-    ScopedRt rt_tmp(w4, h4, fmt, Graphics::kCreateSrv, "rt_tmp");
-    post_process(rt_composite, rt_tmp, _scale);
+  int w4 = w/4;
+  int h4 = h/4;
+  ScopedRt rt_tmp(w4, h4, fmt, Graphics::kCreateSrv, "rt_tmp");
+  post_process(rt_composite, rt_tmp, _scale);
 
-    ScopedRt rt_tmpa(w4, h4, fmt, Graphics::kCreateUav | Graphics::kCreateSrv, "rt_tmpa");
-    ScopedRt rt_tmpb(w4, h4, fmt, Graphics::kCreateUav | Graphics::kCreateSrv, "rt_tmpb");
+  ScopedRt rt_tmpa(w4, h4, fmt, Graphics::kCreateUav | Graphics::kCreateSrv, "rt_tmpa");
+  ScopedRt rt_tmpb(w4, h4, fmt, Graphics::kCreateUav | Graphics::kCreateSrv, "rt_tmpb");
 
-    _ctx->set_vs(GraphicsObjectHandle());
-    _ctx->set_ps(GraphicsObjectHandle());
-    _ctx->set_gs(GraphicsObjectHandle());
-    _blur.do_blur(0, rt_tmp, rt_tmpa, rt_tmpb, w4, h4, _ctx);
+  _ctx->set_vs(GraphicsObjectHandle());
+  _ctx->set_ps(GraphicsObjectHandle());
+  _ctx->set_gs(GraphicsObjectHandle());
+  _blur.do_blur(0, rt_tmp, rt_tmpa, rt_tmpb, w4, h4, _ctx);
 
-    _ctx->set_cs(GraphicsObjectHandle());
+  _ctx->set_cs(GraphicsObjectHandle());
 */
-    post_process(rt_composite, GraphicsObjectHandle(), _scale);
+  add_post_process(graph, "present", rt_composite, backbuffer, _scale, RenderGraph::kLoad);
 /*
-    {
-      // gamma correction
-      _ctx->set_default_render_target(false);
-      TextureArray arr = { rt_composite, _rt_final, rt_tmpb, rt_pos };
-      _ctx->render_technique(_gamma_correct, 
-        bind(&ScenePlayer::fill_cbuffer, this, _1), arr, DeferredContext::InstanceData());
-    }
-*/
+  {
+    // gamma correction
+    _ctx->set_default_render_target(false);
+    TextureArray arr = { rt_composite, _rt_final, rt_tmpb, rt_pos };
+    _ctx->render_technique(_gamma_correct, 
+      bind(&ScenePlayer::fill_cbuffer, this, _1), arr, DeferredContext::InstanceData());
   }
-
-  _ctx->end_frame();
-
-  return true;
+*/
 }
 
-void ScenePlayer::post_process(GraphicsObjectHandle input, GraphicsObjectHandle output, GraphicsObjectHandle technique) {
-  if (output.is_valid())
-    _ctx->set_render_target(output, true);
-  else
-    _ctx->set_default_render_target(false);
-
-  TextureArray arr = { input };
-  _ctx->render_technique(technique, bind(&ScenePlayer::fill_cbuffer, this, _1), arr, DeferredContext::InstanceData());
-
-  if (output.is_valid())
-    _ctx->unset_render_targets(0, 1);
+int ScenePlayer::add_post_process(RenderGraph *graph, const char *name, RenderGraph::ResourceId input, RenderGraph::ResourceId output, 
+                                  GraphicsObjectHandle technique, uint32 write_flags) {
+  int pass = graph->add_pass(name, [=](RenderQueue *queue, int key_pass) {
+    TextureArray arr = { graph->handle(input) };
+    queue->add_technique(key_pass, technique, this, arr);
+  });
+  graph->read(pass, input);
+  graph->write(pass, output, write_flags);
+  return pass;
 }
 
 bool ScenePlayer::close() {
+#if WITH_SOFTWARE_RASTERIZER
+  _software.log_stats();
+#endif
   return true;
 }
 
@@ -4,6 +4,9 @@
 #include "../property_manager.hpp"
 #include "../camera.hpp"
 #include "../gaussian_blur.hpp"
+#include "../render_graph.hpp"
+#include "../light_clusters.hpp"
+#include "../software_rasterizer.hpp"
 
 struct Scene;
 class DeferredContext;
@@ -17,6 +20,10 @@ public:
   virtual bool update(int64 global_time, int64 local_time, int64 delta, bool paused, int64 frequency, int32 num_ticks, float ticks_fraction) override;
   virtual bool render() override;
   virtual bool close() override;
+
+  // declares the frame's passes and targets at the given size. The passes only run when the
+  // graph executes, so the graph can be compiled without a scene
+  void declare_graph(RenderGraph *graph, int w, int h);
 private:
 
   virtual void fill_cbuffer(CBuffer *cbuffer) const;
@@ -26,9 +33,11 @@ private:
 
   void calc_camera_matrices(double time, double delta, XMFLOAT4X4 *view, XMFLOAT4X4 *proj);
 
-  void post_process(GraphicsObjectHandle input, GraphicsObjectHandle output, GraphicsObjectHandle technique);
+  int add_post_process(RenderGraph *graph, const char *name, RenderGraph::ResourceId input, RenderGraph::ResourceId output, 
+    GraphicsObjectHandle technique, uint32 write_flags);
+  void upload_lights(DeferredContext *ctx);
 
-  PropertyId _light_pos_id, _light_color_id, _light_att_start_id, _light_att_end_id;
+  PropertyId _cluster_params_id;
   PropertyId _view_mtx_id, _proj_mtx_id;
 
   Scene *_scene;
@@ -56,6 +65,18 @@ private:
 
   DeferredContext *_ctx;
 
+  RenderGraph _graph;
+  int64 _logged_graph_bytes;
+
+  LightClusters _light_clusters;
+  // view space light positions, with the radius in w
+  std::vector<XMFLOAT4> _light_view;
+  // the lights, the clusters, and the clusters' light lists, for the light pass
+  GraphicsObjectHandle _light_buffer, _cluster_buffer, _light_index_buffer;
+  int _light_index_capacity;
+
+  SoftwareRasterizer _software;
+
   float _blurX, _blurY;
 
   PropertyId _screenSizeId;
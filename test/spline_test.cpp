@@ -458,7 +458,6 @@ bool SplineTest::init() {
     return false;
 
   _staticVb = GFX_create_buffer(D3D11_BIND_VERTEX_BUFFER, 64 * 1024 * 1024, true, nullptr, sizeof(VsInput));
-  _dynamicVb = GFX_create_buffer(D3D11_BIND_VERTEX_BUFFER, 4 * 1024 * 1024, true, nullptr, sizeof(VsInput));
 
   _particleVb = GFX_create_buffer(D3D11_BIND_VERTEX_BUFFER, 1024 * 1024, true, nullptr, sizeof(ParticleVtx));
 
@@ -652,13 +651,18 @@ void SplineTest::renderSplines(GraphicsObjectHandle rtMirror) {
   int h = GRAPHICS.height();
 
   D3D11_MAPPED_SUBRESOURCE staticRes;
-  D3D11_MAPPED_SUBRESOURCE dynamicRes;
-
   _ctx->map(_staticVb, 0, _staticVertCount == 0 ? D3D11_MAP_WRITE_DISCARD : D3D11_MAP_WRITE_NO_OVERWRITE, 0, &staticRes);
-  _ctx->map(_dynamicVb, 0, D3D11_MAP_WRITE_DISCARD, 0, &dynamicRes);
+
+  // the dynamic verts are only known after writing them, so the unused part of the
+  // allocation is returned to the ring on unmap
+  DeferredContext::TransientAlloc dynamicVb;
+  if (!_ctx->map_transient_vb(4 * 1024 * 1024, &dynamicVb)) {
+    _ctx->unmap(_staticVb, 0);
+    return;
+  }
 
   VsInput *staticVerts = (VsInput *)staticRes.pData;
-  VsInput *dynamicVerts = (VsInput *)dynamicRes.pData;
+  VsInput *dynamicVerts = (VsInput *)dynamicVb.data;
 
   int newDynamicVerts = 0;
   int newStaticVerts = 0;
@@ -669,7 +673,7 @@ void SplineTest::renderSplines(GraphicsObjectHandle rtMirror) {
   _staticVertCount += newStaticVerts;
 
   _ctx->unmap(_staticVb, 0);
-  _ctx->unmap(_dynamicVb, 0);
+  _ctx->unmap_transient(&dynamicVb, newDynamicVerts * sizeof(VsInput));
 
 #pragma pack(push, 1)
   struct {
@@ -701,7 +705,7 @@ void SplineTest::renderSplines(GraphicsObjectHandle rtMirror) {
   _ctx->set_vb(_staticVb);
   _ctx->draw(_staticVertCount, 0);
 
-  _ctx->set_vb(_dynamicVb);
+  _ctx->set_vb(dynamicVb.buffer, sizeof(VsInput), dynamicVb.offset);
   _ctx->draw(newDynamicVerts, 0);
 
 
@@ -718,7 +722,7 @@ void SplineTest::renderSplines(GraphicsObjectHandle rtMirror) {
   _ctx->set_vb(_staticVb);
   _ctx->draw(_staticVertCount, 0);
 
-  _ctx->set_vb(_dynamicVb);
+  _ctx->set_vb(dynamicVb.buffer, sizeof(VsInput), dynamicVb.offset);
   _ctx->draw(newDynamicVerts, 0);
 
   _ctx->unset_render_targets(0, 1);
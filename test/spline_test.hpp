@@ -60,7 +60,6 @@ private:
 
   bool _useZFill;
 
-  GraphicsObjectHandle _dynamicVb;
   GraphicsObjectHandle _staticVb;
   int _staticVertCount;
 
@@ -0,0 +1,177 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "bvh.hpp"
+#include "frustum_culler.hpp"
+
+using namespace std;
+
+namespace {
+  struct Boxes {
+    vector<XMFLOAT3> centers, extents;
+  };
+
+  uint32 g_seed;
+  float rnd(float lo, float hi) {
+    g_seed = g_seed * 1664525 + 1013904223;
+    return lo + (hi - lo) * (g_seed >> 8) / (float)(1 << 24);
+  }
+
+  void make_boxes(int count, Boxes *boxes) {
+    g_seed = 1;
+    for (int i = 0; i < count; ++i) {
+      boxes->centers.push_back(XMFLOAT3(rnd(-1000, 1000), rnd(-1000, 1000), rnd(-1000, 1000)));
+      boxes->extents.push_back(XMFLOAT3(rnd(0.1f, 5), rnd(0.1f, 5), rnd(0.1f, 5)));
+    }
+  }
+
+  Frustum make_frustum() {
+    Frustum frustum;
+    frustum.from_view_proj(transpose(perspective_foh(XM_PI / 4, 16 / 9.0f, 1, 800)));
+    return frustum;
+  }
+
+  // the same test as the bvh's leaves, one box at a time
+  void frustum_brute_force(const Frustum &frustum, const Boxes &boxes, vector<int> *out) {
+    for (size_t i = 0; i < boxes.centers.size(); ++i) {
+      const XMFLOAT3 &c = boxes.centers[i], &e = boxes.extents[i];
+      bool inside = true;
+      for (int j = 0; j < 6 && inside; ++j) {
+        const XMFLOAT4 &p = frustum.planes[j];
+        inside = c.x * p.x + c.y * p.y + c.z * p.z + p.w + e.x * fabsf(p.x) + e.y * fabsf(p.y) + e.z * fabsf(p.z) >= 0;
+      }
+      if (inside)
+        out->push_back((int)i);
+    }
+  }
+
+  bool overlaps(const XMFLOAT3 &c0, const XMFLOAT3 &e0, const XMFLOAT3 &c1, const XMFLOAT3 &e1) {
+    return fabsf(c0.x - c1.x) <= e0.x + e1.x && fabsf(c0.y - c1.y) <= e0.y + e1.y && fabsf(c0.z - c1.z) <= e0.z + e1.z;
+  }
+
+  // slab test, returns the entry distance, or -1 for a miss
+  float ray_box(const XMFLOAT3 &o, const XMFLOAT3 &d, float max_t, const XMFLOAT3 &c, const XMFLOAT3 &e) {
+    const float org[] = { o.x, o.y, o.z }, dir[] = { d.x, d.y, d.z };
+    const float lo[] = { c.x - e.x, c.y - e.y, c.z - e.z }, hi[] = { c.x + e.x, c.y + e.y, c.z + e.z };
+    float t0 = 0, t1 = max_t;
+    for (int i = 0; i < 3; ++i) {
+      float n = (lo[i] - org[i]) / dir[i], f = (hi[i] - org[i]) / dir[i];
+      if (n > f)
+        swap(n, f);
+      t0 = max(t0, n);
+      t1 = min(t1, f);
+    }
+    return t0 <= t1 ? t0 : -1;
+  }
+}
+
+TEST(bvh_queries_match_brute_force) {
+  Boxes boxes;
+  make_boxes(20000, &boxes);
+  Bvh bvh;
+  bvh.build(boxes.centers.data(), boxes.extents.data(), (int)boxes.centers.size());
+  CHECK(bvh.num_boxes() == (int)boxes.centers.size());
+
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1) {
+      // move everything, and keep the tree
+      for (size_t i = 0; i < boxes.centers.size(); ++i)
+        boxes.centers[i] = boxes.centers[i] + XMFLOAT3(rnd(-20, 20), rnd(-20, 20), rnd(-20, 20));
+      bvh.refit(boxes.centers.data(), boxes.extents.data());
+    }
+
+    const Frustum frustum = make_frustum();
+    vector<int> found, expected;
+    bvh.query_frustum(frustum, &found);
+    sort(found.begin(), found.end());
+    frustum_brute_force(frustum, boxes, &expected);
+    CHECK(!expected.empty());
+    CHECK(found == expected);
+
+    const XMFLOAT3 center(10, 20, 30), extents(100, 60, 70);
+    found.clear();
+    expected.clear();
+    bvh.query_aabb(center, extents, &found);
+    sort(found.begin(), found.end());
+    for (size_t i = 0; i < boxes.centers.size(); ++i) {
+      if (overlaps(center, extents, boxes.centers[i], boxes.extents[i]))
+        expected.push_back((int)i);
+    }
+    CHECK(!expected.empty());
+    CHECK(found == expected);
+
+    // rays through the volume, compared on the hit distance, as boxes can overlap
+    int num_hits = 0;
+    for (int i = 0; i < 100; ++i) {
+      const XMFLOAT3 origin(rnd(-1000, 1000), rnd(-1000, 1000), -1200);
+      const XMFLOAT3 dir(rnd(-0.3f, 0.3f), rnd(-0.3f, 0.3f), 1);
+      float best_t = -1;
+      for (size_t j = 0; j < boxes.centers.size(); ++j) {
+        const float t = ray_box(origin, dir, 1e9f, boxes.centers[j], boxes.extents[j]);
+        if (t >= 0 && (best_t < 0 || t < best_t))
+          best_t = t;
+      }
+      float hit_t = -1;
+      const int hit = bvh.raycast(origin, dir, 1e9f, &hit_t);
+      CHECK((hit == -1) == (best_t < 0));
+      if (hit != -1) {
+        CHECK(fabsf(hit_t - best_t) < 1e-3f);
+        ++num_hits;
+      }
+    }
+    CHECK(num_hits > 0);
+  }
+}
+
+TEST(bvh_handles_small_sets) {
+  Bvh bvh;
+  bvh.build(nullptr, nullptr, 0);
+  vector<int> found;
+  bvh.query_aabb(XMFLOAT3(0, 0, 0), XMFLOAT3(1, 1, 1), &found);
+  CHECK(found.empty());
+  float t;
+  CHECK(bvh.raycast(XMFLOAT3(0, 0, -10), XMFLOAT3(0, 0, 1), 100, &t) == -1);
+
+  const XMFLOAT3 centers[] = { XMFLOAT3(0, 0, 0), XMFLOAT3(0, 0, 5) };
+  const XMFLOAT3 extents[] = { XMFLOAT3(1, 1, 1), XMFLOAT3(1, 1, 1) };
+  bvh.build(centers, extents, 2);
+  CHECK(bvh.raycast(XMFLOAT3(0, 0, -10), XMFLOAT3(0, 0, 1), 100, &t) == 0 && fabsf(t - 9) < 1e-4f);
+  CHECK(bvh.raycast(XMFLOAT3(0, 0, 10), XMFLOAT3(0, 0, -1), 100, &t) == 1 && fabsf(t - 4) < 1e-4f);
+  // the ray stops before reaching the boxes
+  CHECK(bvh.raycast(XMFLOAT3(0, 0, -10), XMFLOAT3(0, 0, 1), 5, &t) == -1);
+}
+
+BENCHMARK(bvh_100k) {
+  const int cNumBoxes = 100000;
+  const int cRuns = 20;
+  Boxes boxes;
+  make_boxes(cNumBoxes, &boxes);
+
+  Bvh bvh;
+  test::BenchTimer timer;
+  bvh.build(boxes.centers.data(), boxes.extents.data(), cNumBoxes);
+  const double build_ms = timer.elapsed_ms();
+
+  timer.reset();
+  bvh.refit(boxes.centers.data(), boxes.extents.data());
+  const double refit_ms = timer.elapsed_ms();
+
+  const Frustum frustum = make_frustum();
+  vector<int> found, expected;
+  timer.reset();
+  for (int i = 0; i < cRuns; ++i) {
+    found.clear();
+    bvh.query_frustum(frustum, &found);
+  }
+  const double query_ms = timer.elapsed_ms() / cRuns;
+
+  timer.reset();
+  for (int i = 0; i < cRuns; ++i) {
+    expected.clear();
+    frustum_brute_force(frustum, boxes, &expected);
+  }
+  const double brute_ms = timer.elapsed_ms() / cRuns;
+
+  CHECK(found.size() == expected.size());
+  BENCH_LOG("%d boxes: build %.2f ms, refit %.2f ms, frustum query %.3f ms (brute force %.3f ms) for %d boxes",
+    cNumBoxes, build_ms, refit_ms, query_ms, brute_ms, (int)found.size());
+}
@@ -0,0 +1,64 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "command_recorder.hpp"
+#include "deferred_context.hpp"
+#include "graphics.hpp"
+
+using namespace std;
+
+// These run on the headless device, and submit through a context recording to the graphics
+// recorder, like -headless does
+
+namespace {
+  GraphicsObjectHandle create_texture(const char *name) {
+    uint32 pixels[4 * 4];
+    memset(pixels, 0xff, sizeof(pixels));
+    return GRAPHICS.create_texture(FROM_HERE, 4, 4, DXGI_FORMAT_R8G8B8A8_UNORM, pixels, 4, 4, 4 * sizeof(uint32), name);
+  }
+}
+
+TEST(recorder_counts_released_handles) {
+  GraphicsObjectHandle tex = create_texture("recorder_test_texture");
+  CHECK(GRAPHICS.is_live(tex));
+
+  CommandRecorder *recorder = GRAPHICS.recorder();
+  recorder->reset();
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+  ctx->begin_frame();
+  ctx->set_shader_resource(tex, ShaderType::kPixelShader);
+  ctx->draw(3, 0);
+  CHECK(recorder->num_errors() == 0);
+
+  // the released handle is counted everywhere it's used, and bound as null, or skipped,
+  // instead of being dereferenced
+  GRAPHICS._textures.release(tex.id());
+  CHECK(!GRAPHICS.is_live(tex));
+  ctx->set_shader_resource(tex, ShaderType::kPixelShader);
+  ctx->draw(3, 0);
+  D3D11_MAPPED_SUBRESOURCE mapped;
+  CHECK(!ctx->map(tex, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped));
+  ctx->end_frame();
+  GRAPHICS.destroy_deferred_context(ctx);
+
+  CHECK(recorder->num_errors() == 2);
+  CHECK(recorder->count(CommandRecorder::kDraw) == 2);
+  CHECK(recorder->count(CommandRecorder::kSetShaderResources) == 2);
+  recorder->reset();
+}
+
+TEST(recorder_allows_invalid_handles) {
+  // invalid handles unbind, so they aren't errors
+  CommandRecorder *recorder = GRAPHICS.recorder();
+  recorder->reset();
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+  ctx->begin_frame();
+  ctx->set_shader_resource(GraphicsObjectHandle(), ShaderType::kPixelShader);
+  ctx->set_vb(GraphicsObjectHandle(), 0, 0);
+  ctx->draw(3, 0);
+  ctx->end_frame();
+  GRAPHICS.destroy_deferred_context(ctx);
+
+  CHECK(recorder->num_errors() == 0);
+  CHECK(recorder->count(CommandRecorder::kDraw) == 1);
+  recorder->reset();
+}
@@ -0,0 +1,242 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "command_replay.hpp"
+#include "command_recorder.hpp"
+#include "deferred_context.hpp"
+#include "graphics.hpp"
+#include "id_buffer.hpp"
+#include "file_utils.hpp"
+
+using namespace std;
+
+// These run on the headless device. The frames are captured with the graphics recorder,
+// like -capture= does, and the replayed commands are recorded again and compared
+
+namespace {
+  const int cVertexSize = 32;
+  const int cVertexCount = 64;
+  const int cCBufferSize = 64;
+
+  struct Resources {
+    Resources() {
+      vb = GRAPHICS.create_buffer(FROM_HERE, D3D11_BIND_VERTEX_BUFFER, cVertexSize * cVertexCount, true, nullptr, cVertexSize);
+      ib = GRAPHICS.create_buffer(FROM_HERE, D3D11_BIND_INDEX_BUFFER, 6 * sizeof(uint16), true, nullptr, DXGI_FORMAT_R16_UINT);
+      cb = GRAPHICS.create_buffer(FROM_HERE, D3D11_BIND_CONSTANT_BUFFER, cCBufferSize, true, nullptr, cCBufferSize);
+    }
+    GraphicsObjectHandle vb, ib, cb;
+  };
+
+  // a frame of draws, each with its own constants, and the vertex buffer rewritten once
+  void submit_frame(DeferredContext *ctx, const Resources &res, int frame, int num_draws) {
+    char constants[cCBufferSize];
+    ctx->begin_frame();
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    if (ctx->map(res.vb, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)) {
+      memset(mapped.pData, frame, cVertexSize * cVertexCount);
+      ctx->unmap(res.vb, 0);
+    }
+    ctx->set_vb(res.vb);
+    ctx->set_ib(res.ib);
+    ctx->set_topology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    for (int i = 0; i < num_draws; ++i) {
+      memset(constants, i + frame, sizeof(constants));
+      ctx->set_cbuffer(res.cb, 0, ShaderType::kVertexShader, constants, sizeof(constants));
+      ctx->draw_indexed(6, 0, i % cVertexCount);
+    }
+    ctx->end_frame();
+  }
+
+  // captures the frames to 'filename', and returns the captured stream
+  vector<uint8> capture(const char *filename, int num_frames, int num_draws) {
+    Resources res;
+    CommandRecorder *recorder = GRAPHICS.recorder();
+    recorder->reset();
+    recorder->set_keep_stream(true);
+    DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+    for (int i = 0; i < num_frames; ++i)
+      submit_frame(ctx, res, i, num_draws);
+    GRAPHICS.destroy_deferred_context(ctx);
+    CHECK(recorder->save(filename));
+    vector<uint8> stream = recorder->stream();
+    recorder->set_keep_stream(false);
+    recorder->reset();
+    return stream;
+  }
+
+  string temp_filename(const char *name) {
+    char path[MAX_PATH];
+    GetTempPathA(MAX_PATH, path);
+    return string(path) + name;
+  }
+
+  bool loads(const void *stream, int len) {
+    const string filename = temp_filename("kumi_replay_decode_test.bin");
+    CHECK(save_file(filename.c_str(), stream, len));
+    CommandReplayer replayer;
+    const bool res = replayer.load(filename.c_str());
+    DeleteFileA(filename.c_str());
+    return res;
+  }
+
+  bool loads(const CommandRecorder &recorder) {
+    return loads(recorder.stream().data(), (int)recorder.stream().size());
+  }
+}
+
+TEST(replay_reissues_the_captured_commands) {
+  const string filename = temp_filename("kumi_replay_test.bin");
+  const vector<uint8> captured = capture(filename.c_str(), 3, 10);
+
+  CommandReplayer replayer;
+  CHECK(replayer.load(filename.c_str()));
+  DeleteFileA(filename.c_str());
+  CHECK(replayer.num_frames() == 3);
+
+  // the replayed calls are recorded exactly like the captured ones, payloads included
+  CommandRecorder *recorder = GRAPHICS.recorder();
+  recorder->set_keep_stream(true);
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+  replayer.replay(ctx);
+  GRAPHICS.destroy_deferred_context(ctx);
+  CHECK(recorder->stream() == captured);
+  CHECK(recorder->num_commands() == replayer.num_commands());
+  CHECK(recorder->count(CommandRecorder::kDrawIndexed) == 30);
+  CHECK(recorder->num_errors() == 0);
+  recorder->set_keep_stream(false);
+  recorder->reset();
+
+  CHECK(replayer.stats(CommandRecorder::kDrawIndexed).count == 30);
+  CHECK(replayer.stats(CommandRecorder::kUnmap).count == 3);
+  for (int i = 0; i < CommandRecorder::kNumOps; ++i)
+    CHECK(replayer.stats((CommandRecorder::Op)i).skipped == 0);
+}
+
+TEST(replay_skips_dead_handles) {
+  // a handle past the end of the graphics tables, like one from a capture of another demo
+  IdBuffer<int *> other(nullptr);
+  int dummy;
+  for (int i = 0; i < 4096; ++i)
+    other[other.find_free_index()] = &dummy;
+  const GraphicsObjectHandle dead = Graphics::make_goh(GraphicsObjectHandle::kVertexBuffer, other, 4095, cVertexSize);
+  CHECK(!GRAPHICS.is_live(dead));
+
+  CommandRecorder stream(true);
+  stream.record(CommandRecorder::kBeginFrame);
+  stream.record(CommandRecorder::kSetVb, dead, cVertexSize, 0);
+  stream.record(CommandRecorder::kDraw, 3, 0);
+  stream.record(CommandRecorder::kEndFrame);
+  const string filename = temp_filename("kumi_replay_dead_test.bin");
+  CHECK(stream.save(filename.c_str()));
+
+  CommandReplayer replayer;
+  CHECK(replayer.load(filename.c_str()));
+  DeleteFileA(filename.c_str());
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+  replayer.replay(ctx);
+  GRAPHICS.destroy_deferred_context(ctx);
+  GRAPHICS.recorder()->reset();
+
+  CHECK(replayer.stats(CommandRecorder::kSetVb).skipped == 1);
+  CHECK(replayer.stats(CommandRecorder::kSetVb).count == 0);
+  CHECK(replayer.stats(CommandRecorder::kDraw).count == 1);
+}
+
+TEST(replay_rejects_malformed_streams) {
+  // too few arguments for the op
+  CommandRecorder draw(true);
+  draw.record(CommandRecorder::kDraw, 3);
+  CHECK(!loads(draw));
+
+  CommandRecorder instanced(true);
+  instanced.record(CommandRecorder::kDrawIndexedInstanced, 6, 1, 0);
+  CHECK(!loads(instanced));
+
+  CommandRecorder unset(true);
+  unset.record(CommandRecorder::kUnsetShaderResources, 1, 1);
+  CHECK(!loads(unset));
+
+  // the blend factors are a required payload
+  CommandRecorder bs(true);
+  bs.record(CommandRecorder::kSetBs, GraphicsObjectHandle(), 0xffffffff);
+  CHECK(!loads(bs));
+
+  const float factors[2] = { 1, 1 };
+  uint64 bs_args[] = { GraphicsObjectHandle(), 0xffffffff };
+  CommandRecorder short_bs(true);
+  short_bs.record(CommandRecorder::kSetBs, bs_args, 2, factors, sizeof(factors));
+  CHECK(!loads(short_bs));
+
+  // a payload on an op that doesn't take one
+  CommandRecorder frame(true);
+  frame.record(CommandRecorder::kBeginFrame, nullptr, 0, factors, sizeof(factors));
+  CHECK(!loads(frame));
+
+  // an unknown op
+  const uint8 unknown[] = { CommandRecorder::kNumOps, 0 };
+  CHECK(!loads(unknown, sizeof(unknown)));
+
+  // the well formed versions load
+  const float all_factors[4] = { 1, 1, 1, 1 };
+  CommandRecorder valid(true);
+  valid.record(CommandRecorder::kBeginFrame);
+  valid.record(CommandRecorder::kDraw, 3, 0);
+  const uint64 instanced_args[] = { 6, 1, 0, 0, 0 };
+  valid.record(CommandRecorder::kDrawIndexedInstanced, instanced_args, ELEMS_IN_ARRAY(instanced_args));
+  valid.record(CommandRecorder::kSetBs, bs_args, 2, all_factors, sizeof(all_factors));
+  valid.record(CommandRecorder::kEndFrame);
+  CHECK(loads(valid));
+  CHECK(loads(nullptr, 0));
+}
+
+TEST(replay_rejects_truncated_streams) {
+  // every cut that isn't between two commands must fail to load
+  const char constants[cCBufferSize] = { 0 };
+  const float factors[4] = { 1, 1, 1, 1 };
+  uint64 cb_args[] = { GraphicsObjectHandle(), 0, ShaderType::kVertexShader };
+  uint64 bs_args[] = { GraphicsObjectHandle(), 0xffffffff };
+
+  CommandRecorder stream(true);
+  vector<int> boundaries;
+  boundaries.push_back(0);
+  stream.record(CommandRecorder::kBeginFrame);
+  boundaries.push_back((int)stream.stream().size());
+  stream.record(CommandRecorder::kSetCBuffer, cb_args, ELEMS_IN_ARRAY(cb_args), constants, sizeof(constants));
+  boundaries.push_back((int)stream.stream().size());
+  stream.record(CommandRecorder::kSetBs, bs_args, ELEMS_IN_ARRAY(bs_args), factors, sizeof(factors));
+  boundaries.push_back((int)stream.stream().size());
+  // large arguments take several bytes each
+  stream.record(CommandRecorder::kDrawIndexed, 1 << 20, 1 << 14, 1 << 7);
+  boundaries.push_back((int)stream.stream().size());
+  stream.record(CommandRecorder::kEndFrame);
+
+  const vector<uint8> &bytes = stream.stream();
+  CHECK(loads(bytes.data(), (int)bytes.size()));
+  for (int len = 1; len < (int)bytes.size(); ++len) {
+    const bool boundary = find(boundaries.begin(), boundaries.end(), len) != boundaries.end();
+    CHECK(loads(bytes.data(), len) == boundary);
+  }
+}
+
+BENCHMARK(replay_submission) {
+  // the cpu cost of submitting a captured frame, with nothing but the null device below
+  const int cNumDraws = 5000;
+  const int cLoops = 20;
+  const string filename = temp_filename("kumi_replay_bench.bin");
+  capture(filename.c_str(), 1, cNumDraws);
+
+  CommandReplayer replayer;
+  CHECK(replayer.load(filename.c_str()));
+  DeleteFileA(filename.c_str());
+
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+  test::BenchTimer timer;
+  for (int i = 0; i < cLoops; ++i)
+    replayer.replay(ctx);
+  const double ms = timer.elapsed_ms() / cLoops;
+  GRAPHICS.destroy_deferred_context(ctx);
+  GRAPHICS.recorder()->reset();
+
+  CHECK(replayer.stats(CommandRecorder::kDrawIndexed).count == cNumDraws * cLoops);
+  BENCH_LOG("%d commands/frame: %.3f ms/frame, %.3f us/command",
+    replayer.num_commands(), ms, ms * 1000 / replayer.num_commands());
+}
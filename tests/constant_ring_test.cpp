@@ -0,0 +1,102 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "constant_ring.hpp"
+#include "command_recorder.hpp"
+
+using namespace std;
+
+TEST(constant_ring_aligns_allocations) {
+  ConstantRing ring(4096, 256);
+  ring.reset();
+  bool wrapped;
+  int ofs = ring.alloc(1, &wrapped);
+  CHECK(ofs == 0 && wrapped);
+  ofs = ring.alloc(257, &wrapped);
+  CHECK(ofs == 256 && !wrapped);
+  ofs = ring.alloc(256, &wrapped);
+  CHECK(ofs == 768 && !wrapped);
+  CHECK(ring.head() == 1024);
+  CHECK(ring.alloc(4097, &wrapped) == -1);
+
+  // trimming the latest allocation returns the rest of it to the ring
+  ofs = ring.alloc(1000, &wrapped);
+  CHECK(ofs == 1024);
+  ring.trim(ofs, 10);
+  CHECK(ring.head() == 1280);
+}
+
+TEST(constant_ring_wraps) {
+  ConstantRing ring(1024, 16);
+  for (int frame = 0; frame < 3; ++frame) {
+    // a reset ring always reports a wrap first, so a new frame discards
+    ring.reset();
+    bool wrapped;
+    int ofs = ring.alloc(600, &wrapped);
+    CHECK(ofs == 0 && wrapped);
+    ofs = ring.alloc(400, &wrapped);
+    CHECK(ofs == 608 && !wrapped);
+    ofs = ring.alloc(32, &wrapped);
+    CHECK(ofs == 0 && wrapped);
+    ofs = ring.alloc(16, &wrapped);
+    CHECK(ofs == 32 && !wrapped);
+  }
+}
+
+TEST(constant_ring_fills_without_wrapping) {
+  ConstantRing ring(1024, 256);
+  ring.reset();
+  CHECK(ring.alloc_no_wrap(100) == 0);
+  CHECK(ring.alloc_no_wrap(512) == 256);
+  CHECK(ring.alloc_no_wrap(512) == -1);
+  // a failed allocation doesn't use up the ring
+  CHECK(ring.alloc_no_wrap(256) == 768);
+  CHECK(ring.alloc_no_wrap(1) == -1);
+  CHECK(ring.head() == 1024);
+}
+
+BENCHMARK(constant_ring_draws) {
+  // draws with a mesh and a system cbuffer each, recorded with their payloads. The constants
+  // are staged into the ring, and the used part of it is copied once per frame, where the
+  // per-buffer path maps and discards a buffer for every upload
+  const int cNumDraws = 20000;
+  const int cFrames = 20;
+  const int cCBufferSize = 256;
+  const int cRingSize = 2 * cNumDraws * cCBufferSize;
+  vector<char> constants(cCBufferSize);
+  for (int i = 0; i < cCBufferSize; ++i)
+    constants[i] = (char)i;
+
+  CommandRecorder recorder(true);
+  ConstantRing ring(cRingSize, cCBufferSize);
+  vector<char> staging(cRingSize), uploaded(cRingSize);
+  double total_ms = 0, upload_ms = 0;
+  // the first frame grows the recorder's stream
+  for (int frame = 0; frame <= cFrames; ++frame) {
+    test::BenchTimer timer;
+    recorder.reset();
+    ring.reset();
+    for (int i = 0; i < cNumDraws; ++i) {
+      for (int slot = 0; slot < 2; ++slot) {
+        constants[0] = (char)i;
+        const int ofs = ring.alloc_no_wrap(cCBufferSize);
+        memcpy(&staging[ofs], constants.data(), cCBufferSize);
+        const uint64 args[] = { (uint64)slot, (uint64)ofs / 16 };
+        recorder.record(CommandRecorder::kSetCBuffer, args, 2, constants.data(), cCBufferSize);
+      }
+      recorder.record(CommandRecorder::kDrawIndexed, 36, 0, 0);
+    }
+    const double record_ms = timer.elapsed_ms();
+    memcpy(uploaded.data(), staging.data(), ring.head());
+    if (frame > 0) {
+      total_ms += timer.elapsed_ms();
+      upload_ms += timer.elapsed_ms() - record_ms;
+    }
+  }
+
+  CHECK(ring.head() == cRingSize);
+  CHECK(uploaded[cRingSize - cCBufferSize] == (char)(cNumDraws - 1));
+  CHECK(recorder.count(CommandRecorder::kDrawIndexed) == cNumDraws);
+  BENCH_LOG("%d draws/frame: %.3f ms/frame, %.1f M draws/s, %d KB of constants uploaded in %.3f ms with 1 map instead of %d",
+    cNumDraws, total_ms / cFrames, cNumDraws * cFrames / total_ms / 1000,
+    cRingSize / 1024, upload_ms / cFrames, 2 * cNumDraws);
+}
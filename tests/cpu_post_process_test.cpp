@@ -0,0 +1,235 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "cpu_post_process.hpp"
+#include <float.h>
+
+using namespace std;
+
+namespace {
+  uint32 g_seed;
+  float rnd(float lo, float hi) {
+    g_seed = g_seed * 1664525 + 1013904223;
+    return lo + (hi - lo) * (g_seed >> 8) / (float)(1 << 24);
+  }
+
+  void make_image(int w, int h, float lo, float hi, FloatImage *img) {
+    g_seed = 1;
+    img->resize(w, h);
+    for (size_t i = 0; i < img->pixels.size(); ++i)
+      img->pixels[i] = XMFLOAT4(rnd(lo, hi), rnd(lo, hi), rnd(lo, hi), rnd(0, 1));
+  }
+
+  float max_error(const FloatImage &a, const FloatImage &b) {
+    if (a.width != b.width || a.height != b.height)
+      return FLT_MAX;
+    float err = 0;
+    for (size_t i = 0; i < a.pixels.size(); ++i) {
+      const XMFLOAT4 &p = a.pixels[i], &q = b.pixels[i];
+      err = max(err, max(max(fabsf(p.x - q.x), fabsf(p.y - q.y)), max(fabsf(p.z - q.z), fabsf(p.w - q.w))));
+    }
+    return err;
+  }
+
+  bool identical(const FloatImage &a, const FloatImage &b) {
+    return a.width == b.width && a.height == b.height &&
+      memcmp(a.pixels.data(), b.pixels.data(), a.pixels.size() * sizeof(XMFLOAT4)) == 0;
+  }
+
+  XMFLOAT4 texel(const FloatImage &img, int x, int y) {
+    return x >= 0 && x < img.width && y >= 0 && y < img.height ? img.row(y)[x] : XMFLOAT4(0, 0, 0, 0);
+  }
+
+  XMFLOAT4 clamped(const FloatImage &img, int x, int y) {
+    return img.row(max(0, min(img.height - 1, y)))[max(0, min(img.width - 1, x))];
+  }
+
+  // the box blur shader, one pixel at a time: the taps within the radius, and the
+  // fractional part of the radius applied to the next ones
+  void reference_box_blur_pass(const FloatImage &src, FloatImage *dst, float radius, int dx, int dy, bool saturate) {
+    const int m = (int)radius;
+    const float alpha = radius - m;
+    dst->resize(src.width, src.height);
+    for (int y = 0; y < src.height; ++y) {
+      for (int x = 0; x < src.width; ++x) {
+        XMFLOAT4 sum(0, 0, 0, 0);
+        for (int i = -m; i <= m; ++i)
+          sum = sum + texel(src, x + i * dx, y + i * dy);
+        sum = sum + alpha * (texel(src, x - (m + 1) * dx, y - (m + 1) * dy) + texel(src, x + (m + 1) * dx, y + (m + 1) * dy));
+        XMFLOAT4 res = (1 / (2 * radius + 1)) * sum;
+        if (saturate)
+          res = XMFLOAT4(min(1.0f, res.x), min(1.0f, res.y), min(1.0f, res.z), min(1.0f, res.w));
+        dst->row(y)[x] = res;
+      }
+    }
+  }
+}
+
+TEST(cpu_box_blur_matches_reference) {
+  FloatImage src, dst, tmp, expected, ref_tmp;
+  make_image(67, 45, 0, 1, &src);
+  const float radii[] = { 1, 2.5f, 6 };
+  for (int i = 0; i < ELEMS_IN_ARRAY(radii); ++i) {
+    cpu_box_blur(src, &dst, &tmp, radii[i], 2, false);
+    expected = src;
+    for (int j = 0; j < 2; ++j) {
+      reference_box_blur_pass(expected, &ref_tmp, radii[i], 1, 0, false);
+      reference_box_blur_pass(ref_tmp, &expected, radii[i], 0, 1, true);
+    }
+    // the running sums pick up some rounding
+    CHECK(max_error(dst, expected) < 1e-4f);
+  }
+}
+
+TEST(cpu_gaussian_blur_matches_reference) {
+  const float sigma = 2.5f;
+  FloatImage src, dst, tmp, expected;
+  make_image(50, 33, 0, 4, &src);
+  cpu_gaussian_blur(src, &dst, &tmp, sigma, false);
+
+  float weights[12];
+  for (int i = 0; i < 12; ++i) {
+    const float d = (float)(i - 6);
+    weights[i] = 1.0f / sqrtf(2.0f * 3.14159f * sigma * sigma) * expf(-(d * d) / (2 * sigma * sigma));
+  }
+  FloatImage horiz(src.width, src.height);
+  expected.resize(src.width, src.height);
+  for (int y = 0; y < src.height; ++y) {
+    for (int x = 0; x < src.width; ++x) {
+      XMFLOAT4 sum(0, 0, 0, 0);
+      for (int i = 0; i < 12; ++i)
+        sum = sum + weights[i] * clamped(src, x + i - 6, y);
+      horiz.row(y)[x] = sum;
+    }
+  }
+  for (int y = 0; y < src.height; ++y) {
+    for (int x = 0; x < src.width; ++x) {
+      XMFLOAT4 sum(0, 0, 0, 0);
+      for (int i = 0; i < 12; ++i)
+        sum = sum + weights[i] * clamped(horiz, x, y + i - 6);
+      expected.row(y)[x] = sum;
+    }
+  }
+  CHECK(max_error(dst, expected) < 1e-4f);
+}
+
+TEST(cpu_scale_halving_averages_blocks) {
+  FloatImage src, dst(32, 20);
+  make_image(64, 40, 0, 1, &src);
+  cpu_scale(src, &dst, false);
+  float err = 0;
+  for (int y = 0; y < dst.height; ++y) {
+    for (int x = 0; x < dst.width; ++x) {
+      const XMFLOAT4 avg = 0.25f * (src.row(2*y)[2*x] + src.row(2*y)[2*x+1] + src.row(2*y+1)[2*x] + src.row(2*y+1)[2*x+1]);
+      const XMFLOAT4 &d = dst.row(y)[x];
+      err = max(err, max(max(fabsf(d.x - avg.x), fabsf(d.y - avg.y)), max(fabsf(d.z - avg.z), fabsf(d.w - avg.w))));
+    }
+  }
+  CHECK(err < 1e-5f);
+
+  // scaling to the same size is a copy
+  FloatImage same(src.width, src.height);
+  cpu_scale(src, &same, false);
+  CHECK(max_error(same, src) < 1e-6f);
+}
+
+TEST(cpu_luminance_and_cutoff) {
+  // a dim image with a single bright pixel, which is the only one that passes the cutoff
+  FloatImage src(16, 16), lum, cut(16, 16);
+  fill(src.pixels.begin(), src.pixels.end(), XMFLOAT4(0.1f, 0.1f, 0.1f, 1));
+  src.row(5)[7] = XMFLOAT4(50, 50, 50, 1);
+  cpu_luminance_map(src, &lum, false);
+  CHECK(fabsf(lum.row(0)[0].x - logf(0.1f)) < 1e-5f);
+  CHECK(fabsf(lum.row(5)[7].x - logf(50)) < 1e-4f);
+
+  const float avg = cpu_average_log_luminance(lum);
+  CHECK(fabsf(avg - (255 * logf(0.1f) + logf(50)) / 256) < 1e-4f);
+  cpu_scale_cutoff(src, avg, &cut, false);
+  for (int y = 0; y < 16; ++y) {
+    for (int x = 0; x < 16; ++x)
+      CHECK(cut.row(y)[x].x == (x == 7 && y == 5 ? 50 : 0) && cut.row(y)[x].w == 1);
+  }
+}
+
+TEST(cpu_gamma_correct_blends_by_depth_of_field) {
+  FloatImage color(2, 1), blurred(2, 1), pos(2, 1), dst;
+  color.pixels[0] = color.pixels[1] = XMFLOAT4(0.25f, 0.5f, 1, 1);
+  blurred.pixels[0] = blurred.pixels[1] = XMFLOAT4(1, 1, 1, 1);
+  pos.pixels[0] = XMFLOAT4(0, 0, 0, 0);
+  pos.pixels[1] = XMFLOAT4(0, 0, 0, 1);
+  cpu_gamma_correct(color, blurred, pos, 0.5f, &dst, false);
+  CHECK(fabsf(dst.pixels[0].x - 0.5f) < 1e-6f && fabsf(dst.pixels[0].y - sqrtf(0.5f)) < 1e-6f);
+  CHECK(dst.pixels[1].x == 1 && dst.pixels[1].y == 1);
+}
+
+TEST(cpu_post_process_parallel_matches_serial) {
+  // more rows than a band, and not a multiple of it
+  FloatImage src, a, b, tmp_a, tmp_b;
+  make_image(100, 83, 0, 2, &src);
+
+  cpu_box_blur(src, &a, &tmp_a, 2, 3, false);
+  cpu_box_blur(src, &b, &tmp_b, 2, 3, true);
+  CHECK(identical(a, b));
+
+  cpu_gaussian_blur(src, &a, &tmp_a, 3, false);
+  cpu_gaussian_blur(src, &b, &tmp_b, 3, true);
+  CHECK(identical(a, b));
+
+  a.resize(37, 29);
+  b.resize(37, 29);
+  cpu_scale(src, &a, false);
+  cpu_scale(src, &b, true);
+  CHECK(identical(a, b));
+
+  cpu_luminance_map(src, &a, false);
+  cpu_luminance_map(src, &b, true);
+  CHECK(identical(a, b));
+
+  const float avg = cpu_average_log_luminance(a);
+  a.resize(50, 41);
+  b.resize(50, 41);
+  cpu_scale_cutoff(src, avg, &a, false);
+  cpu_scale_cutoff(src, avg, &b, true);
+  CHECK(identical(a, b));
+
+  cpu_gamma_correct(src, src, src, 1 / 2.2f, &a, false);
+  cpu_gamma_correct(src, src, src, 1 / 2.2f, &b, true);
+  CHECK(identical(a, b));
+}
+
+BENCHMARK(cpu_post_process_1440x900) {
+  // the passes the scene player runs, at its resolution
+  const int cWidth = 1440, cHeight = 900;
+  const int cRuns = 5;
+  FloatImage src, dst, tmp, quarter(cWidth / 4, cHeight / 4);
+  make_image(cWidth, cHeight, 0, 2, &src);
+
+  for (int parallel = 0; parallel < 2; ++parallel) {
+    test::BenchTimer timer;
+    for (int i = 0; i < cRuns; ++i)
+      cpu_box_blur(src, &dst, &tmp, 1, 2, !!parallel);
+    const double box_ms = timer.elapsed_ms() / cRuns;
+
+    timer.reset();
+    for (int i = 0; i < cRuns; ++i)
+      cpu_gaussian_blur(src, &dst, &tmp, 2.5f, !!parallel);
+    const double gaussian_ms = timer.elapsed_ms() / cRuns;
+
+    timer.reset();
+    for (int i = 0; i < cRuns; ++i)
+      cpu_scale(src, &quarter, !!parallel);
+    const double scale_ms = timer.elapsed_ms() / cRuns;
+
+    timer.reset();
+    for (int i = 0; i < cRuns; ++i)
+      cpu_luminance_map(src, &dst, !!parallel);
+    const double luminance_ms = timer.elapsed_ms() / cRuns;
+
+    timer.reset();
+    for (int i = 0; i < cRuns; ++i)
+      cpu_gamma_correct(src, src, src, 1 / 2.2f, &dst, !!parallel);
+    const double gamma_ms = timer.elapsed_ms() / cRuns;
+
+    BENCH_LOG("%dx%d %s: box blur %.2f ms, gaussian blur %.2f ms, scale %.2f ms, luminance %.2f ms, gamma %.2f ms",
+      cWidth, cHeight, parallel ? "parallel" : "serial", box_ms, gaussian_ms, scale_ms, luminance_ms, gamma_ms);
+  }
+}
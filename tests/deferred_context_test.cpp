@@ -0,0 +1,314 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "graphics.hpp"
+#include "deferred_context.hpp"
+#include "command_recorder.hpp"
+
+using namespace std;
+
+// These run on the headless device, and check the commands that reach the recorder
+
+namespace {
+  // the ssao light pass' instance variables
+  enum { kLightPos = 1, kLightColor, kAttStart, kAttEnd };
+
+  InstanceBuffer make_instance_buffer(int capacity) {
+    InstanceBuffer ib;
+    ib.stride = 48;
+    ib.slot = 5;
+    ib.capacity = capacity;
+    ib.vars.push_back(CBufferVariable(0, 16, kLightPos));
+    ib.vars.push_back(CBufferVariable(16, 16, kLightColor));
+    ib.vars.push_back(CBufferVariable(32, 4, kAttStart));
+    ib.vars.push_back(CBufferVariable(36, 4, kAttEnd));
+    ib.handle = GRAPHICS.create_structured_buffer(FROM_HERE, ib.stride, capacity, true, true);
+    return ib;
+  }
+
+  void make_instances(int count, DeferredContext::InstanceData *data) {
+    data->add_variable(kLightPos, sizeof(XMFLOAT4));
+    data->add_variable(kLightColor, sizeof(XMFLOAT4));
+    data->add_variable(kAttStart, sizeof(float));
+    data->add_variable(kAttEnd, sizeof(float));
+    data->alloc(count);
+    for (int i = 0; i < count; ++i) {
+      *(XMFLOAT4 *)data->data(0, i) = XMFLOAT4((float)i, 0, 0, 1);
+      *(XMFLOAT4 *)data->data(1, i) = XMFLOAT4(1, 1, 1, 1);
+      *(float *)data->data(2, i) = 10;
+      *(float *)data->data(3, i) = 20;
+    }
+  }
+
+  struct RecordedCommand {
+    CommandRecorder::Op op;
+    vector<uint64> args;
+    vector<uint8> payload;
+  };
+
+  // decodes a recorder's stream, laid out as described in command_recorder.hpp
+  vector<RecordedCommand> decode(const vector<uint8> &stream) {
+    vector<RecordedCommand> res;
+    size_t pos = 0;
+    auto read_varint = [&]() {
+      uint64 value = 0;
+      for (int shift = 0; pos < stream.size(); shift += 7) {
+        const uint8 b = stream[pos++];
+        value |= (uint64)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+          break;
+      }
+      return value;
+    };
+
+    while (pos + 2 <= stream.size()) {
+      RecordedCommand cmd;
+      const uint8 op = stream[pos++];
+      const int num_args = stream[pos++];
+      cmd.op = (CommandRecorder::Op)(op & ~CommandRecorder::kHasPayload);
+      for (int i = 0; i < num_args; ++i)
+        cmd.args.push_back(read_varint());
+      if (op & CommandRecorder::kHasPayload) {
+        const size_t len = (size_t)read_varint();
+        cmd.payload.assign(stream.begin() + pos, stream.begin() + pos + len);
+        pos += len;
+      }
+      res.push_back(cmd);
+    }
+    return res;
+  }
+}
+
+TEST(instances_are_drawn_in_batches) {
+  InstanceBuffer ib = make_instance_buffer(1024);
+  CHECK(ib.is_valid());
+
+  const int counts[] = { 1, 1024, 1025, 2500 };
+  for (int i = 0; i < ELEMS_IN_ARRAY(counts); ++i) {
+    DeferredContext::InstanceData data;
+    make_instances(counts[i], &data);
+
+    CommandRecorder recorder(false);
+    DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+    ctx->begin_frame();
+    ctx->set_recorder(&recorder);
+    ctx->draw_instances(ib, data, 6);
+    ctx->end_frame();
+    GRAPHICS.destroy_deferred_context(ctx);
+
+    // one map and one instanced draw per buffer full
+    const int batches = (counts[i] + ib.capacity - 1) / ib.capacity;
+    CHECK(recorder.count(CommandRecorder::kDrawIndexedInstanced) == batches);
+    CHECK(recorder.count(CommandRecorder::kMap) == batches);
+    CHECK(recorder.count(CommandRecorder::kDrawIndexed) == 0);
+    CHECK(recorder.num_errors() == 0);
+  }
+}
+
+TEST(transient_ring_discards_once_per_frame) {
+  // three slices of the index ring per frame, where the last one doesn't fit and wraps. A
+  // frame only discards on its first map and on the wrap, and the capture holds just the
+  // part of each slice that was used
+  const int cBigSlice = 600 * 1024;
+  const struct { int len, used, ofs; D3D11_MAP map_type; } slices[] = {
+    { 1000, 100, 0, D3D11_MAP_WRITE_DISCARD },
+    { cBigSlice, cBigSlice, 112, D3D11_MAP_WRITE_NO_OVERWRITE },
+    { cBigSlice, 10, 0, D3D11_MAP_WRITE_DISCARD },
+  };
+  const int cNumSlices = ELEMS_IN_ARRAY(slices);
+  const int cFrames = 3;
+
+  CommandRecorder recorder(true);
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+  for (int frame = 0; frame < cFrames; ++frame) {
+    ctx->begin_frame();
+    ctx->set_recorder(&recorder);
+    for (int i = 0; i < cNumSlices; ++i) {
+      DeferredContext::TransientAlloc alloc;
+      CHECK(ctx->map_transient_ib(slices[i].len, &alloc));
+      CHECK(alloc.offset == slices[i].ofs);
+      memset(alloc.data, frame * cNumSlices + i + 1, slices[i].used);
+      ctx->unmap_transient(&alloc, slices[i].used);
+    }
+    ctx->end_frame();
+    CHECK(ctx->bind_stats().transient_wraps == 1);
+  }
+
+  // a frame that's too big for the ring discards on every wrap, and has the wraps counted.
+  // Each slice still gets its own data, as a discard renames the ring
+  const int cBigSlices = 4;
+  CommandRecorder wrap_recorder(true);
+  ctx->begin_frame();
+  ctx->set_recorder(&wrap_recorder);
+  for (int i = 0; i < cBigSlices; ++i) {
+    DeferredContext::TransientAlloc alloc;
+    CHECK(ctx->map_transient_ib(cBigSlice, &alloc));
+    CHECK(alloc.offset == 0);
+    memset(alloc.data, i + 1, cBigSlice);
+    ctx->unmap_transient(&alloc, cBigSlice);
+  }
+  ctx->end_frame();
+  CHECK(ctx->bind_stats().transient_wraps == cBigSlices - 1);
+
+  // and the next frame starts over
+  ctx->begin_frame();
+  ctx->set_recorder(&wrap_recorder);
+  DeferredContext::TransientAlloc alloc;
+  CHECK(ctx->map_transient_ib(cBigSlice, &alloc));
+  ctx->unmap_transient(&alloc, 0);
+  ctx->end_frame();
+  CHECK(ctx->bind_stats().transient_wraps == 0);
+  GRAPHICS.destroy_deferred_context(ctx);
+  CHECK(recorder.num_errors() == 0);
+
+  int num_wrap_maps = 0;
+  const vector<RecordedCommand> wrap_cmds = decode(wrap_recorder.stream());
+  for (size_t i = 0; i < wrap_cmds.size(); ++i) {
+    if (wrap_cmds[i].op == CommandRecorder::kMap) {
+      CHECK(wrap_cmds[i].args[2] == D3D11_MAP_WRITE_DISCARD);
+      ++num_wrap_maps;
+    } else if (wrap_cmds[i].op == CommandRecorder::kUnmap && num_wrap_maps <= cBigSlices) {
+      CHECK(wrap_cmds[i].payload.size() == cBigSlice);
+      CHECK(wrap_cmds[i].payload.front() == num_wrap_maps && wrap_cmds[i].payload.back() == num_wrap_maps);
+    }
+  }
+  CHECK(num_wrap_maps == cBigSlices + 1);
+
+  vector<RecordedCommand> maps, unmaps;
+  const vector<RecordedCommand> cmds = decode(recorder.stream());
+  for (size_t i = 0; i < cmds.size(); ++i) {
+    if (cmds[i].op == CommandRecorder::kMap)
+      maps.push_back(cmds[i]);
+    else if (cmds[i].op == CommandRecorder::kUnmap)
+      unmaps.push_back(cmds[i]);
+  }
+  CHECK(maps.size() == cFrames * cNumSlices && unmaps.size() == maps.size());
+  for (size_t i = 0; i < maps.size() && i < unmaps.size(); ++i) {
+    const int slice = i % cNumSlices;
+    CHECK(maps[i].args[2] == slices[slice].map_type);
+    CHECK(unmaps[i].args.size() == 3 && unmaps[i].args[2] == slices[slice].ofs);
+    CHECK(unmaps[i].payload.size() == slices[slice].used);
+    CHECK(unmaps[i].payload.front() == i + 1 && unmaps[i].payload.back() == i + 1);
+  }
+}
+
+TEST(cbuffer_uploads_use_the_ring_when_supported) {
+  // a deferred context sub-allocates each upload from its constant ring, in 256 byte aligned
+  // slices, on runtimes with constant buffer offsets. Elsewhere it maps the buffer for each
+  // upload. Either way, uploading the same contents again is skipped
+  const int cSize = 48;
+  const int cUploads = 10;
+  const int cFrames = 2;
+  GraphicsObjectHandle cb = GRAPHICS.create_buffer(FROM_HERE, D3D11_BIND_CONSTANT_BUFFER, cSize, true, nullptr, cSize);
+  char constants[cSize];
+
+  CommandRecorder recorder(true);
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(false);
+  for (int frame = 0; frame < cFrames; ++frame) {
+    ctx->begin_frame();
+    ctx->set_recorder(&recorder);
+    for (int i = 0; i < cUploads; ++i) {
+      memset(constants, frame * cUploads + i + 1, cSize);
+      ctx->set_cbuffer(cb, 0, ShaderType::kVertexShader, constants, cSize);
+    }
+    ctx->set_cbuffer(cb, 0, ShaderType::kVertexShader, constants, cSize);
+    const int ring_used = ctx->cbuffer_ring_used();
+    ctx->end_frame();
+
+    CHECK(ring_used == -1 || ring_used == cUploads * 256);
+    CHECK(ctx->bind_stats().cbuffer_bytes_uploaded == cUploads * cSize);
+    CHECK(ctx->bind_stats().cbuffer_uploads_skipped == 1);
+    if (frame == 0)
+      test::log("constant buffer ring: %s", ring_used == -1 ? "not supported, per-buffer uploads" : "in use");
+  }
+  GRAPHICS.destroy_deferred_context(ctx);
+
+  // the recorder sees every upload, with its contents, whichever way it was done
+  CHECK(recorder.num_errors() == 0);
+  const vector<RecordedCommand> cmds = decode(recorder.stream());
+  int num_uploads = 0;
+  for (size_t i = 0; i < cmds.size(); ++i) {
+    if (cmds[i].op != CommandRecorder::kSetCBuffer)
+      continue;
+    const int idx = min(num_uploads % (cUploads + 1), cUploads - 1) + num_uploads / (cUploads + 1) * cUploads;
+    CHECK(cmds[i].payload.size() == cSize && cmds[i].payload[0] == idx + 1);
+    ++num_uploads;
+  }
+  CHECK(num_uploads == cFrames * (cUploads + 1));
+}
+
+BENCHMARK(instanced_draws) {
+  // 10k lights, drawn instanced, and one at a time with the instance in a cbuffer, the way
+  // shaders without an instance buffer are drawn
+  const int cNumInstances = 10000;
+  const int cRuns = 20;
+  InstanceBuffer ib = make_instance_buffer(1024);
+  DeferredContext::InstanceData data;
+  make_instances(cNumInstances, &data);
+  const int cbuffer_size = 48;
+  GraphicsObjectHandle cb = GRAPHICS.create_buffer(FROM_HERE, D3D11_BIND_CONSTANT_BUFFER, cbuffer_size, true, nullptr, cbuffer_size);
+
+  CommandRecorder recorder(false);
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(true);
+
+  test::BenchTimer timer;
+  for (int run = 0; run < cRuns; ++run) {
+    ctx->begin_frame();
+    ctx->set_recorder(&recorder);
+    ctx->draw_instances(ib, data, 6);
+    ctx->end_frame();
+  }
+  const double instanced_ms = timer.elapsed_ms() / cRuns;
+  const int instanced_draws = recorder.count(CommandRecorder::kDrawIndexedInstanced) / cRuns;
+
+  recorder.reset();
+  char staging[cbuffer_size];
+  timer.reset();
+  for (int run = 0; run < cRuns; ++run) {
+    ctx->begin_frame();
+    ctx->set_recorder(&recorder);
+    for (int i = 0; i < cNumInstances; ++i) {
+      memset(staging, 0, sizeof(staging));
+      for (size_t j = 0; j < ib.vars.size(); ++j)
+        memcpy(staging + ib.vars[j].ofs, data.data((int)j, i), ib.vars[j].len);
+      ctx->set_cbuffer(cb, 0, ShaderType::kPixelShader, staging, cbuffer_size);
+      ctx->draw_indexed(6, 0, 0);
+    }
+    ctx->end_frame();
+  }
+  const double single_ms = timer.elapsed_ms() / cRuns;
+  const int single_draws = recorder.count(CommandRecorder::kDrawIndexed) / cRuns;
+  GRAPHICS.destroy_deferred_context(ctx);
+
+  CHECK(instanced_draws == (cNumInstances + ib.capacity - 1) / ib.capacity);
+  CHECK(single_draws == cNumInstances);
+  BENCH_LOG("%d instances: instanced %.3f ms (%d draws), one at a time %.3f ms (%d draws), %.1fx faster",
+    cNumInstances, instanced_ms, instanced_draws, single_ms, single_draws, single_ms / max(instanced_ms, 0.001));
+}
+
+TEST(unset_render_targets_keeps_the_rest_bound) {
+  // unbinding the second of two targets leaves the first bound, so binding it on its own
+  // again is filtered, where unbinding both has to bind it again
+  const char *names[] = { "System::unset_test_a", "System::unset_test_b" };
+  GraphicsObjectHandle targets[2];
+  bool clear[2] = { false, false };
+  for (int i = 0; i < 2; ++i)
+    targets[i] = GRAPHICS.get_temp_render_target(FROM_HERE, 16, 16, DXGI_FORMAT_R8G8B8A8_UNORM, Graphics::kCreateSrv, names[i]);
+
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(false);
+  DeferredContext::BindStats stats[2];
+  for (int frame = 0; frame < 2; ++frame) {
+    ctx->begin_frame();
+    ctx->set_render_targets(targets, clear, 2);
+    ctx->unset_render_targets(frame == 0 ? 1 : 0, frame == 0 ? 1 : 2);
+    ctx->set_render_target(targets[0], false);
+    ctx->end_frame();
+    stats[frame] = ctx->bind_stats();
+  }
+  GRAPHICS.destroy_deferred_context(ctx);
+  for (int i = 0; i < 2; ++i)
+    GRAPHICS.release_temp_render_target(targets[i]);
+  GRAPHICS.recorder()->reset();
+
+  CHECK(stats[0].filtered == stats[1].filtered + 1);
+  CHECK(stats[0].issued + 1 == stats[1].issued);
+}
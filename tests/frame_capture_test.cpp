@@ -0,0 +1,386 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "frame_capture.hpp"
+#include "bitmap_utils.hpp"
+#include "graphics.hpp"
+
+using namespace std;
+
+// The png encoder is checked by decoding its files here, with a crc, inflate and adler that
+// don't share any code with it. The encoder only writes fixed huffman blocks, so that's all
+// the inflate handles, besides stored blocks
+
+namespace {
+  string temp_filename(const char *name) {
+    char path[MAX_PATH];
+    GetTempPathA(MAX_PATH, path);
+    return string(path) + name;
+  }
+
+  bool load_file(const string &filename, vector<uint8> *buf) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f)
+      return false;
+    fseek(f, 0, SEEK_END);
+    buf->resize(ftell(f));
+    fseek(f, 0, SEEK_SET);
+    const bool ok = buf->empty() || fread(buf->data(), buf->size(), 1, f) == 1;
+    fclose(f);
+    return ok;
+  }
+
+  uint32 read_be32(const uint8 *p) {
+    return p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+  }
+
+  // bit by bit, without a table
+  uint32 reference_crc(const uint8 *buf, size_t len) {
+    uint32 crc = 0xffffffff;
+    for (size_t i = 0; i < len; ++i) {
+      crc ^= buf[i];
+      for (int k = 0; k < 8; ++k)
+        crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+  }
+
+  struct BitReader {
+    BitReader(const uint8 *data, size_t size) : data(data), size(size), pos(0) {}
+    // LSB first, and 0 past the end, which the caller catches with overrun()
+    uint32 bits(int count) {
+      uint32 value = 0;
+      for (int i = 0; i < count; ++i, ++pos)
+        value |= (pos / 8 < size ? (data[pos / 8] >> (pos % 8)) & 1 : 0) << i;
+      return value;
+    }
+    // huffman codes are packed MSB first
+    uint32 code_bit(uint32 code) { return code << 1 | bits(1); }
+    bool overrun() const { return pos > size * 8; }
+    const uint8 *data;
+    size_t size;
+    size_t pos;
+  };
+
+  int read_fixed_litlen(BitReader *r) {
+    uint32 code = 0;
+    for (int i = 0; i < 7; ++i)
+      code = r->code_bit(code);
+    if (code <= 23)
+      return 256 + code;
+    code = r->code_bit(code);
+    if (code >= 0x30 && code <= 0xbf)
+      return code - 0x30;
+    if (code >= 0xc0 && code <= 0xc7)
+      return 280 + code - 0xc0;
+    code = r->code_bit(code);
+    return 144 + code - 0x190;
+  }
+
+  bool inflate(const uint8 *data, size_t size, vector<uint8> *out) {
+    static const int len_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const int dist_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+
+    BitReader r(data, size);
+    for (bool last = false; !last; ) {
+      last = !!r.bits(1);
+      const uint32 type = r.bits(2);
+      if (type == 0) {
+        r.pos = (r.pos + 7) & ~7;
+        const uint32 len = r.bits(16), nlen = r.bits(16);
+        if ((len ^ nlen) != 0xffff)
+          return false;
+        for (uint32 i = 0; i < len; ++i)
+          out->push_back((uint8)r.bits(8));
+      } else if (type == 1) {
+        for (;;) {
+          const int sym = read_fixed_litlen(&r);
+          if (r.overrun() || sym > 285)
+            return false;
+          if (sym < 256) {
+            out->push_back((uint8)sym);
+            continue;
+          }
+          if (sym == 256)
+            break;
+          const int l = sym - 257;
+          const int len = len_base[l] + r.bits(l >= 8 && l < 28 ? (l - 4) / 4 : 0);
+          uint32 d = 0;
+          for (int i = 0; i < 5; ++i)
+            d = r.code_bit(d);
+          if (d >= 30)
+            return false;
+          const size_t dist = dist_base[d] + r.bits(d >= 4 ? (d - 2) / 2 : 0);
+          if (dist > out->size())
+            return false;
+          for (int i = 0; i < len; ++i)
+            out->push_back((*out)[out->size() - dist]);
+        }
+      } else {
+        return false;
+      }
+      if (r.overrun())
+        return false;
+    }
+    return true;
+  }
+
+  int paeth(int a, int b, int c) {
+    const int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+  }
+
+  // reads an 8 bit rgba png into bgra pixels, like the encoder takes them, checking every
+  // crc and checksum on the way
+  bool load_png(const string &filename, int *width, int *height, vector<uint32> *pixels) {
+    vector<uint8> file;
+    static const uint8 signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (!load_file(filename, &file) || file.size() < 8 || memcmp(file.data(), signature, 8) != 0)
+      return false;
+
+    vector<uint8> idat;
+    bool has_header = false, has_end = false;
+    for (size_t pos = 8; pos < file.size(); ) {
+      if (file.size() - pos < 12)
+        return false;
+      const uint32 len = read_be32(&file[pos]);
+      if (file.size() - pos - 12 < len)
+        return false;
+      const uint8 *type = &file[pos + 4], *data = &file[pos + 8];
+      if (reference_crc(type, len + 4) != read_be32(data + len))
+        return false;
+      if (!memcmp(type, "IHDR", 4)) {
+        // 8 bit rgba, deflate, no interlacing
+        if (len != 13 || data[8] != 8 || data[9] != 6 || data[10] || data[11] || data[12])
+          return false;
+        *width = read_be32(data);
+        *height = read_be32(data + 4);
+        has_header = true;
+      } else if (!memcmp(type, "IDAT", 4)) {
+        idat.insert(idat.end(), data, data + len);
+      } else if (!memcmp(type, "IEND", 4)) {
+        has_end = true;
+      }
+      pos += 12 + len;
+    }
+    if (!has_header || !has_end || idat.size() < 6)
+      return false;
+
+    // the zlib header: deflate with a 32k window, no dictionary, and a valid check
+    if ((idat[0] & 0xf) != 8 || (idat[0] >> 4) > 7 || (idat[1] & 0x20) || (idat[0] << 8 | idat[1]) % 31)
+      return false;
+    vector<uint8> raw;
+    if (!inflate(&idat[2], idat.size() - 6, &raw))
+      return false;
+    uint32 a = 1, b = 0;
+    for (size_t i = 0; i < raw.size(); ++i) {
+      a = (a + raw[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+    if ((b << 16 | a) != read_be32(&idat[idat.size() - 4]))
+      return false;
+
+    const int w = *width, h = *height, stride = w * 4;
+    if (raw.size() != (size_t)(stride + 1) * h)
+      return false;
+    vector<uint8> rgba(stride * h);
+    for (int y = 0; y < h; ++y) {
+      const uint8 filter = raw[y * (stride + 1)];
+      const uint8 *src = &raw[y * (stride + 1) + 1];
+      uint8 *dst = &rgba[y * stride], *prev = y > 0 ? &rgba[(y - 1) * stride] : nullptr;
+      for (int i = 0; i < stride; ++i) {
+        const int left = i >= 4 ? dst[i - 4] : 0, up = prev ? prev[i] : 0, up_left = prev && i >= 4 ? prev[i - 4] : 0;
+        const int predictions[] = { 0, left, up, (left + up) / 2, paeth(left, up, up_left) };
+        if (filter > 4)
+          return false;
+        dst[i] = (uint8)(src[i] + predictions[filter]);
+      }
+    }
+    pixels->resize(w * h);
+    for (int i = 0; i < w * h; ++i)
+      (*pixels)[i] = rgba[i * 4 + 3] << 24 | rgba[i * 4] << 16 | rgba[i * 4 + 1] << 8 | rgba[i * 4 + 2];
+    return true;
+  }
+
+  uint32 g_seed;
+  uint32 rnd() {
+    g_seed = g_seed * 1664525 + 1013904223;
+    return g_seed >> 8;
+  }
+
+  // smooth gradients with some noise on top, and a few flat rectangles, like a rendered frame
+  void make_frame(int width, int height, vector<uint32> *pixels) {
+    g_seed = 1;
+    pixels->resize(width * height);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const uint32 r = x * 255 / width, g = y * 255 / height, b = (rnd() & 7) + 100;
+        (*pixels)[y * width + x] = 0xff000000 | r << 16 | g << 8 | b;
+      }
+    }
+    for (int i = 0; i < 8; ++i) {
+      const int x0 = rnd() % width, y0 = rnd() % height, x1 = min(width, x0 + 200), y1 = min(height, y0 + 100);
+      const uint32 color = 0xff000000 | rnd();
+      for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x)
+          (*pixels)[y * width + x] = color;
+      }
+    }
+  }
+
+  bool round_trips(const vector<uint32> &pixels, int width, int height) {
+    const string filename = temp_filename("kumi_png_test.png");
+    vector<uint32> loaded;
+    int w = 0, h = 0;
+    const bool ok = save_png32(filename.c_str(), (const uint8 *)pixels.data(), width, height) &&
+      load_png(filename, &w, &h, &loaded) && w == width && h == height && loaded == pixels;
+    DeleteFileA(filename.c_str());
+    return ok;
+  }
+}
+
+TEST(png_round_trips_pixels) {
+  vector<uint32> pixels;
+  // a single pixel, and odd sizes
+  CHECK(round_trips(vector<uint32>(1, 0x80402010), 1, 1));
+  make_frame(37, 5, &pixels);
+  CHECK(round_trips(pixels, 37, 5));
+  make_frame(5, 37, &pixels);
+  CHECK(round_trips(pixels, 5, 37));
+
+  // noise, which has next to no matches, and translucent alpha
+  g_seed = 7;
+  pixels.resize(64 * 64);
+  for (size_t i = 0; i < pixels.size(); ++i)
+    pixels[i] = rnd() << 8 | (rnd() & 0xff);
+  CHECK(round_trips(pixels, 64, 64));
+
+  // a flat image is all matches, longer than the longest one and further apart than a row
+  pixels.assign(300 * 200, 0xff336699);
+  CHECK(round_trips(pixels, 300, 200));
+
+  make_frame(640, 360, &pixels);
+  CHECK(round_trips(pixels, 640, 360));
+}
+
+TEST(png_compresses_flat_images) {
+  const string filename = temp_filename("kumi_png_test.png");
+  const vector<uint32> pixels(256 * 256, 0xff204080);
+  CHECK(save_png32(filename.c_str(), (const uint8 *)pixels.data(), 256, 256));
+  vector<uint8> file;
+  CHECK(load_file(filename, &file));
+  DeleteFileA(filename.c_str());
+  CHECK(file.size() > 12 && file.size() < pixels.size() * 4 / 50);
+  // every png ends with the same IEND chunk, whose crc is well known
+  static const uint8 iend[] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 };
+  CHECK(file.size() > 12 && memcmp(&file[file.size() - 12], iend, 12) == 0);
+}
+
+TEST(frame_capture_writes_cpu_frames) {
+  const int cWidth = 97, cHeight = 31, cPitch = 128;
+  vector<uint32> frame;
+  make_frame(cPitch, cHeight, &frame);
+  // the alpha isn't kept
+  frame[0] &= 0x00ffffff;
+
+  FrameCapture capture;
+  capture.set_drop_when_busy(false);
+  vector<string> filenames;
+  for (int i = 0; i < 2 * FrameCapture::kMaxPendingWrites; ++i) {
+    char name[64];
+    sprintf(name, "kumi_capture_test%02d.png", i);
+    filenames.push_back(temp_filename(name));
+    CHECK(capture.capture(frame.data(), cWidth, cHeight, cPitch, filenames.back()));
+  }
+  capture.flush();
+
+  const FrameCapture::Stats stats = capture.stats();
+  CHECK(stats.captured == (int)filenames.size() && stats.written == stats.captured);
+  CHECK(stats.dropped == 0 && stats.failed == 0);
+
+  bool all_match = true;
+  for (size_t i = 0; i < filenames.size(); ++i) {
+    vector<uint32> loaded;
+    int w = 0, h = 0;
+    bool match = load_png(filenames[i], &w, &h, &loaded) && w == cWidth && h == cHeight;
+    for (int y = 0; match && y < cHeight; ++y) {
+      for (int x = 0; x < cWidth; ++x)
+        match &= loaded[y * cWidth + x] == (frame[y * cPitch + x] | 0xff000000);
+    }
+    all_match &= match;
+    DeleteFileA(filenames[i].c_str());
+  }
+  CHECK(all_match);
+}
+
+TEST(frame_dump_pattern_is_not_a_format_string) {
+  CHECK(GRAPHICS.start_frame_dump("dump/frame%05d.png"));
+  const string filename = GRAPHICS.frame_dump_filename();
+  CHECK(filename.size() == strlen("dump/frame00000.png") && filename.compare(0, 10, "dump/frame") == 0);
+  CHECK(filename.compare(filename.size() - 4, 4, ".png") == 0);
+
+  CHECK(GRAPHICS.start_frame_dump("100%%_%d"));
+  CHECK(GRAPHICS.frame_dump_filename().compare(0, 5, "100%_") == 0);
+
+  // anything else is refused, and stops dumping
+  const char *invalid[] = { "frame.png", "%s.png", "%d_%d.png", "%x.png", "%5.2f", "%n%d", "frame%" };
+  for (int i = 0; i < ELEMS_IN_ARRAY(invalid); ++i) {
+    CHECK(!GRAPHICS.start_frame_dump(invalid[i]));
+    CHECK(GRAPHICS.frame_dump_filename().empty());
+  }
+
+  CHECK(GRAPHICS.start_frame_dump(""));
+  CHECK(GRAPHICS.frame_dump_filename().empty());
+}
+
+BENCHMARK(png_encode_1280x720) {
+  const int cWidth = 1280, cHeight = 720;
+  const int cRuns = 5;
+  const string filename = temp_filename("kumi_png_bench.png");
+  vector<uint32> pixels;
+  make_frame(cWidth, cHeight, &pixels);
+
+  test::BenchTimer timer;
+  for (int i = 0; i < cRuns; ++i)
+    save_png32(filename.c_str(), (const uint8 *)pixels.data(), cWidth, cHeight);
+  const double png_ms = timer.elapsed_ms() / cRuns;
+  vector<uint8> file;
+  load_file(filename, &file);
+
+  timer.reset();
+  for (int i = 0; i < cRuns; ++i)
+    save_bmp32(filename.c_str(), (uint8 *)pixels.data(), cWidth, cHeight);
+  const double bmp_ms = timer.elapsed_ms() / cRuns;
+  DeleteFileA(filename.c_str());
+
+  BENCH_LOG("%dx%d: png %.2f ms (%d kb, %.1f%% of raw), bmp %.2f ms",
+    cWidth, cHeight, png_ms, (int)file.size() / 1024, 100.0 * file.size() / (cWidth * cHeight * 4), bmp_ms);
+}
+
+BENCHMARK(frame_capture_cpu_frames) {
+  // the main thread cost of dumping frames, with the encoding on the workers
+  const int cWidth = 1280, cHeight = 720;
+  const int cFrames = 30;
+  vector<uint32> frame;
+  make_frame(cWidth, cHeight, &frame);
+
+  FrameCapture capture;
+  capture.set_drop_when_busy(false);
+  test::BenchTimer timer;
+  for (int i = 0; i < cFrames; ++i) {
+    char name[64];
+    sprintf(name, "kumi_capture_bench%02d.png", i);
+    capture.capture(frame.data(), cWidth, cHeight, cWidth, temp_filename(name));
+  }
+  const double capture_ms = timer.elapsed_ms();
+  capture.flush();
+  const double total_ms = timer.elapsed_ms();
+  for (int i = 0; i < cFrames; ++i) {
+    char name[64];
+    sprintf(name, "kumi_capture_bench%02d.png", i);
+    DeleteFileA(temp_filename(name).c_str());
+  }
+
+  BENCH_LOG("%d frames at %dx%d: %.3f ms/frame to capture, %.2f ms/frame until written",
+    cFrames, cWidth, cHeight, capture_ms / cFrames, total_ms / cFrames);
+  capture.log_stats();
+}
@@ -0,0 +1,92 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "frame_pacer.hpp"
+
+using namespace std;
+
+// These run in real time, paced to 100 fps, so each frame is 10 ms. The bounds leave room for
+// the odd late wake up on a busy machine: most frames have to be spot on, but the p99 only
+// has to stay within an interval
+
+namespace {
+  const int cFps = 100;
+  const int cFrames = 200;
+
+  uint32 g_seed;
+
+  // spins for 'ms' scaled by 0.75 to 1.25, and by 'spike' on every 25th frame, like
+  // App::run_headless's simulated workload
+  void simulate_work(double ms, int frame, double spike) {
+    g_seed = g_seed * 1664525 + 1013904223;
+    const double scale = frame % 25 == 24 ? spike : 0.75 + 0.5 * (g_seed >> 8) / (1 << 24);
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    const int64 end = now.QuadPart + (int64)(scale * ms * freq.QuadPart / 1000);
+    while (now.QuadPart < end)
+      QueryPerformanceCounter(&now);
+  }
+
+  void run_frames(FramePacer *pacer, double work_ms, double spike) {
+    g_seed = 1;
+    for (int i = 0; i < cFrames; ++i) {
+      pacer->begin_frame();
+      simulate_work(work_ms, i, spike);
+      pacer->end_frame(nullptr);
+    }
+  }
+
+  int histogram_total(const FramePacer &pacer) {
+    int total = 0;
+    for (int i = 0; i < FramePacer::kHistogramBuckets; ++i)
+      total += pacer.stats().histogram[i];
+    return total;
+  }
+}
+
+TEST(frame_pacer_holds_the_target_interval) {
+  FramePacer pacer;
+  pacer.set_target_fps(cFps);
+  run_frames(&pacer, 4, 1);
+
+  // the prediction covers most of the jitter, so only the odd frame is late, and then only
+  // by a little
+  CHECK(pacer.stats().frames == cFrames);
+  CHECK(pacer.stats().late <= cFrames / 10);
+  CHECK(pacer.deviation_ms(0.5) < 0.25);
+  CHECK(pacer.deviation_ms(0.95) < 1);
+  CHECK(pacer.deviation_ms(0.99) < 1000.0 / cFps);
+  // the prediction is above the average cost, to cover the jitter
+  CHECK(pacer.predicted_ms() > 4);
+
+  // every interval after the first present is in the histogram, almost all of them at 10 ms,
+  // or just under it if the timer rounds down
+  CHECK(histogram_total(pacer) == cFrames - 1);
+  const int on_target = pacer.stats().histogram[1000 / cFps] + pacer.stats().histogram[1000 / cFps - 1];
+  CHECK(on_target >= cFrames * 9 / 10);
+}
+
+TEST(frame_pacer_restarts_after_late_frames) {
+  // every 25th frame takes 12 ms, longer than the interval, and is late. The frame after it
+  // starts a new grid of deadlines instead of rushing, so the other frames stay on time
+  FramePacer pacer;
+  pacer.set_target_fps(cFps);
+  run_frames(&pacer, 4, 3);
+
+  const int spikes = cFrames / 25;
+  CHECK(pacer.stats().late >= spikes && pacer.stats().late <= spikes + cFrames / 10);
+  CHECK(pacer.deviation_ms(0.5) < 0.25 && pacer.deviation_ms(0.9) < 1);
+  // the late frames are 4% of them, and overrun by a few ms, but less than an interval
+  CHECK(pacer.deviation_ms(0.99) > 1 && pacer.deviation_ms(0.99) < 1000.0 / cFps);
+}
+
+TEST(frame_pacer_tracks_unpaced_frames) {
+  // without a target, nothing waits, and the deviation is from the average interval
+  FramePacer pacer;
+  run_frames(&pacer, 2, 1);
+  CHECK(pacer.stats().frames == cFrames);
+  CHECK(pacer.stats().late == 0 && pacer.stats().wait_ticks == 0);
+  CHECK(histogram_total(pacer) == cFrames - 1);
+  CHECK(pacer.stats().histogram[1] + pacer.stats().histogram[2] >= cFrames * 9 / 10);
+  CHECK(pacer.deviation_ms(0.9) < 1);
+}
@@ -0,0 +1,99 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "frustum_culler.hpp"
+
+using namespace std;
+
+namespace {
+  // a camera at the origin looking down +z, with the matrix transposed like the shaders get it
+  Frustum make_frustum() {
+    Frustum frustum;
+    frustum.from_view_proj(transpose(perspective_foh(XM_PI / 3, 16 / 9.0f, 1, 500)));
+    return frustum;
+  }
+
+  // boxes spread around the camera, with about 6% of them in the frustum
+  void make_boxes(int count, FrustumCuller *culler) {
+    uint32 seed = 1;
+    auto rnd = [&](float lo, float hi) {
+      seed = seed * 1664525 + 1013904223;
+      return lo + (hi - lo) * (seed >> 8) / (float)(1 << 24);
+    };
+    culler->resize(count);
+    for (int i = 0; i < count; ++i) {
+      XMFLOAT3 center(rnd(-600, 600), rnd(-600, 600), rnd(-600, 600));
+      XMFLOAT3 extents(rnd(0.1f, 10), rnd(0.1f, 10), rnd(0.1f, 10));
+      culler->set_bounds(i, center, extents);
+    }
+  }
+}
+
+TEST(frustum_culler_keeps_boxes_inside) {
+  const struct { XMFLOAT3 center, extents; bool visible; } boxes[] = {
+    { XMFLOAT3(0, 0, 10), XMFLOAT3(1, 1, 1), true },
+    { XMFLOAT3(0, 0, -10), XMFLOAT3(1, 1, 1), false },    // behind the camera
+    { XMFLOAT3(0, 0, 0.5f), XMFLOAT3(1, 1, 1), true },    // crossing the near plane
+    { XMFLOAT3(0, 0, 600), XMFLOAT3(1, 1, 1), false },    // past the far plane
+    { XMFLOAT3(0, 0, 499), XMFLOAT3(5, 5, 5), true },
+    { XMFLOAT3(1000, 0, 10), XMFLOAT3(1, 1, 1), false },  // right
+    { XMFLOAT3(-1000, 0, 10), XMFLOAT3(1, 1, 1), false }, // left
+    { XMFLOAT3(0, 100, 10), XMFLOAT3(1, 1, 1), false },   // above
+    { XMFLOAT3(0, 12, 10), XMFLOAT3(10, 10, 10), true },  // partly above
+  };
+  const int count = ELEMS_IN_ARRAY(boxes);
+
+  FrustumCuller culler;
+  culler.resize(count);
+  for (int i = 0; i < count; ++i)
+    culler.set_bounds(i, boxes[i].center, boxes[i].extents);
+
+  vector<int> visible(count);
+  const int num_visible = culler.cull(make_frustum(), visible.data());
+  int expected = 0;
+  for (int i = 0; i < count; ++i) {
+    if (boxes[i].visible) {
+      CHECK(expected < num_visible && visible[expected] == i);
+      ++expected;
+    }
+  }
+  CHECK(num_visible == expected);
+}
+
+TEST(frustum_culler_matches_scalar) {
+  // sizes that aren't a multiple of 4, so the padding is exercised
+  const int counts[] = { 1, 3, 5, 1001 };
+  const Frustum frustum = make_frustum();
+  for (int i = 0; i < ELEMS_IN_ARRAY(counts); ++i) {
+    FrustumCuller culler;
+    make_boxes(counts[i], &culler);
+    vector<int> visible(counts[i]), visible_scalar(counts[i]);
+    const int num_visible = culler.cull(frustum, visible.data());
+    CHECK(num_visible == culler.cull_scalar(frustum, visible_scalar.data()));
+    CHECK(visible == visible_scalar);
+  }
+}
+
+BENCHMARK(frustum_culler_100k) {
+  const int cNumBoxes = 100000;
+  const int cRuns = 100;
+  FrustumCuller culler;
+  make_boxes(cNumBoxes, &culler);
+  const Frustum frustum = make_frustum();
+  vector<int> visible(cNumBoxes);
+
+  int num_visible = 0;
+  test::BenchTimer timer;
+  for (int i = 0; i < cRuns; ++i)
+    num_visible = culler.cull(frustum, visible.data());
+  const double sse_ms = timer.elapsed_ms() / cRuns;
+
+  int num_visible_scalar = 0;
+  timer.reset();
+  for (int i = 0; i < cRuns; ++i)
+    num_visible_scalar = culler.cull_scalar(frustum, visible.data());
+  const double scalar_ms = timer.elapsed_ms() / cRuns;
+
+  CHECK(num_visible == num_visible_scalar);
+  BENCH_LOG("%d boxes, %d visible: sse %.3f ms, scalar %.3f ms, %.1fx faster",
+    cNumBoxes, num_visible, sse_ms, scalar_ms, scalar_ms / max(sse_ms, 0.001));
+}
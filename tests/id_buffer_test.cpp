@@ -0,0 +1,112 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "id_buffer.hpp"
+#include "graphics.hpp"
+
+using namespace std;
+
+namespace {
+  int g_num_deleted;
+
+  GraphicsObjectHandle create(IdBuffer<int *> *buf, int value) {
+    const int idx = buf->find_free_index();
+    (*buf)[idx] = new int(value);
+    return Graphics::make_goh(GraphicsObjectHandle::kResource, *buf, idx);
+  }
+}
+
+TEST(id_buffer_reuses_released_slots) {
+  g_num_deleted = 0;
+  {
+    IdBuffer<int *> buf([](int *p) { delete p; ++g_num_deleted; });
+    GraphicsObjectHandle a = create(&buf, 1);
+    GraphicsObjectHandle b = create(&buf, 2);
+    GraphicsObjectHandle c = create(&buf, 3);
+    CHECK(a.id() == 0 && b.id() == 1 && c.id() == 2);
+    CHECK(*buf.get(b) == 2);
+
+    // the most recently released slot is reused first, with a new generation
+    buf.release(a.id());
+    buf.release(c.id());
+    CHECK(g_num_deleted == 2);
+    CHECK(!buf.is_live(a) && !buf.is_live(c) && buf.is_live(b));
+    GraphicsObjectHandle d = create(&buf, 4);
+    GraphicsObjectHandle e = create(&buf, 5);
+    CHECK(d.id() == c.id() && d.generation() != c.generation());
+    CHECK(e.id() == a.id() && e.generation() != a.generation());
+    CHECK(*buf.get(d) == 4 && *buf.get(e) == 5);
+    CHECK(buf.size() == 3);
+
+    // a slot that was handed out but never filled is handed out again
+    const int pending = buf.find_free_index();
+    CHECK(buf.find_free_index() == pending && pending == 3);
+  }
+  // the rest are deleted with the buffer
+  CHECK(g_num_deleted == 5);
+}
+
+TEST(id_buffer_ignores_double_release) {
+  g_num_deleted = 0;
+  IdBuffer<int *> buf([](int *p) { delete p; ++g_num_deleted; });
+  GraphicsObjectHandle a = create(&buf, 1);
+  GraphicsObjectHandle b = create(&buf, 2);
+  buf.release(a.id());
+  const uint32 generation = buf.generation(a.id());
+  // releasing again, or releasing a slot that was never filled, leaves the free list and
+  // the generation alone
+  buf.release(a.id());
+  buf.release(buf.size());
+  CHECK(g_num_deleted == 1);
+  CHECK(buf.generation(a.id()) == generation);
+  CHECK(buf.get(a) == nullptr && *buf.get(b) == 2);
+
+  // so the slot is only handed out once
+  GraphicsObjectHandle c = create(&buf, 3);
+  GraphicsObjectHandle d = create(&buf, 4);
+  CHECK(c.id() == a.id() && d.id() == 2);
+  CHECK(*buf.get(c) == 3 && *buf.get(d) == 4 && *buf.get(b) == 2);
+}
+
+TEST(id_buffer_get_rejects_foreign_handles) {
+  IdBuffer<int *> small_buf([](int *p) { delete p; });
+  IdBuffer<int *> big_buf([](int *p) { delete p; });
+  create(&small_buf, 1);
+  for (int i = 0; i < 10; ++i)
+    create(&big_buf, i);
+  GraphicsObjectHandle h = Graphics::make_goh(GraphicsObjectHandle::kResource, big_buf, 9);
+
+  CHECK(small_buf.get(GraphicsObjectHandle()) == nullptr);
+  CHECK(small_buf.get(h) == nullptr);
+  CHECK(!small_buf.is_live(h));
+  CHECK(*big_buf.get(h) == 9);
+}
+
+BENCHMARK(id_buffer_create_release) {
+  // 1M objects, created and released in batches, like a level's worth of resources coming
+  // and going
+  const int cNumObjects = 1000000;
+  const int cBatch = 1000;
+  int dummy;
+  IdBuffer<int *> buf(nullptr);
+  vector<GraphicsObjectHandle> handles(cBatch);
+  size_t checksum = 0;
+
+  test::BenchTimer timer;
+  for (int i = 0; i < cNumObjects; i += cBatch) {
+    for (int j = 0; j < cBatch; ++j) {
+      const int idx = buf.find_free_index();
+      buf[idx] = &dummy;
+      handles[j] = Graphics::make_goh(GraphicsObjectHandle::kResource, buf, idx);
+    }
+    for (int j = 0; j < cBatch; ++j)
+      checksum += buf.get(handles[j]) == &dummy;
+    for (int j = 0; j < cBatch; ++j)
+      buf.release(handles[j].id());
+  }
+  const double ms = timer.elapsed_ms();
+
+  CHECK(checksum == cNumObjects);
+  CHECK(buf.size() == cBatch);
+  BENCH_LOG("%d objects created, looked up and released: %.3f ms, %.1f ns per object",
+    cNumObjects, ms, ms * 1e6 / cNumObjects);
+}
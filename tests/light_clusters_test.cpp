@@ -0,0 +1,163 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "light_clusters.hpp"
+
+using namespace std;
+
+namespace {
+  // the same projection as the frustum tests, transposed like System::proj
+  XMFLOAT4X4 make_proj() {
+    return transpose(perspective_foh(XM_PI / 3, 16 / 9.0f, 1, 500));
+  }
+
+  uint32 g_seed;
+  float rnd(float lo, float hi) {
+    g_seed = g_seed * 1664525 + 1013904223;
+    return lo + (hi - lo) * (g_seed >> 8) / (float)(1 << 24);
+  }
+
+  // lights around the view frustum, some of them behind the camera or past the far plane
+  void make_lights(int count, vector<XMFLOAT4> *lights) {
+    g_seed = 1;
+    lights->clear();
+    for (int i = 0; i < count; ++i) {
+      const float z = rnd(-20, 550);
+      lights->push_back(XMFLOAT4(rnd(-z, z), rnd(-z, z) * 0.6f, z, rnd(0.5f, 30)));
+    }
+  }
+
+  // the squared distance from the light to the cluster's view space box, with the box built
+  // like the clusters are
+  float cluster_distance2(const LightClusters &clusters, const XMFLOAT4X4 &proj, int tx, int ty, int slice, const XMFLOAT4 &l) {
+    const float n = clusters.near_plane(), f = clusters.far_plane();
+    const float z0 = n * powf(f / n, (float)slice / LightClusters::kSlicesZ);
+    const float z1 = n * powf(f / n, (float)(slice + 1) / LightClusters::kSlicesZ);
+    const float tile_w = 2.0f / LightClusters::kTilesX, tile_h = 2.0f / LightClusters::kTilesY;
+    const float ndc_x0 = -1 + tx * tile_w, ndc_x1 = ndc_x0 + tile_w;
+    const float ndc_y1 = 1 - ty * tile_h, ndc_y0 = ndc_y1 - tile_h;
+    const float min_x = min(ndc_x0 * z0, ndc_x0 * z1) / proj.m[0][0], max_x = max(ndc_x1 * z0, ndc_x1 * z1) / proj.m[0][0];
+    const float min_y = min(ndc_y0 * z0, ndc_y0 * z1) / proj.m[1][1], max_y = max(ndc_y1 * z0, ndc_y1 * z1) / proj.m[1][1];
+    const float dx = max(0.0f, max(min_x - l.x, l.x - max_x));
+    const float dy = max(0.0f, max(min_y - l.y, l.y - max_y));
+    const float dz = max(0.0f, max(z0 - l.z, l.z - z1));
+    return dx * dx + dy * dy + dz * dz;
+  }
+}
+
+TEST(light_clusters_match_brute_force) {
+  const XMFLOAT4X4 proj = make_proj();
+  vector<XMFLOAT4> lights;
+  make_lights(500, &lights);
+  LightClusters clusters;
+  clusters.set_projection(proj);
+  CHECK(fabsf(clusters.near_plane() - 1) < 1e-3f && fabsf(clusters.far_plane() - 500) < 0.5f);
+  clusters.build(lights.data(), (int)lights.size(), false);
+
+  // every light in a cluster's list reaches it, and every light that reaches it is in the
+  // list, up to rounding at the boundary
+  int num_wrong = 0, num_entries = 0;
+  vector<bool> in_list(lights.size()), used(lights.size());
+  for (int z = 0; z < LightClusters::kSlicesZ; ++z) {
+    for (int y = 0; y < LightClusters::kTilesY; ++y) {
+      for (int x = 0; x < LightClusters::kTilesX; ++x) {
+        const LightClusters::Cluster &c = clusters.cluster(LightClusters::cluster_index(x, y, z));
+        fill(in_list.begin(), in_list.end(), false);
+        for (uint32 i = 0; i < c.count; ++i)
+          in_list[clusters.indices()[c.offset + i]] = true;
+        num_entries += c.count;
+        for (size_t i = 0; i < lights.size(); ++i) {
+          const float d2 = cluster_distance2(clusters, proj, x, y, z, lights[i]);
+          const float r2 = lights[i].w * lights[i].w;
+          if (in_list[i] ? d2 > r2 * 1.001f : d2 < r2 * 0.999f)
+            ++num_wrong;
+          used[i] = used[i] || in_list[i];
+        }
+      }
+    }
+  }
+  CHECK(num_wrong == 0);
+  CHECK(num_entries == (int)clusters.indices().size());
+  int num_used = 0;
+  for (size_t i = 0; i < lights.size(); ++i) {
+    CHECK(clusters.light_used((int)i) == used[i]);
+    num_used += used[i];
+  }
+  CHECK(num_used == clusters.num_used_lights());
+  CHECK(num_used > 0 && num_used < (int)lights.size());
+}
+
+TEST(light_clusters_parallel_matches_serial) {
+  vector<XMFLOAT4> lights;
+  make_lights(2001, &lights);
+  LightClusters serial, parallel;
+  serial.set_projection(make_proj());
+  parallel.set_projection(make_proj());
+  serial.build(lights.data(), (int)lights.size(), false);
+  parallel.build(lights.data(), (int)lights.size(), true);
+
+  CHECK(serial.indices() == parallel.indices());
+  for (int i = 0; i < LightClusters::kNumClusters; ++i)
+    CHECK(serial.cluster(i).offset == parallel.cluster(i).offset && serial.cluster(i).count == parallel.cluster(i).count);
+}
+
+TEST(light_clusters_find_a_small_light) {
+  // a light in front of the camera, in the middle of the top left tile, is in that tile's
+  // cluster at its depth. The cluster boxes cover the whole depth range of the slice, so
+  // towards the screen edges they overlap the next tiles' boxes, and it's in a few of them
+  // too, but only in its own slice
+  LightClusters clusters;
+  const XMFLOAT4X4 proj = make_proj();
+  clusters.set_projection(proj);
+  const float depth = 50;
+  const float ndc_x = -1 + 1.0f / LightClusters::kTilesX, ndc_y = 1 - 1.0f / LightClusters::kTilesY;
+  const XMFLOAT4 light(ndc_x * depth / proj.m[0][0], ndc_y * depth / proj.m[1][1], depth, 0.1f);
+  clusters.build(&light, 1, false);
+
+  const int slice = clusters.slice_for_depth(depth);
+  const LightClusters::Cluster &c = clusters.cluster(LightClusters::cluster_index(0, 0, slice));
+  CHECK(c.count == 1 && clusters.indices()[c.offset] == 0);
+  for (int z = 0; z < LightClusters::kSlicesZ; ++z) {
+    for (int y = 0; y < LightClusters::kTilesY; ++y) {
+      for (int x = 0; x < LightClusters::kTilesX; ++x) {
+        if (clusters.cluster(LightClusters::cluster_index(x, y, z)).count)
+          CHECK(x <= 2 && y <= 1 && z == slice);
+      }
+    }
+  }
+  CHECK(clusters.slice_for_depth(0.5f) == 0);
+  CHECK(clusters.slice_for_depth(1000) == LightClusters::kSlicesZ - 1);
+}
+
+TEST(light_clusters_bin_at_most_max_lights) {
+  vector<XMFLOAT4> lights(LightClusters::kMaxLights + 10, XMFLOAT4(0, 0, 10, 1));
+  LightClusters clusters;
+  clusters.set_projection(make_proj());
+  clusters.build(lights.data(), (int)lights.size(), true);
+  CHECK(clusters.num_used_lights() == LightClusters::kMaxLights);
+  CHECK(clusters.light_used(LightClusters::kMaxLights - 1));
+  CHECK(!clusters.light_used(LightClusters::kMaxLights));
+}
+
+BENCHMARK(light_clusters_build) {
+  const int counts[] = { 256, 4096, 32768 };
+  const int cRuns = 10;
+  LightClusters clusters;
+  clusters.set_projection(make_proj());
+  vector<XMFLOAT4> lights;
+  for (int i = 0; i < ELEMS_IN_ARRAY(counts); ++i) {
+    make_lights(counts[i], &lights);
+
+    test::BenchTimer timer;
+    for (int j = 0; j < cRuns; ++j)
+      clusters.build(lights.data(), counts[i], false);
+    const double serial_ms = timer.elapsed_ms() / cRuns;
+
+    timer.reset();
+    for (int j = 0; j < cRuns; ++j)
+      clusters.build(lights.data(), counts[i], true);
+    const double parallel_ms = timer.elapsed_ms() / cRuns;
+
+    BENCH_LOG("%d lights, %d used, %d indices: serial %.3f ms, parallel %.3f ms",
+      counts[i], clusters.num_used_lights(), (int)clusters.indices().size(), serial_ms, parallel_ms);
+  }
+}
@@ -0,0 +1,162 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "occlusion_buffer.hpp"
+
+using namespace std;
+
+namespace {
+  // a camera at the origin looking down +z, with the matrix transposed like the shaders get it
+  XMFLOAT4X4 make_view_proj() {
+    return transpose(perspective_foh(XM_PI / 3, 16 / 9.0f, 1, 500));
+  }
+
+  // the world matrices are transposed too, so the translation is in the last column
+  XMFLOAT4X4 translation(float x, float y, float z) {
+    XMFLOAT4X4 m = mtx_identity();
+    m.m[0][3] = x;
+    m.m[1][3] = y;
+    m.m[2][3] = z;
+    return m;
+  }
+
+  // a quad facing the camera, covering [-size, size] in x and y
+  void add_quad(OcclusionBuffer *buf, float z, float size, bool flip) {
+    const XMFLOAT3 verts[] = {
+      XMFLOAT3(-size, -size, 0), XMFLOAT3(size, -size, 0), XMFLOAT3(size, size, 0), XMFLOAT3(-size, size, 0)
+    };
+    const int indices[] = { 0, 1, 2, 0, 2, 3 };
+    const int flipped[] = { 0, 2, 1, 0, 3, 2 };
+    buf->add_occluder(translation(0, 0, z), verts, 4, flip ? flipped : indices, 6);
+  }
+
+  struct Box {
+    Box() {
+      for (int i = 0; i < 8; ++i)
+        verts[i] = XMFLOAT3(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f);
+      const int faces[6][4] = { { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 2, 6, 4 }, { 1, 5, 7, 3 } };
+      for (int i = 0; i < 6; ++i) {
+        const int quad[] = { faces[i][0], faces[i][1], faces[i][2], faces[i][0], faces[i][2], faces[i][3] };
+        memcpy(&indices[i * 6], quad, sizeof(quad));
+      }
+    }
+    XMFLOAT3 verts[8];
+    int indices[36];
+  };
+
+  uint32 g_seed;
+  float rnd(float lo, float hi) {
+    g_seed = g_seed * 1664525 + 1013904223;
+    return lo + (hi - lo) * (g_seed >> 8) / (float)(1 << 24);
+  }
+
+  // unit boxes scaled and spread out in front of the camera, like the largest meshes of a scene
+  void add_boxes(OcclusionBuffer *buf, int count) {
+    const Box box;
+    g_seed = 1;
+    for (int i = 0; i < count; ++i) {
+      XMFLOAT4X4 m = translation(rnd(-60, 60), rnd(-30, 30), rnd(20, 100));
+      m.m[0][0] = rnd(2, 15);
+      m.m[1][1] = rnd(2, 15);
+      m.m[2][2] = rnd(2, 15);
+      buf->add_occluder(m, box.verts, 8, box.indices, 36);
+    }
+  }
+}
+
+TEST(occlusion_buffer_culls_boxes_behind_occluders) {
+  for (int flip = 0; flip < 2; ++flip) {
+    OcclusionBuffer buf;
+    buf.begin_frame(make_view_proj());
+    add_quad(&buf, 20, 10, flip != 0);
+    buf.rasterize(false);
+    CHECK(buf.num_triangles() == 2);
+
+    CHECK(buf.is_occluded(XMFLOAT3(0, 0, 50), XMFLOAT3(2, 2, 2)));
+    CHECK(buf.is_occluded(XMFLOAT3(5, -5, 30), XMFLOAT3(1, 1, 1)));
+    CHECK(!buf.is_occluded(XMFLOAT3(0, 0, 10), XMFLOAT3(1, 1, 1)));       // in front
+    CHECK(!buf.is_occluded(XMFLOAT3(0, 0, 20), XMFLOAT3(1, 1, 1)));       // through the quad
+    CHECK(!buf.is_occluded(XMFLOAT3(30, 0, 50), XMFLOAT3(2, 2, 2)));      // beside it
+    CHECK(!buf.is_occluded(XMFLOAT3(0, 0, 50), XMFLOAT3(40, 2, 2)));      // larger than it
+    CHECK(!buf.is_occluded(XMFLOAT3(0, 0, 0.5f), XMFLOAT3(1, 1, 1)));     // crossing the near plane
+    CHECK(!buf.is_occluded(XMFLOAT3(500, 0, 50), XMFLOAT3(2, 2, 2)));     // off screen
+  }
+
+  // the buffer is cleared between frames
+  OcclusionBuffer buf;
+  buf.begin_frame(make_view_proj());
+  add_quad(&buf, 20, 10, false);
+  buf.rasterize(false);
+  buf.begin_frame(make_view_proj());
+  buf.rasterize(false);
+  CHECK(buf.num_triangles() == 0);
+  CHECK(!buf.is_occluded(XMFLOAT3(0, 0, 50), XMFLOAT3(2, 2, 2)));
+}
+
+TEST(occlusion_buffer_drops_triangles_crossing_the_near_plane) {
+  OcclusionBuffer buf;
+  buf.begin_frame(make_view_proj());
+  const XMFLOAT3 verts[] = { XMFLOAT3(-10, 0, -5), XMFLOAT3(10, 0, -5), XMFLOAT3(0, 10, 20) };
+  const int indices[] = { 0, 1, 2 };
+  buf.add_occluder(mtx_identity(), verts, 3, indices, 3);
+  buf.rasterize(false);
+  CHECK(buf.num_triangles() == 0);
+  CHECK(!buf.is_occluded(XMFLOAT3(0, 5, 50), XMFLOAT3(1, 1, 1)));
+}
+
+TEST(occlusion_buffer_parallel_matches_serial) {
+  const int cNumPixels = OcclusionBuffer::kWidth * OcclusionBuffer::kHeight;
+  OcclusionBuffer serial, parallel;
+  serial.begin_frame(make_view_proj());
+  parallel.begin_frame(make_view_proj());
+  add_boxes(&serial, 64);
+  add_boxes(&parallel, 64);
+  serial.rasterize(false);
+  parallel.rasterize(true);
+
+  CHECK(serial.num_triangles() > 0);
+  CHECK(memcmp(serial.depth(), parallel.depth(), cNumPixels * sizeof(float)) == 0);
+  int covered = 0;
+  for (int i = 0; i < cNumPixels; ++i)
+    covered += serial.depth()[i] < 1;
+  CHECK(covered > 0 && covered < cNumPixels);
+}
+
+BENCHMARK(occlusion_buffer_100k) {
+  // 16 box occluders, like the scene uses at most, and 100k boxes tested against them
+  const int cNumOccluders = 16;
+  const int cNumBoxes = 100000;
+  const int cRuns = 20;
+  OcclusionBuffer buf;
+
+  test::BenchTimer timer;
+  for (int i = 0; i < cRuns; ++i) {
+    buf.begin_frame(make_view_proj());
+    add_boxes(&buf, cNumOccluders);
+    buf.rasterize(false);
+  }
+  const double serial_ms = timer.elapsed_ms() / cRuns;
+
+  timer.reset();
+  for (int i = 0; i < cRuns; ++i) {
+    buf.begin_frame(make_view_proj());
+    add_boxes(&buf, cNumOccluders);
+    buf.rasterize(true);
+  }
+  const double parallel_ms = timer.elapsed_ms() / cRuns;
+
+  vector<XMFLOAT3> centers, extents;
+  g_seed = 2;
+  for (int i = 0; i < cNumBoxes; ++i) {
+    centers.push_back(XMFLOAT3(rnd(-150, 150), rnd(-80, 80), rnd(5, 300)));
+    extents.push_back(XMFLOAT3(rnd(0.1f, 5), rnd(0.1f, 5), rnd(0.1f, 5)));
+  }
+  int num_occluded = 0;
+  timer.reset();
+  for (int i = 0; i < cNumBoxes; ++i)
+    num_occluded += buf.is_occluded(centers[i], extents[i]);
+  const double test_ms = timer.elapsed_ms();
+
+  CHECK(num_occluded > 0);
+  BENCH_LOG("%d occluders, %d triangles: rasterize %.3f ms (parallel %.3f ms), %d boxes tested in %.3f ms, %d occluded",
+    cNumOccluders, buf.num_triangles(), serial_ms, parallel_ms, cNumBoxes, test_ms, num_occluded);
+}
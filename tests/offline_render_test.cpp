@@ -0,0 +1,123 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "demo_engine.hpp"
+#include "graphics.hpp"
+#include "file_utils.hpp"
+
+using namespace std;
+
+// The tests run on the null driver, which has nothing to read back, so the export runs kumi
+// again, like "kumi -offline -headless -frames=N -fps=N -dump=pattern" from the command line
+
+namespace {
+  const int cFrames = 8;
+  const int cFps = 30;
+
+  // the command line values end at the next space, so the temp path is shortened to avoid them
+  string temp_prefix(const char *name) {
+    char path[MAX_PATH], short_path[MAX_PATH];
+    GetTempPathA(MAX_PATH, path);
+    if (!GetShortPathNameA(path, short_path, MAX_PATH))
+      strcpy(short_path, path);
+    return string(short_path) + name;
+  }
+
+  string frame_filename(const string &prefix, int frame) {
+    char buf[16];
+    sprintf(buf, "%03d.png", frame);
+    return prefix + buf;
+  }
+
+  void delete_frames(const string &prefix) {
+    for (int i = 0; i <= cFrames; ++i)
+      DeleteFileA(frame_filename(prefix, i).c_str());
+  }
+
+  // returns kumi's exit code, or -1 if it couldn't be started
+  int run_kumi(const string &args) {
+    char exe[MAX_PATH];
+    GetModuleFileNameA(NULL, exe, MAX_PATH);
+    string cmd_line = string("\"") + exe + "\" " + args;
+    vector<char> buf(cmd_line.begin(), cmd_line.end());
+    buf.push_back('\0');
+
+    STARTUPINFOA si;
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    PROCESS_INFORMATION pi;
+    if (!CreateProcessA(NULL, buf.data(), NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
+      return -1;
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD code = 0;
+    GetExitCodeProcess(pi.hProcess, &code);
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    return (int)code;
+  }
+
+  int export_frames(const string &prefix) {
+    char args[MAX_PATH + 128];
+    sprintf(args, "-offline -headless -frames=%d -fps=%d -dump=%s%%03d.png", cFrames, cFps, prefix.c_str());
+    return run_kumi(args);
+  }
+
+  bool can_render_headless() {
+    const D3D_FEATURE_LEVEL level = D3D_FEATURE_LEVEL_11_0;
+    const D3D_DRIVER_TYPE drivers[] = { D3D_DRIVER_TYPE_WARP, D3D_DRIVER_TYPE_REFERENCE };
+    for (int i = 0; i < ELEMS_IN_ARRAY(drivers); ++i) {
+      CComPtr<ID3D11Device> device;
+      if (SUCCEEDED(D3D11CreateDevice(NULL, drivers[i], NULL, 0, &level, 1, D3D11_SDK_VERSION, &device.p, NULL, NULL)))
+        return true;
+    }
+    return false;
+  }
+}
+
+TEST(offline_render_saves_every_frame) {
+  if (!can_render_headless()) {
+    test::log("No WARP or reference device with feature level 11, skipping the export");
+    return;
+  }
+
+  const string first = temp_prefix("kumi_offline_a");
+  const string second = temp_prefix("kumi_offline_b");
+  delete_frames(first);
+  delete_frames(second);
+
+  CHECK(export_frames(first) == 0);
+  CHECK(export_frames(second) == 0);
+
+  // the frames are at fixed demo times, so both exports have exactly the same images
+  for (int i = 0; i < cFrames; ++i) {
+    vector<uint8> a, b;
+    CHECK(load_file(frame_filename(first, i).c_str(), &a));
+    CHECK(load_file(frame_filename(second, i).c_str(), &b));
+    CHECK(!a.empty() && a == b);
+  }
+  CHECK(!file_exists(frame_filename(first, cFrames).c_str()));
+
+  delete_frames(first);
+  delete_frames(second);
+}
+
+TEST(offline_render_needs_a_dump_pattern) {
+  char args[64];
+  sprintf(args, "-offline -headless -frames=%d", cFrames);
+  CHECK(run_kumi(args) == 1);
+}
+
+TEST(fixed_fps_ticks_are_deterministic) {
+  // the demo time only depends on the number of frames, not on how long they take
+  DEMO_ENGINE.set_pos(0);
+  DEMO_ENGINE.set_fixed_fps(cFps);
+  DEMO_ENGINE.start();
+  for (int i = 1; i <= cFrames; ++i) {
+    if (i % 2)
+      Sleep(20);
+    DEMO_ENGINE.tick();
+    GRAPHICS.present();
+    const int64 expected = (int64)i * 1000 / cFps;
+    CHECK(DEMO_ENGINE.pos() >= expected - 1 && DEMO_ENGINE.pos() <= expected);
+  }
+  DEMO_ENGINE.set_fixed_fps(0);
+}
@@ -0,0 +1,156 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "render_graph.hpp"
+#include "graphics.hpp"
+#include "deferred_context.hpp"
+#include "command_recorder.hpp"
+#include "property_manager.hpp"
+#include "test/scene_player.hpp"
+
+using namespace std;
+
+// These run on the headless device, with the graph's targets from the temp pool
+
+namespace {
+  GraphicsObjectHandle system_property(const char *name) {
+    return PROPERTY_MANAGER.get_property<GraphicsObjectHandle>(PROPERTY_MANAGER.get_or_create<GraphicsObjectHandle>(name));
+  }
+
+  // a chain of 'num_passes' passes, each reading the previous pass' target
+  void add_chain(RenderGraph *graph, int num_passes) {
+    const RenderGraph::TargetDesc desc(16, 16, DXGI_FORMAT_R8G8B8A8_UNORM, Graphics::kCreateSrv);
+    RenderGraph::ResourceId prev = -1;
+    for (int i = 0; i < num_passes; ++i) {
+      auto target = graph->create_target("System::graph_test_chain", desc);
+      int pass = graph->add_pass("chain", [](RenderQueue *, int) {});
+      if (prev != -1)
+        graph->read(pass, prev);
+      graph->write(pass, target, RenderGraph::kClear);
+      prev = target;
+    }
+    graph->mark_output(prev);
+  }
+}
+
+TEST(render_graph_sets_properties_of_aliased_targets) {
+  // a chain of passes, where each target is done with once the next pass has read it, so
+  // c can share a's physical target, and d b's
+  const char *names[] = { "System::graph_test_a", "System::graph_test_b", "System::graph_test_c", "System::graph_test_d" };
+  const RenderGraph::TargetDesc desc(64, 64, DXGI_FORMAT_R8G8B8A8_UNORM, Graphics::kCreateSrv);
+  RenderGraph graph;
+  RenderGraph::ResourceId targets[4];
+  for (int i = 0; i < 4; ++i)
+    targets[i] = graph.create_target(names[i], desc);
+  auto unused = graph.create_target("System::graph_test_unused", desc);
+  graph.mark_output(targets[3]);
+
+  bool ran[4] = { false };
+  bool properties_match = true;
+  for (int i = 0; i < 4; ++i) {
+    int pass = graph.add_pass(names[i], [&, i](RenderQueue *, int) {
+      ran[i] = true;
+      // every target's property points at its physical target while the graph executes
+      for (int j = 0; j < 4; ++j)
+        properties_match &= system_property(names[j]) == graph.handle(targets[j]);
+    });
+    if (i > 0)
+      graph.read(pass, targets[i - 1]);
+    graph.write(pass, targets[i], RenderGraph::kClear);
+  }
+  int culled = graph.add_pass("unused", [](RenderQueue *, int) {});
+  graph.read(culled, targets[3]);
+  graph.write(culled, unused, RenderGraph::kClear);
+
+  CHECK(graph.compile());
+  CHECK(graph.num_culled_passes() == 1);
+  CHECK(graph.num_transient_targets() == 4);
+  CHECK(graph.num_physical_targets() == 2);
+  CHECK(graph.transient_bytes() * 2 == graph.unaliased_transient_bytes());
+
+  DeferredContext *ctx = GRAPHICS.create_deferred_context(false);
+  for (int frame = 0; frame < 2; ++frame) {
+    ctx->begin_frame();
+    graph.execute(ctx);
+    ctx->end_frame();
+  }
+  GRAPHICS.destroy_deferred_context(ctx);
+  GRAPHICS.recorder()->reset();
+
+  for (int i = 0; i < 4; ++i)
+    CHECK(ran[i]);
+  CHECK(properties_match);
+  CHECK(system_property(names[0]) == system_property(names[2]));
+  CHECK(system_property(names[1]) == system_property(names[3]));
+  CHECK(system_property(names[0]) != system_property(names[1]));
+}
+
+TEST(render_graph_rejects_what_it_cant_execute) {
+  // every live pass needs its own pass in the render keys
+  const int max_passes = 1 << RenderKey::kPassBits;
+  RenderGraph graph;
+  add_chain(&graph, max_passes);
+  CHECK(graph.compile());
+  add_chain(&graph, 1);
+  CHECK(!graph.compile());
+
+  // culled passes don't count
+  graph.reset();
+  add_chain(&graph, max_passes);
+  int culled = graph.add_pass("culled", [](RenderQueue *, int) {});
+  graph.write(culled, graph.create_target("System::graph_test_unused", RenderGraph::TargetDesc(16, 16, DXGI_FORMAT_R8G8B8A8_UNORM, 0)), RenderGraph::kClear);
+  CHECK(graph.compile());
+  CHECK(graph.num_culled_passes() == 1);
+
+  // more targets than can be bound at once
+  const RenderGraph::TargetDesc desc(16, 16, DXGI_FORMAT_R8G8B8A8_UNORM, Graphics::kCreateSrv);
+  graph.reset();
+  int pass = graph.add_pass("gbuffer", [](RenderQueue *, int) {});
+  for (int i = 0; i <= D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT; ++i) {
+    auto target = graph.create_target("System::graph_test_gbuffer", desc);
+    graph.write(pass, target, RenderGraph::kClear);
+    graph.mark_output(target);
+  }
+  CHECK(!graph.compile());
+
+  // the backbuffer is bound on its own
+  graph.reset();
+  pass = graph.add_pass("present", [](RenderQueue *, int) {});
+  auto target = graph.create_target("System::graph_test_present", desc);
+  graph.mark_output(target);
+  graph.write(pass, graph.import_backbuffer(), RenderGraph::kClear);
+  graph.write(pass, target, RenderGraph::kClear);
+  CHECK(!graph.compile());
+}
+
+TEST(scene_player_graph_aliases_targets) {
+  // the frame's own graph, compiled without executing it
+  ScenePlayer player("render graph test");
+  RenderGraph graph;
+  player.declare_graph(&graph, 1280, 720);
+  CHECK(graph.compile());
+  // nothing reads the luminance until the bloom is back
+  CHECK(graph.num_culled_passes() == 1);
+  CHECK(graph.num_transient_targets() == 7);
+  CHECK(graph.transient_bytes() <= graph.unaliased_transient_bytes());
+  const int64 frame_bytes = graph.transient_bytes();
+  test::log("Scene player graph: %d targets in %d physical targets, %.1f MB (%.1f MB without aliasing)",
+    graph.num_transient_targets(), graph.num_physical_targets(),
+    graph.transient_bytes() / (1024.0 * 1024.0), graph.unaliased_transient_bytes() / (1024.0 * 1024.0));
+
+  // the lighting reads every full size target, so on its own the frame has nothing to share.
+  // The g-buffer is done with after it though, so a full size pass after the lighting, like
+  // the bloom's first, reuses one of its targets instead of a new one
+  const RenderGraph::TargetDesc desc(1280, 720, DXGI_FORMAT_R16G16B16A16_FLOAT, Graphics::kCreateSrv);
+  auto bloom = graph.create_target("System::graph_test_bloom", desc);
+  graph.mark_output(bloom);
+  auto composite = graph.find_target("System::rt_composite");
+  CHECK(composite != -1);
+  int pass = graph.add_pass("bloom", [](RenderQueue *, int) {});
+  graph.read(pass, composite);
+  graph.write(pass, bloom, RenderGraph::kClear);
+  CHECK(graph.compile());
+  CHECK(graph.num_transient_targets() == 8);
+  CHECK(graph.num_physical_targets() == 7);
+  CHECK(graph.transient_bytes() == frame_bytes);
+  CHECK(graph.transient_bytes() < graph.unaliased_transient_bytes());
+}
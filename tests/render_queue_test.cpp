@@ -0,0 +1,154 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "render_queue.hpp"
+
+using namespace std;
+
+namespace {
+  // the handles can't be created outside of the id buffers, so the keys are built from
+  // their fields directly
+  RenderKey make_key(int pass, RenderKey::Cmd cmd, uint32 technique, uint32 material, uint32 depth) {
+    RenderKey key;
+    key.data = (uint64)pass << RenderKey::kPassShift | (uint64)cmd << RenderKey::kCmdShift |
+      (uint64)technique << RenderKey::kTechniqueShift | (uint64)material << RenderKey::kMaterialShift |
+      (uint64)depth << RenderKey::kDepthShift;
+    return key;
+  }
+
+  uint32 field(RenderKey key, int bits, int shift) {
+    return (uint32)((key.data >> shift) & ((1ull << bits) - 1));
+  }
+
+  // the mesh pointer is only used as a tag, so the commands can be traced through the sort
+  MeshRenderData tagged(size_t tag) {
+    MeshRenderData data;
+    memset(&data, 0, sizeof(data));
+    data.mesh = (const Mesh *)(tag + 1);
+    return data;
+  }
+
+  size_t tag(const MeshRenderData &data) {
+    return (size_t)data.mesh - 1;
+  }
+
+  // a frame's worth of meshes, spread over a few passes, techniques and materials
+  void make_commands(int count, vector<RenderKey> *keys) {
+    uint32 seed = 1;
+    for (int i = 0; i < count; ++i) {
+      seed = seed * 1664525 + 1013904223;
+      keys->push_back(make_key((seed >> 28) & 3, RenderKey::kRenderMesh, (seed >> 8) & 15, (seed >> 12) & 255,
+        RenderKey::depth_bits((seed & 0xffff) / 16.0f)));
+    }
+  }
+}
+
+TEST(render_queue_sorts_by_key) {
+  vector<RenderKey> keys;
+  make_commands(5000, &keys);
+
+  RenderQueue queue;
+  for (size_t i = 0; i < keys.size(); ++i)
+    queue.add_mesh(keys[i], tagged(i));
+  queue.sort();
+
+  CHECK(queue.size() == keys.size());
+  for (size_t i = 1; i < queue.size(); ++i) {
+    const RenderKey prev = queue.key(i - 1), cur = queue.key(i);
+    CHECK(prev.data <= cur.data);
+    CHECK(prev.pass() <= cur.pass());
+    // commands with the same key keep the order they were added in
+    if (prev.data == cur.data)
+      CHECK(tag(queue.mesh_data(i - 1)) < tag(queue.mesh_data(i)));
+  }
+  // the data follows its key
+  for (size_t i = 0; i < queue.size(); ++i)
+    CHECK(keys[tag(queue.mesh_data(i))].data == queue.key(i).data);
+}
+
+TEST(render_queue_orders_commands_within_a_pass) {
+  RenderQueue queue;
+  queue.add_mesh(make_key(1, RenderKey::kRenderMesh, 2, 3, 100), tagged(0));
+  queue.add_callback(RenderKey(1, RenderKey::kEndPass), [](DeferredContext *) {});
+  queue.add_callback(RenderKey(1, RenderKey::kBeginPass), [](DeferredContext *) {});
+  queue.add_mesh(make_key(0, RenderKey::kRenderMesh, 2, 3, 100), tagged(1));
+  queue.add_callback(RenderKey(0, RenderKey::kBeginPass), [](DeferredContext *) {});
+  queue.add_mesh(make_key(1, RenderKey::kRenderMesh, 1, 7, 200), tagged(2));
+  queue.sort();
+
+  const struct { int pass; RenderKey::Cmd cmd; uint32 technique; } expected[] = {
+    { 0, RenderKey::kBeginPass, 0 },
+    { 0, RenderKey::kRenderMesh, 2 },
+    { 1, RenderKey::kBeginPass, 0 },
+    { 1, RenderKey::kRenderMesh, 1 },
+    { 1, RenderKey::kRenderMesh, 2 },
+    { 1, RenderKey::kEndPass, 0 },
+  };
+  CHECK(queue.size() == ELEMS_IN_ARRAY(expected));
+  for (size_t i = 0; i < queue.size() && i < ELEMS_IN_ARRAY(expected); ++i) {
+    const RenderKey key = queue.key(i);
+    CHECK(key.pass() == expected[i].pass);
+    CHECK(key.cmd() == expected[i].cmd);
+    CHECK(field(key, RenderKey::kTechniqueBits, RenderKey::kTechniqueShift) == expected[i].technique);
+  }
+}
+
+TEST(render_key_holds_any_handle_id) {
+  // every technique and material id a handle can have fits in the key, and the depths still
+  // sort in order after being truncated
+  const uint32 max_id = (1 << GraphicsObjectHandle::cIdBits) - 1;
+  const RenderKey key = make_key(15, RenderKey::kEndPass, max_id, max_id - 1, RenderKey::depth_bits(1e30f));
+  CHECK(key.pass() == 15 && key.cmd() == RenderKey::kEndPass);
+  CHECK(field(key, RenderKey::kTechniqueBits, RenderKey::kTechniqueShift) == max_id);
+  CHECK(field(key, RenderKey::kMaterialBits, RenderKey::kMaterialShift) == max_id - 1);
+
+  const float depths[] = { -1, 0, 0.01f, 0.5f, 1, 1.5f, 10, 1000, 1e30f };
+  for (int i = 1; i < ELEMS_IN_ARRAY(depths); ++i) {
+    CHECK(RenderKey::depth_bits(depths[i]) < (1u << RenderKey::kDepthBits));
+    CHECK(RenderKey::depth_bits(depths[i - 1]) <= RenderKey::depth_bits(depths[i]));
+  }
+  CHECK(RenderKey::depth_bits(1) < RenderKey::depth_bits(1.5f));
+}
+
+BENCHMARK(render_queue_sort) {
+  const int cNumCommands = 100000;
+  const int cFrames = 20;
+  vector<RenderKey> keys;
+  make_commands(cNumCommands, &keys);
+
+  // the queue: add, sort, and walk the commands in order, like execute does
+  RenderQueue queue;
+  size_t checksum = 0;
+  test::BenchTimer timer;
+  for (int frame = 0; frame < cFrames; ++frame) {
+    queue.reset();
+    for (int i = 0; i < cNumCommands; ++i)
+      queue.add_mesh(keys[i], tagged(i));
+    queue.sort();
+    for (size_t i = 0; i < queue.size(); ++i)
+      checksum += tag(queue.mesh_data(i));
+  }
+  const double queue_ms = timer.elapsed_ms() / cFrames;
+
+  // grouping the draws in a map on pass, technique and material, rebuilt every frame, with
+  // each group sorted on depth
+  typedef map<uint64, vector<pair<uint32, size_t> > > Groups;
+  const uint64 cDepthMask = (1ull << RenderKey::kDepthBits) - 1;
+  size_t map_checksum = 0;
+  timer.reset();
+  for (int frame = 0; frame < cFrames; ++frame) {
+    Groups groups;
+    for (int i = 0; i < cNumCommands; ++i)
+      groups[keys[i].data & ~cDepthMask].push_back(make_pair((uint32)(keys[i].data & cDepthMask), (size_t)i));
+    for (auto it = groups.begin(); it != groups.end(); ++it) {
+      stable_sort(it->second.begin(), it->second.end(),
+        [](const pair<uint32, size_t> &a, const pair<uint32, size_t> &b) { return a.first < b.first; });
+      for (size_t i = 0; i < it->second.size(); ++i)
+        map_checksum += it->second[i].second;
+    }
+  }
+  const double map_ms = timer.elapsed_ms() / cFrames;
+
+  CHECK(checksum == map_checksum);
+  BENCH_LOG("%d commands: render queue %.3f ms/frame, map grouping %.3f ms/frame, %.1fx faster",
+    cNumCommands, queue_ms, map_ms, map_ms / max(queue_ms, 0.001));
+}
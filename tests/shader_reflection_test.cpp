@@ -0,0 +1,215 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "shader_reflection.hpp"
+#include "property.hpp"
+#include "string_utils.hpp"
+
+using namespace std;
+
+namespace {
+  // An fxc style header, with 'num_vars' variables in each of two cbuffers, a texture and a
+  // sampler, and an input signature
+  string make_header(int num_vars, int seed) {
+    string res = "#if 0\r\n//\r\n// Generated by Microsoft (R) HLSL Shader Compiler\r\n//\r\n//\r\n";
+    res += "// Buffer Definitions: \r\n//\r\n";
+    const char *cbuffers[] = { "PerFrame", "PerMaterial" };
+    for (int i = 0; i < 2; ++i) {
+      res += to_string("// cbuffer %s%d\r\n// {\r\n//\r\n", cbuffers[i], seed);
+      for (int j = 0; j < num_vars; ++j) {
+        res += to_string("//   float4 var_%d_%d;                       // Offset: %4d Size:    16%s\r\n",
+          i, j, j * 16, j % 3 == 2 ? " [unused]" : "");
+      }
+      res += "//\r\n// }\r\n//\r\n";
+    }
+    res += "//\r\n// Resource Bindings:\r\n//\r\n";
+    res += "// Name                                 Type  Format         Dim Slot Elements\r\n";
+    res += "// ------------------------------ ---------- ------- ----------- ---- --------\r\n";
+    res += "// diffuse_sampler                   sampler      NA          NA    0        1\r\n";
+    res += "// diffuse_texture                   texture  float4          2d    0        1\r\n";
+    res += to_string("// PerFrame%d                          cbuffer      NA          NA    0        1\r\n", seed);
+    res += to_string("// PerMaterial%d                       cbuffer      NA          NA    1        1\r\n", seed);
+    res += "//\r\n//\r\n//\r\n// Input signature:\r\n//\r\n";
+    res += "// Name                 Index   Mask Register SysValue Format   Used\r\n";
+    res += "// -------------------- ----- ------ -------- -------- ------ ------\r\n";
+    res += "// POSITION                 0   xyz         0     NONE  float   xyz \r\n";
+    res += "// NORMAL                   0   xyz         1     NONE  float   xyz \r\n";
+    res += "// TEXCOORD                 0   xy          2     NONE  float   xy  \r\n";
+    res += "//\r\n//\r\n// Output signature:\r\n//\r\n";
+    res += "#endif\r\n";
+    return res;
+  }
+
+  bool parse(const string &header, ShaderReflectionData *out) {
+    // parse_header writes to the text
+    vector<char> text(begin(header), end(header));
+    text.push_back('\0');
+    return ShaderReflection::parse_header(text.data(), (int)text.size() - 1, true, out);
+  }
+}
+
+TEST(reflection_parses_header) {
+  ShaderReflectionData data;
+  CHECK(parse(make_header(5, 0), &data));
+  CHECK(data.cbuffers.size() == 2);
+  CHECK(data.cbuffers[0].name == "PerFrame0");
+  CHECK(data.cbuffers[0].vars.size() == 5);
+  CHECK(data.cbuffers[0].vars[4].ofs == 64 && data.cbuffers[0].vars[4].len == 16);
+  CHECK(!data.cbuffers[0].vars[2].used);
+  CHECK(data.bindings.size() == 4);
+  CHECK(data.has_input_signature && data.input_elements.size() == 3);
+  CHECK(data.input_elements[2].format == DXGI_FORMAT_R32G32_FLOAT);
+}
+
+TEST(reflection_finds_structured_buffers) {
+  // structured buffers are bound like textures, but listed with a "struct" format
+  string header = make_header(2, 3);
+  const string row = "// diffuse_texture                   texture  float4          2d    0        1\r\n";
+  const size_t pos = header.find(row);
+  CHECK(pos != string::npos);
+  header.insert(pos + row.size(), "// Lights                            texture  struct         r/o    7        1\r\n");
+
+  ShaderReflectionData data;
+  CHECK(parse(header, &data));
+  CHECK(data.bindings.size() == 5);
+  int num_textures = 0, num_structured = 0;
+  for (size_t i = 0; i < data.bindings.size(); ++i) {
+    const ShaderReflectionData::Binding &b = data.bindings[i];
+    num_textures += b.type == ShaderReflectionData::kBindTexture;
+    if (b.type == ShaderReflectionData::kBindStructuredBuffer) {
+      ++num_structured;
+      CHECK(b.name == "Lights" && b.bind_point == 7);
+    }
+  }
+  CHECK(num_textures == 1 && num_structured == 1);
+
+  // and survive the sidecar
+  vector<char> buf;
+  ShaderReflection::write_cache(3, data, &buf);
+  ShaderReflectionData loaded;
+  CHECK(ShaderReflection::load_cache(buf, 3, &loaded));
+  CHECK(loaded.bindings.size() == 5);
+  for (size_t i = 0; i < loaded.bindings.size() && i < data.bindings.size(); ++i)
+    CHECK(loaded.bindings[i].type == data.bindings[i].type);
+}
+
+TEST(reflection_rejects_bind_points_past_the_slots) {
+  // a texture in a slot past MAX_TEXTURES, in the header
+  string header = make_header(2, 4);
+  const string row = "// diffuse_texture                   texture  float4          2d    0        1\r\n";
+  const size_t pos = header.find(row);
+  CHECK(pos != string::npos);
+  header.replace(pos, row.size(), to_string("// diffuse_texture                   texture  float4          2d  %3d        1\r\n", MAX_TEXTURES));
+  ShaderReflectionData data;
+  CHECK(!parse(header, &data));
+
+  // and in the sidecar, where the last slot of each kind loads, and the one after it doesn't
+  CHECK(parse(make_header(2, 4), &data));
+  for (size_t i = 0; i < data.bindings.size(); ++i) {
+    const ShaderReflectionData::BindingType type = data.bindings[i].type;
+    const int num_slots = type == ShaderReflectionData::kBindCBuffer ? D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT
+      : type == ShaderReflectionData::kBindSampler ? MAX_SAMPLERS : MAX_TEXTURES;
+    const int slots[] = { num_slots - 1, num_slots, 200, -1 };
+    for (int j = 0; j < ELEMS_IN_ARRAY(slots); ++j) {
+      ShaderReflectionData bad(data);
+      bad.bindings[i].bind_point = slots[j];
+      vector<char> buf;
+      ShaderReflection::write_cache(4, bad, &buf);
+      ShaderReflectionData loaded;
+      CHECK(ShaderReflection::load_cache(buf, 4, &loaded) == (j == 0));
+    }
+  }
+}
+
+TEST(reflection_cache_round_trips) {
+  ShaderReflectionData data;
+  CHECK(parse(make_header(8, 1), &data));
+
+  vector<char> buf;
+  ShaderReflection::write_cache(1234, data, &buf);
+
+  ShaderReflectionData loaded;
+  CHECK(ShaderReflection::load_cache(buf, 1234, &loaded));
+  CHECK(loaded.cbuffers.size() == data.cbuffers.size());
+  for (size_t i = 0; i < loaded.cbuffers.size() && i < data.cbuffers.size(); ++i) {
+    CHECK(loaded.cbuffers[i].name == data.cbuffers[i].name);
+    CHECK(loaded.cbuffers[i].vars.size() == data.cbuffers[i].vars.size());
+  }
+  CHECK(loaded.bindings.size() == data.bindings.size());
+  CHECK(loaded.input_elements.size() == data.input_elements.size());
+
+  // a sidecar for other bytecode is a miss
+  CHECK(!ShaderReflection::load_cache(buf, 4321, &loaded));
+}
+
+TEST(reflection_cache_rejects_corrupt_data) {
+  ShaderReflectionData data;
+  CHECK(parse(make_header(4, 2), &data));
+  vector<char> buf;
+  ShaderReflection::write_cache(1, data, &buf);
+
+  // every truncation, and trailing garbage
+  ShaderReflectionData loaded;
+  for (size_t i = 0; i < buf.size(); ++i) {
+    vector<char> truncated(buf.begin(), buf.begin() + i);
+    CHECK(!ShaderReflection::load_cache(truncated, 1, &loaded));
+    CHECK(loaded.cbuffers.empty() && loaded.bindings.empty());
+  }
+  vector<char> longer(buf);
+  longer.push_back(0);
+  CHECK(!ShaderReflection::load_cache(longer, 1, &loaded));
+
+  // flipping bytes must either fail or give something that still parses, but never crash
+  // or allocate from a bogus count. The counts follow the 12 byte magic/version/hash
+  for (size_t i = 12; i < buf.size(); ++i) {
+    vector<char> corrupt(buf);
+    corrupt[i] ^= 0xff;
+    ShaderReflection::load_cache(corrupt, 1, &loaded);
+  }
+  vector<char> huge_count(buf);
+  const int count = 0x7fffffff;
+  memcpy(&huge_count[12], &count, sizeof(count));
+  CHECK(!ShaderReflection::load_cache(huge_count, 1, &loaded));
+  const int negative = -1;
+  memcpy(&huge_count[12], &negative, sizeof(negative));
+  CHECK(!ShaderReflection::load_cache(huge_count, 1, &loaded));
+}
+
+BENCHMARK(reflection_load_time) {
+  // a corpus of headers, reflected from the text and from the sidecars
+  const int cNumShaders = 200;
+  vector<string> headers;
+  vector<vector<char> > caches(cNumShaders);
+  for (int i = 0; i < cNumShaders; ++i) {
+    headers.push_back(make_header(4 + i % 24, i));
+    ShaderReflectionData data;
+    parse(headers.back(), &data);
+    ShaderReflection::write_cache(i, data, &caches[i]);
+  }
+
+  const int cRuns = 20;
+  test::BenchTimer timer;
+  size_t text_bytes = 0;
+  for (int run = 0; run < cRuns; ++run) {
+    for (int i = 0; i < cNumShaders; ++i) {
+      ShaderReflectionData data;
+      CHECK(parse(headers[i], &data));
+      text_bytes += headers[i].size();
+    }
+  }
+  const double parse_ms = timer.elapsed_ms();
+
+  timer.reset();
+  size_t cache_bytes = 0;
+  for (int run = 0; run < cRuns; ++run) {
+    for (int i = 0; i < cNumShaders; ++i) {
+      ShaderReflectionData data;
+      CHECK(ShaderReflection::load_cache(caches[i], i, &data));
+      cache_bytes += caches[i].size();
+    }
+  }
+  const double cache_ms = timer.elapsed_ms();
+
+  BENCH_LOG("%d shaders: header parse %.3f ms/shader (%d bytes avg), sidecar load %.3f ms/shader (%d bytes avg), %.1fx faster",
+    cNumShaders, parse_ms / (cRuns * cNumShaders), (int)(text_bytes / (cRuns * cNumShaders)),
+    cache_ms / (cRuns * cNumShaders), (int)(cache_bytes / (cRuns * cNumShaders)), parse_ms / max(cache_ms, 0.001));
+}
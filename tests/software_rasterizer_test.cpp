@@ -0,0 +1,198 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "software_rasterizer.hpp"
+
+using namespace std;
+
+// With an identity view-projection, the vertices are in clip space with w = 1, so x and y
+// map straight to the screen, and z is the depth
+
+namespace {
+  const int cWidth = 128;
+  const int cHeight = 64;
+  const XMFLOAT4 cClearColor(0, 0, 0, 1);
+  const uint32 cClear = 0xff000000;
+
+  // a quad from (x0, y0) to (x1, y1) in clip space, at depth z
+  void draw_quad(SoftwareRasterizer *r, float x0, float y0, float x1, float y1, float z, const XMFLOAT4 &color,
+                 const SoftwareRasterizer::Texture *texture = nullptr) {
+    const XMFLOAT3 verts[] = { XMFLOAT3(x0, y0, z), XMFLOAT3(x1, y0, z), XMFLOAT3(x1, y1, z), XMFLOAT3(x0, y1, z) };
+    const XMFLOAT2 uvs[] = { XMFLOAT2(0, 1), XMFLOAT2(1, 1), XMFLOAT2(1, 0), XMFLOAT2(0, 0) };
+    const int indices[] = { 0, 1, 2, 0, 2, 3 };
+    r->draw_indexed(mtx_identity(), verts, uvs, 4, indices, 6, color, texture);
+  }
+
+  uint32 pixel(const SoftwareRasterizer &r, int x, int y) {
+    return r.pixels()[y * r.pitch() + x];
+  }
+
+  int count_pixels(const SoftwareRasterizer &r, uint32 color) {
+    int count = 0;
+    for (int y = 0; y < r.height(); ++y) {
+      for (int x = 0; x < r.width(); ++x)
+        count += pixel(r, x, y) == color;
+    }
+    return count;
+  }
+
+  uint32 g_seed;
+  float rnd(float lo, float hi) {
+    g_seed = g_seed * 1664525 + 1013904223;
+    return lo + (hi - lo) * (g_seed >> 8) / (float)(1 << 24);
+  }
+
+  // overlapping triangles at random depths, up to size across in clip space, some of them
+  // crossing the screen edges and the near plane
+  void draw_random_triangles(SoftwareRasterizer *r, int count, float size) {
+    g_seed = 1;
+    vector<XMFLOAT3> verts;
+    vector<int> indices;
+    for (int i = 0; i < count; ++i) {
+      const XMFLOAT3 center(rnd(-1.1f, 1.1f), rnd(-1.1f, 1.1f), rnd(0, 1));
+      for (int j = 0; j < 3; ++j) {
+        verts.push_back(center + XMFLOAT3(rnd(-size, size), rnd(-size, size), rnd(-0.1f, 0.1f)));
+        indices.push_back((i % 16) * 3 + j);
+      }
+    }
+    // in draws of 16 triangles, each with its own vertices
+    for (int i = 0; i < count; i += 16) {
+      const XMFLOAT4 color(rnd(0, 1), rnd(0, 1), rnd(0, 1), 1);
+      const int n = min(16, count - i);
+      r->draw_indexed(mtx_identity(), &verts[i * 3], nullptr, n * 3, &indices[i * 3], n * 3, color, nullptr);
+    }
+  }
+}
+
+TEST(software_rasterizer_covers_pixel_centers) {
+  SoftwareRasterizer r;
+  r.resize(cWidth, cHeight);
+  r.begin_frame(mtx_identity(), cClearColor);
+  // x from 32 to 96 and y from 16 to 48 on the screen
+  draw_quad(&r, -0.5f, -0.5f, 0.5f, 0.5f, 0.5f, XMFLOAT4(1, 1, 1, 1));
+  r.end_frame(false);
+
+  CHECK(r.stats().triangles == 2 && r.stats().triangles_drawn == 2);
+  // the pixels on the shared edge pass the test for the first triangle only
+  CHECK(r.stats().pixels == 64 * 32);
+  CHECK(count_pixels(r, cClear) == cWidth * cHeight - 64 * 32);
+  CHECK(pixel(r, 32, 16) != cClear && pixel(r, 95, 47) != cClear);
+  CHECK(pixel(r, 31, 16) == cClear && pixel(r, 96, 47) == cClear && pixel(r, 32, 15) == cClear && pixel(r, 95, 48) == cClear);
+  CHECK(r.depth()[30 * r.pitch() + 50] == 0.5f);
+}
+
+TEST(software_rasterizer_keeps_the_closest_surface) {
+  const uint32 texels[] = { 0xffff0000, 0xff00ff00 };
+  SoftwareRasterizer::Texture red, green;
+  red.width = green.width = red.height = green.height = 1;
+  red.texels = &texels[0];
+  green.texels = &texels[1];
+
+  // in either order, the closer green quad wins where they overlap
+  for (int order = 0; order < 2; ++order) {
+    SoftwareRasterizer r;
+    r.resize(cWidth, cHeight);
+    r.begin_frame(mtx_identity(), cClearColor);
+    if (order == 0) {
+      draw_quad(&r, -1, -1, 0.5f, 1, 0.8f, XMFLOAT4(1, 1, 1, 1), &red);
+      draw_quad(&r, -0.5f, -1, 1, 1, 0.2f, XMFLOAT4(1, 1, 1, 1), &green);
+    } else {
+      draw_quad(&r, -0.5f, -1, 1, 1, 0.2f, XMFLOAT4(1, 1, 1, 1), &green);
+      draw_quad(&r, -1, -1, 0.5f, 1, 0.8f, XMFLOAT4(1, 1, 1, 1), &red);
+    }
+    r.end_frame(false);
+    CHECK(count_pixels(r, texels[0]) == 32 * cHeight);
+    CHECK(count_pixels(r, texels[1]) == 96 * cHeight);
+  }
+}
+
+TEST(software_rasterizer_samples_textures) {
+  // a 2x2 texture stretched over the screen, so each texel covers a quarter of it. v goes
+  // down the texture, and the quad's top has v = 0
+  const uint32 texels[] = { 0xffff0000, 0xff00ff00, 0xff0000ff, 0xffffffff };
+  SoftwareRasterizer::Texture tex;
+  tex.width = tex.height = 2;
+  tex.texels = texels;
+
+  SoftwareRasterizer r;
+  r.resize(cWidth, cHeight);
+  r.begin_frame(mtx_identity(), cClearColor);
+  draw_quad(&r, -1, -1, 1, 1, 0.5f, XMFLOAT4(1, 1, 1, 1), &tex);
+  r.end_frame(false);
+  for (int i = 0; i < 4; ++i)
+    CHECK(count_pixels(r, texels[i]) == cWidth * cHeight / 4);
+  CHECK(pixel(r, 0, 0) == texels[0] && pixel(r, cWidth - 1, 0) == texels[1]);
+  CHECK(pixel(r, 0, cHeight - 1) == texels[2] && pixel(r, cWidth - 1, cHeight - 1) == texels[3]);
+
+  // the color modulates the texels
+  r.begin_frame(mtx_identity(), cClearColor);
+  draw_quad(&r, -1, -1, 1, 1, 0.5f, XMFLOAT4(0.5f, 0.5f, 0.5f, 1), &tex);
+  r.end_frame(false);
+  CHECK(pixel(r, cWidth - 1, cHeight - 1) == 0xff808080);
+}
+
+TEST(software_rasterizer_clips_to_the_screen_and_near_plane) {
+  SoftwareRasterizer r;
+  r.resize(cWidth, cHeight);
+
+  // far outside the screen on every side, which would overflow the edge functions unclipped
+  r.begin_frame(mtx_identity(), cClearColor);
+  draw_quad(&r, -1000, -1000, 1000, 1000, 0.5f, XMFLOAT4(1, 1, 1, 1));
+  r.end_frame(false);
+  CHECK(count_pixels(r, cClear) == 0);
+  CHECK(r.stats().pixels == cWidth * cHeight);
+
+  // only the part in front of the near plane (z >= 0) is drawn. The depth goes from -1 at
+  // the left edge to 1 at the right, so the right half is left
+  r.begin_frame(mtx_identity(), cClearColor);
+  const XMFLOAT3 verts[] = { XMFLOAT3(-1, -1, -1), XMFLOAT3(1, -1, 1), XMFLOAT3(1, 1, 1), XMFLOAT3(-1, 1, -1) };
+  const int indices[] = { 0, 1, 2, 0, 2, 3 };
+  r.draw_indexed(mtx_identity(), verts, nullptr, 4, indices, 6, XMFLOAT4(1, 1, 1, 1), nullptr);
+  r.end_frame(false);
+  CHECK(count_pixels(r, cClear) == cWidth * cHeight / 2);
+  CHECK(pixel(r, cWidth / 2 - 1, 10) == cClear && pixel(r, cWidth / 2, 10) != cClear);
+
+  // and nothing behind it
+  r.begin_frame(mtx_identity(), cClearColor);
+  draw_quad(&r, -1, -1, 1, 1, -0.5f, XMFLOAT4(1, 1, 1, 1));
+  r.end_frame(false);
+  CHECK(count_pixels(r, cClear) == cWidth * cHeight);
+}
+
+TEST(software_rasterizer_parallel_matches_serial) {
+  // a size that isn't a multiple of the tiles
+  SoftwareRasterizer serial, parallel;
+  serial.resize(300, 170);
+  parallel.resize(300, 170);
+  serial.begin_frame(mtx_identity(), cClearColor);
+  parallel.begin_frame(mtx_identity(), cClearColor);
+  draw_random_triangles(&serial, 500, 1);
+  draw_random_triangles(&parallel, 500, 1);
+  serial.end_frame(false);
+  parallel.end_frame(true);
+
+  const size_t size = serial.pitch() * serial.height();
+  CHECK(memcmp(serial.pixels(), parallel.pixels(), size * sizeof(uint32)) == 0);
+  CHECK(memcmp(serial.depth(), parallel.depth(), size * sizeof(float)) == 0);
+  CHECK(serial.stats().pixels == parallel.stats().pixels);
+  CHECK(serial.stats().triangles_drawn > 0);
+}
+
+BENCHMARK(software_rasterizer_1280x720) {
+  // small triangles, like a tessellated scene
+  const int cNumTriangles = 20000;
+  const int cFrames = 10;
+  SoftwareRasterizer r;
+  r.resize(1280, 720);
+
+  for (int parallel = 0; parallel < 2; ++parallel) {
+    test::BenchTimer timer;
+    for (int i = 0; i < cFrames; ++i) {
+      r.begin_frame(mtx_identity(), cClearColor);
+      draw_random_triangles(&r, cNumTriangles, 0.05f);
+      r.end_frame(!!parallel);
+    }
+    const double ms = timer.elapsed_ms() / cFrames;
+    BENCH_LOG("%d triangles at 1280x720, %s: %.2f ms/frame", cNumTriangles, parallel ? "parallel" : "serial", ms);
+  }
+  r.log_stats();
+}
@@ -0,0 +1,100 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "technique_symbols.hpp"
+#include "string_utils.hpp"
+
+using namespace std;
+using namespace technique_parser_details;
+
+TEST(trie_finds_every_symbol) {
+  const Trie &trie = Trie::instance();
+  for (int i = 0; i < g_num_symbols; ++i)
+    CHECK(trie.find_symbol(g_symbols[i].str) == g_symbols[i].symbol);
+}
+
+TEST(trie_returns_longest_match) {
+  const Trie &trie = Trie::instance();
+  struct {
+    const char *str;
+    Symbol symbol;
+    int len;
+  } cases[] = {
+    { "float4x4 world;", kSymFloat4x4, 8 },
+    { "float4 color;", kSymFloat4, 6 },
+    { "floaty", kSymFloat, 5 },
+    { "depth_bias_clamp = 0", kSymDepthBias, 16 },
+    { "// comment", kSymSingleLineComment, 2 },
+    { "{}", kSymBlockOpen, 1 },
+  };
+
+  for (int i = 0; i < ELEMS_IN_ARRAY(cases); ++i) {
+    int len = 0;
+    CHECK(trie.find_symbol(cases[i].str, strlen(cases[i].str), &len) == cases[i].symbol);
+    CHECK(len == cases[i].len);
+  }
+
+  // a prefix of a keyword, and running out of input in the middle of one
+  int len = -1;
+  CHECK(trie.find_symbol("flo", 3, &len) == kSymUnknown);
+  CHECK(len == -1);
+  CHECK(trie.find_symbol("techniquex", 5, &len) == kSymUnknown);
+  CHECK(trie.find_symbol("", 0, &len) == kSymUnknown);
+  CHECK(trie.find_symbol("xyz") == kSymUnknown);
+}
+
+BENCHMARK(tokenize_tec) {
+  const char *block =
+    "technique diffuse_%d {\r\n"
+    "  vertex_shader {\r\n"
+    "    file = \"diffuse.vso\";\r\n"
+    "    entry_point = vs_main;\r\n"
+    "    params = [\r\n"
+    "      { name = world; type = float4x4; source = mesh; }\r\n"
+    "      { name = diffuse; type = float4; source = material; default = 1 1 1 1; }\r\n"
+    "    ]\r\n"
+    "  }\r\n"
+    "  // blending\r\n"
+    "  blend_desc = { render_target = [ { blend_enable = true; src_blend = src_alpha; dest_blend = inv_src_alpha; } ] }\r\n"
+    "  depth_stencil_desc = { depth_enable = true; depth_func = less_equal; depth_write_mask = 1; }\r\n"
+    "  sampler_desc = { filter = min_mag_mip_linear; address_u = wrap; address_v = wrap; max_anisotropy = 4; }\r\n"
+    "}\r\n";
+
+  string src;
+  src.reserve(8 << 20);
+  for (int i = 0; src.size() < (8 << 20); ++i)
+    src += to_string(block, i);
+
+  const Trie &trie = Trie::instance();
+  const int num_runs = 5;
+  int keywords = 0, others = 0;
+  test::BenchTimer timer;
+  for (int run = 0; run < num_runs; ++run) {
+    const char *p = src.data(), *end = src.data() + src.size();
+    while (p < end) {
+      if (isspace((uint8)*p)) {
+        ++p;
+        continue;
+      }
+      int len = 0;
+      if (trie.find_symbol(p, end - p, &len) != kSymUnknown) {
+        ++keywords;
+        p += len;
+      } else {
+        // identifiers and numbers
+        ++others;
+        const char *start = p;
+        while (p < end && (isalnum((uint8)*p) || *p == '_' || *p == '.'))
+          ++p;
+        p += p == start ? 1 : 0;
+      }
+    }
+  }
+  const double ms = timer.elapsed_ms();
+
+  CHECK(keywords > 0);
+  BENCH_LOG("tokenized %.1f MB %d times in %.1f ms: %.1f MB/s, %d keywords, %d other tokens per run",
+    src.size() / (1024.0 * 1024), num_runs, ms, num_runs * src.size() / (1024.0 * 1024) / (ms / 1000),
+    keywords / num_runs, others / num_runs);
+  BENCH_LOG("trie: %d nodes, %d bytes (%d bytes with 256 child pointers per node)",
+    trie.num_nodes(), (int)trie.memory_footprint(), trie.num_nodes() * 256 * (int)sizeof(void *));
+}
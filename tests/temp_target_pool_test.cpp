@@ -0,0 +1,195 @@
+#include "stdafx.h"
+#include "test.hpp"
+#include "temp_target_pool.hpp"
+#include "id_buffer.hpp"
+#include "string_utils.hpp"
+
+using namespace std;
+
+namespace {
+  struct MockTarget {
+    int width, height;
+    DXGI_FORMAT format;
+    uint32 flags;
+    uint64 pool_key;
+    bool in_use;
+  };
+
+  // Graphics' temp render target path, with the targets created by a mock factory
+  class MockTargets {
+  public:
+    MockTargets() : _targets([](MockTarget *t) { delete t; }), _frame(0), _num_created(0) {}
+
+    int get(int width, int height, DXGI_FORMAT format, uint32 flags, const string &name) {
+      const uint64 key = TempTargetPool::make_key(width, height, format, flags);
+      int idx = _pool.acquire(key);
+      if (idx != -1) {
+        _targets[idx]->in_use = true;
+        _targets.rename(idx, name);
+        return idx;
+      }
+      MockTarget *t = new MockTarget;
+      t->width = width;
+      t->height = height;
+      t->format = format;
+      t->flags = flags;
+      t->pool_key = key;
+      t->in_use = true;
+      idx = _targets.find_free_index();
+      _targets.set_pair(idx, make_pair(name, t));
+      ++_num_created;
+      return idx;
+    }
+
+    void release(int idx) {
+      _targets[idx]->in_use = false;
+      _targets.clear_key(idx);
+      _pool.release(_targets[idx]->pool_key, idx, _frame);
+    }
+
+    void next_frame(int max_unused_frames) {
+      ++_frame;
+      vector<int> stale;
+      _pool.collect(_frame, max_unused_frames, &stale);
+      for (size_t i = 0; i < stale.size(); ++i)
+        _targets.release(stale[i]);
+      _targets.remove_stale_keys();
+    }
+
+    SearchableIdBuffer<string, MockTarget *> _targets;
+    TempTargetPool _pool;
+    int _frame;
+    int _num_created;
+  };
+}
+
+TEST(temp_target_pool_reuses_by_key) {
+  TempTargetPool pool;
+  const uint64 a = TempTargetPool::make_key(1280, 720, DXGI_FORMAT_R16G16B16A16_FLOAT, 1);
+  const uint64 b = TempTargetPool::make_key(1280, 720, DXGI_FORMAT_R16G16B16A16_FLOAT, 3);
+  CHECK(a != b);
+  CHECK(pool.acquire(a) == -1);
+
+  pool.release(a, 1, 0);
+  pool.release(a, 2, 1);
+  pool.release(b, 3, 1);
+  CHECK(pool.num_free() == 3);
+  // the most recently released target, and only ones with the same flags
+  CHECK(pool.acquire(a) == 2);
+  CHECK(pool.acquire(a) == 1);
+  CHECK(pool.acquire(a) == -1);
+  CHECK(pool.acquire(b) == 3);
+  CHECK(pool.num_free() == 0);
+}
+
+TEST(temp_target_pool_collects_unused) {
+  TempTargetPool pool;
+  const uint64 key = TempTargetPool::make_key(256, 256, DXGI_FORMAT_R8G8B8A8_UNORM, 0);
+  pool.release(key, 10, 0);
+  pool.release(key, 11, 5);
+  pool.release(key, 12, 9);
+
+  vector<int> stale;
+  pool.collect(10, 10, &stale);
+  CHECK(stale.empty());
+  pool.collect(16, 10, &stale);
+  CHECK(stale.size() == 2 && stale[0] == 10 && stale[1] == 11);
+  CHECK(pool.num_free() == 1);
+  CHECK(pool.acquire(key) == 12);
+}
+
+TEST(temp_target_names_go_stale) {
+  MockTargets m;
+  const int a = m.get(64, 64, DXGI_FORMAT_R8G8B8A8_UNORM, 0, "System::blur_a");
+  CHECK(m._targets.idx_from_token("System::blur_a") == a);
+  m.release(a);
+  // released temp targets keep their slot, but lose their name
+  CHECK(m._targets.idx_from_token("System::blur_a") == -1);
+
+  const int b = m.get(64, 64, DXGI_FORMAT_R8G8B8A8_UNORM, 0, "System::blur_b");
+  CHECK(b == a && m._num_created == 1);
+  CHECK(m._targets.idx_from_token("System::blur_b") == b);
+  CHECK(m._targets.idx_from_token("System::blur_a") == -1);
+
+  // an alias lives until its object is released
+  m._targets.add_alias("blur", b);
+  CHECK(m._targets.idx_from_token("blur") == b);
+  m.release(b);
+  CHECK(m._targets.idx_from_token("blur") == b);
+  m.next_frame(0);
+  CHECK(m._targets.idx_from_token("blur") == -1);
+  CHECK(m._targets.num_keys() == 0);
+
+  // a new object in the released slot doesn't pick up the old names
+  const int c = m.get(64, 64, DXGI_FORMAT_R8G8B8A8_UNORM, 0, "System::blur_c");
+  CHECK(c == a && m._num_created == 2);
+  CHECK(m._targets.idx_from_token("blur") == -1);
+}
+
+BENCHMARK(temp_target_pool_acquire) {
+  // a gbuffer and blur chain's worth of temps, acquired and released every frame, with a
+  // few thousand long lived render targets around, like the old linear scan had to skip
+  const int cFrames = 2000;
+  const int cLongLived = 4000;
+  struct { int w, h; DXGI_FORMAT fmt; uint32 flags; const char *name; } temps[] = {
+    { 1280, 720, DXGI_FORMAT_R16G16B16A16_FLOAT, 5, "System::rt_pos" },
+    { 1280, 720, DXGI_FORMAT_R16G16B16A16_FLOAT, 4, "System::rt_normal" },
+    { 1280, 720, DXGI_FORMAT_R8G8B8A8_UNORM, 4, "System::rt_diffuse" },
+    { 1280, 720, DXGI_FORMAT_R16G16B16A16_FLOAT, 4, "System::rt_specular" },
+    { 640, 360, DXGI_FORMAT_R16_FLOAT, 4, "System::rt_occlusion_tmp" },
+    { 320, 180, DXGI_FORMAT_R16G16B16A16_FLOAT, 12, "System::blur_a" },
+    { 320, 180, DXGI_FORMAT_R16G16B16A16_FLOAT, 12, "System::blur_b" },
+  };
+  const int cNumTemps = ELEMS_IN_ARRAY(temps);
+
+  MockTargets m;
+  for (int i = 0; i < cLongLived; ++i)
+    m.get(128 + i, 128, DXGI_FORMAT_R8G8B8A8_UNORM, 4, to_string("texture_%d", i));
+
+  int idx[cNumTemps];
+  test::BenchTimer timer;
+  for (int frame = 0; frame < cFrames; ++frame) {
+    for (int i = 0; i < cNumTemps; ++i)
+      idx[i] = m.get(temps[i].w, temps[i].h, temps[i].fmt, temps[i].flags, temps[i].name);
+    for (int i = 0; i < cNumTemps; ++i)
+      m.release(idx[i]);
+    if (frame % 60 == 0)
+      m.next_frame(120);
+  }
+  const double pool_ms = timer.elapsed_ms();
+  CHECK(m._num_created == cLongLived + cNumTemps);
+
+  // the old way: scan every slot for a free target with the same description
+  vector<MockTarget> slots(cLongLived + cNumTemps);
+  for (int i = 0; i < cLongLived; ++i) {
+    MockTarget t = { 128 + i, 128, DXGI_FORMAT_R8G8B8A8_UNORM, 4, 0, true };
+    slots[i] = t;
+  }
+  for (int i = 0; i < cNumTemps; ++i) {
+    MockTarget t = { temps[i].w, temps[i].h, temps[i].fmt, temps[i].flags, 0, false };
+    slots[cLongLived + i] = t;
+  }
+  int found = 0;
+  timer.reset();
+  for (int frame = 0; frame < cFrames; ++frame) {
+    for (int i = 0; i < cNumTemps; ++i) {
+      for (size_t j = 0; j < slots.size(); ++j) {
+        MockTarget &t = slots[j];
+        if (!t.in_use && t.width == temps[i].w && t.height == temps[i].h && t.format == temps[i].fmt && t.flags == temps[i].flags) {
+          t.in_use = true;
+          idx[i] = (int)j;
+          ++found;
+          break;
+        }
+      }
+    }
+    for (int i = 0; i < cNumTemps; ++i)
+      slots[idx[i]].in_use = false;
+  }
+  const double scan_ms = timer.elapsed_ms();
+  CHECK(found == cFrames * cNumTemps);
+
+  const int acquires = cFrames * cNumTemps;
+  BENCH_LOG("%d acquire/release pairs with %d other targets: pool %.3f us each, linear scan %.3f us each",
+    acquires, cLongLived, pool_ms * 1000 / acquires, scan_ms * 1000 / acquires);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// A minimal test runner. TEST and BENCHMARK register a function at static init time, and
+// run_tests() runs the tests or the benchmarks whose name contains the filter. A failed
+// CHECK logs the expression and fails the current test, but doesn't stop it. Benchmarks
+// report their numbers with BENCH_LOG, and time themselves with a BenchTimer.
+
+namespace test {
+  typedef void (*TestFn)();
+
+  struct Registrar {
+    Registrar(const char *name, TestFn fn, bool benchmark);
+  };
+
+  void check_failed(const char *file, int line, const char *expr);
+  void log(const char *fmt, ...);
+
+  // returns the number of failed tests
+  int run_tests(bool benchmarks, const char *filter);
+
+  class BenchTimer {
+  public:
+    BenchTimer();
+    void reset();
+    double elapsed_ms() const;
+  private:
+    int64 _start;
+    int64 _frequency;
+  };
+}
+
+#define TEST(name) \
+  static void test_##name(); \
+  static test::Registrar g_test_##name(#name, test_##name, false); \
+  static void test_##name()
+
+#define BENCHMARK(name) \
+  static void bench_##name(); \
+  static test::Registrar g_bench_##name(#name, bench_##name, true); \
+  static void bench_##name()
+
+#define CHECK(x) do { if (!(x)) test::check_failed(__FILE__, __LINE__, #x); } while (false)
+
+#define BENCH_LOG(fmt, ...) test::log(fmt, __VA_ARGS__)
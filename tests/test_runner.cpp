@@ -0,0 +1,83 @@
+#include "stdafx.h"
+#include "test.hpp"
+
+using namespace std;
+
+namespace test {
+
+  namespace {
+    struct TestCase {
+      const char *name;
+      TestFn fn;
+      bool benchmark;
+    };
+
+    // a function local static, so the registrars don't depend on the init order of the
+    // translation units
+    vector<TestCase> &registry() {
+      static vector<TestCase> tests;
+      return tests;
+    }
+
+    int g_failed_checks;
+  }
+
+  Registrar::Registrar(const char *name, TestFn fn, bool benchmark) {
+    TestCase t = { name, fn, benchmark };
+    registry().push_back(t);
+  }
+
+  void check_failed(const char *file, int line, const char *expr) {
+    ++g_failed_checks;
+    log("%s(%d): CHECK failed: %s", file, line, expr);
+  }
+
+  void log(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    char buf[1024];
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    buf[sizeof(buf) - 1] = 0;
+    // stdout for the console or a redirect, and the log for the debugger
+    printf("%s\n", buf);
+    fflush(stdout);
+    LOG_INFO_LN("%s", buf);
+  }
+
+  int run_tests(bool benchmarks, const char *filter) {
+    int failed = 0, ran = 0;
+    const vector<TestCase> &tests = registry();
+    for (size_t i = 0; i < tests.size(); ++i) {
+      const TestCase &t = tests[i];
+      if (t.benchmark != benchmarks || (filter && *filter && !strstr(t.name, filter)))
+        continue;
+
+      log("[ RUN  ] %s", t.name);
+      g_failed_checks = 0;
+      BenchTimer timer;
+      t.fn();
+      const bool ok = g_failed_checks == 0;
+      log("[ %s ] %s (%.1f ms)", ok ? " OK " : "FAIL", t.name, timer.elapsed_ms());
+      ++ran;
+      failed += ok ? 0 : 1;
+    }
+    log("%d of %d %s passed", ran - failed, ran, benchmarks ? "benchmarks" : "tests");
+    return failed;
+  }
+
+  BenchTimer::BenchTimer() {
+    QueryPerformanceFrequency((LARGE_INTEGER *)&_frequency);
+    reset();
+  }
+
+  void BenchTimer::reset() {
+    QueryPerformanceCounter((LARGE_INTEGER *)&_start);
+  }
+
+  double BenchTimer::elapsed_ms() const {
+    int64 now;
+    QueryPerformanceCounter((LARGE_INTEGER *)&now);
+    return (now - _start) * 1000.0 / _frequency;
+  }
+}
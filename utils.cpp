@@ -43,3 +43,11 @@ float gaussianRand(float mean, float variance) {
   }
   return (float)(mean + sum / numIters);
 }
+
+uint32 fnv_hash(const void *data, int len, uint32 seed) {
+  const uint8 *p = (const uint8 *)data;
+  uint32 h = seed;
+  for (int i = 0; i < len; ++i)
+    h = (h ^ p[i]) * 0x01000193;
+  return h;
+}
@@ -184,6 +184,9 @@ T clamp(T minValue, T maxValue, T value) {
 
 float gaussianRand(float mean, float variance);
 
+// 32-bit FNV-1a. Pass in the previous result as 'seed' to hash several blocks
+uint32 fnv_hash(const void *data, int len, uint32 seed = 0x811c9dc5);
+
 // a bit of a misnomer, as we don't call T's ctor
 template<typename T>
 T *aligned_new(int count, int alignment) {